@@ -0,0 +1,51 @@
+# Measures the round trip between a native coder thread and the Ruby event loop.
+# The archive is read through a stream which returns a few bytes for each read,
+# without read-ahead, so that every read is one round trip.
+#
+#   ruby -Ilib benchmark/event_loop.rb [size_in_KB] [chunk_size] [repeat]
+
+require("seven_zip_ruby")
+require("stringio")
+require("benchmark")
+require("etc")
+
+size = (ARGV[0] || 1024).to_i << 10
+chunk_size = (ARGV[1] || 64).to_i
+repeat = (ARGV[2] || 3).to_i
+
+class ChunkedStringIO < StringIO
+  attr_accessor :chunk_size, :read_count
+
+  def read(length = nil, *args)
+    @read_count = (@read_count || 0) + 1
+    super((length && [ length, @chunk_size ].min), *args)
+  end
+end
+
+data = Random.new(0).bytes(size)
+archive = StringIO.new("".b)
+SevenZipRuby::SevenZipWriter.open(archive) do |szw|
+  szw.method = "COPY"
+  szw.add_data(data, "data.bin")
+end
+
+# The cost of the same reads in Ruby, which is not a part of the round trip.
+ruby_time = Benchmark.realtime do
+  stream = ChunkedStringIO.new(archive.string)
+  stream.chunk_size = chunk_size
+  while (stream.read(chunk_size))
+  end
+end
+
+puts("size: #{size >> 10} KB, chunk: #{chunk_size} bytes, processors: #{Etc.nprocessors}")
+repeat.times do
+  stream = ChunkedStringIO.new(archive.string)
+  stream.chunk_size = chunk_size
+  time = Benchmark.realtime do
+    SevenZipRuby::SevenZipReader.open(stream, read_ahead_size: 0) do |szr|
+      raise "data mismatch" unless (szr.extract_data(0) == data)
+    end
+  end
+  round_trip = (time - ruby_time) / stream.read_count
+  puts(format("%d round trips, %.3f s, %.2f us per round trip", stream.read_count, time, round_trip * 1_000_000))
+end
@@ -0,0 +1,55 @@
+# Compares the extraction throughput of a BCJ2 folder (BCJ2 + 3 LZMA coders
+# connected with stream binders) with the buffered stream binder and with
+# the unbuffered handoff (binder_buffer_size: 0).
+#
+#   ruby -Ilib benchmark/stream_binder.rb [size_in_MB] [repeat]
+
+require("seven_zip_ruby")
+require("stringio")
+require("tmpdir")
+require("benchmark")
+
+size = (ARGV[0] || 32).to_i << 20
+repeat = (ARGV[1] || 3).to_i
+
+# Collect x86 code so that the 7z encoder chooses BCJ2 for it.
+data = "".b
+(Dir.glob("/usr/bin/*") + Dir.glob("/usr/lib/**/*.so*")).each do |path|
+  break if (data.size >= size)
+  next unless (File.file?(path) && File.executable?(path))
+  head = File.binread(path, 4)
+  data << File.binread(path) if (head == "\x7FELF".b || head == "\xCF\xFA\xED\xFE".b)
+end
+data = data.byteslice(0, size)
+
+archive = StringIO.new("".b)
+Dir.mktmpdir do |dir|
+  Dir.chdir(dir) do
+    File.binwrite("data.exe", data)
+    File.chmod(0755, "data.exe")
+    # The encoder selects the exe filter by the executable bit on Unix.
+    SevenZipRuby::SevenZipWriter.open(archive) do |szw|
+      szw.level = 9
+      szw.add_file("data.exe")
+    end
+  end
+end
+
+SevenZipRuby::SevenZipReader.open(StringIO.new(archive.string)) do |szr|
+  puts("method: #{szr.entries.first.method}, size: #{data.size >> 20} MB")
+end
+
+Benchmark.bm(20) do |bm|
+  [ [ "unbuffered", { binder_buffer_size: 0 } ], [ "ring buffer (4 MB)", {} ] ].each do |label, param|
+    bm.report(label) do
+      repeat.times do
+        Dir.mktmpdir do |dir|
+          SevenZipRuby::SevenZipReader.open(StringIO.new(archive.string)) do |szr|
+            szr.extract_all(dir, param)
+          end
+          raise "data mismatch" unless (File.binread(File.join(dir, "data.exe")) == data)
+        end
+      end
+    end
+  end
+end
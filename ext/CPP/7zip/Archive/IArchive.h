@@ -143,6 +143,78 @@ ARCHIVE_INTERFACE(IArchiveOpenSeq, 0x61)
   STDMETHOD(OpenSeq)(ISequentialInStream *stream) PURE;
 };
 
+/*
+IInArchiveExtractStream::ExtractFromStream:
+  same as IInArchive::Extract, but packed data is read from inStream,
+  which must have the same contents as the stream passed to Open.
+  The parsed archive is not changed, so the calls with different
+  streams can run concurrently.
+  numThreads, outOfOrder and binderBufferSize are used instead of
+  the extraction properties set with ISetProperties.
+*/
+
+ARCHIVE_INTERFACE(IInArchiveExtractStream, 0x62)
+{
+  STDMETHOD(ExtractFromStream)(IInStream *inStream, const UInt32* indices, UInt32 numItems,
+      Int32 testMode, UInt32 numThreads, Int32 outOfOrder, UInt32 binderBufferSize,
+      IArchiveExtractCallback *extractCallback) PURE;
+};
+
+/*
+IInArchiveFolderCache:
+  keeps the decoded folders (solid blocks) up to size bytes in memory,
+  so that their entries extracted again are copied from memory.
+  size = 0 disables the cache.
+*/
+
+ARCHIVE_INTERFACE(IInArchiveFolderCache, 0x63)
+{
+  STDMETHOD(SetFolderCacheSize)(UInt64 size) PURE;
+  STDMETHOD(GetFolderCacheStat)(UInt64 *numHits, UInt64 *numMisses, UInt64 *size) PURE;
+};
+
+/*
+IInArchiveCheckpoints:
+  keeps the states of the decoder at each interval bytes of the folders,
+  so that the entries in the middle of solid folders are decoded from
+  the nearest state before them.
+  interval = 0 disables the checkpoints.
+  The least recently used checkpoints are dropped when their total size
+  exceeds maxSize.
+*/
+
+ARCHIVE_INTERFACE(IInArchiveCheckpoints, 0x64)
+{
+  STDMETHOD(SetCheckpointInterval)(UInt64 interval, UInt64 maxSize) PURE;
+  STDMETHOD(GetCheckpointStat)(UInt64 *numCheckpoints, UInt64 *size) PURE;
+};
+
+/*
+IInArchiveDatabaseCache:
+  the parsed headers of the archives are kept in a cache shared by
+  the process, so that the same archive opened again is not parsed again.
+  SetUseDatabaseCache(0) makes the next Open neither use nor fill it.
+  ClearDatabaseCache and GetDatabaseCacheStat work on the shared cache.
+*/
+
+ARCHIVE_INTERFACE(IInArchiveDatabaseCache, 0x67)
+{
+  STDMETHOD(SetUseDatabaseCache)(Int32 use) PURE;
+  STDMETHOD(ClearDatabaseCache)() PURE;
+  STDMETHOD(GetDatabaseCacheStat)(UInt32 *numDatabases, UInt64 *numItems) PURE;
+};
+
+/*
+IArchiveFolderStatCallback:
+  can be supported by IArchiveExtractCallback to receive the time spent
+  on decoding each folder (solid block), in microseconds.
+*/
+
+ARCHIVE_INTERFACE(IArchiveFolderStatCallback, 0x65)
+{
+  STDMETHOD(SetFolderStat)(UInt32 folderIndex, UInt64 packSize, UInt64 unpackSize, UInt64 time) PURE;
+};
+
 #define INTERFACE_IArchiveUpdateCallback(x) \
   INTERFACE_IProgress(x); \
   STDMETHOD(GetUpdateItemInfo)(UInt32 index,  \
@@ -169,6 +241,18 @@ ARCHIVE_INTERFACE_SUB(IArchiveUpdateCallback2, IArchiveUpdateCallback, 0x82)
   INTERFACE_IArchiveUpdateCallback2(PURE);
 };
 
+/*
+IArchiveUpdateCallbackSample:
+  can be supported by IArchiveUpdateCallback to read a part of the new data
+  of the item at offset without opening its stream, so that the handler can
+  check whether the data is compressible before choosing its method.
+*/
+
+ARCHIVE_INTERFACE(IArchiveUpdateCallbackSample, 0x66)
+{
+  STDMETHOD(GetSample)(UInt32 index, UInt64 offset, void *data, UInt32 size, UInt32 *processedSize) PURE;
+};
+
 
 #define INTERFACE_IOutArchive(x) \
   STDMETHOD(UpdateItems)(ISequentialOutStream *outStream, UInt32 numItems, IArchiveUpdateCallback *updateCallback) x; \
@@ -7,7 +7,7 @@
 #define kCrcPoly 0xEDB88320
 
 #ifdef MY_CPU_LE
-#define CRC_NUM_TABLES 8
+#define CRC_NUM_TABLES 16
 #else
 #define CRC_NUM_TABLES 1
 #endif
@@ -33,6 +33,8 @@ static UInt32 MY_FAST_CALL CrcUpdateT1(UInt32 v, const void *data, size_t size,
 
 UInt32 MY_FAST_CALL CrcUpdateT4(UInt32 v, const void *data, size_t size, const UInt32 *table);
 UInt32 MY_FAST_CALL CrcUpdateT8(UInt32 v, const void *data, size_t size, const UInt32 *table);
+UInt32 MY_FAST_CALL CrcUpdateT16(UInt32 v, const void *data, size_t size, const UInt32 *table);
+UInt32 MY_FAST_CALL CrcUpdateClmul(UInt32 v, const void *data, size_t size, const UInt32 *table);
 
 #endif
 
@@ -65,12 +67,12 @@ void MY_FAST_CALL CrcGenerateTable()
     UInt32 r = g_CrcTable[i - 256];
     g_CrcTable[i] = g_CrcTable[r & 0xFF] ^ (r >> 8);
   }
-  g_CrcUpdate = CrcUpdateT4;
-/* FIXME
+  g_CrcUpdate = CrcUpdateT8;
   #ifdef MY_CPU_X86_OR_AMD64
   if (!CPU_Is_InOrder())
-    g_CrcUpdate = CrcUpdateT8;
+    g_CrcUpdate = CrcUpdateT16;
+  if (CPU_Is_Clmul_Supported())
+    g_CrcUpdate = CrcUpdateClmul;
   #endif
-*/
   #endif
 }
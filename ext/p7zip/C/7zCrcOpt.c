@@ -28,7 +28,155 @@ UInt32 MY_FAST_CALL CrcUpdateT4(UInt32 v, const void *data, size_t size, const U
 
 UInt32 MY_FAST_CALL CrcUpdateT8(UInt32 v, const void *data, size_t size, const UInt32 *table)
 {
-  return CrcUpdateT4(v, data, size, table);
+  const Byte *p = (const Byte *)data;
+  for (; size > 0 && ((unsigned)(ptrdiff_t)p & 7) != 0; size--, p++)
+    v = CRC_UPDATE_BYTE_2(v, *p);
+  for (; size >= 8; size -= 8, p += 8)
+  {
+    UInt32 d;
+    v ^= *(const UInt32 *)p;
+    v =
+      table[0x700 + (v & 0xFF)] ^
+      table[0x600 + ((v >> 8) & 0xFF)] ^
+      table[0x500 + ((v >> 16) & 0xFF)] ^
+      table[0x400 + ((v >> 24))];
+    d = *((const UInt32 *)p + 1);
+    v ^=
+      table[0x300 + (d & 0xFF)] ^
+      table[0x200 + ((d >> 8) & 0xFF)] ^
+      table[0x100 + ((d >> 16) & 0xFF)] ^
+      table[0x000 + ((d >> 24))];
+  }
+  for (; size > 0; size--, p++)
+    v = CRC_UPDATE_BYTE_2(v, *p);
+  return v;
+}
+
+#define CRC_T16_WORD(d, t) \
+      table[((t) + 3) * 0x100 + ((d) & 0xFF)] ^ \
+      table[((t) + 2) * 0x100 + (((d) >> 8) & 0xFF)] ^ \
+      table[((t) + 1) * 0x100 + (((d) >> 16) & 0xFF)] ^ \
+      table[((t) + 0) * 0x100 + ((d) >> 24)]
+
+/* table must contain 16 sub-tables */
+UInt32 MY_FAST_CALL CrcUpdateT16(UInt32 v, const void *data, size_t size, const UInt32 *table)
+{
+  const Byte *p = (const Byte *)data;
+  for (; size > 0 && ((unsigned)(ptrdiff_t)p & 7) != 0; size--, p++)
+    v = CRC_UPDATE_BYTE_2(v, *p);
+  for (; size >= 16; size -= 16, p += 16)
+  {
+    UInt32 d0 = *(const UInt32 *)p ^ v;
+    UInt32 d1 = *((const UInt32 *)p + 1);
+    UInt32 d2 = *((const UInt32 *)p + 2);
+    UInt32 d3 = *((const UInt32 *)p + 3);
+    v =
+      CRC_T16_WORD(d0, 12) ^
+      CRC_T16_WORD(d1, 8) ^
+      CRC_T16_WORD(d2, 4) ^
+      CRC_T16_WORD(d3, 0);
+  }
+  return CrcUpdateT8(v, p, size, table);
+}
+
+#ifdef MY_CPU_X86_OR_AMD64
+#if defined(_MSC_VER) && (_MSC_VER >= 1500)
+#define USE_CRC_CLMUL
+#define CRC_CLMUL_FUNC_ATTR
+#elif defined(__clang__) || (defined(__GNUC__) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9))))
+#define USE_CRC_CLMUL
+#define CRC_CLMUL_FUNC_ATTR __attribute__((__target__("pclmul,sse2")))
+#endif
+#endif
+
+#ifdef USE_CRC_CLMUL
+
+#include <wmmintrin.h>
+
+/* Folding with carry-less multiplication
+   ("Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction", Intel).
+   The constants are for bit-reflected polynomial 0xEDB88320. */
+
+/* CRC_CLMUL_CONST(h1, h0, l1, l0) is {(h1:h0), (l1:l0)} in two 64-bit lanes */
+#define CRC_CLMUL_CONST(h1, h0, l1, l0) _mm_set_epi32((int)(h1), (int)(h0), (int)(l1), (int)(l0))
+
+#define CRC_FOLD(x, k, d) \
+  x = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), d);
+
+#define LOAD_DATA(i) _mm_loadu_si128((const __m128i *)(const void *)p + (i))
+
+/* size >= 64, (size % 16) == 0 */
+CRC_CLMUL_FUNC_ATTR
+static UInt32 CrcUpdateClmul_Blocks(UInt32 v, const Byte *p, size_t size)
+{
+  const __m128i k1k2 = CRC_CLMUL_CONST(1, 0xC6E41596, 1, 0x54442BD4);
+  const __m128i k3k4 = CRC_CLMUL_CONST(0, 0xCCAA009E, 1, 0x751997D0);
+  const __m128i k5 = CRC_CLMUL_CONST(0, 0, 1, 0x63CD6124);
+  const __m128i poly = CRC_CLMUL_CONST(1, 0xF7011641, 1, 0xDB710641);
+  const __m128i mask32 = CRC_CLMUL_CONST(0, 0xFFFFFFFF, 0, 0xFFFFFFFF);
+  __m128i x0, x1, x2, x3;
+
+  x0 = _mm_xor_si128(LOAD_DATA(0), _mm_cvtsi32_si128((int)v));
+  x1 = LOAD_DATA(1);
+  x2 = LOAD_DATA(2);
+  x3 = LOAD_DATA(3);
+  p += 64;
+  size -= 64;
+
+  for (; size >= 64; size -= 64, p += 64)
+  {
+    CRC_FOLD(x0, k1k2, LOAD_DATA(0))
+    CRC_FOLD(x1, k1k2, LOAD_DATA(1))
+    CRC_FOLD(x2, k1k2, LOAD_DATA(2))
+    CRC_FOLD(x3, k1k2, LOAD_DATA(3))
+  }
+
+  CRC_FOLD(x0, k3k4, x1)
+  CRC_FOLD(x0, k3k4, x2)
+  CRC_FOLD(x0, k3k4, x3)
+
+  for (; size >= 16; size -= 16, p += 16)
+  {
+    CRC_FOLD(x0, k3k4, LOAD_DATA(0))
+  }
+
+  /* 128 bits -> 64 bits */
+  x1 = _mm_clmulepi64_si128(x0, k3k4, 0x10);
+  x0 = _mm_xor_si128(_mm_srli_si128(x0, 8), x1);
+  x1 = _mm_srli_si128(x0, 4);
+  x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), k5, 0x00);
+  x0 = _mm_xor_si128(x0, x1);
+
+  /* Barrett reduction to 32 bits */
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x10);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x00);
+  x0 = _mm_xor_si128(x0, x1);
+
+  return (UInt32)_mm_cvtsi128_si32(_mm_srli_si128(x0, 4));
 }
 
+#define CRC_CLMUL_MIN_SIZE 128
+
+UInt32 MY_FAST_CALL CrcUpdateClmul(UInt32 v, const void *data, size_t size, const UInt32 *table)
+{
+  const Byte *p = (const Byte *)data;
+  if (size >= CRC_CLMUL_MIN_SIZE)
+  {
+    size_t blocks = size & ~(size_t)15;
+    v = CrcUpdateClmul_Blocks(v, p, blocks);
+    p += blocks;
+    size -= blocks;
+  }
+  return CrcUpdateT16(v, p, size, table);
+}
+
+#else
+
+UInt32 MY_FAST_CALL CrcUpdateClmul(UInt32 v, const void *data, size_t size, const UInt32 *table)
+{
+  return CrcUpdateT16(v, data, size, table);
+}
+
+#endif
+
 #endif
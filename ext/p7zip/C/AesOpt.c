@@ -0,0 +1,207 @@
+/* AesOpt.c -- Intel's AES
+2009-11-23 : Igor Pavlov : Public domain
+2026-10-17 : seven_zip_ruby contributors : GCC / Clang build, 4-way CBC decoding and CTR */
+
+#include "CpuArch.h"
+
+#ifdef MY_CPU_X86_OR_AMD64
+#if defined(_MSC_VER) && (_MSC_VER >= 1500)
+#define USE_INTEL_AES
+#define AES_FUNC_ATTR
+#elif defined(__clang__) || (defined(__GNUC__) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9))))
+#define USE_INTEL_AES
+/* The functions are compiled for AES-NI, but they are called only
+   after CPU_Is_Aes_Supported() check in AesGenTables(). */
+#define AES_FUNC_ATTR __attribute__((__target__("aes,sse2")))
+#endif
+#endif
+
+#ifdef USE_INTEL_AES
+
+#include <wmmintrin.h>
+
+/* ivAes layout: iv, keyMode (numRounds2), roundKeys.
+   ivAes is 16-byte aligned, data can be unaligned. */
+
+#define LOAD_DATA(i) _mm_loadu_si128((const __m128i *)(const void *)(data) + (i))
+#define STORE_DATA(i, v) _mm_storeu_si128((__m128i *)(void *)(data) + (i), (v))
+
+AES_FUNC_ATTR
+void MY_FAST_CALL AesCbc_Encode_Intel(UInt32 *ivAes, Byte *data, size_t numBlocks)
+{
+  __m128i *p = (__m128i *)(void *)ivAes;
+  __m128i m = *p;
+  for (; numBlocks != 0; numBlocks--, data += 16)
+  {
+    UInt32 numRounds2 = *(const UInt32 *)(p + 1) - 1;
+    const __m128i *w = p + 3;
+    m = _mm_xor_si128(m, LOAD_DATA(0));
+    m = _mm_xor_si128(m, p[2]);
+    do
+    {
+      m = _mm_aesenc_si128(m, w[0]);
+      m = _mm_aesenc_si128(m, w[1]);
+      w += 2;
+    }
+    while (--numRounds2 != 0);
+    m = _mm_aesenc_si128(m, w[0]);
+    m = _mm_aesenclast_si128(m, w[1]);
+    STORE_DATA(0, m);
+  }
+  *p = m;
+}
+
+#define NUM_WAYS 4
+
+#define AES_OP_W(op, n) { \
+    const __m128i t = w[n]; \
+    m0 = op(m0, t); \
+    m1 = op(m1, t); \
+    m2 = op(m2, t); \
+    m3 = op(m3, t); \
+    }
+
+#define AES_DEC(n) AES_OP_W(_mm_aesdec_si128, n)
+#define AES_DEC_LAST(n) AES_OP_W(_mm_aesdeclast_si128, n)
+#define AES_ENC(n) AES_OP_W(_mm_aesenc_si128, n)
+#define AES_ENC_LAST(n) AES_OP_W(_mm_aesenclast_si128, n)
+
+AES_FUNC_ATTR
+void MY_FAST_CALL AesCbc_Decode_Intel(UInt32 *ivAes, Byte *data, size_t numBlocks)
+{
+  __m128i *p = (__m128i *)(void *)ivAes;
+  __m128i iv = *p;
+  for (; numBlocks >= NUM_WAYS; numBlocks -= NUM_WAYS, data += 16 * NUM_WAYS)
+  {
+    UInt32 numRounds2 = *(const UInt32 *)(p + 1);
+    const __m128i *w = p + numRounds2 * 2;
+    __m128i d0 = LOAD_DATA(0);
+    __m128i d1 = LOAD_DATA(1);
+    __m128i d2 = LOAD_DATA(2);
+    __m128i d3 = LOAD_DATA(3);
+    __m128i m0, m1, m2, m3;
+    {
+      const __m128i t = w[2];
+      m0 = _mm_xor_si128(t, d0);
+      m1 = _mm_xor_si128(t, d1);
+      m2 = _mm_xor_si128(t, d2);
+      m3 = _mm_xor_si128(t, d3);
+    }
+    numRounds2--;
+    do
+    {
+      AES_DEC(1)
+      AES_DEC(0)
+      w -= 2;
+    }
+    while (--numRounds2 != 0);
+    AES_DEC(1)
+    AES_DEC_LAST(0)
+
+    STORE_DATA(0, _mm_xor_si128(m0, iv));
+    STORE_DATA(1, _mm_xor_si128(m1, d0));
+    STORE_DATA(2, _mm_xor_si128(m2, d1));
+    STORE_DATA(3, _mm_xor_si128(m3, d2));
+    iv = d3;
+  }
+  for (; numBlocks != 0; numBlocks--, data += 16)
+  {
+    UInt32 numRounds2 = *(const UInt32 *)(p + 1);
+    const __m128i *w = p + numRounds2 * 2;
+    __m128i d = LOAD_DATA(0);
+    __m128i m = _mm_xor_si128(w[2], d);
+    numRounds2--;
+    do
+    {
+      m = _mm_aesdec_si128(m, w[1]);
+      m = _mm_aesdec_si128(m, w[0]);
+      w -= 2;
+    }
+    while (--numRounds2 != 0);
+    m = _mm_aesdec_si128(m, w[1]);
+    m = _mm_aesdeclast_si128(m, w[0]);
+
+    STORE_DATA(0, _mm_xor_si128(m, iv));
+    iv = d;
+  }
+  *p = iv;
+}
+
+AES_FUNC_ATTR
+void MY_FAST_CALL AesCtr_Code_Intel(UInt32 *ivAes, Byte *data, size_t numBlocks)
+{
+  __m128i *p = (__m128i *)(void *)ivAes;
+  __m128i ctr = *p;
+  /* the counter is the low 64-bit word of the block (as in AesCtr_Code) */
+  const __m128i one = _mm_cvtsi32_si128(1);
+  for (; numBlocks >= NUM_WAYS; numBlocks -= NUM_WAYS, data += 16 * NUM_WAYS)
+  {
+    UInt32 numRounds2 = *(const UInt32 *)(p + 1) - 1;
+    const __m128i *w = p;
+    __m128i m0, m1, m2, m3;
+    {
+      const __m128i t = w[2];
+      ctr = _mm_add_epi64(ctr, one); m0 = _mm_xor_si128(ctr, t);
+      ctr = _mm_add_epi64(ctr, one); m1 = _mm_xor_si128(ctr, t);
+      ctr = _mm_add_epi64(ctr, one); m2 = _mm_xor_si128(ctr, t);
+      ctr = _mm_add_epi64(ctr, one); m3 = _mm_xor_si128(ctr, t);
+    }
+    w += 3;
+    do
+    {
+      AES_ENC(0)
+      AES_ENC(1)
+      w += 2;
+    }
+    while (--numRounds2 != 0);
+    AES_ENC(0)
+    AES_ENC_LAST(1)
+
+    STORE_DATA(0, _mm_xor_si128(m0, LOAD_DATA(0)));
+    STORE_DATA(1, _mm_xor_si128(m1, LOAD_DATA(1)));
+    STORE_DATA(2, _mm_xor_si128(m2, LOAD_DATA(2)));
+    STORE_DATA(3, _mm_xor_si128(m3, LOAD_DATA(3)));
+  }
+  for (; numBlocks != 0; numBlocks--, data += 16)
+  {
+    UInt32 numRounds2 = *(const UInt32 *)(p + 1) - 1;
+    const __m128i *w = p + 3;
+    __m128i m;
+    ctr = _mm_add_epi64(ctr, one);
+    m = _mm_xor_si128(ctr, p[2]);
+    do
+    {
+      m = _mm_aesenc_si128(m, w[0]);
+      m = _mm_aesenc_si128(m, w[1]);
+      w += 2;
+    }
+    while (--numRounds2 != 0);
+    m = _mm_aesenc_si128(m, w[0]);
+    m = _mm_aesenclast_si128(m, w[1]);
+    STORE_DATA(0, _mm_xor_si128(m, LOAD_DATA(0)));
+  }
+  *p = ctr;
+}
+
+#else
+
+void MY_FAST_CALL AesCbc_Encode(UInt32 *ivAes, Byte *data, size_t numBlocks);
+void MY_FAST_CALL AesCbc_Decode(UInt32 *ivAes, Byte *data, size_t numBlocks);
+void MY_FAST_CALL AesCtr_Code(UInt32 *ivAes, Byte *data, size_t numBlocks);
+
+void MY_FAST_CALL AesCbc_Encode_Intel(UInt32 *p, Byte *data, size_t numBlocks)
+{
+  AesCbc_Encode(p, data, numBlocks);
+}
+
+void MY_FAST_CALL AesCbc_Decode_Intel(UInt32 *p, Byte *data, size_t numBlocks)
+{
+  AesCbc_Decode(p, data, numBlocks);
+}
+
+void MY_FAST_CALL AesCtr_Code_Intel(UInt32 *p, Byte *data, size_t numBlocks)
+{
+  AesCtr_Code(p, data, numBlocks);
+}
+
+#endif
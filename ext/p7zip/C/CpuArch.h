@@ -147,6 +147,7 @@ int x86cpuid_GetFirm(const Cx86cpuid *p);
 
 Bool CPU_Is_InOrder();
 Bool CPU_Is_Aes_Supported();
+Bool CPU_Is_Clmul_Supported();
 
 #endif
 
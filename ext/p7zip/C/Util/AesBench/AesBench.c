@@ -0,0 +1,246 @@
+/* AesBench.c -- AES check and benchmark
+2026-10-17 : seven_zip_ruby contributors : Public domain */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../Aes.h"
+#include "../../CpuArch.h"
+
+#define kBufferSize (1 << 24)
+#define kNumTestBlocks 19
+
+/* The portable functions of Aes.c. g_AesCbc_* point to them or to the AES-NI ones. */
+void MY_FAST_CALL AesCbc_Encode(UInt32 *ivAes, Byte *data, size_t numBlocks);
+void MY_FAST_CALL AesCbc_Decode(UInt32 *ivAes, Byte *data, size_t numBlocks);
+void MY_FAST_CALL AesCtr_Code(UInt32 *ivAes, Byte *data, size_t numBlocks);
+
+typedef struct
+{
+  const char *Name;
+  const char *Key;
+  const char *Iv;
+  const char *Plain;
+  const char *Cipher;
+} CAesVector;
+
+static const CAesVector kVectors[] =
+{
+  /* FIPS-197 Appendix C: one block with zero IV */
+  { "FIPS-197 C.1",
+    "000102030405060708090a0b0c0d0e0f",
+    "00000000000000000000000000000000",
+    "00112233445566778899aabbccddeeff",
+    "69c4e0d86a7b0430d8cdb78070b4c55a" },
+  { "FIPS-197 C.2",
+    "000102030405060708090a0b0c0d0e0f1011121314151617",
+    "00000000000000000000000000000000",
+    "00112233445566778899aabbccddeeff",
+    "dda97ca4864cdfe06eaf70a0ec0d7191" },
+  { "FIPS-197 C.3",
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f",
+    "00000000000000000000000000000000",
+    "00112233445566778899aabbccddeeff",
+    "8ea2b7ca516745bfeafc49904b496089" },
+  /* SP 800-38A F.2.1, F.2.3, F.2.5: CBC-AES128, CBC-AES192, CBC-AES256 */
+  { "SP 800-38A F.2.1",
+    "2b7e151628aed2a6abf7158809cf4f3c",
+    "000102030405060708090a0b0c0d0e0f",
+    "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+    "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+    "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"
+    "73bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7" },
+  { "SP 800-38A F.2.3",
+    "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+    "000102030405060708090a0b0c0d0e0f",
+    "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+    "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+    "4f021db243bc633d7178183a9fa071e8b4d9ada9ad7dedf4e5e738763f69145a"
+    "571b242012fb7ae07fa9baac3df102e008b0e27988598881d920a9e64f5615cd" },
+  { "SP 800-38A F.2.5",
+    "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+    "000102030405060708090a0b0c0d0e0f",
+    "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+    "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+    "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d"
+    "39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b" }
+};
+
+#define kMaxVectorSize 64
+
+static size_t ParseHex(const char *s, Byte *dest)
+{
+  size_t i;
+  for (i = 0; s[i * 2] != 0; i++)
+  {
+    unsigned v;
+    sscanf(s + i * 2, "%2x", &v);
+    dest[i] = (Byte)v;
+  }
+  return i;
+}
+
+/* ivAes must be 16-byte aligned */
+static UInt32 *AlignAes(UInt32 *buf)
+{
+  return buf + ((0 - (unsigned)(ptrdiff_t)buf) & 0xF) / sizeof(UInt32);
+}
+
+static void SetKey(UInt32 *ivAes, AES_SET_KEY_FUNC setKey, const Byte *key, unsigned keySize, const Byte *iv)
+{
+  setKey(ivAes + 4, key, keySize);
+  AesCbc_Init(ivAes, iv);
+}
+
+static int CheckVectors(void)
+{
+  UInt32 aesBuf[AES_NUM_IVMRK_WORDS + 3];
+  UInt32 *aes = AlignAes(aesBuf);
+  unsigned i;
+  for (i = 0; i < sizeof(kVectors) / sizeof(kVectors[0]); i++)
+  {
+    const CAesVector *v = &kVectors[i];
+    Byte key[32], iv[16], plain[kMaxVectorSize], cipher[kMaxVectorSize], buf[kMaxVectorSize + 1];
+    unsigned keySize = (unsigned)ParseHex(v->Key, key);
+    size_t size = ParseHex(v->Plain, plain);
+    ParseHex(v->Iv, iv);
+    ParseHex(v->Cipher, cipher);
+
+    /* buf + 1 checks unaligned data */
+    memcpy(buf + 1, plain, size);
+    SetKey(aes, Aes_SetKey_Enc, key, keySize, iv);
+    g_AesCbc_Encode(aes, buf + 1, size / AES_BLOCK_SIZE);
+    if (memcmp(buf + 1, cipher, size) != 0)
+    {
+      fprintf(stderr, "AES encode error: %s\n", v->Name);
+      return 1;
+    }
+    SetKey(aes, Aes_SetKey_Dec, key, keySize, iv);
+    g_AesCbc_Decode(aes, buf + 1, size / AES_BLOCK_SIZE);
+    if (memcmp(buf + 1, plain, size) != 0)
+    {
+      fprintf(stderr, "AES decode error: %s\n", v->Name);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Compares the selected functions with the portable ones for all key sizes,
+   for the block counts around the 4-block loops and for the continuation of the IV. */
+static int CheckFuncs(const Byte *data)
+{
+  UInt32 aesBuf[AES_NUM_IVMRK_WORDS + 3], refBuf[AES_NUM_IVMRK_WORDS + 3];
+  UInt32 *aes = AlignAes(aesBuf);
+  UInt32 *ref = AlignAes(refBuf);
+  Byte buf[kNumTestBlocks * AES_BLOCK_SIZE], refData[kNumTestBlocks * AES_BLOCK_SIZE];
+  unsigned keySize;
+  for (keySize = 16; keySize <= 32; keySize += 8)
+  {
+    size_t numBlocks;
+    for (numBlocks = 1; numBlocks <= kNumTestBlocks; numBlocks++)
+    {
+      size_t size = numBlocks * AES_BLOCK_SIZE;
+      unsigned mode;
+      for (mode = 0; mode < 3; mode++)
+      {
+        AES_SET_KEY_FUNC setKey = (mode == 1) ? Aes_SetKey_Dec : Aes_SetKey_Enc;
+        AES_CODE_FUNC func = (mode == 0) ? g_AesCbc_Encode : (mode == 1) ? g_AesCbc_Decode : g_AesCtr_Code;
+        AES_CODE_FUNC refFunc = (mode == 0) ? AesCbc_Encode : (mode == 1) ? AesCbc_Decode : AesCtr_Code;
+        unsigned k;
+        SetKey(aes, setKey, data, keySize, data + 32);
+        SetKey(ref, setKey, data, keySize, data + 32);
+        memcpy(buf, data + 48, size);
+        memcpy(refData, data + 48, size);
+        /* two calls check the IV (or the counter) left by the first one */
+        for (k = 0; k < 2; k++)
+        {
+          func(aes, buf, numBlocks);
+          refFunc(ref, refData, numBlocks);
+        }
+        if (memcmp(buf, refData, size) != 0 || memcmp(aes, ref, AES_BLOCK_SIZE) != 0)
+        {
+          fprintf(stderr, "AES error: mode = %u, keySize = %u, numBlocks = %u\n",
+              mode, keySize, (unsigned)numBlocks);
+          return 1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+static double GetSpeed(clock_t start, unsigned numCycles)
+{
+  double t = (double)(clock() - start) / CLOCKS_PER_SEC;
+  if (t <= 0)
+    t = 1.0 / CLOCKS_PER_SEC;
+  return (double)kBufferSize * numCycles / t / 1000000;
+}
+
+static void BenchFunc(const char *name, AES_CODE_FUNC func, AES_SET_KEY_FUNC setKey,
+    Byte *buf, unsigned numCycles)
+{
+  UInt32 aesBuf[AES_NUM_IVMRK_WORDS + 3];
+  UInt32 *aes = AlignAes(aesBuf);
+  unsigned i;
+  clock_t start;
+  SetKey(aes, setKey, buf, 32, buf + 32);
+  start = clock();
+  for (i = 0; i < numCycles; i++)
+    func(aes, buf, kBufferSize / AES_BLOCK_SIZE);
+  printf("%-16s %8.0f MB/s\n", name, GetSpeed(start, numCycles));
+}
+
+static void Bench(Byte *buf, unsigned numCycles)
+{
+  BenchFunc("CBC encode:", g_AesCbc_Encode, Aes_SetKey_Enc, buf, numCycles);
+  BenchFunc("CBC decode:", g_AesCbc_Decode, Aes_SetKey_Dec, buf, numCycles);
+  BenchFunc("CTR:", g_AesCtr_Code, Aes_SetKey_Enc, buf, numCycles);
+  if (g_AesCbc_Decode != AesCbc_Decode)
+  {
+    BenchFunc("CBC encode (C):", AesCbc_Encode, Aes_SetKey_Enc, buf, numCycles);
+    BenchFunc("CBC decode (C):", AesCbc_Decode, Aes_SetKey_Dec, buf, numCycles);
+    BenchFunc("CTR (C):", AesCtr_Code, Aes_SetKey_Enc, buf, numCycles);
+  }
+}
+
+int main(int numArgs, const char *args[])
+{
+  Byte *buf;
+  size_t i;
+  UInt32 seed = 1;
+  int testOnly = (numArgs > 1 && strcmp(args[1], "-t") == 0);
+  unsigned numCycles = (numArgs > 1 && !testOnly) ? (unsigned)atoi(args[1]) : 4;
+
+  AesGenTables();
+
+  buf = (Byte *)malloc(kBufferSize);
+  if (!buf)
+  {
+    fprintf(stderr, "Can't allocate memory\n");
+    return 1;
+  }
+  for (i = 0; i < kBufferSize; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = (Byte)(seed >> 16);
+  }
+
+  #ifdef MY_CPU_X86_OR_AMD64
+  printf("AES-NI: %s\n", CPU_Is_Aes_Supported() ? "yes" : "no");
+  #endif
+
+  if (CheckVectors() != 0 || CheckFuncs(buf) != 0)
+  {
+    free(buf);
+    return 1;
+  }
+  printf("Check: OK\n");
+  if (!testOnly)
+    Bench(buf, numCycles == 0 ? 1 : numCycles);
+  free(buf);
+  return 0;
+}
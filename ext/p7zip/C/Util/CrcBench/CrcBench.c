@@ -0,0 +1,132 @@
+/* CrcBench.c -- CRC32 / CRC64 check and benchmark
+2026-10-17 : seven_zip_ruby contributors : Public domain */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../7zCrc.h"
+#include "../../CpuArch.h"
+#include "../../XzCrc64.h"
+
+#define kBufferSize (1 << 24)
+#define kNumTestSizes 300
+
+static UInt32 RefCrc32(const Byte *p, size_t size)
+{
+  UInt32 v = CRC_INIT_VAL;
+  for (; size > 0; size--, p++)
+    v = CRC_UPDATE_BYTE(v, *p);
+  return CRC_GET_DIGEST(v);
+}
+
+static UInt64 RefCrc64(const Byte *p, size_t size)
+{
+  UInt64 v = CRC64_INIT_VAL;
+  for (; size > 0; size--, p++)
+    v = CRC64_UPDATE_BYTE(v, *p);
+  return CRC64_GET_DIGEST(v);
+}
+
+static int Check(const Byte *buf)
+{
+  static const char kCheckString[] = "123456789";
+  size_t offset, size;
+  if (CrcCalc(kCheckString, 9) != 0xCBF43926 ||
+      Crc64Calc(kCheckString, 9) != UINT64_CONST(0x995DC9BBDF1939FA))
+  {
+    fprintf(stderr, "CRC check value error\n");
+    return 1;
+  }
+  for (offset = 0; offset < 16; offset++)
+    for (size = 0; size < kNumTestSizes; size++)
+    {
+      const Byte *p = buf + offset;
+      /* split the data to check CrcUpdate() continuation */
+      size_t split = size / 3;
+      UInt32 crc = CRC_GET_DIGEST(CrcUpdate(CrcUpdate(CRC_INIT_VAL, p, split), p + split, size - split));
+      if (crc != RefCrc32(p, size) ||
+          CrcCalc(p, size) != crc ||
+          Crc64Calc(p, size) != RefCrc64(p, size))
+      {
+        fprintf(stderr, "CRC error: offset = %u, size = %u\n", (unsigned)offset, (unsigned)size);
+        return 1;
+      }
+    }
+  if (CrcCalc(buf, kBufferSize) != RefCrc32(buf, kBufferSize) ||
+      Crc64Calc(buf, kBufferSize) != RefCrc64(buf, kBufferSize))
+  {
+    fprintf(stderr, "CRC error: size = %u\n", (unsigned)kBufferSize);
+    return 1;
+  }
+  return 0;
+}
+
+static double GetSpeed(clock_t start, unsigned numCycles)
+{
+  double t = (double)(clock() - start) / CLOCKS_PER_SEC;
+  if (t <= 0)
+    t = 1.0 / CLOCKS_PER_SEC;
+  return (double)kBufferSize * numCycles / t / 1000000;
+}
+
+static void Bench(const Byte *buf, unsigned numCycles)
+{
+  unsigned i;
+  UInt32 crc = 0;
+  UInt64 crc64 = 0;
+  clock_t start;
+
+  start = clock();
+  for (i = 0; i < numCycles; i++)
+    crc ^= CrcCalc(buf, kBufferSize);
+  printf("CRC32: %8.0f MB/s\n", GetSpeed(start, numCycles));
+
+  start = clock();
+  for (i = 0; i < numCycles; i++)
+    crc64 ^= Crc64Calc(buf, kBufferSize);
+  printf("CRC64: %8.0f MB/s\n", GetSpeed(start, numCycles));
+
+  if (crc == 1 && crc64 == 1)
+    printf("\n");
+}
+
+int main(int numArgs, const char *args[])
+{
+  Byte *buf;
+  size_t i;
+  UInt32 seed = 1;
+  int testOnly = (numArgs > 1 && strcmp(args[1], "-t") == 0);
+  unsigned numCycles = (numArgs > 1 && !testOnly) ? (unsigned)atoi(args[1]) : 20;
+
+  CrcGenerateTable();
+  Crc64GenerateTable();
+
+  buf = (Byte *)malloc(kBufferSize + 16);
+  if (!buf)
+  {
+    fprintf(stderr, "Can't allocate memory\n");
+    return 1;
+  }
+  for (i = 0; i < kBufferSize + 16; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = (Byte)(seed >> 16);
+  }
+
+  #ifdef MY_CPU_X86_OR_AMD64
+  printf("CLMUL: %s\n", CPU_Is_Clmul_Supported() ? "yes" : "no");
+  #endif
+
+  if (Check(buf) != 0)
+  {
+    free(buf);
+    return 1;
+  }
+  printf("Check: OK\n");
+  if (!testOnly)
+    Bench(buf, numCycles == 0 ? 1 : numCycles);
+  free(buf);
+  return 0;
+}
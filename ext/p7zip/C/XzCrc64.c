@@ -2,9 +2,32 @@
 2010-04-16 : Igor Pavlov : Public domain */
 
 #include "XzCrc64.h"
+#include "CpuArch.h"
 
 #define kCrc64Poly UINT64_CONST(0xC96C5795D7870F42)
-UInt64 g_Crc64Table[256];
+
+#ifdef MY_CPU_LE
+#define CRC64_NUM_TABLES 8
+#else
+#define CRC64_NUM_TABLES 1
+#endif
+
+typedef UInt64 (MY_FAST_CALL *CRC64_FUNC)(UInt64 v, const void *data, size_t size, const UInt64 *table);
+
+static CRC64_FUNC g_Crc64Update;
+UInt64 g_Crc64Table[256 * CRC64_NUM_TABLES];
+
+static UInt64 MY_FAST_CALL XzCrc64UpdateT1(UInt64 v, const void *data, size_t size, const UInt64 *table)
+{
+  const Byte *p = (const Byte *)data;
+  for (; size > 0 ; size--, p++)
+    v = table[(v ^ *p) & 0xFF] ^ (v >> 8);
+  return v;
+}
+
+#if CRC64_NUM_TABLES > 1
+UInt64 MY_FAST_CALL XzCrc64UpdateT8(UInt64 v, const void *data, size_t size, const UInt64 *table);
+#endif
 
 void MY_FAST_CALL Crc64GenerateTable(void)
 {
@@ -17,14 +40,20 @@ void MY_FAST_CALL Crc64GenerateTable(void)
       r = (r >> 1) ^ ((UInt64)kCrc64Poly & ~((r & 1) - 1));
     g_Crc64Table[i] = r;
   }
+  g_Crc64Update = XzCrc64UpdateT1;
+  #if CRC64_NUM_TABLES > 1
+  for (; i < 256 * CRC64_NUM_TABLES; i++)
+  {
+    UInt64 r = g_Crc64Table[i - 256];
+    g_Crc64Table[i] = g_Crc64Table[r & 0xFF] ^ (r >> 8);
+  }
+  g_Crc64Update = XzCrc64UpdateT8;
+  #endif
 }
 
 UInt64 MY_FAST_CALL Crc64Update(UInt64 v, const void *data, size_t size)
 {
-  const Byte *p = (const Byte *)data;
-  for (; size > 0 ; size--, p++)
-    v = CRC64_UPDATE_BYTE(v, *p);
-  return v;
+  return g_Crc64Update(v, data, size, g_Crc64Table);
 }
 
 UInt64 MY_FAST_CALL Crc64Calc(const void *data, size_t size)
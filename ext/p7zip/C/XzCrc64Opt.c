@@ -0,0 +1,34 @@
+/* XzCrc64Opt.c -- CRC64 calculation : optimized version
+2026-10-17 : seven_zip_ruby contributors : Public domain */
+
+#include "CpuArch.h"
+
+#ifdef MY_CPU_LE
+
+#define CRC64_UPDATE_BYTE_2(crc, b) (table[((crc) ^ (b)) & 0xFF] ^ ((crc) >> 8))
+
+UInt64 MY_FAST_CALL XzCrc64UpdateT8(UInt64 v, const void *data, size_t size, const UInt64 *table)
+{
+  const Byte *p = (const Byte *)data;
+  for (; size > 0 && ((unsigned)(ptrdiff_t)p & 7) != 0; size--, p++)
+    v = CRC64_UPDATE_BYTE_2(v, *p);
+  for (; size >= 8; size -= 8, p += 8)
+  {
+    UInt32 d0 = (UInt32)v ^ *(const UInt32 *)p;
+    UInt32 d1 = (UInt32)(v >> 32) ^ *((const UInt32 *)p + 1);
+    v =
+      table[0x700 + (d0 & 0xFF)] ^
+      table[0x600 + ((d0 >> 8) & 0xFF)] ^
+      table[0x500 + ((d0 >> 16) & 0xFF)] ^
+      table[0x400 + ((d0 >> 24))] ^
+      table[0x300 + (d1 & 0xFF)] ^
+      table[0x200 + ((d1 >> 8) & 0xFF)] ^
+      table[0x100 + ((d1 >> 16) & 0xFF)] ^
+      table[0x000 + ((d1 >> 24))];
+  }
+  for (; size > 0; size--, p++)
+    v = CRC64_UPDATE_BYTE_2(v, *p);
+  return v;
+}
+
+#endif
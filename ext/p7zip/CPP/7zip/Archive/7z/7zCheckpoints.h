@@ -0,0 +1,214 @@
+// 7zCheckpoints.h
+
+#ifndef __7Z_CHECKPOINTS_H
+#define __7Z_CHECKPOINTS_H
+
+#include <memory>
+
+#include "../../../Common/MyVector.h"
+#include "../../../Windows/Synchronization.h"
+
+#include "../../Compress/LzmaDecoder.h"
+
+#include "7zItem.h"
+
+namespace NArchive {
+namespace N7z {
+
+/*
+  CCheckpoints keeps the states of the LZMA decoder taken at the multiples
+  of the interval in the unpacked streams of the folders, so that an entry
+  in the middle of a solid folder is decoded from the nearest checkpoint
+  before it instead of the start of the folder.
+  Each checkpoint holds the copy of the dictionary, so it takes up to the
+  dictionary size of the folder. The least recently used checkpoints are
+  dropped when the total size exceeds the maximum size.
+  The interval is 0 (disabled) by default.
+*/
+
+class CCheckpoints
+{
+public:
+  typedef std::shared_ptr<const NCompress::NLzma::CCheckpoint> CCheckpointPtr;
+
+private:
+  struct CItem
+  {
+    CCheckpointPtr Checkpoint;
+    UInt64 LastUse;
+  };
+
+  struct CFolderItem
+  {
+    CNum FolderIndex;
+    CObjectVector<CItem> Items; // sorted by OutSize
+  };
+
+  NWindows::NSynchronization::CCriticalSection _cs;
+  CObjectVector<CFolderItem> _folders;
+  UInt64 _interval;
+  UInt64 _maxSize;
+  UInt64 _num;
+  UInt64 _size;
+  UInt64 _useCounter;
+
+  int FindFolder(CNum folderIndex) const
+  {
+    for (int i = 0; i < _folders.Size(); i++)
+      if (_folders[i].FolderIndex == folderIndex)
+        return i;
+    return -1;
+  }
+
+  // Returns the index of the first checkpoint after outSize.
+  static int FindNext(const CObjectVector<CItem> &items, UInt64 outSize)
+  {
+    int left = 0, right = items.Size();
+    while (left < right)
+    {
+      int mid = (left + right) / 2;
+      if (items[mid].Checkpoint->OutSize <= outSize)
+        left = mid + 1;
+      else
+        right = mid;
+    }
+    return left;
+  }
+
+  void ClearItems()
+  {
+    _folders.Clear();
+    _num = 0;
+    _size = 0;
+  }
+
+  // Drops the least recently used checkpoints.
+  void Reduce(UInt64 maxSize)
+  {
+    while (_size > maxSize)
+    {
+      int folder = -1, item = -1;
+      for (int i = 0; i < _folders.Size(); i++)
+      {
+        const CObjectVector<CItem> &items = _folders[i].Items;
+        for (int j = 0; j < items.Size(); j++)
+          if (folder < 0 || items[j].LastUse < _folders[folder].Items[item].LastUse)
+          {
+            folder = i;
+            item = j;
+          }
+      }
+      if (folder < 0)
+        return;
+      CObjectVector<CItem> &items = _folders[folder].Items;
+      _size -= items[item].Checkpoint->GetMemSize();
+      _num--;
+      items.Delete(item);
+      if (items.IsEmpty())
+        _folders.Delete(folder);
+    }
+  }
+
+public:
+  CCheckpoints(): _interval(0), _maxSize(0), _num(0), _size(0), _useCounter(0) {}
+
+  // The checkpoints taken at the other interval are dropped.
+  void SetInterval(UInt64 interval)
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    if (interval != _interval)
+      ClearItems();
+    _interval = interval;
+  }
+
+  UInt64 GetInterval()
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    return _interval;
+  }
+
+  void SetMaxSize(UInt64 maxSize)
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    _maxSize = maxSize;
+    Reduce(_maxSize);
+  }
+
+  // The checkpoint of memSize bytes at outSize is not kept if it exists,
+  // or if it is larger than the maximum size.
+  bool Need(CNum folderIndex, UInt64 outSize, UInt64 memSize)
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    if (memSize > _maxSize)
+      return false;
+    int folder = FindFolder(folderIndex);
+    if (folder < 0)
+      return true;
+    const CObjectVector<CItem> &items = _folders[folder].Items;
+    int i = FindNext(items, outSize);
+    return !(i > 0 && items[i - 1].Checkpoint->OutSize == outSize);
+  }
+
+  // Returns the last checkpoint at or before outSize.
+  CCheckpointPtr Find(CNum folderIndex, UInt64 outSize)
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    int folder = FindFolder(folderIndex);
+    if (folder < 0)
+      return CCheckpointPtr();
+    CObjectVector<CItem> &items = _folders[folder].Items;
+    int i = FindNext(items, outSize);
+    if (i == 0)
+      return CCheckpointPtr();
+    items[i - 1].LastUse = ++_useCounter;
+    return items[i - 1].Checkpoint;
+  }
+
+  // Takes the ownership of the checkpoint.
+  void Add(CNum folderIndex, NCompress::NLzma::CCheckpoint *checkpoint)
+  {
+    CItem item;
+    item.Checkpoint = CCheckpointPtr(checkpoint);
+    UInt64 memSize = checkpoint->GetMemSize();
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    if (memSize > _maxSize)
+      return;
+    item.LastUse = ++_useCounter;
+    int folder = FindFolder(folderIndex);
+    if (folder < 0)
+    {
+      CFolderItem folderItem;
+      folderItem.FolderIndex = folderIndex;
+      _folders.Add(folderItem);
+      folder = _folders.Size() - 1;
+    }
+    {
+      CObjectVector<CItem> &items = _folders[folder].Items;
+      int i = FindNext(items, checkpoint->OutSize);
+      if (i > 0 && items[i - 1].Checkpoint->OutSize == checkpoint->OutSize)
+        return;
+      items.Insert(i, item);
+    }
+    _num++;
+    _size += memSize;
+    Reduce(_maxSize);
+  }
+
+  // The checkpoints of the other archive are dropped. The interval and the maximum size are kept.
+  void Clear()
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    ClearItems();
+  }
+
+  void GetStat(UInt64 &num, UInt64 &size)
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    num = _num;
+    size = _size;
+  }
+};
+
+}}
+
+#endif
@@ -84,6 +84,15 @@ CDecoder::CDecoder(bool multiThread)
   #endif
   _multiThread = multiThread;
   _bindInfoExPrevIsDefined = false;
+  _binderBufferSize = kStreamBinderBufferSizeDefault;
+}
+
+void CDecoder::SetBinderBufferSize(UInt32 size)
+{
+  if (size == _binderBufferSize)
+    return;
+  _binderBufferSize = size;
+  _bindInfoExPrevIsDefined = false;
 }
 
 HRESULT CDecoder::Decode(
@@ -150,6 +159,7 @@ HRESULT CDecoder::Decode(
       _mixerCoderMTSpec = new NCoderMixer::CCoderMixer2MT;
       _mixerCoder = _mixerCoderMTSpec;
       _mixerCoderCommon = _mixerCoderMTSpec;
+      _mixerCoderMTSpec->SetBinderBufferSize(_binderBufferSize);
     }
     else
     {
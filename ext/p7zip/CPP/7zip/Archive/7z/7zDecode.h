@@ -44,8 +44,10 @@ class CDecoder
   CMyComPtr<ICompressCoder2> _mixerCoder;
   CObjectVector<CMyComPtr<IUnknown> > _decoders;
   // CObjectVector<CMyComPtr<ICompressCoder2> > _decoders2;
+  UInt32 _binderBufferSize;
 public:
   CDecoder(bool multiThread);
+  void SetBinderBufferSize(UInt32 size);
   HRESULT Decode(
       DECL_EXTERNAL_CODECS_LOC_VARS
       IInStream *inStream,
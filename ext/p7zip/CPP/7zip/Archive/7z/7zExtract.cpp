@@ -2,15 +2,27 @@
 
 #include "StdAfx.h"
 
+#include <chrono>
+
 #include "../../../Common/ComTry.h"
 
+#include "../../Common/LimitedStreams.h"
 #include "../../Common/ProgressUtils.h"
+#include "../../Common/StreamUtils.h"
+
 
 #include "7zDecode.h"
 // #include "7z1Decode.h"
 #include "7zFolderOutStream.h"
 #include "7zHandler.h"
 
+#ifdef __7Z_MT_EXTRACT
+#include "../../../Windows/Synchronization.h"
+#include "../../../Windows/Thread.h"
+
+#include "../../Common/LockedStream.h"
+#endif
+
 namespace NArchive {
 namespace N7z {
 
@@ -43,8 +55,1036 @@ struct CExtractFolderInfo
   };
 };
 
+static UInt64 GetTimeInMicroseconds()
+{
+  return (UInt64)std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static HRESULT SetFolderStat(IArchiveFolderStatCallback *folderStat,
+    const CArchiveDatabaseEx &db, CNum folderIndex, UInt64 time)
+{
+  if (!folderStat)
+    return S_OK;
+  return folderStat->SetFolderStat(folderIndex, db.GetFolderFullPackSize(folderIndex),
+      db.Folders[folderIndex].GetUnpackSize(), time);
+}
+
+// Writes the folder decoded into memory. size is less than the unpack size
+// of the folder, if decoding failed with decodeResult or an exception.
+static HRESULT WriteFolder(
+    const CArchiveDatabaseEx &db,
+    const CExtractFolderInfo &efi,
+    const Byte *data, size_t size,
+    HRESULT decodeResult, bool dataError,
+    IArchiveExtractCallback *extractCallback,
+    bool testMode, bool checkCrc)
+{
+  CFolderOutStream *folderOutStream = new CFolderOutStream;
+  CMyComPtr<ISequentialOutStream> outStream(folderOutStream);
+
+  RINOK(folderOutStream->Init(&db, 0, db.FolderStartFileIndex[efi.FolderIndex],
+      &efi.ExtractStatuses, extractCallback, testMode, checkCrc));
+
+  RINOK(WriteStream(outStream, data, size));
+
+  if (dataError)
+    return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError);
+  if (decodeResult == S_FALSE)
+    return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError);
+  if (decodeResult == E_NOTIMPL)
+    return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kUnSupportedMethod);
+  if (decodeResult != S_OK)
+    return decodeResult;
+  if (folderOutStream->WasWritingFinished() != S_OK)
+    return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError);
+  return S_OK;
+}
+
+// Passes the decoded data to the folder stream, and keeps its copy for the folder cache.
+class CFolderCacheOutStream:
+  public ISequentialOutStream,
+  public CMyUnknownImp
+{
+  CMyComPtr<ISequentialOutStream> _stream;
+  Byte *_buffer;
+  size_t _size;
+  size_t _pos;
+  bool _overflow;
+public:
+  void Init(ISequentialOutStream *stream, Byte *buffer, size_t size)
+  {
+    _stream = stream;
+    _buffer = buffer;
+    _size = size;
+    _pos = 0;
+    _overflow = false;
+  }
+  bool IsFilled() const { return !_overflow && _pos == _size; }
+
+  MY_UNKNOWN_IMP
+  STDMETHOD(Write)(const void *data, UInt32 size, UInt32 *processedSize);
+};
+
+STDMETHODIMP CFolderCacheOutStream::Write(const void *data, UInt32 size, UInt32 *processedSize)
+{
+  UInt32 cur = size;
+  HRESULT result = _stream->Write(data, size, &cur);
+  size_t rem = _size - _pos;
+  if (rem > cur)
+    rem = cur;
+  else if (rem < cur)
+    _overflow = true;
+  memcpy(_buffer + _pos, data, rem);
+  _pos += rem;
+  if (processedSize)
+    *processedSize = cur;
+  return result;
+}
+
+static const CMethodId k_LZMA = 0x030101;
+
+// Folders of one LZMA coder can be decoded from the checkpoints.
+static bool CanUseCheckpoints(const CFolder &folder)
+{
+  return folder.Coders.Size() == 1 && folder.PackStreams.Size() == 1 &&
+      folder.Coders[0].MethodID == k_LZMA && folder.Coders[0].IsSimpleCoder();
+}
+
+class CFolderCheckpointCallback: public NCompress::NLzma::ICheckpointCallback
+{
+  CCheckpoints *_checkpoints;
+  CNum _folderIndex;
+public:
+  CFolderCheckpointCallback(CCheckpoints *checkpoints, CNum folderIndex):
+      _checkpoints(checkpoints), _folderIndex(folderIndex) {}
+  bool NeedCheckpoint(UInt64 outSize, UInt64 memSize)
+      { return _checkpoints->Need(_folderIndex, outSize, memSize); }
+  HRESULT AddCheckpoint(NCompress::NLzma::CCheckpoint *checkpoint)
+  {
+    _checkpoints->Add(_folderIndex, checkpoint);
+    return S_OK;
+  }
+};
+
+// Drops the first bytes written to it.
+class CSkipOutStream:
+  public ISequentialOutStream,
+  public CMyUnknownImp
+{
+  CMyComPtr<ISequentialOutStream> _stream;
+  UInt64 _rem;
+public:
+  void Init(ISequentialOutStream *stream, UInt64 skipSize)
+  {
+    _stream = stream;
+    _rem = skipSize;
+  }
+
+  MY_UNKNOWN_IMP
+  STDMETHOD(Write)(const void *data, UInt32 size, UInt32 *processedSize);
+};
+
+STDMETHODIMP CSkipOutStream::Write(const void *data, UInt32 size, UInt32 *processedSize)
+{
+  if (processedSize)
+    *processedSize = 0;
+  if (_rem >= size)
+  {
+    _rem -= size;
+    if (processedSize)
+      *processedSize = size;
+    return S_OK;
+  }
+  UInt32 skip = (UInt32)_rem;
+  _rem = 0;
+  UInt32 cur = 0;
+  HRESULT result = _stream->Write((const Byte *)data + skip, size - skip, &cur);
+  if (processedSize)
+    *processedSize = skip + cur;
+  return result;
+}
+
+/*
+  Decodes the folder from the nearest checkpoint before the first file
+  to extract, and stops after the last one. The checkpoints passed on
+  the way are added.
+*/
+
+static HRESULT ExtractFolderFromCheckpoint(
+    IInStream *inStream, UInt32 ref2Offset,
+    const CArchiveDatabaseEx &db,
+    const CExtractFolderInfo &efi,
+    IArchiveExtractCallback *extractCallback,
+    bool testMode, bool checkCrc,
+    ICompressProgressInfo *progress,
+    CCheckpoints &checkpoints)
+{
+  CNum folderIndex = efi.FolderIndex;
+  const CFolder &folderInfo = db.Folders[folderIndex];
+  CNum folderStartIndex = db.FolderStartFileIndex[folderIndex];
+
+  int first = 0;
+  UInt64 startPos = 0;
+  while (first < efi.ExtractStatuses.Size() && !efi.ExtractStatuses[first])
+    startPos += db.Files[folderStartIndex + first++].Size;
+  UInt64 endPos = startPos;
+  CBoolVector extractStatuses;
+  for (int i = first; i < efi.ExtractStatuses.Size(); i++)
+  {
+    endPos += db.Files[folderStartIndex + i].Size;
+    extractStatuses.Add(efi.ExtractStatuses[i]);
+  }
+
+  CFolderOutStream *folderOutStream = new CFolderOutStream;
+  CMyComPtr<ISequentialOutStream> outStream(folderOutStream);
+  RINOK(folderOutStream->Init(&db, ref2Offset, folderStartIndex + first,
+      &extractStatuses, extractCallback, testMode, checkCrc));
+
+  CCheckpoints::CCheckpointPtr checkpoint = checkpoints.Find(folderIndex, startPos);
+  UInt64 inPos = checkpoint ? checkpoint->InSize : 0;
+  UInt64 outPos = checkpoint ? checkpoint->OutSize : 0;
+  UInt64 packSize = db.PackSizes[db.FolderStartPackStreamIndex[folderIndex]];
+  if (inPos > packSize)
+    return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError);
+
+  CSkipOutStream *skipStreamSpec = new CSkipOutStream;
+  CMyComPtr<ISequentialOutStream> skipStream = skipStreamSpec;
+  skipStreamSpec->Init(outStream, startPos - outPos);
+
+  RINOK(inStream->Seek(db.GetFolderStreamPos(folderIndex, 0) + inPos, STREAM_SEEK_SET, NULL));
+  CLimitedSequentialInStream *limitedStreamSpec = new CLimitedSequentialInStream;
+  CMyComPtr<ISequentialInStream> limitedStream = limitedStreamSpec;
+  limitedStreamSpec->SetStream(inStream);
+  limitedStreamSpec->Init(packSize - inPos);
+
+  NCompress::NLzma::CDecoder *decoderSpec = new NCompress::NLzma::CDecoder;
+  CMyComPtr<ICompressCoder> decoder = decoderSpec;
+  CFolderCheckpointCallback callback(&checkpoints, folderIndex);
+
+  try
+  {
+    const CByteBuffer &props = folderInfo.Coders[0].Props;
+    HRESULT result = decoderSpec->SetDecoderProperties2(props, (UInt32)props.GetCapacity());
+    if (result == S_OK)
+    {
+      decoderSpec->SetCheckpoints(checkpoints.GetInterval(), &callback);
+      if (checkpoint)
+        result = decoderSpec->CodeFromCheckpoint(limitedStream, skipStream, *checkpoint, &endPos, progress);
+      else
+        result = decoder->Code(limitedStream, skipStream, NULL, &endPos, progress);
+    }
+
+    if (result == S_FALSE)
+      return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError);
+    if (result == E_NOTIMPL)
+      return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kUnSupportedMethod);
+    if (result != S_OK)
+      return result;
+    if (folderOutStream->WasWritingFinished() != S_OK)
+      return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError);
+  }
+  catch(...)
+  {
+    return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError);
+  }
+  return S_OK;
+}
+
+static HRESULT ExtractFolder(
+    DECL_EXTERNAL_CODECS_LOC_VARS
+    CDecoder &decoder,
+    IInStream *inStream, UInt32 ref2Offset,
+    const CArchiveDatabaseEx &db,
+    const CExtractFolderInfo &efi,
+    IArchiveExtractCallback *extractCallbackSpec,
+    bool testMode, bool checkCrc,
+    ICompressProgressInfo *progress,
+    CFolderCache *folderCache, CCheckpoints *checkpoints
+    #if !defined(_7ZIP_ST) && !defined(_SFX)
+    , UInt32 numThreads
+    #endif
+    )
+{
+  CMyComPtr<IArchiveExtractCallback> extractCallback = extractCallbackSpec;
+
+  // Testing decodes the packed data, even if the folder is in the cache.
+  bool useCache = (!testMode && efi.FileIndex == kNumNoIndex && folderCache && folderCache->CanKeep(efi.UnpackSize));
+  if (useCache)
+  {
+    CFolderCache::CDataPtr data = folderCache->Find(efi.FolderIndex);
+    if (data)
+      return WriteFolder(db, efi, *data, data->GetCapacity(), S_OK, false,
+          extractCallback, testMode, checkCrc);
+  }
+
+  if (!useCache && efi.FileIndex == kNumNoIndex && checkpoints && checkpoints->GetInterval() != 0 &&
+      CanUseCheckpoints(db.Folders[efi.FolderIndex]))
+    return ExtractFolderFromCheckpoint(inStream, ref2Offset, db, efi,
+        extractCallback, testMode, checkCrc, progress, *checkpoints);
+
+  CFolderOutStream *folderOutStream = new CFolderOutStream;
+  CMyComPtr<ISequentialOutStream> outStream(folderOutStream);
+
+  CNum startIndex;
+  if (efi.FileIndex != kNumNoIndex)
+    startIndex = efi.FileIndex;
+  else
+    startIndex = db.FolderStartFileIndex[efi.FolderIndex];
+
+  RINOK(folderOutStream->Init(&db, ref2Offset, startIndex,
+      &efi.ExtractStatuses, extractCallback, testMode, checkCrc));
+
+  if (efi.FileIndex != kNumNoIndex)
+    return S_OK;
+
+  CNum folderIndex = efi.FolderIndex;
+  const CFolder &folderInfo = db.Folders[folderIndex];
+
+  CNum packStreamIndex = db.FolderStartPackStreamIndex[folderIndex];
+  UInt64 folderStartPackPos = db.GetFolderStreamPos(folderIndex, 0);
+
+  #ifndef _NO_CRYPTO
+  CMyComPtr<ICryptoGetTextPassword> getTextPassword;
+  if (extractCallback)
+    extractCallback.QueryInterface(IID_ICryptoGetTextPassword, &getTextPassword);
+  #endif
+
+  std::shared_ptr<CByteBuffer> cacheData;
+  CFolderCacheOutStream *cacheStreamSpec = NULL;
+  CMyComPtr<ISequentialOutStream> decoderOutStream = outStream;
+  if (useCache)
+  {
+    try
+    {
+      cacheData.reset(new CByteBuffer((size_t)efi.UnpackSize));
+      cacheStreamSpec = new CFolderCacheOutStream;
+      decoderOutStream = cacheStreamSpec;
+      cacheStreamSpec->Init(outStream, *cacheData, (size_t)efi.UnpackSize);
+    }
+    catch(...)
+    {
+      // The folder is extracted without the cache, if its copy cannot be allocated.
+      cacheData.reset();
+      cacheStreamSpec = NULL;
+      decoderOutStream = outStream;
+    }
+  }
+
+  try
+  {
+    #ifndef _NO_CRYPTO
+    bool passwordIsDefined;
+    #endif
+
+    HRESULT result = decoder.Decode(
+        EXTERNAL_CODECS_LOC_VARS
+        inStream,
+        folderStartPackPos,
+        &db.PackSizes[packStreamIndex],
+        folderInfo,
+        decoderOutStream,
+        progress
+        #ifndef _NO_CRYPTO
+        , getTextPassword, passwordIsDefined
+        #endif
+        #if !defined(_7ZIP_ST) && !defined(_SFX)
+        , true, numThreads
+        #endif
+        );
+
+    if (result == S_FALSE)
+      return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError);
+    if (result == E_NOTIMPL)
+      return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kUnSupportedMethod);
+    if (result != S_OK)
+      return result;
+    if (folderOutStream->WasWritingFinished() != S_OK)
+      return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError);
+  }
+  catch(...)
+  {
+    return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError);
+  }
+  if (cacheStreamSpec && cacheStreamSpec->IsFilled())
+    folderCache->Add(efi.FolderIndex, cacheData);
+  return S_OK;
+}
+
+#ifdef __7Z_MT_EXTRACT
+
+// Folders up to this size are decoded by worker threads into memory and
+// then written to the callback by the calling thread.
+static const UInt64 kMtFolderSizeMax = (UInt64)1 << 26;
+
+class CMtFolderOutStream:
+  public ISequentialOutStream,
+  public CMyUnknownImp
+{
+  Byte *_buffer;
+  size_t _size;
+  size_t _pos;
+public:
+  bool Overflow;
+
+  void Init(Byte *buffer, size_t size)
+  {
+    _buffer = buffer;
+    _size = size;
+    _pos = 0;
+    Overflow = false;
+  }
+  size_t GetPos() const { return _pos; }
+
+  MY_UNKNOWN_IMP
+  STDMETHOD(Write)(const void *data, UInt32 size, UInt32 *processedSize);
+};
+
+STDMETHODIMP CMtFolderOutStream::Write(const void *data, UInt32 size, UInt32 *processedSize)
+{
+  size_t rem = _size - _pos;
+  if (rem > size)
+    rem = (size_t)size;
+  else if (rem < size)
+    Overflow = true;
+  memcpy(_buffer + _pos, data, rem);
+  _pos += rem;
+  if (processedSize)
+    *processedSize = size;
+  return S_OK;
+}
+
+struct CMtExtractJob
+{
+  enum
+  {
+    kNone,
+    kQueued,
+    kFinished,
+    kDelivered
+  };
+
+  int Status;
+  std::shared_ptr<CByteBuffer> Buf;
+  CRecordVector<Int32> TestResults; // in test mode, the folder is not kept in Buf
+  UInt64 Time;
+  CFolderCache::CDataPtr Cached; // the folder is not decoded, if it is in the folder cache
+  size_t Processed;
+  bool Overflow;
+  bool Exception;
+  HRESULT Result;
+
+  CMtExtractJob(): Status(kNone), Time(0), Processed(0), Overflow(false), Exception(false), Result(S_OK) {}
+};
+
+class CMtExtract;
+
+class CMtExtractProgress:
+  public ICompressProgressInfo,
+  public CMyUnknownImp
+{
+public:
+  CMtExtract *Mt;
+
+  MY_UNKNOWN_IMP
+  STDMETHOD(SetRatioInfo)(const UInt64 *inSize, const UInt64 *outSize);
+};
+
+#ifndef _NO_CRYPTO
+class CMtExtractPassword:
+  public ICryptoGetTextPassword,
+  public CMyUnknownImp
+{
+public:
+  CMtExtract *Mt;
+  CMyComPtr<ICryptoGetTextPassword> GetTextPassword;
+
+  MY_UNKNOWN_IMP
+  STDMETHOD(CryptoGetTextPassword)(BSTR *password);
+};
+#endif
+
+struct CMtExtractThread
+{
+  CMtExtract *Mt;
+  CDecoder Decoder;
+  NWindows::CThread Thread;
+  CMyComPtr<ICompressProgressInfo> Progress;
+  #ifndef _NO_CRYPTO
+  CMyComPtr<ICryptoGetTextPassword> GetTextPassword;
+  #endif
+
+  CMtExtractThread():
+    Decoder(
+      #ifdef _ST_MODE
+      false
+      #else
+      true
+      #endif
+      )
+    {}
+  void Process();
+  HRESULT DecodeFolder(const CExtractFolderInfo &efi, CMtExtractJob &job);
+  HRESULT TestFolder(const CExtractFolderInfo &efi, CMtExtractJob &job);
+};
+
+class CMtExtract
+{
+public:
+  #ifdef EXTERNAL_CODECS
+  ICompressCodecsInfo *CodecsInfo;
+  const CObjectVector<CCodecInfoEx> *ExternalCodecs;
+  #endif
+  const CArchiveDatabaseEx *Db;
+  const CObjectVector<CExtractFolderInfo> *Items;
+  bool TestMode;
+  bool CheckCrc;
+  CLockedInStream LockedInStream;
+  UInt64 StreamSize;
+  UInt32 BinderBufferSize;
+
+  NWindows::NSynchronization::CCriticalSection CS;
+  NWindows::NSynchronization::CCriticalSection CallbackCS;
+  NWindows::NSynchronization::CSemaphore JobSemaphore;
+  NWindows::NSynchronization::CAutoResetEvent JobFinishedEvent;
+  CRecordVector<int> Queue;
+  int QueuePos;
+  CRecordVector<int> Finished;
+  CObjectVector<CMtExtractJob> Jobs;
+  bool Stop;
+  bool Exit;
+
+  CObjectVector<CMtExtractThread> Threads;
+  int NumCreatedThreads;
+
+  #ifndef _NO_CRYPTO
+  CMyComPtr<ICryptoGetTextPassword> GetTextPassword;
+  #endif
+
+  CMtExtract(): QueuePos(0), Stop(false), Exit(false), NumCreatedThreads(0) {}
+  ~CMtExtract() { StopThreads(); }
+  HRESULT Create(UInt32 numThreads);
+  void StopThreads();
+  void Push(int itemIndex);
+  int GetFinished();
+  void WaitFinished() { JobFinishedEvent.Lock(); }
+};
+
+static THREAD_FUNC_DECL MtExtractThreadFunc(void *p)
+{
+  ((CMtExtractThread *)p)->Process();
+  return 0;
+}
+
+HRESULT CMtExtract::Create(UInt32 numThreads)
+{
+  RINOK(JobSemaphore.Create(0, 0x7FFFFFFF));
+  RINOK(JobFinishedEvent.CreateIfNotCreated());
+  for (UInt32 i = 0; i < numThreads; i++)
+    Threads.Add(CMtExtractThread());
+  for (UInt32 i = 0; i < numThreads; i++)
+  {
+    CMtExtractThread &t = Threads[i];
+    t.Mt = this;
+    t.Decoder.SetBinderBufferSize(BinderBufferSize);
+    CMtExtractProgress *progressSpec = new CMtExtractProgress;
+    t.Progress = progressSpec;
+    progressSpec->Mt = this;
+    #ifndef _NO_CRYPTO
+    if (GetTextPassword)
+    {
+      CMtExtractPassword *passwordSpec = new CMtExtractPassword;
+      t.GetTextPassword = passwordSpec;
+      passwordSpec->Mt = this;
+      passwordSpec->GetTextPassword = GetTextPassword;
+    }
+    #endif
+    RINOK(t.Thread.Create(MtExtractThreadFunc, &t));
+    NumCreatedThreads++;
+  }
+  return S_OK;
+}
+
+void CMtExtract::StopThreads()
+{
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(CS);
+    Stop = true;
+    Exit = true;
+    QueuePos = Queue.Size();
+  }
+  if (NumCreatedThreads != 0)
+    JobSemaphore.Release(NumCreatedThreads);
+  for (int i = 0; i < NumCreatedThreads; i++)
+    Threads[i].Thread.Wait();
+  NumCreatedThreads = 0;
+}
+
+void CMtExtract::Push(int itemIndex)
+{
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(CS);
+    Jobs[itemIndex].Status = CMtExtractJob::kQueued;
+    Queue.Add(itemIndex);
+  }
+  JobSemaphore.Release();
+}
+
+int CMtExtract::GetFinished()
+{
+  NWindows::NSynchronization::CCriticalSectionLock lock(CS);
+  if (Finished.IsEmpty())
+    return -1;
+  int itemIndex = Finished.Front();
+  Finished.Delete(0);
+  return itemIndex;
+}
+
+STDMETHODIMP CMtExtractProgress::SetRatioInfo(const UInt64 * /* inSize */, const UInt64 * /* outSize */)
+{
+  NWindows::NSynchronization::CCriticalSectionLock lock(Mt->CS);
+  return Mt->Stop ? E_ABORT : S_OK;
+}
+
+#ifndef _NO_CRYPTO
+STDMETHODIMP CMtExtractPassword::CryptoGetTextPassword(BSTR *password)
+{
+  NWindows::NSynchronization::CCriticalSectionLock lock(Mt->CallbackCS);
+  return GetTextPassword->CryptoGetTextPassword(password);
+}
+#endif
+
+void CMtExtractThread::Process()
+{
+  for (;;)
+  {
+    Mt->JobSemaphore.Lock();
+    int itemIndex;
+    {
+      NWindows::NSynchronization::CCriticalSectionLock lock(Mt->CS);
+      if (Mt->QueuePos == Mt->Queue.Size())
+      {
+        if (Mt->Exit)
+          return;
+        continue;
+      }
+      itemIndex = Mt->Queue[Mt->QueuePos++];
+    }
+    CMtExtractJob &job = Mt->Jobs[itemIndex];
+    UInt64 startTime = GetTimeInMicroseconds();
+    try
+    {
+      if (Mt->TestMode)
+        job.Result = TestFolder((*Mt->Items)[itemIndex], job);
+      else
+        job.Result = DecodeFolder((*Mt->Items)[itemIndex], job);
+    }
+    catch(...)
+    {
+      job.Exception = true;
+    }
+    job.Time = GetTimeInMicroseconds() - startTime;
+    {
+      NWindows::NSynchronization::CCriticalSectionLock lock(Mt->CS);
+      job.Status = CMtExtractJob::kFinished;
+      Mt->Finished.Add(itemIndex);
+    }
+    Mt->JobFinishedEvent.Set();
+  }
+}
+
+HRESULT CMtExtractThread::DecodeFolder(const CExtractFolderInfo &efi, CMtExtractJob &job)
+{
+  const CArchiveDatabaseEx &db = *Mt->Db;
+  CNum folderIndex = efi.FolderIndex;
+
+  CLockedInStreamImp *inStreamSpec = new CLockedInStreamImp;
+  CMyComPtr<IInStream> inStream = inStreamSpec;
+  inStreamSpec->Init(&Mt->LockedInStream, Mt->StreamSize);
+
+  job.Buf.reset(new CByteBuffer((size_t)efi.UnpackSize));
+  CMtFolderOutStream *outStreamSpec = new CMtFolderOutStream;
+  CMyComPtr<ISequentialOutStream> outStream = outStreamSpec;
+  outStreamSpec->Init(*job.Buf, (size_t)efi.UnpackSize);
+
+  #ifndef _NO_CRYPTO
+  bool passwordIsDefined;
+  #endif
+
+  HRESULT result = Decoder.Decode(
+      #ifdef EXTERNAL_CODECS
+      Mt->CodecsInfo, Mt->ExternalCodecs,
+      #endif
+      inStream,
+      db.GetFolderStreamPos(folderIndex, 0),
+      &db.PackSizes[db.FolderStartPackStreamIndex[folderIndex]],
+      db.Folders[folderIndex],
+      outStream,
+      Progress
+      #ifndef _NO_CRYPTO
+      , GetTextPassword, passwordIsDefined
+      #endif
+      , true, 1
+      );
+  job.Processed = outStreamSpec->GetPos();
+  job.Overflow = outStreamSpec->Overflow;
+  return result;
+}
+
+// Keeps the results of the files tested by a worker thread,
+// to be passed to the extract callback by the calling thread.
+class CMtTestResults:
+  public IArchiveExtractCallback,
+  public CMyUnknownImp
+{
+public:
+  CRecordVector<Int32> *Results;
+
+  MY_UNKNOWN_IMP1(IArchiveExtractCallback)
+  INTERFACE_IArchiveExtractCallback(;)
+};
+
+STDMETHODIMP CMtTestResults::SetTotal(UInt64 /* total */) { return S_OK; }
+STDMETHODIMP CMtTestResults::SetCompleted(const UInt64 * /* completeValue */) { return S_OK; }
+
+STDMETHODIMP CMtTestResults::GetStream(UInt32 /* index */, ISequentialOutStream **outStream, Int32 /* askExtractMode */)
+{
+  *outStream = NULL;
+  return S_OK;
+}
+
+STDMETHODIMP CMtTestResults::PrepareOperation(Int32 /* askExtractMode */) { return S_OK; }
+
+STDMETHODIMP CMtTestResults::SetOperationResult(Int32 resultEOperationResult)
+{
+  Results->Add(resultEOperationResult);
+  return S_OK;
+}
+
+// Tests the folder by decoding it into the CRC of the files without keeping the data.
+HRESULT CMtExtractThread::TestFolder(const CExtractFolderInfo &efi, CMtExtractJob &job)
+{
+  const CArchiveDatabaseEx &db = *Mt->Db;
+  CNum folderIndex = efi.FolderIndex;
+
+  CLockedInStreamImp *inStreamSpec = new CLockedInStreamImp;
+  CMyComPtr<IInStream> inStream = inStreamSpec;
+  inStreamSpec->Init(&Mt->LockedInStream, Mt->StreamSize);
+
+  CMtTestResults *resultsSpec = new CMtTestResults;
+  CMyComPtr<IArchiveExtractCallback> results = resultsSpec;
+  resultsSpec->Results = &job.TestResults;
+
+  CFolderOutStream *folderOutStream = new CFolderOutStream;
+  CMyComPtr<ISequentialOutStream> outStream(folderOutStream);
+  RINOK(folderOutStream->Init(&db, 0, db.FolderStartFileIndex[folderIndex],
+      &efi.ExtractStatuses, results, true, Mt->CheckCrc));
+
+  #ifndef _NO_CRYPTO
+  bool passwordIsDefined;
+  #endif
+
+  try
+  {
+    HRESULT result = Decoder.Decode(
+        #ifdef EXTERNAL_CODECS
+        Mt->CodecsInfo, Mt->ExternalCodecs,
+        #endif
+        inStream,
+        db.GetFolderStreamPos(folderIndex, 0),
+        &db.PackSizes[db.FolderStartPackStreamIndex[folderIndex]],
+        db.Folders[folderIndex],
+        outStream,
+        Progress
+        #ifndef _NO_CRYPTO
+        , GetTextPassword, passwordIsDefined
+        #endif
+        , true, 1
+        );
+
+    if (result == S_FALSE)
+      return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError);
+    if (result == E_NOTIMPL)
+      return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kUnSupportedMethod);
+    if (result != S_OK)
+      return result;
+    if (folderOutStream->WasWritingFinished() != S_OK)
+      return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError);
+  }
+  catch(...)
+  {
+    return folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError);
+  }
+  return S_OK;
+}
+
+// Passes the results of the folder tested by a worker thread to the callback.
+static HRESULT ReportMtFolder(
+    const CArchiveDatabaseEx &db,
+    const CExtractFolderInfo &efi,
+    const CMtExtractJob &job,
+    IArchiveExtractCallback *extractCallback)
+{
+  if (job.Result != S_OK && !job.Exception)
+    return job.Result;
+  CNum startIndex = db.FolderStartFileIndex[efi.FolderIndex];
+  for (int i = 0; i < efi.ExtractStatuses.Size(); i++)
+  {
+    Int32 askMode = efi.ExtractStatuses[i] ?
+        NExtract::NAskMode::kTest :
+        NExtract::NAskMode::kSkip;
+    CMyComPtr<ISequentialOutStream> realOutStream;
+    RINOK(extractCallback->GetStream(startIndex + i, &realOutStream, askMode));
+    RINOK(extractCallback->PrepareOperation(askMode));
+    Int32 result = (!job.Exception && i < job.TestResults.Size()) ?
+        job.TestResults[i] :
+        NExtract::NOperationResult::kDataError;
+    RINOK(extractCallback->SetOperationResult(result));
+  }
+  return S_OK;
+}
+
+static HRESULT WriteMtFolder(
+    const CArchiveDatabaseEx &db,
+    const CExtractFolderInfo &efi,
+    const CMtExtractJob &job,
+    IArchiveExtractCallback *extractCallback,
+    bool testMode, bool checkCrc,
+    CFolderCache *folderCache)
+{
+  const Byte *data = (job.Buf ? (const Byte *)*job.Buf : NULL);
+  RINOK(WriteFolder(db, efi, data, job.Processed, job.Result, job.Exception || job.Overflow,
+      extractCallback, testMode, checkCrc));
+  if (folderCache && job.Result == S_OK && !job.Exception && !job.Overflow &&
+      job.Processed == efi.UnpackSize && folderCache->CanKeep(efi.UnpackSize))
+    folderCache->Add(efi.FolderIndex, job.Buf);
+  return S_OK;
+}
+
+/*
+  ExtractMt decodes small folders in worker threads and writes the decoded
+  data to extractCallback from the calling thread, so extractCallback is never
+  called concurrently. Folders are written in the order of the request unless
+  outOfOrder is set, in which case they are written as soon as they are decoded.
+  In test mode, folders of any size are tested in the worker threads, and only
+  the results of the files are passed to extractCallback, in any order.
+*/
+
+static HRESULT ExtractMt(
+    DECL_EXTERNAL_CODECS_LOC_VARS
+    IInStream *stream,
+    const CArchiveDatabaseEx &db,
+    const CObjectVector<CExtractFolderInfo> &items,
+    IArchiveExtractCallback *extractCallbackSpec,
+    bool testMode, bool checkCrc,
+    UInt32 numThreads, bool outOfOrder, UInt32 binderBufferSize,
+    CFolderCache *folderCache, CCheckpoints *checkpoints)
+{
+  CMyComPtr<IArchiveExtractCallback> extractCallback = extractCallbackSpec;
+
+  CMtExtract mt;
+  #ifdef EXTERNAL_CODECS
+  mt.CodecsInfo = codecsInfo;
+  mt.ExternalCodecs = externalCodecs;
+  #endif
+  mt.Db = &db;
+  mt.Items = &items;
+  mt.TestMode = testMode;
+  mt.CheckCrc = checkCrc;
+  mt.BinderBufferSize = binderBufferSize;
+  RINOK(stream->Seek(0, STREAM_SEEK_END, &mt.StreamSize));
+  mt.LockedInStream.Init(stream);
+
+  #ifndef _NO_CRYPTO
+  if (extractCallback)
+    extractCallback.QueryInterface(IID_ICryptoGetTextPassword, &mt.GetTextPassword);
+  #endif
+  CMyComPtr<IArchiveFolderStatCallback> folderStat;
+  if (extractCallback)
+    extractCallback.QueryInterface(IID_IArchiveFolderStatCallback, &folderStat);
+
+  if (testMode)
+    outOfOrder = true;
+
+  int i;
+  for (i = 0; i < items.Size(); i++)
+    mt.Jobs.Add(CMtExtractJob());
+  RINOK(mt.Create(numThreads));
+
+  CLockedInStreamImp *inStreamSpec = new CLockedInStreamImp;
+  CMyComPtr<IInStream> inStream = inStreamSpec;
+  inStreamSpec->Init(&mt.LockedInStream, mt.StreamSize);
+
+  CDecoder decoder(
+    #ifdef _ST_MODE
+    false
+    #else
+    true
+    #endif
+    );
+  decoder.SetBinderBufferSize(binderBufferSize);
+
+  CLocalProgress *lps = new CLocalProgress;
+  CMyComPtr<ICompressProgressInfo> progress = lps;
+  lps->Init(extractCallback, false);
+
+  const int maxNumJobs = numThreads * 2;
+  const UInt64 maxJobsSize = numThreads * kMtFolderSizeMax;
+  int numJobs = 0;
+  UInt64 jobsSize = 0;
+  int numDelivered = 0;
+  int nextSchedule = 0;
+  int nextDeliver = 0;
+  UInt64 totalPacked = 0;
+  UInt64 totalUnpacked = 0;
+
+  for (;;)
+  {
+    {
+      NWindows::NSynchronization::CCriticalSectionLock lock(mt.CallbackCS);
+      lps->OutSize = totalUnpacked;
+      lps->InSize = totalPacked;
+      RINOK(lps->SetCur());
+    }
+
+    if (numDelivered == items.Size())
+      break;
+
+    for (; nextSchedule < items.Size() && numJobs < maxNumJobs; nextSchedule++)
+    {
+      const CExtractFolderInfo &efi = items[nextSchedule];
+      if (efi.FileIndex != kNumNoIndex || (!testMode && efi.UnpackSize > kMtFolderSizeMax))
+        continue;
+      if (!testMode && numJobs != 0 && jobsSize + efi.UnpackSize > maxJobsSize)
+        break;
+      if (!testMode && folderCache && folderCache->CanKeep(efi.UnpackSize))
+      {
+        mt.Jobs[nextSchedule].Cached = folderCache->Find(efi.FolderIndex);
+        if (mt.Jobs[nextSchedule].Cached)
+          continue;
+      }
+      mt.Push(nextSchedule);
+      numJobs++;
+      jobsSize += efi.UnpackSize;
+    }
+
+    int itemIndex = -1;
+    if (outOfOrder)
+    {
+      itemIndex = mt.GetFinished();
+      if (itemIndex < 0)
+      {
+        for (; nextDeliver < nextSchedule; nextDeliver++)
+          if (mt.Jobs[nextDeliver].Status == CMtExtractJob::kNone)
+          {
+            itemIndex = nextDeliver++;
+            break;
+          }
+      }
+    }
+    else
+    {
+      while (mt.Jobs[nextDeliver].Status == CMtExtractJob::kDelivered)
+        nextDeliver++;
+      CMtExtractJob &job = mt.Jobs[nextDeliver];
+      bool ready;
+      {
+        NWindows::NSynchronization::CCriticalSectionLock lock(mt.CS);
+        ready = (job.Status != CMtExtractJob::kQueued);
+      }
+      if (ready)
+        itemIndex = nextDeliver;
+    }
+
+    if (itemIndex < 0)
+    {
+      mt.WaitFinished();
+      continue;
+    }
+
+    const CExtractFolderInfo &efi = items[itemIndex];
+    CMtExtractJob &job = mt.Jobs[itemIndex];
+    {
+      NWindows::NSynchronization::CCriticalSectionLock lock(mt.CallbackCS);
+      if (job.Cached)
+      {
+        RINOK(WriteFolder(db, efi, *job.Cached, job.Cached->GetCapacity(), S_OK, false,
+            extractCallback, testMode, checkCrc));
+        job.Cached.reset();
+      }
+      else if (job.Status == CMtExtractJob::kNone)
+      {
+        lps->OutSize = totalUnpacked;
+        lps->InSize = totalPacked;
+        UInt64 startTime = GetTimeInMicroseconds();
+        RINOK(ExtractFolder(
+            EXTERNAL_CODECS_LOC_VARS
+            decoder, inStream, 0, db, efi, extractCallback, testMode, checkCrc, progress,
+            folderCache, checkpoints, 1));
+        if (efi.FileIndex == kNumNoIndex)
+        {
+          RINOK(SetFolderStat(folderStat, db, efi.FolderIndex, GetTimeInMicroseconds() - startTime));
+        }
+      }
+      else
+      {
+        if (testMode)
+        {
+          RINOK(ReportMtFolder(db, efi, job, extractCallback));
+        }
+        else
+        {
+          RINOK(WriteMtFolder(db, efi, job, extractCallback, testMode, checkCrc, folderCache));
+        }
+        RINOK(SetFolderStat(folderStat, db, efi.FolderIndex, job.Time));
+        job.Buf.reset();
+        job.TestResults.Clear();
+        numJobs--;
+        jobsSize -= efi.UnpackSize;
+      }
+    }
+    job.Status = CMtExtractJob::kDelivered;
+    numDelivered++;
+    totalUnpacked += efi.UnpackSize;
+    if (efi.FileIndex == kNumNoIndex)
+      totalPacked += db.GetFolderFullPackSize(efi.FolderIndex);
+  }
+  return S_OK;
+}
+
+#endif
+
 STDMETHODIMP CHandler::Extract(const UInt32 *indices, UInt32 numItems,
     Int32 testModeSpec, IArchiveExtractCallback *extractCallbackSpec)
+{
+  #ifdef __7Z_MT_EXTRACT
+  return ExtractImpl(_inStream, indices, numItems, testModeSpec,
+      _numExtractThreads, _extractOutOfOrder, _binderBufferSize, extractCallbackSpec);
+  #else
+  return ExtractImpl(_inStream, indices, numItems, testModeSpec,
+      1, false, kStreamBinderBufferSizeDefault, extractCallbackSpec);
+  #endif
+}
+
+// The extraction options are passed with each call instead of the handler properties,
+// so that the calls with different streams can use different options concurrently.
+STDMETHODIMP CHandler::ExtractFromStream(IInStream *inStream, const UInt32 *indices, UInt32 numItems,
+    Int32 testModeSpec, UInt32 numThreads, Int32 outOfOrder, UInt32 binderBufferSize,
+    IArchiveExtractCallback *extractCallbackSpec)
+{
+  if (binderBufferSize > kStreamBinderBufferSizeMax)
+    return E_INVALIDARG;
+  if (numThreads == 0)
+    numThreads = 1;
+  if (numThreads > kNumExtractThreadsMax)
+    numThreads = kNumExtractThreadsMax;
+  return ExtractImpl(inStream, indices, numItems, testModeSpec,
+      numThreads, outOfOrder != 0, binderBufferSize, extractCallbackSpec);
+}
+
+HRESULT CHandler::ExtractImpl(IInStream *inStream, const UInt32 *indices, UInt32 numItems,
+    Int32 testModeSpec, UInt32 numThreads, bool outOfOrder, UInt32 binderBufferSize,
+    IArchiveExtractCallback *extractCallbackSpec)
 {
   COM_TRY_BEGIN
   bool testMode = (testModeSpec != 0);
@@ -57,11 +1097,13 @@ STDMETHODIMP CHandler::Extract(const UInt32 *indices, UInt32 numItems,
     #ifdef _7Z_VOL
     _refs.Size();
     #else
-    _db.Files.Size();
+    _db->Files.Size();
     #endif
 
   if(numItems == 0)
     return S_OK;
+  if (!inStream)
+    return E_FAIL;
 
   /*
   if(_volumes.Size() != 1)
@@ -89,7 +1131,7 @@ STDMETHODIMP CHandler::Extract(const UInt32 *indices, UInt32 numItems,
       const CArchiveDatabaseEx &db = volume.Database;
       UInt32 fileIndex = ref.ItemIndex;
       #else
-      const CArchiveDatabaseEx &db = _db;
+      const CArchiveDatabaseEx &db = *_db;
       UInt32 fileIndex = ref2Index;
       #endif
 
@@ -139,6 +1181,13 @@ STDMETHODIMP CHandler::Extract(const UInt32 *indices, UInt32 numItems,
 
   RINOK(extractCallback->SetTotal(importantTotalUnpacked));
 
+  #ifdef __7Z_MT_EXTRACT
+  if (numThreads > 1 && extractFolderInfoVector.Size() > 1)
+    return ExtractMt(EXTERNAL_CODECS_VARS
+        inStream, *_db, extractFolderInfoVector, extractCallback, testMode, _crcSize != 0,
+        numThreads, outOfOrder, binderBufferSize, &_folderCache, &_checkpoints);
+  #endif
+
   CDecoder decoder(
     #ifdef _ST_MODE
     false
@@ -146,6 +1195,9 @@ STDMETHODIMP CHandler::Extract(const UInt32 *indices, UInt32 numItems,
     true
     #endif
     );
+  #ifdef __7Z_MT_EXTRACT
+  decoder.SetBinderBufferSize(binderBufferSize);
+  #endif
   // CDecoder1 decoder;
 
   UInt64 totalPacked = 0;
@@ -156,6 +1208,9 @@ STDMETHODIMP CHandler::Extract(const UInt32 *indices, UInt32 numItems,
   CMyComPtr<ICompressProgressInfo> progress = lps;
   lps->Init(extractCallback, false);
 
+  CMyComPtr<IArchiveFolderStatCallback> folderStat;
+  extractCallback.QueryInterface(IID_IArchiveFolderStatCallback, &folderStat);
+
   for (int i = 0;; i++, totalUnpacked += curUnpacked, totalPacked += curPacked)
   {
     lps->OutSize = totalUnpacked;
@@ -169,98 +1224,33 @@ STDMETHODIMP CHandler::Extract(const UInt32 *indices, UInt32 numItems,
     curUnpacked = efi.UnpackSize;
     curPacked = 0;
 
-    CFolderOutStream *folderOutStream = new CFolderOutStream;
-    CMyComPtr<ISequentialOutStream> outStream(folderOutStream);
-
     #ifdef _7Z_VOL
     const CVolume &volume = _volumes[efi.VolumeIndex];
     const CArchiveDatabaseEx &db = volume.Database;
     #else
-    const CArchiveDatabaseEx &db = _db;
+    const CArchiveDatabaseEx &db = *_db;
     #endif
 
-    CNum startIndex;
-    if (efi.FileIndex != kNumNoIndex)
-      startIndex = efi.FileIndex;
-    else
-      startIndex = db.FolderStartFileIndex[efi.FolderIndex];
+    if (efi.FileIndex == kNumNoIndex)
+      curPacked = db.GetFolderFullPackSize(efi.FolderIndex);
 
-    HRESULT result = folderOutStream->Init(&db,
+    UInt64 startTime = GetTimeInMicroseconds();
+    RINOK(ExtractFolder(
+        EXTERNAL_CODECS_VARS
+        decoder,
         #ifdef _7Z_VOL
-        volume.StartRef2Index,
+        volume.Stream, volume.StartRef2Index,
         #else
-        0,
+        inStream, 0,
         #endif
-        startIndex,
-        &efi.ExtractStatuses, extractCallback, testMode, _crcSize != 0);
-
-    RINOK(result);
-
-    if (efi.FileIndex != kNumNoIndex)
-      continue;
-
-    CNum folderIndex = efi.FolderIndex;
-    const CFolder &folderInfo = db.Folders[folderIndex];
-
-    curPacked = _db.GetFolderFullPackSize(folderIndex);
-
-    CNum packStreamIndex = db.FolderStartPackStreamIndex[folderIndex];
-    UInt64 folderStartPackPos = db.GetFolderStreamPos(folderIndex, 0);
-
-    #ifndef _NO_CRYPTO
-    CMyComPtr<ICryptoGetTextPassword> getTextPassword;
-    if (extractCallback)
-      extractCallback.QueryInterface(IID_ICryptoGetTextPassword, &getTextPassword);
-    #endif
-
-    try
-    {
-      #ifndef _NO_CRYPTO
-      bool passwordIsDefined;
-      #endif
-
-      HRESULT result = decoder.Decode(
-          EXTERNAL_CODECS_VARS
-          #ifdef _7Z_VOL
-          volume.Stream,
-          #else
-          _inStream,
-          #endif
-          folderStartPackPos,
-          &db.PackSizes[packStreamIndex],
-          folderInfo,
-          outStream,
-          progress
-          #ifndef _NO_CRYPTO
-          , getTextPassword, passwordIsDefined
-          #endif
-          #if !defined(_7ZIP_ST) && !defined(_SFX)
-          , true, _numThreads
-          #endif
-          );
-
-      if (result == S_FALSE)
-      {
-        RINOK(folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError));
-        continue;
-      }
-      if (result == E_NOTIMPL)
-      {
-        RINOK(folderOutStream->FlushCorrupted(NExtract::NOperationResult::kUnSupportedMethod));
-        continue;
-      }
-      if (result != S_OK)
-        return result;
-      if (folderOutStream->WasWritingFinished() != S_OK)
-      {
-        RINOK(folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError));
-        continue;
-      }
-    }
-    catch(...)
+        db, efi, extractCallback, testMode, _crcSize != 0, progress, &_folderCache, &_checkpoints
+        #if !defined(_7ZIP_ST) && !defined(_SFX)
+        , _numThreads
+        #endif
+        ));
+    if (efi.FileIndex == kNumNoIndex)
     {
-      RINOK(folderOutStream->FlushCorrupted(NExtract::NOperationResult::kDataError));
-      continue;
+      RINOK(SetFolderStat(folderStat, db, efi.FolderIndex, GetTimeInMicroseconds() - startTime));
     }
   }
   return S_OK;
@@ -0,0 +1,138 @@
+// 7zFolderCache.h
+
+#ifndef __7Z_FOLDER_CACHE_H
+#define __7Z_FOLDER_CACHE_H
+
+#include <memory>
+
+#include "../../../Common/Buffer.h"
+#include "../../../Common/MyVector.h"
+#include "../../../Windows/Synchronization.h"
+
+#include "7zItem.h"
+
+namespace NArchive {
+namespace N7z {
+
+/*
+  CFolderCache keeps the decoded data of the recently extracted folders,
+  so that the entries of a solid folder extracted again are copied from
+  memory instead of decoding the folder from its start.
+  The least recently used folders are dropped when the total size exceeds
+  the maximum size, which is 0 (disabled) by default.
+  The data is shared with the extracting threads, so dropping it doesn't
+  wait for them.
+*/
+
+class CFolderCache
+{
+public:
+  typedef std::shared_ptr<const CByteBuffer> CDataPtr;
+
+private:
+  struct CItem
+  {
+    CNum FolderIndex;
+    CDataPtr Data;
+  };
+
+  NWindows::NSynchronization::CCriticalSection _cs;
+  CObjectVector<CItem> _items; // the most recently used first
+  UInt64 _size;
+  UInt64 _maxSize;
+  UInt64 _numHits;
+  UInt64 _numMisses;
+
+  void Reduce(UInt64 maxSize)
+  {
+    while (!_items.IsEmpty() && _size > maxSize)
+    {
+      _size -= _items.Back().Data->GetCapacity();
+      _items.DeleteBack();
+    }
+  }
+
+public:
+  CFolderCache(): _size(0), _maxSize(0), _numHits(0), _numMisses(0) {}
+
+  void SetMaxSize(UInt64 maxSize)
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    _maxSize = maxSize;
+    Reduce(_maxSize);
+  }
+
+  bool CanKeep(UInt64 size)
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    return size != 0 && size <= _maxSize;
+  }
+
+  bool Contains(CNum folderIndex)
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    for (int i = 0; i < _items.Size(); i++)
+      if (_items[i].FolderIndex == folderIndex)
+        return true;
+    return false;
+  }
+
+  // Counts a hit or a miss.
+  CDataPtr Find(CNum folderIndex)
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    for (int i = 0; i < _items.Size(); i++)
+    {
+      if (_items[i].FolderIndex != folderIndex)
+        continue;
+      CItem item = _items[i];
+      _items.Delete(i);
+      _items.Insert(0, item);
+      _numHits++;
+      return item.Data;
+    }
+    _numMisses++;
+    return CDataPtr();
+  }
+
+  void Add(CNum folderIndex, const CDataPtr &data)
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    UInt64 size = data->GetCapacity();
+    if (size == 0 || size > _maxSize)
+      return;
+    for (int i = 0; i < _items.Size(); i++)
+      if (_items[i].FolderIndex == folderIndex)
+      {
+        _size -= _items[i].Data->GetCapacity();
+        _items.Delete(i);
+        break;
+      }
+    Reduce(_maxSize - size);
+    CItem item;
+    item.FolderIndex = folderIndex;
+    item.Data = data;
+    _items.Insert(0, item);
+    _size += size;
+  }
+
+  // The data of the other archive is dropped. The counters and the maximum size are kept.
+  void Clear()
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    _items.Clear();
+    _size = 0;
+  }
+
+  void GetStat(UInt64 &numHits, UInt64 &numMisses, UInt64 &size)
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(_cs);
+    numHits = _numHits;
+    numMisses = _numMisses;
+    size = _size;
+  }
+};
+
+}}
+
+#endif
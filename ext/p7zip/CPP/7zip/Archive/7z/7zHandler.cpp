@@ -16,11 +16,9 @@
 #include "7zHandler.h"
 #include "7zProperties.h"
 
-#ifdef __7Z_SET_PROPERTIES
-#ifdef EXTRACT_ONLY
+#if (defined(__7Z_SET_PROPERTIES) && defined(EXTRACT_ONLY)) || defined(__7Z_MT_EXTRACT)
 #include "../Common/ParseProperties.h"
 #endif
-#endif
 
 using namespace NWindows;
 
@@ -29,7 +27,9 @@ extern UString ConvertMethodIdToString(UInt64 id);
 namespace NArchive {
 namespace N7z {
 
-CHandler::CHandler()
+CHandler::CHandler():
+  _db(GetEmptyDatabase()),
+  _useDatabaseCache(true)
 {
   _crcSize = 4;
 
@@ -37,18 +37,23 @@ CHandler::CHandler()
   _passwordIsDefined = false;
   #endif
 
+  #ifdef __7Z_MT_EXTRACT
+  InitExtractProps();
+  #endif
+
   #ifdef EXTRACT_ONLY
   #ifdef __7Z_SET_PROPERTIES
   _numThreads = NSystem::GetNumberOfProcessors();
   #endif
   #else
   Init();
+  InitUpdateProps();
   #endif
 }
 
 STDMETHODIMP CHandler::GetNumberOfItems(UInt32 *numItems)
 {
-  *numItems = _db.Files.Size();
+  *numItems = _db->Files.Size();
   return S_OK;
 }
 
@@ -91,9 +96,9 @@ STDMETHODIMP CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT *value)
       UString resString;
       CRecordVector<UInt64> ids;
       int i;
-      for (i = 0; i < _db.Folders.Size(); i++)
+      for (i = 0; i < _db->Folders.Size(); i++)
       {
-        const CFolder &f = _db.Folders[i];
+        const CFolder &f = _db->Folders[i];
         for (int j = f.Coders.Size() - 1; j >= 0; j--)
           ids.AddToUniqueSorted(f.Coders[j].MethodID);
       }
@@ -112,11 +117,11 @@ STDMETHODIMP CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT *value)
       prop = resString;
       break;
     }
-    case kpidSolid: prop = _db.IsSolid(); break;
-    case kpidNumBlocks: prop = (UInt32)_db.Folders.Size(); break;
-    case kpidHeadersSize:  prop = _db.HeadersSize; break;
-    case kpidPhySize:  prop = _db.PhySize; break;
-    case kpidOffset: if (_db.ArchiveInfo.StartPosition != 0) prop = _db.ArchiveInfo.StartPosition; break;
+    case kpidSolid: prop = _db->IsSolid(); break;
+    case kpidNumBlocks: prop = (UInt32)_db->Folders.Size(); break;
+    case kpidHeadersSize:  prop = _db->HeadersSize; break;
+    case kpidPhySize:  prop = _db->PhySize; break;
+    case kpidOffset: if (_db->ArchiveInfo.StartPosition != 0) prop = _db->ArchiveInfo.StartPosition; break;
   }
   prop.Detach(value);
   return S_OK;
@@ -127,7 +132,7 @@ IMP_IInArchive_ArcProps
 
 #endif
 
-static void SetPropFromUInt64Def(CUInt64DefVector &v, int index, NCOM::CPropVariant &prop)
+static void SetPropFromUInt64Def(const CUInt64DefVector &v, int index, NCOM::CPropVariant &prop)
 {
   UInt64 value;
   if (v.GetItem(index, value))
@@ -192,9 +197,9 @@ static inline void AddHexToString(UString &res, Byte value)
 
 bool CHandler::IsEncrypted(UInt32 index2) const
 {
-  CNum folderIndex = _db.FileIndexToFolderIndexMap[index2];
+  CNum folderIndex = _db->FileIndexToFolderIndexMap[index2];
   if (folderIndex != kNumNoIndex)
-    return _db.Folders[folderIndex].IsEncrypted();
+    return _db->Folders[folderIndex].IsEncrypted();
   return false;
 }
 
@@ -210,7 +215,7 @@ STDMETHODIMP CHandler::GetProperty(UInt32 index, PROPID propID,  PROPVARIANT *va
   const CRef &ref = ref2.Refs.Front();
   */
   
-  const CFileItem &item = _db.Files[index];
+  const CFileItem &item = _db->Files[index];
   UInt32 index2 = index;
 
   switch(propID)
@@ -230,11 +235,11 @@ STDMETHODIMP CHandler::GetProperty(UInt32 index, PROPID propID,  PROPVARIANT *va
     {
       // prop = ref2.PackSize;
       {
-        CNum folderIndex = _db.FileIndexToFolderIndexMap[index2];
+        CNum folderIndex = _db->FileIndexToFolderIndexMap[index2];
         if (folderIndex != kNumNoIndex)
         {
-          if (_db.FolderStartFileIndex[folderIndex] == (CNum)index2)
-            prop = _db.GetFolderFullPackSize(folderIndex);
+          if (_db->FolderStartFileIndex[folderIndex] == (CNum)index2)
+            prop = _db->GetFolderFullPackSize(folderIndex);
           /*
           else
             prop = (UInt64)0;
@@ -245,21 +250,21 @@ STDMETHODIMP CHandler::GetProperty(UInt32 index, PROPID propID,  PROPVARIANT *va
       }
       break;
     }
-    case kpidPosition:  { UInt64 v; if (_db.StartPos.GetItem(index2, v)) prop = v; break; }
-    case kpidCTime:  SetPropFromUInt64Def(_db.CTime, index2, prop); break;
-    case kpidATime:  SetPropFromUInt64Def(_db.ATime, index2, prop); break;
-    case kpidMTime:  SetPropFromUInt64Def(_db.MTime, index2, prop); break;
+    case kpidPosition:  { UInt64 v; if (_db->StartPos.GetItem(index2, v)) prop = v; break; }
+    case kpidCTime:  SetPropFromUInt64Def(_db->CTime, index2, prop); break;
+    case kpidATime:  SetPropFromUInt64Def(_db->ATime, index2, prop); break;
+    case kpidMTime:  SetPropFromUInt64Def(_db->MTime, index2, prop); break;
     case kpidAttrib:  if (item.AttribDefined) prop = item.Attrib; break;
     case kpidCRC:  if (item.CrcDefined) prop = item.Crc; break;
     case kpidEncrypted:  prop = IsEncrypted(index2); break;
-    case kpidIsAnti:  prop = _db.IsItemAnti(index2); break;
+    case kpidIsAnti:  prop = _db->IsItemAnti(index2); break;
     #ifndef _SFX
     case kpidMethod:
       {
-        CNum folderIndex = _db.FileIndexToFolderIndexMap[index2];
+        CNum folderIndex = _db->FileIndexToFolderIndexMap[index2];
         if (folderIndex != kNumNoIndex)
         {
-          const CFolder &folderInfo = _db.Folders[folderIndex];
+          const CFolder &folderInfo = _db->Folders[folderIndex];
           UString methodsString;
           for (int i = folderInfo.Coders.Size() - 1; i >= 0; i--)
           {
@@ -347,7 +352,7 @@ STDMETHODIMP CHandler::GetProperty(UInt32 index, PROPID propID,  PROPVARIANT *va
       break;
     case kpidBlock:
       {
-        CNum folderIndex = _db.FileIndexToFolderIndexMap[index2];
+        CNum folderIndex = _db->FileIndexToFolderIndexMap[index2];
         if (folderIndex != kNumNoIndex)
           prop = (UInt32)folderIndex;
       }
@@ -358,14 +363,14 @@ STDMETHODIMP CHandler::GetProperty(UInt32 index, PROPID propID,  PROPVARIANT *va
     case kpidPackedSize3:
     case kpidPackedSize4:
       {
-        CNum folderIndex = _db.FileIndexToFolderIndexMap[index2];
+        CNum folderIndex = _db->FileIndexToFolderIndexMap[index2];
         if (folderIndex != kNumNoIndex)
         {
-          const CFolder &folderInfo = _db.Folders[folderIndex];
-          if (_db.FolderStartFileIndex[folderIndex] == (CNum)index2 &&
+          const CFolder &folderInfo = _db->Folders[folderIndex];
+          if (_db->FolderStartFileIndex[folderIndex] == (CNum)index2 &&
               folderInfo.PackStreams.Size() > (int)(propID - kpidPackedSize0))
           {
-            prop = _db.GetFolderPackStreamSize(folderIndex, propID - kpidPackedSize0);
+            prop = _db->GetFolderPackStreamSize(folderIndex, propID - kpidPackedSize0);
           }
           else
             prop = (UInt64)0;
@@ -403,6 +408,7 @@ STDMETHODIMP CHandler::Open(IInStream *stream,
     }
     #endif
     CInArchive archive;
+    archive.UseCache = _useDatabaseCache;
     RINOK(archive.Open(stream, maxCheckStartPosition));
     #ifndef _NO_CRYPTO
     _passwordIsDefined = false;
@@ -416,7 +422,6 @@ STDMETHODIMP CHandler::Open(IInStream *stream,
       #endif
       );
     RINOK(result);
-    _db.Fill();
     _inStream = stream;
   }
   catch(...)
@@ -436,11 +441,85 @@ STDMETHODIMP CHandler::Close()
 {
   COM_TRY_BEGIN
   _inStream.Release();
-  _db.Clear();
+  _db = GetEmptyDatabase();
+  _folderCache.Clear();
+  _checkpoints.Clear();
   return S_OK;
   COM_TRY_END
 }
 
+STDMETHODIMP CHandler::SetFolderCacheSize(UInt64 size)
+{
+  _folderCache.SetMaxSize(size);
+  return S_OK;
+}
+
+STDMETHODIMP CHandler::GetFolderCacheStat(UInt64 *numHits, UInt64 *numMisses, UInt64 *size)
+{
+  _folderCache.GetStat(*numHits, *numMisses, *size);
+  return S_OK;
+}
+
+STDMETHODIMP CHandler::SetCheckpointInterval(UInt64 interval, UInt64 maxSize)
+{
+  _checkpoints.SetInterval(interval);
+  _checkpoints.SetMaxSize(maxSize);
+  return S_OK;
+}
+
+STDMETHODIMP CHandler::GetCheckpointStat(UInt64 *numCheckpoints, UInt64 *size)
+{
+  _checkpoints.GetStat(*numCheckpoints, *size);
+  return S_OK;
+}
+
+STDMETHODIMP CHandler::SetUseDatabaseCache(Int32 use)
+{
+  _useDatabaseCache = (use != 0);
+  return S_OK;
+}
+
+STDMETHODIMP CHandler::ClearDatabaseCache()
+{
+  NDatabaseCache::Clear();
+  return S_OK;
+}
+
+STDMETHODIMP CHandler::GetDatabaseCacheStat(UInt32 *numDatabases, UInt64 *numItems)
+{
+  NDatabaseCache::GetStat(*numDatabases, *numItems);
+  return S_OK;
+}
+
+#ifdef __7Z_MT_EXTRACT
+
+HRESULT CHandler::SetExtractProp(const UString &name, const PROPVARIANT &value, bool &processed)
+{
+  processed = true;
+  if (name.Left(3) == L"EMT")
+  {
+    RINOK(ParseMtProp(name.Mid(3), value, NSystem::GetNumberOfProcessors(), _numExtractThreads));
+    if (_numExtractThreads > kNumExtractThreadsMax)
+      _numExtractThreads = kNumExtractThreadsMax;
+    return S_OK;
+  }
+  if (name == L"EOO")
+    return SetBoolProperty(_extractOutOfOrder, value);
+  if (name.Left(3) == L"EBS")
+  {
+    UInt32 size = _binderBufferSize;
+    RINOK(ParsePropValue(name.Mid(3), value, size));
+    if (size > kStreamBinderBufferSizeMax)
+      return E_INVALIDARG;
+    _binderBufferSize = size;
+    return S_OK;
+  }
+  processed = false;
+  return S_OK;
+}
+
+#endif
+
 #ifdef __7Z_SET_PROPERTIES
 #ifdef EXTRACT_ONLY
 
@@ -449,6 +528,9 @@ STDMETHODIMP CHandler::SetProperties(const wchar_t **names, const PROPVARIANT *v
   COM_TRY_BEGIN
   const UInt32 numProcessors = NSystem::GetNumberOfProcessors();
   _numThreads = numProcessors;
+  #ifdef __7Z_MT_EXTRACT
+  InitExtractProps();
+  #endif
 
   for (int i = 0; i < numProperties; i++)
   {
@@ -457,6 +539,12 @@ STDMETHODIMP CHandler::SetProperties(const wchar_t **names, const PROPVARIANT *v
     if (name.IsEmpty())
       return E_INVALIDARG;
     const PROPVARIANT &value = values[i];
+    #ifdef __7Z_MT_EXTRACT
+    bool processed;
+    RINOK(SetExtractProp(name, value, processed));
+    if (processed)
+      continue;
+    #endif
     UInt32 number;
     int index = ParseStringToUInt32(name, number);
     if (index == 0)
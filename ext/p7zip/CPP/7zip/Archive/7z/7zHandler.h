@@ -7,12 +7,15 @@
 #include "../IArchive.h"
 
 #include "../../Common/CreateCoder.h"
+#include "../../Common/StreamBinder.h"
 
 #ifndef EXTRACT_ONLY
 #include "../Common/HandlerOut.h"
 #endif
 
 #include "7zCompressionMode.h"
+#include "7zCheckpoints.h"
+#include "7zFolderCache.h"
 #include "7zIn.h"
 
 namespace NArchive {
@@ -30,12 +33,29 @@ namespace N7z {
 
 #endif
 
+#ifndef __7Z_MT_EXTRACT
+#if !defined(_7ZIP_ST) && !defined(_SFX) && !defined(_7Z_VOL)
+#define __7Z_MT_EXTRACT
+#endif
+#endif
+
+// Upper limit of the threads to extract independent folders with.
+const UInt32 kNumExtractThreadsMax = 256;
+
+#if !defined(EXTRACT_ONLY) && !defined(_7ZIP_ST)
+// Memory for the input and the output of the solid blocks compressed in parallel.
+const UInt64 kFolderThreadsMemoryDefault = (UInt64)1 << 28;
+#endif
 
 class CHandler:
   #ifndef EXTRACT_ONLY
   public NArchive::COutHandler,
   #endif
   public IInArchive,
+  public IInArchiveExtractStream,
+  public IInArchiveFolderCache,
+  public IInArchiveCheckpoints,
+  public IInArchiveDatabaseCache,
   #ifdef __7Z_SET_PROPERTIES
   public ISetProperties,
   #endif
@@ -47,6 +67,10 @@ class CHandler:
 {
 public:
   MY_QUERYINTERFACE_BEGIN2(IInArchive)
+  MY_QUERYINTERFACE_ENTRY(IInArchiveExtractStream)
+  MY_QUERYINTERFACE_ENTRY(IInArchiveFolderCache)
+  MY_QUERYINTERFACE_ENTRY(IInArchiveCheckpoints)
+  MY_QUERYINTERFACE_ENTRY(IInArchiveDatabaseCache)
   #ifdef __7Z_SET_PROPERTIES
   MY_QUERYINTERFACE_ENTRY(ISetProperties)
   #endif
@@ -59,6 +83,18 @@ public:
 
   INTERFACE_IInArchive(;)
 
+  STDMETHOD(ExtractFromStream)(IInStream *inStream, const UInt32* indices, UInt32 numItems,
+      Int32 testMode, UInt32 numThreads, Int32 outOfOrder, UInt32 binderBufferSize,
+      IArchiveExtractCallback *extractCallback);
+
+  STDMETHOD(SetFolderCacheSize)(UInt64 size);
+  STDMETHOD(GetFolderCacheStat)(UInt64 *numHits, UInt64 *numMisses, UInt64 *size);
+  STDMETHOD(SetCheckpointInterval)(UInt64 interval, UInt64 maxSize);
+  STDMETHOD(GetCheckpointStat)(UInt64 *numCheckpoints, UInt64 *size);
+  STDMETHOD(SetUseDatabaseCache)(Int32 use);
+  STDMETHOD(ClearDatabaseCache)();
+  STDMETHOD(GetDatabaseCacheStat)(UInt32 *numDatabases, UInt64 *numItems);
+
   #ifdef __7Z_SET_PROPERTIES
   STDMETHOD(SetProperties)(const wchar_t **names, const PROPVARIANT *values, Int32 numProperties);
   #endif
@@ -73,11 +109,31 @@ public:
 
 private:
   CMyComPtr<IInStream> _inStream;
-  NArchive::N7z::CArchiveDatabaseEx _db;
+  NArchive::N7z::CDatabasePtr _db;
+  CFolderCache _folderCache;
+  CCheckpoints _checkpoints;
+  bool _useDatabaseCache;
   #ifndef _NO_CRYPTO
   bool _passwordIsDefined;
   #endif
 
+  HRESULT ExtractImpl(IInStream *inStream, const UInt32* indices, UInt32 numItems,
+      Int32 testMode, UInt32 numThreads, bool outOfOrder, UInt32 binderBufferSize,
+      IArchiveExtractCallback *extractCallback);
+
+  #ifdef __7Z_MT_EXTRACT
+  UInt32 _numExtractThreads;
+  bool _extractOutOfOrder;
+  UInt32 _binderBufferSize;
+  void InitExtractProps()
+  {
+    _numExtractThreads = 1;
+    _extractOutOfOrder = false;
+    _binderBufferSize = kStreamBinderBufferSizeDefault;
+  }
+  HRESULT SetExtractProp(const UString &name, const PROPVARIANT &value, bool &processed);
+  #endif
+
   #ifdef EXTRACT_ONLY
   
   #ifdef __7Z_SET_PROPERTIES
@@ -90,6 +146,21 @@ private:
   
   CRecordVector<CBind> _binds;
 
+  bool _storeIncompressible;
+  #ifndef _7ZIP_ST
+  UInt32 _numFolderThreads;
+  UInt64 _folderThreadsMemory;
+  #endif
+  void InitUpdateProps()
+  {
+    _storeIncompressible = false;
+    #ifndef _7ZIP_ST
+    _numFolderThreads = 1;
+    _folderThreadsMemory = kFolderThreadsMemoryDefault;
+    #endif
+  }
+  HRESULT SetUpdateProp(const UString &name, const PROPVARIANT &value, bool &processed);
+
   HRESULT SetCompressionMethod(CCompressionMethodMode &method,
       CObjectVector<COneMethodInfo> &methodsInfo
       #ifndef _7ZIP_ST
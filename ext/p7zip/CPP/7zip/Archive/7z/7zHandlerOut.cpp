@@ -7,6 +7,10 @@
 #include "../../../Common/ComTry.h"
 #include "../../../Common/StringToInt.h"
 
+#ifndef _7ZIP_ST
+#include "../../../Windows/System.h"
+#endif
+
 #include "../../ICoder.h"
 
 #include "../Common/ItemNameUtils.h"
@@ -201,7 +205,7 @@ STDMETHODIMP CHandler::UpdateItems(ISequentialOutStream *outStream, UInt32 numIt
   }
   #else
   if (_inStream != 0)
-    db = &_db;
+    db = _db.get();
   #endif
 
   CObjectVector<CUpdateItem> updateItems;
@@ -322,6 +326,16 @@ STDMETHODIMP CHandler::UpdateItems(ISequentialOutStream *outStream, UInt32 numIt
       if (ui.Size != 0 && ui.IsAnti)
         return E_INVALIDARG;
     }
+
+    if (ui.NewData)
+    {
+      NCOM::CPropVariant prop;
+      RINOK(updateCallback->GetProperty(i, kpidMethod, &prop));
+      if (prop.vt == VT_BSTR)
+        ui.Method = IsCopyMethod(prop.bstrVal) ? NItemMethod::kCopy : NItemMethod::kMain;
+      else if (prop.vt != VT_EMPTY)
+        return E_INVALIDARG;
+    }
     updateItems.Add(ui);
   }
 
@@ -386,6 +400,14 @@ STDMETHODIMP CHandler::UpdateItems(ISequentialOutStream *outStream, UInt32 numIt
   options.SolidExtension = _solidExtension;
   options.RemoveSfxBlock = _removeSfxBlock;
   options.VolumeMode = _volumeMode;
+  options.StoreIncompressible = _storeIncompressible;
+  #ifndef _7ZIP_ST
+  options.NumFolderThreads = _numFolderThreads;
+  options.FolderThreadsMemory = _folderThreadsMemory;
+  #else
+  options.NumFolderThreads = 1;
+  options.FolderThreadsMemory = 0;
+  #endif
 
   COutArchive archive;
   CArchiveDatabase newDatabase;
@@ -449,11 +471,38 @@ static HRESULT GetBindInfo(UString &srcString, CBind &bind)
   return S_OK;
 }
 
+HRESULT CHandler::SetUpdateProp(const UString &name, const PROPVARIANT &value, bool &processed)
+{
+  processed = true;
+  if (name == L"FSI")
+    return SetBoolProperty(_storeIncompressible, value);
+  #ifndef _7ZIP_ST
+  if (name.Left(3) == L"FMT")
+    return ParseMtProp(name.Mid(3), value, NSystem::GetNumberOfProcessors(), _numFolderThreads);
+  if (name == L"FMM")
+  {
+    if (value.vt == VT_UI4)
+      _folderThreadsMemory = value.ulVal;
+    else if (value.vt == VT_UI8)
+      _folderThreadsMemory = value.uhVal.QuadPart;
+    else
+      return E_INVALIDARG;
+    return S_OK;
+  }
+  #endif
+  processed = false;
+  return S_OK;
+}
+
 STDMETHODIMP CHandler::SetProperties(const wchar_t **names, const PROPVARIANT *values, Int32 numProperties)
 {
   COM_TRY_BEGIN
   _binds.Clear();
   BeforeSetProperty();
+  #ifdef __7Z_MT_EXTRACT
+  InitExtractProps();
+  #endif
+  InitUpdateProps();
 
   for (int i = 0; i < numProperties; i++)
   {
@@ -464,6 +513,18 @@ STDMETHODIMP CHandler::SetProperties(const wchar_t **names, const PROPVARIANT *v
 
     const PROPVARIANT &value = values[i];
 
+    #ifdef __7Z_MT_EXTRACT
+    bool processed;
+    RINOK(SetExtractProp(name, value, processed));
+    if (processed)
+      continue;
+    #endif
+
+    bool updateProcessed;
+    RINOK(SetUpdateProp(name, value, updateProcessed));
+    if (updateProcessed)
+      continue;
+
     if (name[0] == 'B')
     {
       name.Delete(0);
@@ -5,6 +5,8 @@
 #include "../../../../C/7zCrc.h"
 #include "../../../../C/CpuArch.h"
 
+#include "../../../Windows/Synchronization.h"
+
 #include "../../Common/StreamObjects.h"
 #include "../../Common/StreamUtils.h"
 
@@ -357,6 +359,108 @@ HRESULT CInArchive::FindAndReadSignature(IInStream *stream, const UInt64 *search
 }
 
 // S_FALSE means that file is not archive
+static CDatabasePtr CreateEmptyDatabase()
+{
+  CArchiveDatabaseEx *db = new CArchiveDatabaseEx;
+  db->Clear();
+  db->ArchiveInfo.StartPosition = 0;
+  return CDatabasePtr(db);
+}
+
+const CDatabasePtr &GetEmptyDatabase()
+{
+  static const CDatabasePtr emptyDb = CreateEmptyDatabase();
+  return emptyDb;
+}
+
+namespace NDatabaseCache
+{
+  struct CItem
+  {
+    CDatabaseCacheKey Key;
+    CDatabasePtr Db;
+    UInt64 NumItems;
+  };
+
+  struct CCache
+  {
+    NWindows::NSynchronization::CCriticalSection CS;
+    CObjectVector<CItem> Items; // the most recently used first
+    UInt64 NumItems;
+    CCache(): NumItems(0) {}
+  };
+
+  static CCache &GetCache()
+  {
+    static CCache cache;
+    return cache;
+  }
+
+  static UInt64 GetNumItems(const CArchiveDatabaseEx &db)
+  {
+    return (UInt64)db.Files.Size() + db.Folders.Size();
+  }
+
+  CDatabasePtr Find(const CDatabaseCacheKey &key)
+  {
+    CCache &cache = GetCache();
+    NWindows::NSynchronization::CCriticalSectionLock lock(cache.CS);
+    for (int i = 0; i < cache.Items.Size(); i++)
+    {
+      if (!(cache.Items[i].Key == key))
+        continue;
+      CItem item = cache.Items[i];
+      cache.Items.Delete(i);
+      cache.Items.Insert(0, item);
+      return item.Db;
+    }
+    return CDatabasePtr();
+  }
+
+  void Add(const CDatabaseCacheKey &key, const CDatabasePtr &db)
+  {
+    CItem item;
+    item.Key = key;
+    item.Db = db;
+    item.NumItems = GetNumItems(*db);
+    if (item.NumItems > kMaxNumItems)
+      return;
+
+    CCache &cache = GetCache();
+    NWindows::NSynchronization::CCriticalSectionLock lock(cache.CS);
+    for (int i = 0; i < cache.Items.Size(); i++)
+      if (cache.Items[i].Key == key)
+      {
+        cache.NumItems -= cache.Items[i].NumItems;
+        cache.Items.Delete(i);
+        break;
+      }
+    cache.Items.Insert(0, item);
+    cache.NumItems += item.NumItems;
+    while (cache.Items.Size() > kMaxNumDatabases || cache.NumItems > kMaxNumItems)
+    {
+      cache.NumItems -= cache.Items.Back().NumItems;
+      cache.Items.DeleteBack();
+    }
+  }
+
+  void Clear()
+  {
+    CCache &cache = GetCache();
+    NWindows::NSynchronization::CCriticalSectionLock lock(cache.CS);
+    cache.Items.Clear();
+    cache.NumItems = 0;
+  }
+
+  void GetStat(UInt32 &numDatabases, UInt64 &numItems)
+  {
+    CCache &cache = GetCache();
+    NWindows::NSynchronization::CCriticalSectionLock lock(cache.CS);
+    numDatabases = cache.Items.Size();
+    numItems = cache.NumItems;
+  }
+}
+
 HRESULT CInArchive::Open(IInStream *stream, const UInt64 *searchHeaderSizeLimit)
 {
   HeadersSize = 0;
@@ -822,6 +926,8 @@ HRESULT CInArchive::ReadAndDecodePackedStreams(
   for (int i = 0; i < folders.Size(); i++)
   {
     const CFolder &folder = folders[i];
+    if (folder.IsEncrypted())
+      _headerIsEncrypted = true;
     dataVector.Add(CByteBuffer());
     CByteBuffer &data = dataVector.Back();
     UInt64 unpackSize64 = folder.GetUnpackSize();
@@ -1135,7 +1241,7 @@ void CArchiveDatabaseEx::FillFolderStartFileIndex()
 
 HRESULT CInArchive::ReadDatabase2(
     DECL_EXTERNAL_CODECS_LOC_VARS
-    CArchiveDatabaseEx &db
+    CArchiveDatabaseEx &db, CDatabasePtr &cachedDb
     #ifndef _NO_CRYPTO
     , ICryptoGetTextPassword *getTextPassword, bool &passwordIsDefined
     #endif
@@ -1143,6 +1249,9 @@ HRESULT CInArchive::ReadDatabase2(
 {
   db.Clear();
   db.ArchiveInfo.StartPosition = _arhiveBeginStreamPosition;
+  _cacheKeyDefined = false;
+  _headerIsEncrypted = false;
+  bool startHeaderIsValid = false;
 
   db.ArchiveInfo.Version.Major = _header[6];
   db.ArchiveInfo.Version.Minor = _header[7];
@@ -1187,6 +1296,7 @@ HRESULT CInArchive::ReadDatabase2(
   {
     if (crc != crcFromArchive)
       ThrowIncorrect();
+    startHeaderIsValid = true;
   }
 
   db.ArchiveInfo.StartPositionAfterHeader = _arhiveBeginStreamPosition + kHeaderSize;
@@ -1211,6 +1321,18 @@ HRESULT CInArchive::ReadDatabase2(
 
   if (CrcCalc(buffer2, (UInt32)nextHeaderSize) != nextHeaderCRC)
     ThrowIncorrect();
+
+  if (startHeaderIsValid && UseCache)
+  {
+    _cacheKey.StartPosition = _arhiveBeginStreamPosition;
+    _cacheKey.NextHeaderOffset = nextHeaderOffset;
+    _cacheKey.NextHeaderSize = nextHeaderSize;
+    _cacheKey.NextHeaderCRC = nextHeaderCRC;
+    _cacheKeyDefined = true;
+    cachedDb = NDatabaseCache::Find(_cacheKey);
+    if (cachedDb)
+      return S_OK;
+  }
   
   CStreamSwitch streamSwitch;
   streamSwitch.Set(this, buffer2);
@@ -1255,7 +1377,7 @@ HRESULT CInArchive::ReadDatabase2(
 
 HRESULT CInArchive::ReadDatabase(
     DECL_EXTERNAL_CODECS_LOC_VARS
-    CArchiveDatabaseEx &db
+    CDatabasePtr &db
     #ifndef _NO_CRYPTO
     , ICryptoGetTextPassword *getTextPassword, bool &passwordIsDefined
     #endif
@@ -1263,12 +1385,24 @@ HRESULT CInArchive::ReadDatabase(
 {
   try
   {
-    return ReadDatabase2(
-      EXTERNAL_CODECS_LOC_VARS db
+    std::shared_ptr<CArchiveDatabaseEx> newDb(new CArchiveDatabaseEx);
+    CDatabasePtr cachedDb;
+    RINOK(ReadDatabase2(
+      EXTERNAL_CODECS_LOC_VARS *newDb, cachedDb
       #ifndef _NO_CRYPTO
       , getTextPassword, passwordIsDefined
       #endif
-      );
+      ));
+    if (cachedDb)
+    {
+      db = cachedDb;
+      return S_OK;
+    }
+    newDb->Fill();
+    if (_cacheKeyDefined && !_headerIsEncrypted)
+      NDatabaseCache::Add(_cacheKey, newDb);
+    db = newDb;
+    return S_OK;
   }
   catch(CInArchiveException &) { return S_FALSE; }
 }
@@ -3,6 +3,8 @@
 #ifndef __7Z_IN_H
 #define __7Z_IN_H
 
+#include <memory>
+
 #include "../../../Common/MyCom.h"
 
 #include "../../IPassword.h"
@@ -96,6 +98,49 @@ struct CArchiveDatabaseEx: public CArchiveDatabase
   }
 };
 
+/*
+  The database read by CInArchive::ReadDatabase is shared by all handlers
+  which open the same archive, and is not changed after Fill().
+*/
+typedef std::shared_ptr<const CArchiveDatabaseEx> CDatabasePtr;
+
+const CDatabasePtr &GetEmptyDatabase();
+
+/*
+  The database cache keeps the recently read databases in memory, so that
+  an archive opened again is not decoded and parsed again.
+  The key is the start header: NextHeaderCRC is checked against the header
+  read from the stream, so a changed archive doesn't match.
+  Databases of encrypted headers are not cached, because they would be
+  available without the password.
+*/
+struct CDatabaseCacheKey
+{
+  UInt64 StartPosition;
+  UInt64 NextHeaderOffset;
+  UInt64 NextHeaderSize;
+  UInt32 NextHeaderCRC;
+
+  bool operator==(const CDatabaseCacheKey &a) const
+  {
+    return StartPosition == a.StartPosition &&
+        NextHeaderOffset == a.NextHeaderOffset &&
+        NextHeaderSize == a.NextHeaderSize &&
+        NextHeaderCRC == a.NextHeaderCRC;
+  }
+};
+
+namespace NDatabaseCache
+{
+  const int kMaxNumDatabases = 16;
+  const UInt64 kMaxNumItems = (UInt64)1 << 22; // files and folders of all databases
+
+  CDatabasePtr Find(const CDatabaseCacheKey &key);
+  void Add(const CDatabaseCacheKey &key, const CDatabasePtr &db);
+  void Clear();
+  void GetStat(UInt32 &numDatabases, UInt64 &numItems);
+}
+
 class CInByte2
 {
   const Byte *_buffer;
@@ -222,18 +267,28 @@ private:
       );
   HRESULT ReadDatabase2(
       DECL_EXTERNAL_CODECS_LOC_VARS
-      CArchiveDatabaseEx &db
+      CArchiveDatabaseEx &db, CDatabasePtr &cachedDb
       #ifndef _NO_CRYPTO
       ,ICryptoGetTextPassword *getTextPassword, bool &passwordIsDefined
       #endif
       );
+
+  bool _cacheKeyDefined;
+  bool _headerIsEncrypted;
+  CDatabaseCacheKey _cacheKey;
 public:
+  // The database is neither taken from nor added to the database cache if UseCache is false.
+  bool UseCache;
+
+  CInArchive(): UseCache(true) {}
+
   HRESULT Open(IInStream *stream, const UInt64 *searchHeaderSizeLimit); // S_FALSE means is not archive
   void Close();
 
+  // db is filled. It comes from the database cache, if the archive was read before.
   HRESULT ReadDatabase(
       DECL_EXTERNAL_CODECS_LOC_VARS
-      CArchiveDatabaseEx &db
+      CDatabasePtr &db
       #ifndef _NO_CRYPTO
       ,ICryptoGetTextPassword *getTextPassword, bool &passwordIsDefined
       #endif
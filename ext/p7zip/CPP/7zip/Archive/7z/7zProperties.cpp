@@ -100,10 +100,12 @@ void CHandler::FillPopIDs()
   if(_volumes.Size() < 1)
     return;
   const CVolume &volume = _volumes.Front();
-  const CArchiveDatabaseEx &_db = volume.Database;
+  const CArchiveDatabaseEx &db = volume.Database;
+  #else
+  const CArchiveDatabaseEx &db = *_db;
   #endif
 
-  CRecordVector<UInt64> fileInfoPopIDs = _db.ArchiveInfo.FileInfoPopIDs;
+  CRecordVector<UInt64> fileInfoPopIDs = db.ArchiveInfo.FileInfoPopIDs;
 
   RemoveOneItem(fileInfoPopIDs, NID::kEmptyStream);
   RemoveOneItem(fileInfoPopIDs, NID::kEmptyFile);
@@ -0,0 +1,196 @@
+// 7zSpillBuffer.h
+
+#ifndef __7Z_SPILL_BUFFER_H
+#define __7Z_SPILL_BUFFER_H
+
+#include <string.h>
+
+#include "../../../Common/Buffer.h"
+#include "../../../Common/MyCom.h"
+#include "../../../Common/MyVector.h"
+#include "../../../Windows/FileDir.h"
+#include "../../../Windows/FileIO.h"
+
+#include "../../Common/StreamUtils.h"
+
+#include "../../IStream.h"
+
+namespace NArchive {
+namespace N7z {
+
+/*
+  CSpillBuffer keeps the data written to it in memory up to the memory limit,
+  and the rest in a temporary file. The data is read back once, from the start.
+*/
+
+class CSpillBuffer
+{
+  static const size_t kBlockSize = (size_t)1 << 20;
+
+  CObjectVector<CByteBuffer> _blocks;
+  int _maxNumBlocks;
+  UInt64 _memSize;
+  UInt64 _size;
+  UInt64 _pos;
+  CSysString _tempFileName;
+  NWindows::NFile::NDirectory::CTempFile _tempFile;
+  NWindows::NFile::NIO::COutFile _outFile;
+  NWindows::NFile::NIO::CInFile _inFile;
+  bool _tempFileCreated;
+  bool _inFileOpened;
+
+  bool CreateTempFile()
+  {
+    CSysString tempDirPath;
+    if (!NWindows::NFile::NDirectory::MyGetTempPath(tempDirPath))
+      return false;
+    if (_tempFile.Create(tempDirPath, TEXT("7zs"), _tempFileName) == 0)
+      return false;
+    if (!_outFile.Create(_tempFileName, true))
+      return false;
+    _tempFileCreated = true;
+    return true;
+  }
+
+public:
+  CSpillBuffer(UInt64 memLimit):
+      _memSize(0), _size(0), _pos(0), _tempFileCreated(false), _inFileOpened(false)
+  {
+    UInt64 numBlocks = memLimit / kBlockSize;
+    if (numBlocks < 1)
+      numBlocks = 1;
+    if (numBlocks > (1 << 20))
+      numBlocks = (1 << 20);
+    _maxNumBlocks = (int)numBlocks;
+  }
+
+  UInt64 GetSize() const { return _size; }
+
+  HRESULT Write(const void *data, UInt32 size)
+  {
+    while (size != 0 && !_tempFileCreated)
+    {
+      size_t blockPos = (size_t)(_memSize % kBlockSize);
+      if (blockPos == 0)
+      {
+        if (_blocks.Size() == _maxNumBlocks)
+          break;
+        _blocks.Add(CByteBuffer());
+        _blocks.Back().SetCapacity(kBlockSize);
+      }
+      size_t cur = kBlockSize - blockPos;
+      if (cur > size)
+        cur = size;
+      memcpy((Byte *)_blocks.Back() + blockPos, data, cur);
+      data = (const Byte *)data + cur;
+      size -= (UInt32)cur;
+      _memSize += cur;
+      _size += cur;
+    }
+    if (size == 0)
+      return S_OK;
+    if (!_tempFileCreated && !CreateTempFile())
+      return E_FAIL;
+    UInt32 processed;
+    if (!_outFile.Write(data, size, processed) || processed != size)
+      return E_FAIL;
+    _size += size;
+    return S_OK;
+  }
+
+  HRESULT FinishWriting()
+  {
+    if (_tempFileCreated && !_outFile.Close())
+      return E_FAIL;
+    return S_OK;
+  }
+
+  HRESULT Read(void *data, UInt32 size, UInt32 *processedSize)
+  {
+    *processedSize = 0;
+    if (size == 0 || _pos == _size)
+      return S_OK;
+    if (_pos < _memSize)
+    {
+      size_t blockPos = (size_t)(_pos % kBlockSize);
+      size_t cur = kBlockSize - blockPos;
+      if (cur > _memSize - _pos)
+        cur = (size_t)(_memSize - _pos);
+      if (cur > size)
+        cur = size;
+      memcpy(data, (const Byte *)_blocks[(int)(_pos / kBlockSize)] + blockPos, cur);
+      _pos += cur;
+      *processedSize = (UInt32)cur;
+      return S_OK;
+    }
+    if (!_inFileOpened)
+    {
+      if (!_inFile.Open(_tempFileName))
+        return E_FAIL;
+      _inFileOpened = true;
+    }
+    UInt32 processed;
+    if (!_inFile.ReadPart(data, size, processed) || processed == 0)
+      return E_FAIL;
+    _pos += processed;
+    *processedSize = processed;
+    return S_OK;
+  }
+
+  HRESULT WriteToStream(ISequentialOutStream *stream)
+  {
+    CByteBuffer buf;
+    buf.SetCapacity(kBlockSize);
+    for (;;)
+    {
+      UInt32 processed;
+      RINOK(Read(buf, (UInt32)kBlockSize, &processed));
+      if (processed == 0)
+        return S_OK;
+      RINOK(WriteStream(stream, buf, processed));
+    }
+  }
+};
+
+class CSpillOutStream:
+  public ISequentialOutStream,
+  public CMyUnknownImp
+{
+  CSpillBuffer *_buf;
+public:
+  void Init(CSpillBuffer *buf) { _buf = buf; }
+  MY_UNKNOWN_IMP
+
+  STDMETHOD(Write)(const void *data, UInt32 size, UInt32 *processedSize)
+  {
+    if (processedSize)
+      *processedSize = 0;
+    RINOK(_buf->Write(data, size));
+    if (processedSize)
+      *processedSize = size;
+    return S_OK;
+  }
+};
+
+class CSpillInStream:
+  public ISequentialInStream,
+  public CMyUnknownImp
+{
+  CSpillBuffer *_buf;
+public:
+  void Init(CSpillBuffer *buf) { _buf = buf; }
+  MY_UNKNOWN_IMP
+
+  STDMETHOD(Read)(void *data, UInt32 size, UInt32 *processedSize)
+  {
+    UInt32 processed;
+    HRESULT res = _buf->Read(data, size, &processed);
+    if (processedSize)
+      *processedSize = processed;
+    return res;
+  }
+};
+
+}}
+
+#endif
@@ -2,6 +2,10 @@
 
 #include "StdAfx.h"
 
+#include <math.h>
+
+#include <memory>
+
 #include "../../../../C/CpuArch.h"
 
 #include "../../Common/LimitedStreams.h"
@@ -19,6 +23,7 @@
 #include "7zFolderInStream.h"
 #include "7zHandler.h"
 #include "7zOut.h"
+#include "7zSpillBuffer.h"
 #include "7zUpdate.h"
 
 #ifndef WIN32
@@ -28,6 +33,7 @@
 namespace NArchive {
 namespace N7z {
 
+static const UInt64 k_Copy = 0;
 static const UInt64 k_LZMA = 0x030101;
 static const UInt64 k_BCJ  = 0x03030103;
 static const UInt64 k_BCJ2 = 0x0303011B;
@@ -374,6 +380,100 @@ static bool IsExeFile(const CUpdateItem &ui)
 }
 #endif
 
+// ---------- Compressibility probe ----------
+
+static const UInt32 kProbeSampleSize = 1 << 14;
+static const UInt32 kProbeNumSamples = 4;
+static const UInt32 kProbeMinSize = 1 << 12;
+static const unsigned kProbeHashBits = 12;
+
+// The data compressed already (JPEG, video, zstd, ...) has the entropy of
+// the bytes close to 8 bits, and almost no repeated strings for LZ.
+static const double kIncompressibleEntropy = 7.9;
+static const UInt32 kIncompressibleMatchRatio = 64; // matched bytes < 1/64
+
+class CCompressibilityProbe
+{
+  CByteBuffer _buf;
+  UInt32 _hash[1 << kProbeHashBits];
+  UInt32 _counts[256];
+  UInt32 _numBytes;
+  UInt32 _numMatched;
+
+  void AddSample(const Byte *p, UInt32 size)
+  {
+    UInt32 pos;
+    for (pos = 0; pos < size; pos++)
+      _counts[p[pos]]++;
+    _numBytes += size;
+
+    memset(_hash, 0xFF, sizeof(_hash));
+    for (pos = 0; pos + 4 <= size;)
+    {
+      UInt32 v = GetUi32(p + pos);
+      UInt32 h = (UInt32)(v * 2654435761U) >> (32 - kProbeHashBits);
+      UInt32 prev = _hash[h];
+      _hash[h] = pos;
+      if (prev != (UInt32)(Int32)-1 && GetUi32(p + prev) == v)
+      {
+        UInt32 len = 4;
+        while (pos + len < size && p[prev + len] == p[pos + len])
+          len++;
+        _numMatched += len;
+        pos += len;
+      }
+      else
+        pos++;
+    }
+  }
+
+public:
+  CCompressibilityProbe() { _buf.SetCapacity(kProbeSampleSize); }
+
+  // Reads the samples at the start, the end and between them.
+  HRESULT IsIncompressible(IArchiveUpdateCallbackSample *callback,
+      UInt32 index, UInt64 size, bool &result)
+  {
+    result = false;
+    memset(_counts, 0, sizeof(_counts));
+    _numBytes = 0;
+    _numMatched = 0;
+
+    for (UInt32 i = 0; i < kProbeNumSamples; i++)
+    {
+      UInt64 offset;
+      if (size <= (UInt64)kProbeSampleSize * kProbeNumSamples)
+        offset = (UInt64)kProbeSampleSize * i;
+      else
+        offset = (size - kProbeSampleSize) / (kProbeNumSamples - 1) * i;
+      if (offset >= size)
+        break;
+      UInt32 cur = kProbeSampleSize;
+      if (cur > size - offset)
+        cur = (UInt32)(size - offset);
+      UInt32 processed;
+      RINOK(callback->GetSample(index, offset, _buf, cur, &processed));
+      if (processed == 0)
+        break;
+      AddSample(_buf, processed);
+    }
+    if (_numBytes < kProbeMinSize)
+      return S_OK;
+
+    double entropy = 0;
+    for (int i = 0; i < 256; i++)
+      if (_counts[i] != 0)
+      {
+        double p = (double)_counts[i] / _numBytes;
+        entropy -= p * log(p);
+      }
+    entropy /= log(2.0);
+    result = (entropy >= kIncompressibleEntropy &&
+        (UInt64)_numMatched * kIncompressibleMatchRatio < _numBytes);
+    return S_OK;
+  }
+};
+
 #ifdef USE_86_FILTER
 
 static inline void GetMethodFull(UInt64 methodID, UInt32 numInStreams, CMethodFull &methodResult)
@@ -682,6 +782,34 @@ bool static Is86FilteredFolder(const CFolder &f)
   return false;
 }
 
+static bool IsCopyFolder(const CFolder &f)
+{
+  for (int i = 0; i < f.Coders.Size(); i++)
+  {
+    CMethodId m = f.Coders[i].MethodID;
+    if (m != k_Copy && m != k_AES)
+      return false;
+  }
+  return true;
+}
+
+static bool IsCopyMethod(const CCompressionMethodMode &method)
+{
+  return method.Methods.Size() == 1 && method.Methods[0].Id == k_Copy;
+}
+
+static void MakeCopyMethod(const CCompressionMethodMode &method, CCompressionMethodMode &copyMethod)
+{
+  copyMethod = method;
+  copyMethod.Methods.Clear();
+  copyMethod.Binds.Clear();
+  CMethodFull methodFull;
+  methodFull.Id = k_Copy;
+  methodFull.NumInStreams = 1;
+  methodFull.NumOutStreams = 1;
+  copyMethod.Methods.Add(methodFull);
+}
+
 #ifndef _NO_CRYPTO
 
 class CCryptoGetTextPassword:
@@ -702,14 +830,393 @@ STDMETHODIMP CCryptoGetTextPassword::CryptoGetTextPassword(BSTR *password)
 
 #endif
 
-static const int kNumGroupsMax = 4;
+static const int kNumGroupsMax = 8;
 
 #ifdef USE_86_FILTER
 static bool Is86Group(int group) { return (group & 1) != 0; }
 #endif
 static bool IsEncryptedGroup(int group) { return (group & 2) != 0; }
-static int GetGroupIndex(bool encrypted, int bcjFiltered)
-  { return (encrypted ? 2 : 0) + (bcjFiltered ? 1 : 0); }
+static bool IsStoredGroup(int group) { return (group & 4) != 0; }
+static int GetGroupIndex(bool encrypted, int bcjFiltered, bool stored)
+  { return (stored ? 4 : (bcjFiltered ? 1 : 0)) + (encrypted ? 2 : 0); }
+
+// Returns the number of files from indices[i] compressed into the next solid block.
+static int GetNumSubFiles(
+    const CObjectVector<CUpdateItem> &updateItems,
+    const CRecordVector<UInt32> &indices, int i,
+    UInt64 numSolidFiles, const CUpdateOptions &options)
+{
+  int numFiles = indices.Size();
+  UInt64 totalSize = 0;
+  int numSubFiles;
+  UString prevExtension;
+  for (numSubFiles = 0; i + numSubFiles < numFiles &&
+      numSubFiles < numSolidFiles; numSubFiles++)
+  {
+    const CUpdateItem &ui = updateItems[indices[i + numSubFiles]];
+    totalSize += ui.Size;
+    if (totalSize > options.NumSolidBytes)
+      break;
+    if (options.SolidExtension)
+    {
+      UString ext = ui.GetExtension();
+      if (numSubFiles == 0)
+        prevExtension = ext;
+      else
+        if (ext.CompareNoCase(prevExtension) != 0)
+          break;
+    }
+  }
+  if (numSubFiles < 1)
+    numSubFiles = 1;
+  return numSubFiles;
+}
+
+// Adds the folder of new files and the files read by inStreamSpec to newDatabase.
+static HRESULT AddNewFolder(
+    const CArchiveDatabaseEx *db,
+    const CObjectVector<CUpdateItem> &updateItems,
+    const UInt32 *indices, int numSubFiles,
+    const CFolderInStream *inStreamSpec,
+    const CFolder &folderItem,
+    CArchiveDatabase &newDatabase)
+{
+  newDatabase.Folders.Add(folderItem);
+  
+  CNum numUnpackStreams = 0;
+  for (int subIndex = 0; subIndex < numSubFiles; subIndex++)
+  {
+    const CUpdateItem &ui = updateItems[indices[subIndex]];
+    CFileItem file;
+    CFileItem2 file2;
+    if (ui.NewProps)
+      FromUpdateItemToFileItem(ui, file, file2);
+    else
+      db->GetFile(ui.IndexInArchive, file, file2);
+    if (file2.IsAnti || file.IsDir)
+      return E_FAIL;
+    
+    /*
+    CFileItem &file = newDatabase.Files[
+          startFileIndexInDatabase + i + subIndex];
+    */
+    if (!inStreamSpec->Processed[subIndex])
+    {
+      continue;
+      // file.Name += L".locked";
+    }
+
+    file.Crc = inStreamSpec->CRCs[subIndex];
+    file.Size = inStreamSpec->Sizes[subIndex];
+    if (file.Size != 0)
+    {
+      file.CrcDefined = true;
+      file.HasStream = true;
+      numUnpackStreams++;
+    }
+    else
+    {
+      file.CrcDefined = false;
+      file.HasStream = false;
+    }
+    newDatabase.AddFile(file, file2);
+  }
+  // numUnpackStreams = 0 is very bad case for locked files
+  // v3.13 doesn't understand it.
+  newDatabase.NumUnpackStreamsVector.Add(numUnpackStreams);
+  return S_OK;
+}
+
+#ifndef _7ZIP_ST
+
+/*
+  EncodeFoldersMt compresses the solid blocks of new files in worker threads.
+  The update callback can't be called concurrently, so the calling thread
+  reads the files of each block into a spill buffer, and the worker threads
+  compress the blocks into their own spill buffers, which are written to the
+  archive in order. Each block in progress keeps its input and its output in
+  memory up to a share of the memory budget, and the rest in temporary files.
+*/
+
+static const UInt32 kMtUpdateReadBufSize = (1 << 20);
+
+struct CMtUpdateJob
+{
+  int StartIndex; // in indices
+  int NumSubFiles;
+  CFolderInStream *InStreamSpec;
+  CMyComPtr<ISequentialInStream> InStream; // keeps the sizes and the CRCs of the files
+  std::shared_ptr<CSpillBuffer> InBuf;
+  std::shared_ptr<CSpillBuffer> OutBuf;
+  CFolder Folder;
+  CRecordVector<UInt64> PackSizes;
+  bool Finished;
+  HRESULT Result;
+
+  CMtUpdateJob(): StartIndex(0), NumSubFiles(0), InStreamSpec(NULL), Finished(false), Result(S_OK) {}
+};
+
+class CMtUpdate;
+
+struct CMtUpdateThread
+{
+  CMtUpdate *Mt;
+  CEncoder *Encoder;
+  NWindows::CThread Thread;
+  CMyComPtr<ICompressProgressInfo> Progress;
+
+  CMtUpdateThread(): Mt(NULL), Encoder(NULL) {}
+  ~CMtUpdateThread() { delete Encoder; }
+  void Process();
+  HRESULT EncodeFolder(CMtUpdateJob &job);
+};
+
+class CMtUpdate
+{
+public:
+  #ifdef EXTERNAL_CODECS
+  ICompressCodecsInfo *CodecsInfo;
+  const CObjectVector<CCodecInfoEx> *ExternalCodecs;
+  #endif
+  const UInt64 *InSizeForReduce;
+
+  NWindows::NSynchronization::CCriticalSection CS;
+  NWindows::NSynchronization::CSemaphore JobSemaphore;
+  NWindows::NSynchronization::CAutoResetEvent JobFinishedEvent;
+  CRecordVector<int> Queue;
+  int QueuePos;
+  CObjectVector<CMtUpdateJob> Jobs;
+  bool Stop;
+
+  CObjectVector<CMtUpdateThread> Threads;
+  int NumCreatedThreads;
+
+  CMtUpdate(): QueuePos(0), Stop(false), NumCreatedThreads(0) {}
+  ~CMtUpdate() { StopThreads(); }
+  HRESULT Create(const CCompressionMethodMode &method, UInt32 numThreads);
+  void StopThreads();
+  void Push(int jobIndex);
+  void WaitJob(int jobIndex);
+};
+
+class CMtUpdateProgress:
+  public ICompressProgressInfo,
+  public CMyUnknownImp
+{
+public:
+  CMtUpdate *Mt;
+
+  MY_UNKNOWN_IMP
+  STDMETHOD(SetRatioInfo)(const UInt64 *inSize, const UInt64 *outSize);
+};
+
+STDMETHODIMP CMtUpdateProgress::SetRatioInfo(const UInt64 * /* inSize */, const UInt64 * /* outSize */)
+{
+  NWindows::NSynchronization::CCriticalSectionLock lock(Mt->CS);
+  return Mt->Stop ? E_ABORT : S_OK;
+}
+
+static THREAD_FUNC_DECL MtUpdateThreadFunc(void *p)
+{
+  ((CMtUpdateThread *)p)->Process();
+  return 0;
+}
+
+HRESULT CMtUpdate::Create(const CCompressionMethodMode &method, UInt32 numThreads)
+{
+  RINOK(JobSemaphore.Create(0, 0x7FFFFFFF));
+  RINOK(JobFinishedEvent.CreateIfNotCreated());
+  for (UInt32 i = 0; i < numThreads; i++)
+    Threads.Add(CMtUpdateThread());
+  for (UInt32 i = 0; i < numThreads; i++)
+  {
+    CMtUpdateThread &t = Threads[i];
+    t.Mt = this;
+    t.Encoder = new CEncoder(method);
+    CMtUpdateProgress *progressSpec = new CMtUpdateProgress;
+    t.Progress = progressSpec;
+    progressSpec->Mt = this;
+    RINOK(t.Thread.Create(MtUpdateThreadFunc, &t));
+    NumCreatedThreads++;
+  }
+  return S_OK;
+}
+
+void CMtUpdate::StopThreads()
+{
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(CS);
+    Stop = true;
+  }
+  if (NumCreatedThreads != 0)
+    JobSemaphore.Release(NumCreatedThreads);
+  for (int i = 0; i < NumCreatedThreads; i++)
+    Threads[i].Thread.Wait();
+  NumCreatedThreads = 0;
+}
+
+void CMtUpdate::Push(int jobIndex)
+{
+  {
+    NWindows::NSynchronization::CCriticalSectionLock lock(CS);
+    Queue.Add(jobIndex);
+  }
+  JobSemaphore.Release();
+}
+
+void CMtUpdate::WaitJob(int jobIndex)
+{
+  for (;;)
+  {
+    {
+      NWindows::NSynchronization::CCriticalSectionLock lock(CS);
+      if (Jobs[jobIndex].Finished)
+        return;
+    }
+    JobFinishedEvent.Lock();
+  }
+}
+
+void CMtUpdateThread::Process()
+{
+  for (;;)
+  {
+    Mt->JobSemaphore.Lock();
+    int jobIndex;
+    {
+      NWindows::NSynchronization::CCriticalSectionLock lock(Mt->CS);
+      if (Mt->Stop)
+        return;
+      jobIndex = Mt->Queue[Mt->QueuePos++];
+    }
+    CMtUpdateJob &job = Mt->Jobs[jobIndex];
+    HRESULT result;
+    try
+    {
+      result = EncodeFolder(job);
+    }
+    catch(...)
+    {
+      result = E_FAIL;
+    }
+    {
+      NWindows::NSynchronization::CCriticalSectionLock lock(Mt->CS);
+      job.Result = result;
+      job.Finished = true;
+    }
+    Mt->JobFinishedEvent.Set();
+  }
+}
+
+HRESULT CMtUpdateThread::EncodeFolder(CMtUpdateJob &job)
+{
+  CSpillInStream *inStreamSpec = new CSpillInStream;
+  CMyComPtr<ISequentialInStream> inStream = inStreamSpec;
+  inStreamSpec->Init(job.InBuf.get());
+
+  CSpillOutStream *outStreamSpec = new CSpillOutStream;
+  CMyComPtr<ISequentialOutStream> outStream = outStreamSpec;
+  outStreamSpec->Init(job.OutBuf.get());
+
+  HRESULT result = Encoder->Encode(
+      #ifdef EXTERNAL_CODECS
+      Mt->CodecsInfo, Mt->ExternalCodecs,
+      #endif
+      inStream, NULL, Mt->InSizeForReduce, job.Folder,
+      outStream, job.PackSizes, Progress);
+  job.InBuf.reset();
+  if (result != S_OK)
+    return result;
+  return job.OutBuf->FinishWriting();
+}
+
+static HRESULT EncodeFoldersMt(
+    DECL_EXTERNAL_CODECS_LOC_VARS
+    const CCompressionMethodMode &method,
+    const CArchiveDatabaseEx *db,
+    const CObjectVector<CUpdateItem> &updateItems,
+    const CRecordVector<UInt32> &indices,
+    UInt64 numSolidFiles,
+    const CUpdateOptions &options,
+    IArchiveUpdateCallback *updateCallback,
+    const UInt64 *inSizeForReduce,
+    ISequentialOutStream *outStream,
+    CArchiveDatabase &newDatabase,
+    CLocalProgress *lps)
+{
+  CMtUpdate mt;
+  #ifdef EXTERNAL_CODECS
+  mt.CodecsInfo = codecsInfo;
+  mt.ExternalCodecs = externalCodecs;
+  #endif
+  mt.InSizeForReduce = inSizeForReduce;
+
+  int i;
+  for (i = 0; i < indices.Size();)
+  {
+    CMtUpdateJob job;
+    job.StartIndex = i;
+    job.NumSubFiles = GetNumSubFiles(updateItems, indices, i, numSolidFiles, options);
+    mt.Jobs.Add(job);
+    i += job.NumSubFiles;
+  }
+
+  UInt32 numThreads = options.NumFolderThreads;
+  if (numThreads > (UInt32)mt.Jobs.Size())
+    numThreads = mt.Jobs.Size();
+  RINOK(mt.Create(method, numThreads));
+
+  const UInt64 memLimit = options.FolderThreadsMemory / (numThreads * 2);
+
+  CByteBuffer buf;
+  buf.SetCapacity(kMtUpdateReadBufSize);
+
+  int nextRead = 0;
+  for (i = 0; i < mt.Jobs.Size(); i++)
+  {
+    for (; nextRead < mt.Jobs.Size() && nextRead < i + (int)numThreads; nextRead++)
+    {
+      CMtUpdateJob &job = mt.Jobs[nextRead];
+      job.InStreamSpec = new CFolderInStream;
+      job.InStream = job.InStreamSpec;
+      job.InStreamSpec->Init(updateCallback, &indices[job.StartIndex], job.NumSubFiles);
+      job.InBuf.reset(new CSpillBuffer(memLimit));
+      job.OutBuf.reset(new CSpillBuffer(memLimit));
+      for (;;)
+      {
+        UInt32 processed;
+        RINOK(job.InStream->Read(buf, kMtUpdateReadBufSize, &processed));
+        if (processed == 0)
+          break;
+        RINOK(job.InBuf->Write(buf, processed));
+      }
+      RINOK(job.InBuf->FinishWriting());
+      RINOK(lps->SetCur());
+      mt.Push(nextRead);
+    }
+
+    CMtUpdateJob &job = mt.Jobs[i];
+    mt.WaitJob(i);
+    RINOK(job.Result);
+    RINOK(job.OutBuf->WriteToStream(outStream));
+    job.OutBuf.reset();
+
+    for (int j = 0; j < job.PackSizes.Size(); j++)
+    {
+      newDatabase.PackSizes.Add(job.PackSizes[j]);
+      lps->OutSize += job.PackSizes[j];
+    }
+    lps->InSize += job.Folder.GetUnpackSize();
+    RINOK(lps->SetCur());
+
+    RINOK(AddNewFolder(db, updateItems, &indices[job.StartIndex], job.NumSubFiles,
+        job.InStreamSpec, job.Folder, newDatabase));
+    job.InStream.Release();
+  }
+  return S_OK;
+}
+
+#endif
 
 HRESULT Update(
     DECL_EXTERNAL_CODECS_LOC_VARS
@@ -790,7 +1297,9 @@ HRESULT Update(
       rep.NumCopyFiles = numCopyItems;
       const CFolder &f = db->Folders[i];
       bool isEncrypted = f.IsEncrypted();
-      rep.Group = GetGroupIndex(isEncrypted, Is86FilteredFolder(f));
+      // Stored folders are grouped apart only when incompressible data is stored.
+      bool stored = options.StoreIncompressible && IsCopyFolder(f);
+      rep.Group = GetGroupIndex(isEncrypted, Is86FilteredFolder(f), stored);
       folderRefs.Add(rep);
       if (numCopyItems == numUnpackStreams)
         complexity += db->GetFolderFullPackSize(i);
@@ -849,19 +1358,30 @@ HRESULT Update(
     groups.Add(CSolidGroup());
 
   {
-    // ---------- Split files to 2 groups ----------
+    // ---------- Split files to groups ----------
 
     bool useFilters = options.UseFilters;
     const CCompressionMethodMode &method = *options.Method;
     if (method.Methods.Size() != 1 || method.Binds.Size() != 0)
       useFilters = false;
+
+    CMyComPtr<IArchiveUpdateCallbackSample> sampleCallback;
+    if (options.StoreIncompressible && !IsCopyMethod(method))
+      updateCallback->QueryInterface(IID_IArchiveUpdateCallbackSample, (void **)&sampleCallback);
+    CCompressibilityProbe probe;
+
     for (i = 0; i < updateItems.Size(); i++)
     {
       const CUpdateItem &ui = updateItems[i];
       if (!ui.NewData || !ui.HasStream())
         continue;
+      bool stored = (ui.Method == NItemMethod::kCopy);
+      if (ui.Method == NItemMethod::kAuto && sampleCallback && ui.Size >= kProbeMinSize)
+      {
+        RINOK(probe.IsIncompressible(sampleCallback, ui.IndexInClient, ui.Size, stored));
+      }
       bool filteredGroup = false;
-      if (useFilters)
+      if (useFilters && !stored)
       {
 #ifdef _WIN32
         int dotPos = ui.Name.ReverseFind(L'.');
@@ -871,7 +1391,7 @@ HRESULT Update(
 	filteredGroup = IsExeFile(ui);
 #endif
       }
-      groups[GetGroupIndex(method.PasswordIsDefined, filteredGroup)].Indices.Add(i);
+      groups[GetGroupIndex(method.PasswordIsDefined, filteredGroup, stored)].Indices.Add(i);
     }
   }
 
@@ -910,6 +1430,9 @@ HRESULT Update(
     const CSolidGroup &group = groups[groupIndex];
 
     CCompressionMethodMode method;
+    if (IsStoredGroup(groupIndex))
+      MakeCopyMethod(*options.Method, method);
+    else
     #ifdef USE_86_FILTER
     if (Is86Group(groupIndex))
       MakeExeMethod(*options.Method, options.MaxFilter, method);
@@ -1078,30 +1601,20 @@ HRESULT Update(
       */
     }
     
+    #ifndef _7ZIP_ST
+    if (options.NumFolderThreads > 1)
+    {
+      RINOK(EncodeFoldersMt(
+          EXTERNAL_CODECS_LOC_VARS
+          method, db, updateItems, indices, numSolidFiles, options, updateCallback,
+          &inSizeForReduce, archive.SeqStream, newDatabase, lps));
+      continue;
+    }
+    #endif
+
     for (i = 0; i < numFiles;)
     {
-      UInt64 totalSize = 0;
-      int numSubFiles;
-      UString prevExtension;
-      for (numSubFiles = 0; i + numSubFiles < numFiles &&
-          numSubFiles < numSolidFiles; numSubFiles++)
-      {
-        const CUpdateItem &ui = updateItems[indices[i + numSubFiles]];
-        totalSize += ui.Size;
-        if (totalSize > options.NumSolidBytes)
-          break;
-        if (options.SolidExtension)
-        {
-          UString ext = ui.GetExtension();
-          if (numSubFiles == 0)
-            prevExtension = ext;
-          else
-            if (ext.CompareNoCase(prevExtension) != 0)
-              break;
-        }
-      }
-      if (numSubFiles < 1)
-        numSubFiles = 1;
+      int numSubFiles = GetNumSubFiles(updateItems, indices, i, numSolidFiles, options);
 
       CFolderInStream *inStreamSpec = new CFolderInStream;
       CMyComPtr<ISequentialInStream> solidInStream(inStreamSpec);
@@ -1123,49 +1636,8 @@ HRESULT Update(
       // newDatabase.PackCRCsDefined.Add(false);
       // newDatabase.PackCRCs.Add(0);
       
-      newDatabase.Folders.Add(folderItem);
-      
-      CNum numUnpackStreams = 0;
-      for (int subIndex = 0; subIndex < numSubFiles; subIndex++)
-      {
-        const CUpdateItem &ui = updateItems[indices[i + subIndex]];
-        CFileItem file;
-        CFileItem2 file2;
-        if (ui.NewProps)
-          FromUpdateItemToFileItem(ui, file, file2);
-        else
-          db->GetFile(ui.IndexInArchive, file, file2);
-        if (file2.IsAnti || file.IsDir)
-          return E_FAIL;
-        
-        /*
-        CFileItem &file = newDatabase.Files[
-              startFileIndexInDatabase + i + subIndex];
-        */
-        if (!inStreamSpec->Processed[subIndex])
-        {
-          continue;
-          // file.Name += L".locked";
-        }
-
-        file.Crc = inStreamSpec->CRCs[subIndex];
-        file.Size = inStreamSpec->Sizes[subIndex];
-        if (file.Size != 0)
-        {
-          file.CrcDefined = true;
-          file.HasStream = true;
-          numUnpackStreams++;
-        }
-        else
-        {
-          file.CrcDefined = false;
-          file.HasStream = false;
-        }
-        newDatabase.AddFile(file, file2);
-      }
-      // numUnpackStreams = 0 is very bad case for locked files
-      // v3.13 doesn't understand it.
-      newDatabase.NumUnpackStreamsVector.Add(numUnpackStreams);
+      RINOK(AddNewFolder(db, updateItems, &indices[i], numSubFiles, inStreamSpec,
+          folderItem, newDatabase));
       i += numSubFiles;
     }
   }
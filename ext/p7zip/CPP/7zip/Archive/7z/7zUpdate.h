@@ -12,6 +12,16 @@
 namespace NArchive {
 namespace N7z {
 
+namespace NItemMethod
+{
+  enum
+  {
+    kAuto, // the main method, or COPY if the data is found incompressible
+    kMain,
+    kCopy
+  };
+}
+
 struct CUpdateItem
 {
   int IndexInArchive;
@@ -37,6 +47,8 @@ struct CUpdateItem
   bool ATimeDefined;
   bool MTimeDefined;
 
+  int Method; // NItemMethod, given by kpidMethod
+
   bool HasStream() const { return !IsDir && !IsAnti && Size != 0; }
 
   CUpdateItem():
@@ -45,7 +57,8 @@ struct CUpdateItem
       AttribDefined(false),
       CTimeDefined(false),
       ATimeDefined(false),
-      MTimeDefined(false)
+      MTimeDefined(false),
+      Method(NItemMethod::kAuto)
       {}
   void SetDirStatusFromAttrib() { IsDir = ((Attrib & FILE_ATTRIBUTE_DIRECTORY) != 0); };
 
@@ -67,6 +80,14 @@ struct CUpdateOptions
   bool SolidExtension;
   bool RemoveSfxBlock;
   bool VolumeMode;
+
+  // Checks the samples of the new data with kAuto method, and stores
+  // the incompressible data in COPY folders.
+  bool StoreIncompressible;
+
+  // Solid blocks compressed in parallel, and the memory for their input and output.
+  UInt32 NumFolderThreads;
+  UInt64 FolderThreadsMemory;
 };
 
 HRESULT Update(
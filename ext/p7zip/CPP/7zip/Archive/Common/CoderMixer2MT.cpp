@@ -86,7 +86,7 @@ HRESULT CCoderMixer2MT::SetBindInfo(const CBindInfo &bindInfo)
   for (int i = 0; i < _bindInfo.BindPairs.Size(); i++)
   {
     _streamBinders.Add(CStreamBinder());
-    RINOK(_streamBinders.Back().CreateEvents());
+    RINOK(_streamBinders.Back().CreateEvents(_binderBufferSize));
   }
   return S_OK;
 }
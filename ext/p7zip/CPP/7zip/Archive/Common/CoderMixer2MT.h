@@ -48,6 +48,7 @@ class CCoderMixer2MT:
   CBindInfo _bindInfo;
   CObjectVector<CStreamBinder> _streamBinders;
   int _progressCoderIndex;
+  UInt32 _binderBufferSize;
 
   void AddCoderCommon();
   HRESULT Init(ISequentialInStream **inStreams, ISequentialOutStream **outStreams);
@@ -56,6 +57,8 @@ public:
   CObjectVector<CCoder2> _coders;
   MY_UNKNOWN_IMP
 
+  CCoderMixer2MT(): _binderBufferSize(kStreamBinderBufferSizeDefault) {}
+
   STDMETHOD(Code)(ISequentialInStream **inStreams,
       const UInt64 **inSizes,
       UInt32 numInStreams,
@@ -64,6 +67,8 @@ public:
       UInt32 numOutStreams,
       ICompressProgressInfo *progress);
 
+  // call it before SetBindInfo()
+  void SetBinderBufferSize(UInt32 size) { _binderBufferSize = size; }
   HRESULT SetBindInfo(const CBindInfo &bindInfo);
   void AddCoder(ICompressCoder *coder);
   void AddCoder2(ICompressCoder2 *coder);
@@ -127,6 +127,7 @@ static CNameToPropID g_NameToPropID[] =
   { NCoderPropID::kAlgorithm, VT_UI4, L"a" },
   { NCoderPropID::kMatchFinder, VT_BSTR, L"mf" },
   { NCoderPropID::kNumThreads, VT_UI4, L"mt" },
+  { NCoderPropID::kNumBlockThreads, VT_UI4, L"mtb" },
   { NCoderPropID::kDefaultProp, VT_UI4, L"" }
 };
 
@@ -17,6 +17,27 @@ public:
   HRESULT Read(UInt64 startPos, void *data, UInt32 size, UInt32 *processedSize);
 };
 
+class CLockedInStreamImp:
+  public IInStream,
+  public CMyUnknownImp
+{
+  CLockedInStream *_lockedInStream;
+  UInt64 _pos;
+  UInt64 _size;
+public:
+  void Init(CLockedInStream *lockedInStream, UInt64 size)
+  {
+    _lockedInStream = lockedInStream;
+    _pos = 0;
+    _size = size;
+  }
+
+  MY_UNKNOWN_IMP1(IInStream)
+
+  STDMETHOD(Read)(void *data, UInt32 size, UInt32 *processedSize);
+  STDMETHOD(Seek)(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition);
+};
+
 class CLockedSequentialInStreamImp:
   public ISequentialInStream,
   public CMyUnknownImp
@@ -2,6 +2,8 @@
 
 #include "StdAfx.h"
 
+#include "../../../C/Alloc.h"
+
 #include "StreamBinder.h"
 #include "../../Common/Defs.h"
 #include "../../Common/MyCom.h"
@@ -49,26 +51,68 @@ STDMETHODIMP CSequentialOutStreamForBinder::Write(const void *data, UInt32 size,
 
 //////////////////////////
 // CStreamBinder
-// (_thereAreBytesToReadEvent && _bufferSize == 0) means that stream is finished.
+// Reader and writer wait on the same condition of _synchro.
+// (_numBytes == 0 && _writeIsClosed) means that stream is finished.
 
-HRes CStreamBinder::CreateEvents()
+CStreamBinder::~CStreamBinder()
 {
-  _synchroFor_allBytesAreWritenEvent_and_readStreamIsClosedEvent = new NWindows::NSynchronization::CSynchro();
-  _synchroFor_allBytesAreWritenEvent_and_readStreamIsClosedEvent->Create();
-  RINOK(_allBytesAreWritenEvent.Create(_synchroFor_allBytesAreWritenEvent_and_readStreamIsClosedEvent,true));
-  RINOK(_thereAreBytesToReadEvent.Create());
-  return _readStreamIsClosedEvent.Create(_synchroFor_allBytesAreWritenEvent_and_readStreamIsClosedEvent);
+  FreeBuffer();
+  delete _synchro;
+  _synchro = 0;
 }
 
-void CStreamBinder::ReInit()
+void CStreamBinder::FreeBuffer()
+{
+  ::MidFree(_buf);
+  _buf = 0;
+  _bufSize = 0;
+}
+
+HRes CStreamBinder::CreateEvents(UInt32 bufferSize)
+{
+  if (!_synchro)
+  {
+    _synchro = new NWindows::NSynchronization::CSynchro();
+    _synchro->Create();
+  }
+  if (bufferSize != _bufSize)
+  {
+    FreeBuffer();
+    if (bufferSize != 0)
+    {
+      _buf = (Byte *)::MidAlloc(bufferSize);
+      if (!_buf)
+        return E_OUTOFMEMORY;
+      _bufSize = bufferSize;
+    }
+  }
+  _wakeSize = MyMax(_bufSize / 4, (UInt32)1);
+  ResetState();
+  return S_OK;
+}
+
+void CStreamBinder::ResetState()
 {
-  _thereAreBytesToReadEvent.Reset();
-  _readStreamIsClosedEvent.Reset();
+  _readPos = 0;
+  _numBytes = 0;
+  _directData = NULL;
+  _directSize = 0;
+  _readerNeed = 0;
+  _writerNeed = 0;
+  _readerWaits = false;
+  _writerWaits = false;
+  _readIsClosed = false;
+  _writeIsClosed = false;
   ProcessedSize = 0;
 }
 
+void CStreamBinder::ReInit()
+{
+  ResetState();
+}
+
+
 
-  
 void CStreamBinder::CreateStreams(ISequentialInStream **inStream,
       ISequentialOutStream **outStream)
 {
@@ -84,61 +128,176 @@ void CStreamBinder::CreateStreams(ISequentialInStream **inStream,
   outStreamSpec->SetBinder(this);
   *outStream = outStreamLoc.Detach();
 
-  _buffer = NULL;
-  _bufferSize= 0;
-  ProcessedSize = 0;
+  ResetState();
+}
+
+HRESULT CStreamBinder::ReadDirect(void *data, UInt32 size, UInt32 *processedSize)
+{
+  _synchro->Enter();
+  while (_directSize == 0 && !_writeIsClosed)
+    _synchro->WaitCond();
+  UInt32 cur = MyMin(_directSize, size);
+  memcpy(data, _directData, cur);
+  _directData += cur;
+  _directSize -= cur;
+  if (cur != 0 && _directSize == 0)
+    _synchro->LeaveAndSignal();
+  else
+    _synchro->Leave();
+  if (processedSize != NULL)
+    *processedSize = cur;
+  ProcessedSize += cur;
+  return S_OK;
 }
 
 HRESULT CStreamBinder::Read(void *data, UInt32 size, UInt32 *processedSize)
 {
-  UInt32 sizeToRead = size;
-  if (size > 0)
+  if (processedSize != NULL)
+    *processedSize = 0;
+  if (size == 0)
+    return S_OK;
+  if (_bufSize == 0)
+    return ReadDirect(data, size, processedSize);
+
+  _synchro->Enter();
+  if (_numBytes == 0 && !_writeIsClosed)
   {
-    RINOK(_thereAreBytesToReadEvent.Lock());
-    sizeToRead = MyMin(_bufferSize, size);
-    if (_bufferSize > 0)
+    // we don't want to wake up for each small block
+    _readerNeed = MyMin(size, _wakeSize);
+    do
     {
-      memcpy(data, _buffer, sizeToRead);
-      _buffer = ((const Byte *)_buffer) + sizeToRead;
-      _bufferSize -= sizeToRead;
-      if (_bufferSize == 0)
-      {
-        _thereAreBytesToReadEvent.Reset();
-        _allBytesAreWritenEvent.Set();
-      }
+      _readerWaits = true;
+      _synchro->WaitCond();
     }
+    while (_numBytes < _readerNeed && !_writeIsClosed);
+    _readerWaits = false;
+  }
+  UInt32 cur = MyMin(_numBytes, size);
+  UInt32 pos = _readPos;
+  _synchro->Leave();
+
+  if (cur == 0)
+    return S_OK;
+
+  // the writer doesn't change [_readPos, _readPos + _numBytes) block
+  UInt32 rem = _bufSize - pos;
+  if (rem >= cur)
+    memcpy(data, _buf + pos, cur);
+  else
+  {
+    memcpy(data, _buf + pos, rem);
+    memcpy((Byte *)data + rem, _buf, cur - rem);
+  }
+  pos += cur;
+  if (pos >= _bufSize)
+    pos -= _bufSize;
+
+  _synchro->Enter();
+  _readPos = pos;
+  _numBytes -= cur;
+  if (_writerWaits && _bufSize - _numBytes >= _writerNeed)
+  {
+    _writerWaits = false;
+    _synchro->LeaveAndSignal();
   }
+  else
+    _synchro->Leave();
+
   if (processedSize != NULL)
-    *processedSize = sizeToRead;
-  ProcessedSize += sizeToRead;
+    *processedSize = cur;
+  ProcessedSize += cur;
   return S_OK;
 }
 
 void CStreamBinder::CloseRead()
 {
-  _readStreamIsClosedEvent.Set();
+  _synchro->Enter();
+  _readIsClosed = true;
+  _synchro->LeaveAndSignal();
+}
+
+HRESULT CStreamBinder::WriteDirect(const void *data, UInt32 size, UInt32 *processedSize)
+{
+  _synchro->Enter();
+  if (!_readIsClosed)
+  {
+    _directData = (const Byte *)data;
+    _directSize = size;
+    _synchro->LeaveAndSignal();
+    _synchro->Enter();
+    while (_directSize != 0 && !_readIsClosed)
+      _synchro->WaitCond();
+  }
+  bool readingWasClosed = (_directSize != 0 || _readIsClosed);
+  _directSize = 0;
+  _synchro->Leave();
+  if (readingWasClosed)
+    return S_FALSE;
+  if (processedSize != NULL)
+    *processedSize = size;
+  return S_OK;
 }
 
 HRESULT CStreamBinder::Write(const void *data, UInt32 size, UInt32 *processedSize)
 {
-  if (size > 0)
+  if (processedSize != NULL)
+    *processedSize = 0;
+  if (size == 0)
+    return S_OK;
+  if (_bufSize == 0)
+    return WriteDirect(data, size, processedSize);
+
+  const Byte *src = (const Byte *)data;
+  UInt32 written = 0;
+  while (written != size)
   {
-    _buffer = data;
-    _bufferSize = size;
-    _allBytesAreWritenEvent.Reset();
-    _thereAreBytesToReadEvent.Set();
-
-    HANDLE events[2];
-    events[0] = _allBytesAreWritenEvent;
-    events[1] = _readStreamIsClosedEvent;
-    DWORD waitResult = ::WaitForMultipleObjects(2, events, FALSE, INFINITE);
-    if (waitResult != WAIT_OBJECT_0 + 0)
+    UInt32 rem = size - written;
+    _synchro->Enter();
+    if (_numBytes == _bufSize && !_readIsClosed)
+    {
+      _writerNeed = MyMin(rem, _wakeSize);
+      do
+      {
+        _writerWaits = true;
+        _synchro->WaitCond();
+      }
+      while (_bufSize - _numBytes < _writerNeed && !_readIsClosed);
+      _writerWaits = false;
+    }
+    if (_readIsClosed)
     {
-      // ReadingWasClosed = true;
+      _synchro->Leave();
+      if (processedSize != NULL)
+        *processedSize = written;
       return S_FALSE;
     }
-    // if(!_allBytesAreWritenEvent.Lock())
-    //   return E_FAIL;
+    UInt32 cur = MyMin(_bufSize - _numBytes, rem);
+    UInt32 pos = _readPos + _numBytes;
+    if (pos >= _bufSize)
+      pos -= _bufSize;
+    _synchro->Leave();
+
+    // the reader doesn't access free block
+    UInt32 part = _bufSize - pos;
+    if (part >= cur)
+      memcpy(_buf + pos, src, cur);
+    else
+    {
+      memcpy(_buf + pos, src, part);
+      memcpy(_buf, src + part, cur - part);
+    }
+    src += cur;
+    written += cur;
+
+    _synchro->Enter();
+    _numBytes += cur;
+    if (_readerWaits && _numBytes >= _readerNeed)
+    {
+      _readerWaits = false;
+      _synchro->LeaveAndSignal();
+    }
+    else
+      _synchro->Leave();
   }
   if (processedSize != NULL)
     *processedSize = size;
@@ -147,6 +306,7 @@ HRESULT CStreamBinder::Write(const void *data, UInt32 size, UInt32 *processedSiz
 
 void CStreamBinder::CloseWrite()
 {
-  // _bufferSize must be = 0
-  _thereAreBytesToReadEvent.Set();
+  _synchro->Enter();
+  _writeIsClosed = true;
+  _synchro->LeaveAndSignal();
 }
@@ -6,24 +6,51 @@
 #include "../IStream.h"
 #include "../../Windows/Synchronization.h"
 
+const UInt32 kStreamBinderBufferSizeDefault = (1 << 22);
+const UInt32 kStreamBinderBufferSizeMax = (1 << 28);
+
+/*
+  CStreamBinder connects the output stream of one coder thread to the input
+  stream of another thread.
+  If bufferSize != 0, the data is passed through ring buffer of that size:
+  Write() returns as soon as the data is copied to the buffer, and each side
+  wakes other side only when other side waits and (bufferSize / 4) bytes
+  (or the requested size) are ready.
+  If bufferSize == 0, Write() waits until Read() has consumed all data
+  directly from the writer's buffer.
+*/
+
 class CStreamBinder
 {
-  NWindows::NSynchronization::CManualResetEventWFMO _allBytesAreWritenEvent;
-  NWindows::NSynchronization::CManualResetEvent _thereAreBytesToReadEvent;
-  NWindows::NSynchronization::CManualResetEventWFMO _readStreamIsClosedEvent;
-  NWindows::NSynchronization::CSynchro * _synchroFor_allBytesAreWritenEvent_and_readStreamIsClosedEvent;
-  UInt32 _bufferSize;
-  const void *_buffer;
+  NWindows::NSynchronization::CSynchro *_synchro;
+
+  Byte *_buf;
+  UInt32 _bufSize;
+  UInt32 _wakeSize;
+  UInt32 _readPos;
+  UInt32 _numBytes;
+
+  // (_bufSize == 0) mode
+  const Byte *_directData;
+  UInt32 _directSize;
+
+  UInt32 _readerNeed;
+  UInt32 _writerNeed;
+  bool _readerWaits;
+  bool _writerWaits;
+  bool _readIsClosed;
+  bool _writeIsClosed;
+
+  void FreeBuffer();
+  void ResetState();
+  HRESULT ReadDirect(void *data, UInt32 size, UInt32 *processedSize);
+  HRESULT WriteDirect(const void *data, UInt32 size, UInt32 *processedSize);
 public:
-  // bool ReadingWasClosed;
   UInt64 ProcessedSize;
-  CStreamBinder() { _synchroFor_allBytesAreWritenEvent_and_readStreamIsClosedEvent = 0; }
-  ~CStreamBinder() {
-	if (_synchroFor_allBytesAreWritenEvent_and_readStreamIsClosedEvent)
-		delete _synchroFor_allBytesAreWritenEvent_and_readStreamIsClosedEvent;
-	_synchroFor_allBytesAreWritenEvent_and_readStreamIsClosedEvent = 0;
-  }
-  HRes CreateEvents();
+
+  CStreamBinder(): _synchro(0), _buf(0), _bufSize(0) {}
+  ~CStreamBinder();
+  HRes CreateEvents(UInt32 bufferSize = kStreamBinderBufferSizeDefault);
 
   void CreateStreams(ISequentialInStream **inStream,
       ISequentialOutStream **outStream);
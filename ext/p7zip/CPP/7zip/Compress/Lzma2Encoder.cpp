@@ -49,6 +49,8 @@ HRESULT SetLzma2Prop(PROPID propID, const PROPVARIANT &prop, CLzma2EncProps &lzm
       if (prop.vt != VT_UI4) return E_INVALIDARG; lzma2Props.blockSize = prop.ulVal; break;
     case NCoderPropID::kNumThreads:
       if (prop.vt != VT_UI4) return E_INVALIDARG; lzma2Props.numTotalThreads = (int)(prop.ulVal); break;
+    case NCoderPropID::kNumBlockThreads:
+      if (prop.vt != VT_UI4) return E_INVALIDARG; lzma2Props.numBlockThreads = (int)(prop.ulVal); break;
     default:
       RINOK(NLzma::SetLzmaProp(propID, prop, lzma2Props.lzmaProps));
   }
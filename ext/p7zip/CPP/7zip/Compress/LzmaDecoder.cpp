@@ -27,6 +27,8 @@ namespace NLzma {
 CDecoder::CDecoder(): _inBuf(0), _propsWereSet(false), _outSizeDefined(false),
   _inBufSize(1 << 20),
   _outBufSize(1 << 22),
+  _checkpointCallback(NULL),
+  _checkpointInterval(0),
   FinishStream(false)
 {
   _inSizeProcessed = 0;
@@ -74,6 +76,7 @@ void CDecoder::SetOutStreamSizeResume(const UInt64 *outSize)
     _outSize = *outSize;
   _outSizeProcessed = 0;
   _wrPos = 0;
+  _nextCheckpoint = _checkpointInterval;
   LzmaDec_Init(&_state);
 }
 
@@ -85,6 +88,43 @@ STDMETHODIMP CDecoder::SetOutStreamSize(const UInt64 *outSize)
   return S_OK;
 }
 
+void CDecoder::SetCheckpoints(UInt64 interval, ICheckpointCallback *callback)
+{
+  _checkpointInterval = (callback ? interval : 0);
+  _checkpointCallback = callback;
+}
+
+HRESULT CDecoder::SaveCheckpoint()
+{
+  _nextCheckpoint += _checkpointInterval;
+  // The dictionary is filled from its start up to the first wrap.
+  size_t dicSize = (_outSizeProcessed < _state.dicBufSize) ? (size_t)_outSizeProcessed : _state.dicBufSize;
+  size_t probsSize = _state.numProbs * sizeof(CLzmaProb);
+  if (!_checkpointCallback->NeedCheckpoint(_outSizeProcessed, (UInt64)dicSize + probsSize))
+    return S_OK;
+  CCheckpoint *cp = new CCheckpoint;
+  try
+  {
+    cp->InSize = _inSizeProcessed;
+    cp->OutSize = _outSizeProcessed;
+    cp->State = _state;
+    cp->State.probs = NULL;
+    cp->State.dic = NULL;
+    cp->State.buf = NULL;
+    cp->Probs.SetCapacity(probsSize);
+    memcpy(cp->Probs, _state.probs, probsSize);
+    cp->Dic.SetCapacity(dicSize);
+    memcpy(cp->Dic, _state.dic, dicSize);
+  }
+  catch(...)
+  {
+    // Decoding goes on without the checkpoint, if its copy cannot be allocated.
+    delete cp;
+    return S_OK;
+  }
+  return _checkpointCallback->AddCheckpoint(cp);
+}
+
 HRESULT CDecoder::CodeSpec(ISequentialInStream *inStream, ISequentialOutStream *outStream, ICompressProgressInfo *progress)
 {
   if (_inBuf == 0 || !_propsWereSet)
@@ -115,6 +155,11 @@ HRESULT CDecoder::CodeSpec(ISequentialInStream *inStream, ISequentialOutStream *
           finishMode = LZMA_FINISH_END;
       }
     }
+    if (_checkpointInterval != 0 && _nextCheckpoint - _outSizeProcessed < curSize)
+    {
+      curSize = (SizeT)(_nextCheckpoint - _outSizeProcessed);
+      finishMode = LZMA_FINISH_ANY;
+    }
 
     SizeT inSizeProcessed = _inSize - _inPos;
     ELzmaStatus status;
@@ -128,6 +173,12 @@ HRESULT CDecoder::CodeSpec(ISequentialInStream *inStream, ISequentialOutStream *
     bool finished = (inSizeProcessed == 0 && outSizeProcessed == 0);
     bool stopDecoding = (_outSizeDefined && _outSizeProcessed >= _outSize);
 
+    if (res == 0 && !finished && !stopDecoding &&
+        _checkpointInterval != 0 && _outSizeProcessed == _nextCheckpoint)
+    {
+      RINOK(SaveCheckpoint());
+    }
+
     if (res != 0 || _state.dicPos == next || finished || stopDecoding)
     {
       HRESULT res2 = WriteStream(outStream, _state.dic + _wrPos, _state.dicPos - _wrPos);
@@ -156,6 +207,35 @@ HRESULT CDecoder::CodeSpec(ISequentialInStream *inStream, ISequentialOutStream *
   }
 }
 
+HRESULT CDecoder::CodeFromCheckpoint(ISequentialInStream *inStream, ISequentialOutStream *outStream,
+    const CCheckpoint &cp, const UInt64 *outSize, ICompressProgressInfo *progress)
+{
+  if (_inBuf == 0 || !_propsWereSet)
+    return E_INVALIDARG;
+  if (cp.State.dicBufSize != _state.dicBufSize || cp.State.numProbs != _state.numProbs ||
+      cp.Probs.GetCapacity() != _state.numProbs * sizeof(CLzmaProb) ||
+      cp.Dic.GetCapacity() > _state.dicBufSize)
+    return E_INVALIDARG;
+  SetOutStreamSize(outSize);
+
+  CLzmaProb *probs = _state.probs;
+  Byte *dic = _state.dic;
+  _state = cp.State;
+  _state.probs = probs;
+  _state.dic = dic;
+  memcpy(_state.probs, cp.Probs, cp.Probs.GetCapacity());
+  memcpy(_state.dic, cp.Dic, cp.Dic.GetCapacity());
+
+  if (_state.dicPos == _state.dicBufSize)
+    _state.dicPos = 0;
+  _inSizeProcessed = cp.InSize;
+  _outSizeProcessed = cp.OutSize;
+  _wrPos = _state.dicPos;
+  if (_checkpointInterval != 0)
+    _nextCheckpoint = (cp.OutSize / _checkpointInterval + 1) * _checkpointInterval;
+  return CodeSpec(inStream, outStream, progress);
+}
+
 STDMETHODIMP CDecoder::Code(ISequentialInStream *inStream, ISequentialOutStream *outStream,
     const UInt64 * /* inSize */, const UInt64 *outSize, ICompressProgressInfo *progress)
 {
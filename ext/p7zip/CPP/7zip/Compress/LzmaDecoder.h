@@ -5,12 +5,34 @@
 
 #include "../../../C/LzmaDec.h"
 
+#include "../../Common/Buffer.h"
 #include "../../Common/MyCom.h"
 #include "../ICoder.h"
 
 namespace NCompress {
 namespace NLzma {
 
+// The state of the decoder at OutSize bytes of the unpacked stream.
+// Decoding can be resumed from it at InSize bytes of the packed stream.
+struct CCheckpoint
+{
+  UInt64 InSize;
+  UInt64 OutSize;
+  CLzmaDec State;
+  CByteBuffer Probs;
+  CByteBuffer Dic;
+
+  UInt64 GetMemSize() const { return Probs.GetCapacity() + Dic.GetCapacity(); }
+};
+
+struct ICheckpointCallback
+{
+  // memSize is the size of the copy of the state at outSize.
+  virtual bool NeedCheckpoint(UInt64 outSize, UInt64 memSize) = 0;
+  // The callback takes the ownership of the checkpoint.
+  virtual HRESULT AddCheckpoint(CCheckpoint *checkpoint) = 0;
+};
+
 class CDecoder:
   public ICompressCoder,
   public ICompressSetDecoderProperties2,
@@ -38,9 +60,14 @@ class CDecoder:
   UInt32 _outBufSize;
   SizeT _wrPos;
 
+  ICheckpointCallback *_checkpointCallback;
+  UInt64 _checkpointInterval;
+  UInt64 _nextCheckpoint;
+
   HRESULT CreateInputBuffer();
   HRESULT CodeSpec(ISequentialInStream *inStream, ISequentialOutStream *outStream, ICompressProgressInfo *progress);
   void SetOutStreamSizeResume(const UInt64 *outSize);
+  HRESULT SaveCheckpoint();
 
 public:
   MY_QUERYINTERFACE_BEGIN2(ICompressCoder)
@@ -73,6 +100,14 @@ public:
 
   #endif
 
+  // The checkpoints are taken at the multiples of interval of the unpacked
+  // stream, if the callback needs them. 0 disables them.
+  void SetCheckpoints(UInt64 interval, ICheckpointCallback *callback);
+  // inStream must be positioned at checkpoint.InSize of the packed stream.
+  // outSize is the size of the whole unpacked stream.
+  HRESULT CodeFromCheckpoint(ISequentialInStream *inStream, ISequentialOutStream *outStream,
+      const CCheckpoint &checkpoint, const UInt64 *outSize, ICompressProgressInfo *progress);
+
   bool FinishStream;
 
   CDecoder();
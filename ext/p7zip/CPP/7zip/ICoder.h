@@ -44,7 +44,8 @@ namespace NCoderPropID
     kNumPasses,
     kAlgorithm,
     kNumThreads,
-    kEndMarker
+    kEndMarker,
+    kNumBlockThreads
   };
 }
 
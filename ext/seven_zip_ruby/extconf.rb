@@ -130,6 +130,7 @@ def main
   base_flag = ""
 
   th_h = have_header("ruby/thread.h")
+  have_func("rb_fiber_scheduler_current", "ruby/fiber/scheduler.h")
 
   unless (try_compile(sample_for_rb_thread_call_without_gvl(th_h)))
     base_flag += " -DNO_RB_THREAD_CALL_WITHOUT_GVL"
@@ -19,6 +19,7 @@ CLSID_FORMAT(Lzh, 0x06);
 CLSID_FORMAT(7z,  0x07);
 CLSID_FORMAT(Cab, 0x08);
 CLSID_FORMAT(Lzma,0x0A);
+CLSID_FORMAT(Xz,  0x0C);
 
 CLSID_FORMAT(Wim, 0xE6);
 CLSID_FORMAT(Iso, 0xE7);
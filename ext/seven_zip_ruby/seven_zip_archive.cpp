@@ -1,13 +1,26 @@
 
 #include <array>
+#include <thread>
+#include <system_error>
+#include <algorithm>
 #include <vector>
 #include <cassert>
 #include <string>
+#include <tuple>
 
 #ifndef _WIN32
 #include <dlfcn.h>
 #endif
 
+#ifndef USE_WIN32_FILE_API
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
 #include "seven_zip_archive.h"
 #include "utils.h"
 #include "util_common.h"
@@ -42,11 +55,60 @@ static void *gSevenZipHandle;
 
 ////////////////////////////////////////////////////////////////
 ArchiveBase::RubyAction ArchiveBase::ACTION_END = [](){};
+ArchiveBase::RubyActionNode ArchiveBase::ACTION_QUEUE_CLOSED;
+
+// Both sides of the action queue spin for a while before they sleep,
+// because a Ruby callback such as stream.read usually returns within microseconds.
+// The spin count adapts to how often spinning was enough.
+static const UInt32 kMinActionSpin = 64;
+static const UInt32 kMaxActionSpin = 4096;
+
+static inline void SpinPause()
+{
+#if defined(_MSC_VER)
+    YieldProcessor();
+#elif defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static bool ActionSpinEnabled()
+{
+    // Spinning on a single processor only delays the other side.
+    static const bool enabled = (GetProcessorCount() > 1);
+    return enabled;
+}
+
+template<typename T>
+static bool SpinUntil(std::atomic<UInt32> *spin, T ready)
+{
+    if (!ActionSpinEnabled()){
+        return ready();
+    }
+
+    const UInt32 limit = spin->load(std::memory_order_relaxed);
+    for (UInt32 i=0; i<limit; i++){
+        if (ready()){
+            spin->store(std::min(limit * 2, kMaxActionSpin), std::memory_order_relaxed);
+            return true;
+        }
+        SpinPause();
+    }
+    spin->store(std::max(limit / 2, kMinActionSpin), std::memory_order_relaxed);
+    return ready();
+}
 
 ArchiveBase::ArchiveBase()
-     : m_action_tuple(nullptr),
-       m_event_loop_running(false),
-       m_self(Qnil)
+     : m_action_queue(&ACTION_QUEUE_CLOSED),
+       m_event_loop_parked(false),
+       m_event_loop_spin(kMinActionSpin),
+       m_action_spin(kMinActionSpin),
+       m_self(Qnil),
+       m_fiber_mode(false),
+       m_rb_wakeup_pipe(Qnil),
+       m_wakeup_fd(-1)
 {
     m_action_result.clear();
 }
@@ -65,65 +127,338 @@ VALUE ArchiveBase::self()
     return m_self;
 }
 
-void ArchiveBase::rubyEventLoop()
+// Returns the queued actions in FIFO order,
+// or nullptr if no action is queued or the queue is closed.
+ArchiveBase::RubyActionNode *ArchiveBase::takeRubyActions()
 {
-    m_action_mutex.lock();
-    while(m_event_loop_running){
-        m_action_mutex.unlock();
+    // Only the event loop takes actions, so head cannot be taken by others.
+    RubyActionNode *head = m_action_queue.load();
+    do{
+        if (!head || head == &ACTION_QUEUE_CLOSED){
+            return nullptr;
+        }
+    }while(!m_action_queue.compare_exchange_weak(head, nullptr));
+
+    RubyActionNode *list = nullptr;
+    while(head){
+        RubyActionNode *next = head->next;
+        head->next = list;
+        list = head;
+        head = next;
+    }
+    return list;
+}
 
-        RubyActionTuple end_tuple = std::make_pair(&ACTION_END, false);
-        RubyActionTuple * volatile action_tuple = nullptr;
+// Called without GVL.
+ArchiveBase::RubyActionNode *ArchiveBase::waitRubyActions(bool *cancelled)
+{
+    SpinUntil(&m_event_loop_spin, [&](){
+        return m_action_queue.load() != nullptr;
+    });
 
-        bool success = runNativeFuncProtect([&](){
-            MutexLocker locker(&m_action_mutex);
-            while(!m_action_tuple){
-                m_action_cond_var.wait(&m_action_mutex);
-            }
-            action_tuple = m_action_tuple;
-        }, [&](){
-            MutexLocker locker(&m_action_mutex);
-            if (m_event_loop_running){
-                m_action_tuple = &end_tuple;
-                m_action_cond_var.broadcast();
-            }
-        });
-        if (!success){
-            MutexLocker locker(&m_action_mutex);
-            action_tuple = &end_tuple;
+    if (!m_action_queue.load()){
+        MutexLocker locker(&m_action_mutex);
+        m_event_loop_parked.store(true);
+        while(!m_action_queue.load() && !*cancelled){
+            m_action_cond_var.wait(&m_action_mutex);
+        }
+        m_event_loop_parked.store(false);
+        if (*cancelled){
+            return nullptr;
         }
+    }
+
+    return takeRubyActions();
+}
+
+// Wakes the event loop sleeping in waitRubyActions or runNativeFuncInFiber.
+void ArchiveBase::wakeEventLoop()
+{
+#ifdef USE_FIBER_EVENT_LOOP
+    if (m_wakeup_fd >= 0){
+        // The pipe is non-blocking. If it is full, the fiber is already readable.
+        const char c = 0;
+        ssize_t ret;
+        do{
+            ret = ::write(m_wakeup_fd, &c, 1);
+        }while(ret < 0 && errno == EINTR);
+        return;
+    }
+#endif
+
+    MutexLocker locker(&m_action_mutex);
+    m_action_cond_var.signal();
+}
+
+// Returns the actions queued after the event loop stopped.
+ArchiveBase::RubyActionNode *ArchiveBase::closeActionQueue()
+{
+    RubyActionNode *rest = m_action_queue.exchange(&ACTION_QUEUE_CLOSED);
+    return (rest == &ACTION_QUEUE_CLOSED ? nullptr : rest);
+}
+
+void ArchiveBase::completeRubyAction(RubyActionNode *node, bool success)
+{
+    node->success = success;
+    // node must not be touched after this, because the queuing thread may return.
+    if (node->state.exchange(ACTION_STATE_DONE) == ACTION_STATE_PARKED){
+        MutexLocker locker(&m_action_mutex);
+        m_action_done_cond_var.broadcast();
+    }
+}
 
-        RubyAction *action = action_tuple->first;
-        bool event_loop_running = m_event_loop_running;
-        if (action == &ACTION_END){
-            action_tuple->second = true;
-            event_loop_running = false;
+// Called with GVL. Runs the actions taken at once, and returns false
+// when the event loop should stop, that is, after ACTION_END or an error.
+bool ArchiveBase::runRubyActionList(RubyActionNode *list, bool running)
+{
+    RubyActionNode *rest = nullptr;
+    for (RubyActionNode *node = list; node; ){
+        RubyActionNode *next = node->next;
+        bool success = false;
+        if (!running){
+            success = false;
+        }else if (node->action == &ACTION_END){
+            success = true;
+            running = false;
         }else if (m_action_result.isError()){
-            action_tuple->second = false;
+            success = false;
         }else{
             int status = 0;
-            rb_protect(runProtectedRubyAction, reinterpret_cast<VALUE>(action), &status);
-            action_tuple->second = (status == 0);
+            rb_protect(runProtectedRubyAction, reinterpret_cast<VALUE>(node->action), &status);
+            success = (status == 0);
 
             if (status && !m_action_result.isError()){
                 m_action_result.status = status;
                 m_action_result.exception = rb_gv_get("$!");
-                event_loop_running = false;
+                running = false;
+            }
+        }
+
+        if (!running && !rest){
+            // Close the queue before completing the action, so that the next
+            // operation can start a new event loop as soon as this one returns.
+            rest = closeActionQueue();
+        }
+        completeRubyAction(node, success);
+        node = next;
+    }
+
+    while(rest){
+        RubyActionNode *next = rest->next;
+        completeRubyAction(rest, false);
+        rest = next;
+    }
+    return running;
+}
+
+// Returns false if the thread was interrupted while waiting for an action.
+// Actions queued by several native threads are run in one wakeup.
+bool ArchiveBase::rubyEventLoop()
+{
+    bool interrupted = false;
+    bool running = true;
+    while(running){
+        RubyActionNode *list = nullptr;
+        bool cancelled = false;
+
+        bool success = runNativeFuncProtect([&](){
+            list = waitRubyActions(&cancelled);
+        }, [&](){
+            MutexLocker locker(&m_action_mutex);
+            cancelled = true;
+            m_action_cond_var.broadcast();
+        });
+        if (!success || cancelled){
+            interrupted = true;
+            running = false;
+        }
+        if (!list){
+            break;
+        }
+
+        running = runRubyActionList(list, running);
+    }
+
+    for (RubyActionNode *rest = closeActionQueue(); rest; ){
+        RubyActionNode *next = rest->next;
+        completeRubyAction(rest, false);
+        rest = next;
+    }
+    return !interrupted;
+}
+
+#ifdef USE_FIBER_EVENT_LOOP
+static VALUE WaitWakeupPipe(VALUE io)
+{
+    return rb_io_wait(io, RB_INT2NUM(RUBY_IO_READABLE), Qnil);
+}
+
+// Native threads running the functions of the operations in fiber mode. They are shared
+// by all archives and bounded by the number of processors, so that many fibers are
+// multiplexed on a few threads. The other functions wait in the queue.
+struct FiberWorkerPool
+{
+    struct Job
+    {
+        Job(const std::function<void ()> &f, const std::function<void ()> &d)
+             : func(f), done(d), started(false), finished(false)
+        {
+        }
+
+        const std::function<void ()> &func;
+        // Called with the mutex after func returns. The job is not touched after that.
+        std::function<void ()> done;
+        bool started;
+        bool finished;
+    };
+
+    Mutex mutex;
+    ConditionVariable cond_var;
+    std::list<Job*> queue;
+    size_t thread_num;
+    size_t idle_thread_num;
+    size_t max_thread_num;
+
+    FiberWorkerPool()
+         : thread_num(0), idle_thread_num(0), max_thread_num(std::max<UInt32>(GetProcessorCount(), 1))
+    {
+    }
+};
+
+static FiberWorkerPool *gFiberWorkerPool = nullptr;
+static pid_t gFiberWorkerPoolPid = 0;
+
+// Called with GVL.
+static FiberWorkerPool *GetFiberWorkerPool()
+{
+    // A forked process inherits neither the threads nor usable locks,
+    // so the pool of the parent process is abandoned.
+    if (gFiberWorkerPool && gFiberWorkerPoolPid != getpid()){
+        gFiberWorkerPool = nullptr;
+    }
+    gFiberWorkerPoolPid = getpid();
+    if (!gFiberWorkerPool){
+        gFiberWorkerPool = new FiberWorkerPool();
+    }
+    return gFiberWorkerPool;
+}
+
+static void RunFiberWorker(FiberWorkerPool *pool)
+{
+    MutexLocker locker(&pool->mutex);
+    while(true){
+        pool->idle_thread_num++;
+        while(pool->queue.empty()){
+            pool->cond_var.wait(&pool->mutex);
+        }
+        pool->idle_thread_num--;
+        FiberWorkerPool::Job *job = pool->queue.front();
+        pool->queue.pop_front();
+        job->started = true;
+
+        pool->mutex.unlock();
+        job->func();
+        pool->mutex.lock();
+
+        job->finished = true;
+        job->done();
+    }
+}
+
+static void SubmitFiberWorkerJob(FiberWorkerPool *pool, FiberWorkerPool::Job *job)
+{
+    MutexLocker locker(&pool->mutex);
+    pool->queue.push_back(job);
+    pool->cond_var.signal();
+    if (pool->idle_thread_num >= pool->queue.size() || pool->thread_num >= pool->max_thread_num){
+        return;
+    }
+
+    try{
+        std::thread(RunFiberWorker, pool).detach();
+        pool->thread_num++;
+    }catch(const std::system_error &){
+        // The job waits for a running thread if any.
+        if (pool->thread_num == 0){
+            pool->queue.remove(job);
+            throw RubyCppUtil::RubyException("Cannot create a thread");
+        }
+    }
+}
+
+// Drops the job if no thread has taken it yet.
+static bool CancelFiberWorkerJob(FiberWorkerPool *pool, FiberWorkerPool::Job *job)
+{
+    MutexLocker locker(&pool->mutex);
+    if (job->started){
+        return false;
+    }
+    pool->queue.remove(job);
+    job->finished = true;
+    return true;
+}
+
+static bool IsFiberWorkerJobFinished(FiberWorkerPool *pool, FiberWorkerPool::Job *job)
+{
+    MutexLocker locker(&pool->mutex);
+    return job->finished;
+}
+
+// Runs func on a thread of the fiber worker pool. Meanwhile the calling fiber runs
+// the event loop, and waits for actions through the Fiber scheduler, so that other fibers can run.
+void ArchiveBase::runNativeFuncInFiber(const std::function<void ()> &func)
+{
+    FiberWorkerPool *pool = GetFiberWorkerPool();
+    FiberWorkerPool::Job job(func, [this](){ wakeEventLoop(); });
+    SubmitFiberWorkerJob(pool, &job);
+
+    VALUE reader = rb_ary_entry(m_rb_wakeup_pipe, 0);
+    const int read_fd = NUM2INT(rb_funcall(reader, INTERN("fileno"), 0));
+    VALUE exception = Qnil;
+    int state = 0;
+    bool running = true;
+    while(true){
+        RubyActionNode *list = takeRubyActions();
+        if (list){
+            running = runRubyActionList(list, running);
+            continue;
+        }
+        if (IsFiberWorkerJobFinished(pool, &job)){
+            break;
+        }
+
+        m_event_loop_parked.store(true);
+        RubyActionNode *head = m_action_queue.load();
+        if ((!head || head == &ACTION_QUEUE_CLOSED) && !IsFiberWorkerJobFinished(pool, &job)){
+            int wait_state = 0;
+            rb_protect(WaitWakeupPipe, reader, &wait_state);
+            if (wait_state && !state){
+                // The fiber is interrupted by a raise, throw or kill. Drop the native function
+                // if it has not started, otherwise stop it and wait for it.
+                state = wait_state;
+                exception = rb_errinfo();
+                if (!CancelFiberWorkerJob(pool, &job)){
+                    cancelAction();
+                }
             }
         }
+        m_event_loop_parked.store(false);
+
+        char buf[64];
+        while(::read(read_fd, buf, sizeof(buf)) > 0){
+        }
+    }
 
-        m_action_mutex.lock();
-        m_event_loop_running = event_loop_running;
-        // if (m_action_tuple && m_action_tuple != &end_tuple && m_action_tuple != action_tuple){
-        //     // Someone overrode m_action_tuple.
-        //     // It might be killEventLoopThread. Otherwise, it might a bug.
-        //     // Therefore, terminate event loop for safety.
-        //     m_event_loop_running = false;
-        // }
-        m_action_tuple = nullptr;
-        m_action_cond_var.broadcast();
+    if (state){
+        // An exception is raised again. The other jumps are resumed by rb_jump_tag
+        // after the C++ frames are unwound.
+        if (RB_TYPE_P(exception, T_OBJECT) && RTEST(rb_obj_is_kind_of(exception, rb_eException))){
+            throw RubyCppUtil::RubyException(exception);
+        }
+        throw RubyCppUtil::RubyException(Qnil, state);
     }
-    m_action_mutex.unlock();
 }
+#endif
 
 VALUE ArchiveBase::runProtectedRubyAction(VALUE p)
 {
@@ -132,23 +467,172 @@ VALUE ArchiveBase::runProtectedRubyAction(VALUE p)
     return Qnil;
 }
 
+// Event loop threads are shared by all archives. A thread runs the event loop
+// of one archive at a time, and waits without GVL for the next one while idle.
+struct EventLoopThreadPool
+{
+    static const size_t kMaxIdleThreadNum = 4;
+
+    Mutex mutex;
+    ConditionVariable cond_var;
+    std::list<ArchiveBase*> queue;
+    size_t idle_thread_num;
+
+    EventLoopThreadPool()
+         : idle_thread_num(0)
+    {
+    }
+};
+
+static EventLoopThreadPool *gEventLoopThreadPool = nullptr;
+#ifndef _WIN32
+static pid_t gEventLoopThreadPoolPid = 0;
+#endif
+
+// Called with GVL.
+static EventLoopThreadPool *GetEventLoopThreadPool()
+{
+#ifndef _WIN32
+    // A forked process inherits neither the threads nor usable locks,
+    // so the pool of the parent process is abandoned.
+    if (gEventLoopThreadPool && gEventLoopThreadPoolPid != getpid()){
+        gEventLoopThreadPool = nullptr;
+    }
+    gEventLoopThreadPoolPid = getpid();
+#endif
+    if (!gEventLoopThreadPool){
+        gEventLoopThreadPool = new EventLoopThreadPool();
+    }
+    return gEventLoopThreadPool;
+}
+
+static VALUE CreateEventLoopThread(VALUE pool)
+{
+    return RubyCppUtil::rb_thread_create(ArchiveBase::staticRubyEventLoop, reinterpret_cast<void*>(pool));
+}
+
+// Called with GVL when a thread leaves the pool.
+// Queued archives must not be left without a thread.
+static void LeaveEventLoopThreadPool(EventLoopThreadPool *pool)
+{
+    bool create = false;
+    {
+        MutexLocker locker(&pool->mutex);
+        create = (pool->queue.size() > pool->idle_thread_num);
+    }
+    if (create){
+        int state = 0;
+        rb_protect(CreateEventLoopThread, reinterpret_cast<VALUE>(pool), &state);
+    }
+}
+
 VALUE ArchiveBase::staticRubyEventLoop(void *p)
 {
-    ArchiveBase *self = reinterpret_cast<ArchiveBase*>(p);
-    VALUE gc_guard = self->self();
-    RB_GC_GUARD(gc_guard);
-    self->rubyEventLoop();
-    return Qnil;
+    EventLoopThreadPool *pool = reinterpret_cast<EventLoopThreadPool*>(p);
+
+    while(true){
+        ArchiveBase *self = nullptr;
+        bool interrupted = false;
+
+        std::function<void ()> wait = [&](){
+            MutexLocker locker(&pool->mutex);
+            pool->idle_thread_num++;
+            while(pool->queue.empty() && !interrupted){
+                pool->cond_var.wait(&pool->mutex);
+            }
+            pool->idle_thread_num--;
+            if (!interrupted){
+                self = pool->queue.front();
+                pool->queue.pop_front();
+            }
+        };
+        std::function<void ()> cancel = [&](){
+            MutexLocker locker(&pool->mutex);
+            interrupted = true;
+            pool->cond_var.broadcast();
+        };
+        std::function<void ()> protected_func = [&](){
+            rb_thread_call_without_gvl(rubyCppUtilFunction1, reinterpret_cast<void*>(&wait),
+                                       rubyCppUtilFunction2, reinterpret_cast<void*>(&cancel));
+        };
+
+        int state = 0;
+        rb_protect(rubyCppUtilFunctionForProtect, reinterpret_cast<VALUE>(&protected_func), &state);
+        if (state){
+            if (self){
+                MutexLocker locker(&pool->mutex);
+                pool->queue.push_front(self);
+            }
+            LeaveEventLoopThreadPool(pool);
+            return Qnil;
+        }
+
+        VALUE gc_guard = self->self();
+        RB_GC_GUARD(gc_guard);
+        if (!self->rubyEventLoop()){
+            LeaveEventLoopThreadPool(pool);
+            return Qnil;
+        }
+
+        {
+            MutexLocker locker(&pool->mutex);
+            if (pool->queue.empty() && pool->idle_thread_num >= EventLoopThreadPool::kMaxIdleThreadNum){
+                return Qnil;
+            }
+        }
+    }
 }
 
-void ArchiveBase::startEventLoopThread()
+void ArchiveBase::startEventLoopThread(bool allow_fiber_mode)
 {
-    MutexLocker locker(&m_action_mutex);
-    if (m_event_loop_running){
+#ifdef USE_FIBER_EVENT_LOOP
+    const bool fiber_mode = allow_fiber_mode && !NIL_P(rb_fiber_scheduler_current());
+    if (fiber_mode && NIL_P(m_rb_wakeup_pipe)){
+        m_rb_wakeup_pipe = rb_funcall(rb_cIO, INTERN("pipe"), 0);
+        for (int i = 0; i < 2; i++){
+            const int fd = NUM2INT(rb_funcall(rb_ary_entry(m_rb_wakeup_pipe, i), INTERN("fileno"), 0));
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+#endif
+
+    RubyActionNode *closed = &ACTION_QUEUE_CLOSED;
+    if (!m_action_queue.compare_exchange_strong(closed, nullptr)){
+        return;  // Already running.
+    }
+
+#ifdef USE_FIBER_EVENT_LOOP
+    if (fiber_mode){
+        VALUE writer = rb_ary_entry(m_rb_wakeup_pipe, 1);
+        m_wakeup_fd = NUM2INT(rb_funcall(writer, INTERN("fileno"), 0));
+        m_fiber_mode = true;
         return;
     }
-    m_event_loop_running = true;
-    RubyCppUtil::rb_thread_create(staticRubyEventLoop, this);
+#endif
+
+    EventLoopThreadPool *pool = GetEventLoopThreadPool();
+    bool create = false;
+    {
+        MutexLocker locker(&pool->mutex);
+        pool->queue.push_back(this);
+        if (pool->idle_thread_num >= pool->queue.size()){
+            pool->cond_var.broadcast();
+        }else{
+            create = true;
+        }
+    }
+    if (create){
+        int state = 0;
+        rb_protect(CreateEventLoopThread, reinterpret_cast<VALUE>(pool), &state);
+        if (state){
+            {
+                MutexLocker locker(&pool->mutex);
+                pool->queue.remove(this);
+            }
+            closeActionQueue();
+            rb_jump_tag(state);
+        }
+    }
 }
 
 void ArchiveBase::cancelAction()
@@ -159,41 +643,50 @@ void ArchiveBase::cancelAction()
 
 void ArchiveBase::killEventLoopThread()
 {
-    MutexLocker locker(&m_action_mutex);
-    if (m_event_loop_running){
-        static RubyActionTuple end_tuple;
-        end_tuple = std::make_pair(&ACTION_END, false);
-        m_action_tuple = &end_tuple;  // override.
-        m_action_cond_var.broadcast();
+    for (RubyActionNode *rest = closeActionQueue(); rest; ){
+        RubyActionNode *next = rest->next;
+        completeRubyAction(rest, false);
+        rest = next;
     }
+
+    MutexLocker locker(&m_action_mutex);
+    m_action_cond_var.broadcast();
 }
 
 bool ArchiveBase::runRubyActionImpl(RubyAction *action)
 {
-    MutexLocker locker(&m_action_mutex);
-
-    if (!action || !m_event_loop_running){
+    if (!action){
         return false;
     }
 
-    RubyActionTuple tuple = std::make_pair(action, false);
+    RubyActionNode node(action);
+    RubyActionNode *head = m_action_queue.load();
+    do{
+        if (head == &ACTION_QUEUE_CLOSED){
+            return false;
+        }
+        node.next = head;
+    }while(!m_action_queue.compare_exchange_weak(head, &node));
 
-    while(m_action_tuple && m_event_loop_running){
-        m_action_cond_var.wait(&m_action_mutex);
-    }
-    if (!m_event_loop_running){
-        return false;
+    // Either the event loop sees the node before it sleeps, or this sees it sleeping.
+    if (m_event_loop_parked.load()){
+        wakeEventLoop();
     }
 
-    m_action_tuple = &tuple;
-
-    m_action_cond_var.broadcast();
-
-    while(m_action_tuple == &tuple && m_event_loop_running){
-        m_action_cond_var.wait(&m_action_mutex);
+    bool done = SpinUntil(&m_action_spin, [&](){
+        return node.state.load() == ACTION_STATE_DONE;
+    });
+    if (!done){
+        int expected = ACTION_STATE_PENDING;
+        if (node.state.compare_exchange_strong(expected, ACTION_STATE_PARKED)){
+            MutexLocker locker(&m_action_mutex);
+            while(node.state.load() != ACTION_STATE_DONE){
+                m_action_done_cond_var.wait(&m_action_mutex);
+            }
+        }
     }
 
-    return (tuple.second && m_event_loop_running);
+    return node.success;
 }
 
 template<typename T>
@@ -211,6 +704,7 @@ void ArchiveBase::finishRubyAction()
 void ArchiveBase::mark()
 {
     rb_gc_mark(m_self);
+    rb_gc_mark(m_rb_wakeup_pipe);
     m_action_result.mark();
 }
 
@@ -221,6 +715,19 @@ void ArchiveBase::prepareAction()
 
 void ArchiveBase::terminateEventLoopThread()
 {
+#ifdef USE_FIBER_EVENT_LOOP
+    if (m_fiber_mode){
+        m_fiber_mode = false;
+        m_wakeup_fd = -1;
+        for (RubyActionNode *rest = closeActionQueue(); rest; ){
+            RubyActionNode *next = rest->next;
+            completeRubyAction(rest, false);
+            rest = next;
+        }
+        return;
+    }
+#endif
+
     runNativeFuncProtect([&](){
         finishRubyAction();
     }, [&](){
@@ -229,69 +736,571 @@ void ArchiveBase::terminateEventLoopThread()
 }
 
 ////////////////////////////////////////////////////////////////
-ArchiveReader::ArchiveReader(const GUID &format_guid)
-     : m_rb_callback_proc(Qnil), m_rb_out_stream(Qnil),
-       m_processing_index((UInt32)(Int32)-1), m_rb_in_stream(Qnil),
-       m_format_guid(format_guid),
-       m_password_specified(false),
-       m_state(STATE_INITIAL)
+static bool IsPathSeparator(char c)
 {
-    IInArchive *archive = 0;
-    HRESULT ret = CreateObject(&m_format_guid, &IID_IInArchive, reinterpret_cast<void **>(&archive));
-    if (ret != S_OK){
-        m_state = STATE_ERROR;
-        return;
-    }
-
-    m_in_archive.Attach(archive);
+#ifdef _WIN32
+    return c == '/' || c == '\\';
+#else
+    return c == '/';
+#endif
 }
 
-void ArchiveReader::setProcessingStream(VALUE stream, UInt32 index, Int32 askExtractMode)
+// Rewrites the path from start like Pathname#cleanpath, which EntryInfo#path is
+// normalized with, so that find() takes the same path as EntryInfo#path.
+static void CleanPath(std::string *str, size_t start)
 {
-    m_rb_out_stream = stream;
-    m_processing_index = index;
-    m_ask_extract_mode = askExtractMode;
-}
+    const std::string path = str->substr(start);
+    const bool absolute = (!path.empty() && IsPathSeparator(path[0]));
+
+    std::vector<std::string> names;
+    size_t pos = 0;
+    while (pos < path.size()){
+        size_t end = pos;
+        while (end < path.size() && !IsPathSeparator(path[end])){
+            end++;
+        }
+        const std::string name = path.substr(pos, end - pos);
+        pos = end + 1;
+        if (name.empty() || name == "."){
+            continue;
+        }
+        if (name == ".." && !names.empty() && names.back() != ".."){
+            names.pop_back();
+        }else if (name == ".." && absolute){
+            // ".." of the root is the root.
+        }else{
+            names.push_back(name);
+        }
+    }
 
-void ArchiveReader::getProcessingStream(VALUE *stream, UInt32 *index, Int32 *askExtractMode)
-{
-    if (stream){
-        *stream = m_rb_out_stream;
+    str->resize(start);
+    if (absolute){
+        str->push_back('/');
     }
-    if (index){
-        *index = m_processing_index;
+    for (size_t i=0; i<names.size(); i++){
+        if (i != 0){
+            str->push_back('/');
+        }
+        str->append(names[i]);
     }
-    if (askExtractMode){
-        *askExtractMode = m_ask_extract_mode;
+    if (names.empty() && !absolute){
+        str->push_back('.');
     }
 }
 
-void ArchiveReader::clearProcessingStream()
+void EntryInfoTable::clear()
 {
-    setProcessingStream(Qnil, (UInt32)(Int32)-1, 0);
+    m_filled = false;
+    std::string().swap(m_path_arena);
+    std::vector<size_t>().swap(m_path_offset);
+    std::vector<std::string>().swap(m_method_names);
+    std::vector<UInt32>().swap(m_method_index);
+    std::vector<UInt32>().swap(m_flags);
+    std::vector<UInt64>().swap(m_size);
+    std::vector<UInt64>().swap(m_pack_size);
+    std::vector<UInt64>().swap(m_ctime);
+    std::vector<UInt64>().swap(m_atime);
+    std::vector<UInt64>().swap(m_mtime);
+    std::vector<UInt32>().swap(m_attrib);
+    std::vector<UInt32>().swap(m_crc);
+    std::vector<UInt32>().swap(m_block);
+    std::vector<UInt32>().swap(m_path_index);
 }
 
-void ArchiveReader::setOperationResult(UInt32 index, Int32 result)
+static UInt64 ConvertFiletimeToUInt64(const FILETIME &filetime)
 {
-    if (index < m_test_result.size()){
-        m_test_result[index] = result;
-    }
+    return filetime.dwLowDateTime + ((UInt64)(filetime.dwHighDateTime) << 32);
 }
 
-VALUE ArchiveReader::open(VALUE in_stream, VALUE param)
+static VALUE ConvertUInt64ToTime(UInt64 value)
 {
-    checkStateToBeginOperation(STATE_INITIAL);
-    prepareAction();
-    EventLoopThreadExecuter te(this);
-
-    m_rb_in_stream = in_stream;
-    m_rb_callback_proc = Qnil;
-    m_rb_out_stream = Qnil;
-    m_rb_entry_info_list.clear();
+    FILETIME filetime;
+    filetime.dwLowDateTime = (UInt32)value;
+    filetime.dwHighDateTime = (UInt32)(value >> 32);
+    return ConvertFiletimeToTime(filetime);
+}
 
-    VALUE password;
+// Called without GVL.
+HRESULT EntryInfoTable::fill(IInArchive *archive, const std::string &default_path)
+{
+    struct PropIdVarTypePair
+    {
+        PROPID prop_id;
+        VARTYPE vt;
+    };
+    static const PropIdVarTypePair list[COL_NUM] = {
+        { kpidPath, VT_BSTR },
+        { kpidMethod, VT_BSTR },
+        { kpidIsDir, VT_BOOL },
+        { kpidEncrypted, VT_BOOL },
+        { kpidIsAnti, VT_BOOL },
+        { kpidSize, VT_UI8 },
+        { kpidPackSize, VT_UI8 },
+        { kpidCTime, VT_FILETIME },
+        { kpidATime, VT_FILETIME },
+        { kpidMTime, VT_FILETIME },
+        { kpidAttrib, VT_UI4 },
+        { kpidCRC, VT_UI4 }
+    };
+
+    clear();
+
+    UInt32 num;
+    HRESULT ret = archive->GetNumberOfItems(&num);
+    if (ret != S_OK){
+        return ret;
+    }
+
+    m_path_offset.reserve(num + 1);
+    m_method_index.resize(num, 0);
+    m_flags.resize(num, 0);
+    m_size.resize(num, 0);
+    m_pack_size.resize(num, 0);
+    m_ctime.resize(num, 0);
+    m_atime.resize(num, 0);
+    m_mtime.resize(num, 0);
+    m_attrib.resize(num, 0);
+    m_crc.resize(num, 0);
+    m_block.resize(num, (UInt32)kNoBlock);
+
+    // Methods are shared by many entries, so only their index is kept per entry.
+    std::map<std::string, UInt32> method_map;
+    std::string method;
+
+    m_path_offset.push_back(0);
+    for (UInt32 idx=0; idx<num; idx++){
+        UInt32 flags = 0;
+        for (unsigned int col=0; col<COL_NUM; col++){
+            NWindows::NCOM::CPropVariant prop;
+            if (archive->GetProperty(idx, list[col].prop_id, &prop) != S_OK || prop.vt != list[col].vt){
+                continue;
+            }
+            flags |= (1 << col);
+
+            switch(col){
+              case COL_PATH:
+                AppendBstrToUtf8(prop.bstrVal, &m_path_arena);
+                break;
+              case COL_METHOD:
+                {
+                    method.clear();
+                    AppendBstrToUtf8(prop.bstrVal, &method);
+                    auto it = method_map.find(method);
+                    if (it == method_map.end()){
+                        it = method_map.insert(std::make_pair(method, (UInt32)m_method_names.size())).first;
+                        m_method_names.push_back(method);
+                    }
+                    m_method_index[idx] = it->second;
+                }
+                break;
+              case COL_DIR:
+              case COL_ENCRYPTED:
+              case COL_ANTI:
+                if (prop.boolVal){
+                    flags |= (1 << (col + COL_NUM));
+                }
+                break;
+              case COL_SIZE:
+                m_size[idx] = prop.uhVal.QuadPart;
+                break;
+              case COL_PACK_SIZE:
+                m_pack_size[idx] = prop.uhVal.QuadPart;
+                break;
+              case COL_CTIME:
+                m_ctime[idx] = ConvertFiletimeToUInt64(prop.filetime);
+                break;
+              case COL_ATIME:
+                m_atime[idx] = ConvertFiletimeToUInt64(prop.filetime);
+                break;
+              case COL_MTIME:
+                m_mtime[idx] = ConvertFiletimeToUInt64(prop.filetime);
+                break;
+              case COL_ATTRIB:
+                m_attrib[idx] = prop.ulVal;
+                break;
+              case COL_CRC:
+                m_crc[idx] = prop.ulVal;
+                break;
+            }
+        }
+        {
+            // Cab reports the block as VT_I4, and -1 for the entries without data.
+            NWindows::NCOM::CPropVariant prop;
+            if (archive->GetProperty(idx, kpidBlock, &prop) == S_OK){
+                if (prop.vt == VT_UI4){
+                    m_block[idx] = prop.ulVal;
+                }else if (prop.vt == VT_I4 && prop.lVal >= 0){
+                    m_block[idx] = (UInt32)prop.lVal;
+                }
+            }
+        }
+        if (m_path_arena.size() == m_path_offset.back() && !default_path.empty()){
+            m_path_arena.append(default_path);
+            flags |= (1 << COL_PATH);
+        }
+        if (flags & (1 << COL_PATH)){
+            CleanPath(&m_path_arena, m_path_offset.back());
+        }
+        m_flags[idx] = flags;
+        m_path_offset.push_back(m_path_arena.size());
+    }
+
+    m_filled = true;
+    return S_OK;
+}
+
+VALUE EntryInfoTable::newEntryInfo(UInt32 index) const
+{
+    VALUE value_list[COL_NUM + 1];
+    VALUE *values = value_list + 1;
+
+    value_list[0] = ULONG2NUM(index);
+    std::fill(values, values + COL_NUM, Qnil);
+
+    if (defined(index, COL_PATH)){
+        values[COL_PATH] = rb_str_new(m_path_arena.data() + m_path_offset[index],
+                                      m_path_offset[index+1] - m_path_offset[index]);
+    }
+    if (defined(index, COL_METHOD)){
+        const std::string &method = m_method_names[m_method_index[index]];
+        values[COL_METHOD] = rb_str_new(method.data(), method.size());
+    }
+    for (int col = COL_DIR; col <= COL_ANTI; col++){
+        if (defined(index, (Column)col)){
+            values[col] = (flag(index, (Column)col) ? Qtrue : Qfalse);
+        }
+    }
+    if (defined(index, COL_SIZE)){
+        values[COL_SIZE] = ULL2NUM(m_size[index]);
+    }
+    if (defined(index, COL_PACK_SIZE)){
+        values[COL_PACK_SIZE] = ULL2NUM(m_pack_size[index]);
+    }
+    if (defined(index, COL_CTIME)){
+        values[COL_CTIME] = ConvertUInt64ToTime(m_ctime[index]);
+    }
+    if (defined(index, COL_ATIME)){
+        values[COL_ATIME] = ConvertUInt64ToTime(m_atime[index]);
+    }
+    if (defined(index, COL_MTIME)){
+        values[COL_MTIME] = ConvertUInt64ToTime(m_mtime[index]);
+    }
+    if (defined(index, COL_ATTRIB)){
+        values[COL_ATTRIB] = ULONG2NUM(m_attrib[index]);
+    }
+    if (defined(index, COL_CRC)){
+        values[COL_CRC] = ULONG2NUM(m_crc[index]);
+    }
+
+    VALUE entry_info = rb_const_get(gSevenZipModule, INTERN("EntryInfo"));
+    return rb_funcall2(entry_info, INTERN("new"), COL_NUM + 1, value_list);
+}
+
+size_t EntryInfoTable::hashPath(const char *path, size_t length)
+{
+    // FNV-1a
+    UInt64 hash = 14695981039346656037ULL;
+    for (size_t i=0; i<length; i++){
+        hash = (hash ^ (Byte)path[i]) * 1099511628211ULL;
+    }
+    return (size_t)(hash ^ (hash >> 32));
+}
+
+void EntryInfoTable::buildIndex()
+{
+    size_t slot_num = 16;
+    while (slot_num < (size_t)size() * 2){
+        slot_num <<= 1;
+    }
+    m_path_index.assign(slot_num, 0);
+
+    const size_t mask = slot_num - 1;
+    for (UInt32 i=0; i<size(); i++){
+        if (!defined(i, COL_PATH)){
+            continue;
+        }
+        const char *path = m_path_arena.data() + m_path_offset[i];
+        const size_t length = m_path_offset[i+1] - m_path_offset[i];
+        size_t pos = hashPath(path, length) & mask;
+        for (;; pos = (pos + 1) & mask){
+            const UInt32 slot = m_path_index[pos];
+            if (slot == 0){
+                m_path_index[pos] = i + 1;
+                break;
+            }
+            // Keep the first entry if the same path appears twice.
+            const UInt32 j = slot - 1;
+            if (m_path_offset[j+1] - m_path_offset[j] == length &&
+                std::memcmp(m_path_arena.data() + m_path_offset[j], path, length) == 0){
+                break;
+            }
+        }
+    }
+}
+
+bool EntryInfoTable::find(const char *path, size_t length, UInt32 *index)
+{
+    if (size() == 0){
+        return false;
+    }
+    if (m_path_index.empty()){
+        buildIndex();
+    }
+
+    const size_t mask = m_path_index.size() - 1;
+    for (size_t pos = hashPath(path, length) & mask;; pos = (pos + 1) & mask){
+        const UInt32 slot = m_path_index[pos];
+        if (slot == 0){
+            return false;
+        }
+        const UInt32 j = slot - 1;
+        if (m_path_offset[j+1] - m_path_offset[j] == length &&
+            std::memcmp(m_path_arena.data() + m_path_offset[j], path, length) == 0){
+            *index = j;
+            return true;
+        }
+    }
+}
+
+// Upper limit of the threads options of the writers.
+static const UInt32 kMaxWriterThreads = 256;
+
+// Integer, or String with a suffix "b", "k", "m" or "g" such as "64m".
+// nil means the default value, 0.
+static UInt64 ConvertValueToSize(VALUE value, const char *name, UInt64 max)
+{
+    if (NIL_P(value)){
+        return 0;
+    }
+
+    UInt64 size = 0;
+    bool valid = true;
+    VALUE str = rb_check_string_type(value);
+    if (NIL_P(str)){
+        value = rb_check_to_integer(value, "to_int");
+        if (NIL_P(value) || RTEST(rb_funcall(value, INTERN("negative?"), 0))){
+            valid = false;
+        }else{
+            size = NUM2ULL(value);
+        }
+    }else{
+        std::string s(RSTRING_PTR(str), RSTRING_LEN(str));
+        size_t pos = 0;
+        while (pos < s.size() && '0' <= s[pos] && s[pos] <= '9' && size < (1ULL << 40)){
+            size = size * 10 + (s[pos++] - '0');
+        }
+        int shift = -1;
+        if (pos == 0 || s.size() - pos > 1){
+            valid = false;
+        }else if (pos == s.size()){
+            shift = 0;
+        }else{
+            switch(s[pos]){
+              case 'b': case 'B': shift = 0; break;
+              case 'k': case 'K': shift = 10; break;
+              case 'm': case 'M': shift = 20; break;
+              case 'g': case 'G': shift = 30; break;
+              default: valid = false; break;
+            }
+        }
+        if (valid){
+            size <<= shift;
+        }
+    }
+
+    if (!valid){
+        std::string msg = std::string(name) + " should be Integer or String such as \"64m\"";
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, msg.c_str()));
+    }
+    if (size > max){
+        std::string msg = std::string(name) + " is too large";
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, msg.c_str()));
+    }
+    return size;
+}
+
+static UInt64 ConvertValueToCheckpointInterval(VALUE value, UInt64 min, UInt64 max)
+{
+    UInt64 interval = ConvertValueToSize(value, "checkpoint_interval", max);
+    if (interval != 0 && interval < min){
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, "checkpoint_interval is too small"));
+    }
+    return interval;
+}
+
+static VALUE ConvertSizeToValue(UInt64 size)
+{
+    return (size == 0 ? Qnil : ULL2NUM(size));
+}
+
+////////////////////////////////////////////////////////////////
+ArchiveReader::ArchiveReader(const GUID &format_guid)
+     : m_rb_callback_proc(Qnil), m_rb_out_stream(Qnil),
+       m_processing_index((UInt32)(Int32)-1), m_rb_in_stream(Qnil),
+       m_testing(false), m_test_stop_on_error(false), m_test_stopped(false),
+       m_memory_extract(false),
+       m_memory_extract_result(NArchive::NExtract::NOperationResult::kOK),
+       m_plan_folder_decodes(0), m_plan_saved_decodes(0),
+       m_format_guid(format_guid),
+#ifndef USE_WIN32_FILE_API
+       m_mapped_in_stream(0),
+#endif
+       m_rb_streaming_self(Qnil),
+       m_password_specified(false),
+       m_state(STATE_INITIAL)
+{
+    IInArchive *archive = 0;
+    HRESULT ret = CreateObject(&m_format_guid, &IID_IInArchive, reinterpret_cast<void **>(&archive));
+    if (ret != S_OK){
+        m_state = STATE_ERROR;
+        return;
+    }
+
+    m_in_archive.Attach(archive);
+}
+
+ArchiveReader::~ArchiveReader()
+{
+    // The reader is not freed while an entry is opened, except at exit.
+    // The decoder is cancelled and joined, so that it does not outlive the reader.
+    // Its writes to the pipe and its requests to Ruby fail from here.
+    if (m_entry_thread.joinable()){
+        m_entry_pipe->closeRead();
+        killEventLoopThread();
+        m_entry_thread.join();
+    }
+}
+
+void ArchiveReader::setProcessingStream(VALUE stream, UInt32 index, Int32 askExtractMode)
+{
+    m_rb_out_stream = stream;
+    m_processing_index = index;
+    m_ask_extract_mode = askExtractMode;
+}
+
+void ArchiveReader::getProcessingStream(VALUE *stream, UInt32 *index, Int32 *askExtractMode)
+{
+    if (stream){
+        *stream = m_rb_out_stream;
+    }
+    if (index){
+        *index = m_processing_index;
+    }
+    if (askExtractMode){
+        *askExtractMode = m_ask_extract_mode;
+    }
+}
+
+void ArchiveReader::clearProcessingStream()
+{
+    setProcessingStream(Qnil, (UInt32)(Int32)-1, 0);
+}
+
+bool ArchiveReader::setOperationResult(UInt32 index, Int32 result)
+{
+    if (index < m_test_result.size()){
+        m_test_result[index] = result;
+    }
+    if (m_test_stop_on_error && result != NArchive::NExtract::NOperationResult::kOK){
+        m_test_stopped = true;
+        return false;
+    }
+    return true;
+}
+
+void ArchiveReader::setFolderStat(UInt32 folder_index, UInt64 pack_size, UInt64 unpack_size, UInt64 time)
+{
+    if (!m_testing){
+        return;
+    }
+    FolderStat stat = { folder_index, pack_size, unpack_size, time };
+    m_folder_stats.push_back(stat);
+}
+
+VALUE ArchiveReader::open(VALUE in_stream, VALUE param)
+{
+    checkStateToBeginOperation(STATE_INITIAL);
+
+    UInt32 read_ahead_size = InStream::kDefaultReadAheadSize;
+    VALUE size = rb_hash_aref(param, ID2SYM(INTERN("read_ahead_size")));
+    if (!NIL_P(size)){
+        read_ahead_size = (UInt32)ConvertValueToSize(size, "read_ahead_size", InStream::kMaxReadAheadSize);
+    }
+    UInt64 folder_cache_size = ConvertValueToSize(rb_hash_aref(param, ID2SYM(INTERN("folder_cache_size"))),
+                                                  "folder_cache_size", kMaxFolderCacheSize);
+    UInt64 checkpoint_interval = ConvertValueToCheckpointInterval(rb_hash_aref(param, ID2SYM(INTERN("checkpoint_interval"))),
+                                                                  kMinCheckpointInterval, kMaxCheckpointInterval);
+    UInt64 checkpoint_memory = ConvertValueToSize(rb_hash_aref(param, ID2SYM(INTERN("checkpoint_memory"))),
+                                                  "checkpoint_memory", kMaxCheckpointMemory);
+
+    prepareAction();
+    EventLoopThreadExecuter te(this);
+
+    m_rb_in_stream = in_stream;
+    openStream(new InStream(m_rb_in_stream, this, read_ahead_size), param, folder_cache_size, checkpoint_interval, checkpoint_memory);
+
+    return Qnil;
+}
+
+VALUE ArchiveReader::openFile(VALUE filename, VALUE param)
+{
+    checkStateToBeginOperation(STATE_INITIAL);
+    UInt64 folder_cache_size = ConvertValueToSize(rb_hash_aref(param, ID2SYM(INTERN("folder_cache_size"))),
+                                                  "folder_cache_size", kMaxFolderCacheSize);
+    UInt64 checkpoint_interval = ConvertValueToCheckpointInterval(rb_hash_aref(param, ID2SYM(INTERN("checkpoint_interval"))),
+                                                                  kMinCheckpointInterval, kMaxCheckpointInterval);
+    UInt64 checkpoint_memory = ConvertValueToSize(rb_hash_aref(param, ID2SYM(INTERN("checkpoint_memory"))),
+                                                  "checkpoint_memory", kMaxCheckpointMemory);
+    const bool use_map = RTEST(rb_hash_aref(param, ID2SYM(INTERN("mmap"))));
+    prepareAction();
+    EventLoopThreadExecuter te(this);
+
+    m_rb_in_stream = Qnil;
+    std::string path(RSTRING_PTR(filename), RSTRING_LEN(filename));
+
+#ifdef USE_WIN32_FILE_API
+    FileInStream *stream = new FileInStream(path, this);
+    CMyComPtr<IInStream> ptr(stream);
+    if (!stream->isOpened()){
+        runRubyFunction([&](){
+            rb_sys_fail_str(filename);
+        });
+    }
+#else
+    MappedFileInStream *stream = new MappedFileInStream(path, use_map);
+    CMyComPtr<IInStream> ptr(stream);
+    if (!stream->isOpened()){
+        runRubyFunction([&](){
+            rb_syserr_fail_str(stream->error(), filename);
+        });
+    }
+    stream->adviseSequential(false);
+    m_mapped_in_stream = stream;
+#endif
+
+    openStream(stream, param, folder_cache_size, checkpoint_interval, checkpoint_memory);
+
+    return Qnil;
+}
+
+void ArchiveReader::openStream(IInStream *stream, VALUE param, UInt64 folder_cache_size,
+                               UInt64 checkpoint_interval, UInt64 checkpoint_memory)
+{
+    m_rb_callback_proc = Qnil;
+    m_rb_out_stream = Qnil;
+    m_entry_table.clear();
+    m_rb_entry_info_list.clear();
+    m_plan_folder_decodes = 0;
+    m_plan_saved_decodes = 0;
+    m_folder_stats.clear();
+    m_in_stream = stream;
+
+    VALUE password, default_path;
+    bool header_cache;
     runRubyFunction([&](){
         password = rb_hash_aref(param, ID2SYM(INTERN("password")));
+        default_path = rb_hash_aref(param, ID2SYM(INTERN("default_path")));
+        header_cache = RTEST(rb_hash_lookup2(param, ID2SYM(INTERN("header_cache")), Qtrue));
     });
     if (NIL_P(password)){
         m_password_specified = false;
@@ -299,6 +1308,26 @@ VALUE ArchiveReader::open(VALUE in_stream, VALUE param)
         m_password_specified = true;
         m_password = std::string(RSTRING_PTR(password), RSTRING_LEN(password));
     }
+    if (NIL_P(default_path)){
+        m_default_path.clear();
+    }else{
+        m_default_path = std::string(RSTRING_PTR(default_path), RSTRING_LEN(default_path));
+    }
+
+    // Formats without solid blocks have no folder cache.
+    CMyComPtr<IInArchiveFolderCache> folder_cache;
+    if (m_in_archive->QueryInterface(IID_IInArchiveFolderCache, reinterpret_cast<void **>(&folder_cache)) == S_OK){
+        folder_cache->SetFolderCacheSize(folder_cache_size);
+    }
+    CMyComPtr<IInArchiveCheckpoints> checkpoints;
+    if (m_in_archive->QueryInterface(IID_IInArchiveCheckpoints, reinterpret_cast<void **>(&checkpoints)) == S_OK){
+        checkpoints->SetCheckpointInterval(checkpoint_interval,
+                                           (checkpoint_memory != 0 ? checkpoint_memory : kDefaultCheckpointMemory));
+    }
+    CMyComPtr<IInArchiveDatabaseCache> database_cache;
+    if (m_in_archive->QueryInterface(IID_IInArchiveDatabaseCache, reinterpret_cast<void **>(&database_cache)) == S_OK){
+        database_cache->SetUseDatabaseCache(header_cache ? 1 : 0);
+    }
 
     HRESULT ret = E_FAIL;
     runNativeFunc([&](){
@@ -311,19 +1340,20 @@ VALUE ArchiveReader::open(VALUE in_stream, VALUE param)
 
         CMyComPtr<IArchiveOpenCallback> callback_ptr(callback);
 
-        InStream *stream = new InStream(m_rb_in_stream, this);
-        m_in_stream = stream;
-        ret = m_in_archive->Open(stream, 0, callback);
+        ret = m_in_archive->Open(m_in_stream, 0, callback);
     });
 
     checkState(STATE_INITIAL, "Open error");
     if (ret != S_OK){
+        m_in_stream.Release();
+#ifndef USE_WIN32_FILE_API
+        m_mapped_in_stream = 0;
+#endif
         throw RubyCppUtil::RubyException("Invalid file format. open");
     }
 
+    m_opened_archive = std::make_shared<OpenedArchive>(m_in_archive);
     m_state = STATE_OPENED;
-
-    return Qnil;
 }
 
 VALUE ArchiveReader::close()
@@ -331,14 +1361,24 @@ VALUE ArchiveReader::close()
     if (m_state == STATE_CLOSED){
         return Qnil;
     }
+    if (m_state == STATE_STREAMING){
+        finishEntry(true);
+    }
 
     checkStateToBeginOperation(STATE_OPENED);
     prepareAction();
     EventLoopThreadExecuter te(this);
 
+    // The archive stays opened while its extraction contexts use it.
     runNativeFunc([&](){
-        m_in_archive->Close();
+        m_opened_archive.reset();
     });
+    m_extract_stream.Release();
+    m_in_stream.Release();
+#ifndef USE_WIN32_FILE_API
+    m_mapped_in_stream = 0;
+#endif
+    m_entry_table.clear();
     std::vector<VALUE>().swap(m_rb_entry_info_list);
 
     checkState(STATE_OPENED, "Close error");
@@ -350,18 +1390,17 @@ VALUE ArchiveReader::close()
 VALUE ArchiveReader::entryNum()
 {
     checkStateToBeginOperation(STATE_OPENED);
-    prepareAction();
-    EventLoopThreadExecuter te(this);
+    if (m_entry_table.filled()){
+        return ULONG2NUM(m_entry_table.size());
+    }
 
+    // The handler only returns the number of the parsed items.
+    // It calls no stream and no callback, so the event loop is not needed.
     UInt32 num;
-    runNativeFunc([&](){
-        HRESULT ret = m_in_archive->GetNumberOfItems(&num);
-        if (ret != S_OK){
-            num = 0xFFFFFFFF;
-        }
-    });
-
-    checkState(STATE_OPENED, "entryNum error");
+    HRESULT ret = m_in_archive->GetNumberOfItems(&num);
+    if (ret != S_OK){
+        num = 0xFFFFFFFF;
+    }
 
     return ULONG2NUM(num);
 }
@@ -369,8 +1408,6 @@ VALUE ArchiveReader::entryNum()
 VALUE ArchiveReader::getArchiveProperty()
 {
     checkStateToBeginOperation(STATE_OPENED);
-    prepareAction();
-    EventLoopThreadExecuter te(this);
 
     struct PropIdVarTypePair
     {
@@ -387,17 +1424,14 @@ VALUE ArchiveReader::getArchiveProperty()
 
     const unsigned int size = sizeof(list)/sizeof(list[0]);
 
+    // The properties are taken from the parsed header like entryNum.
     NWindows::NCOM::CPropVariant variant_list[size];
-    runNativeFunc([&](){
-        for (unsigned int i=0; i<size; i++){
-            HRESULT ret = m_in_archive->GetArchiveProperty(list[i].prop_id, &variant_list[i]);
-            if (ret != S_OK || variant_list[i].vt != list[i].vt){
-                variant_list[i].Clear();
-            }
+    for (unsigned int i=0; i<size; i++){
+        HRESULT ret = m_in_archive->GetArchiveProperty(list[i].prop_id, &variant_list[i]);
+        if (ret != S_OK || variant_list[i].vt != list[i].vt){
+            variant_list[i].Clear();
         }
-    });
-
-    checkState(STATE_OPENED, "getArchiveProperty error");
+    }
 
     VALUE ret;
     VALUE value_list[size];
@@ -412,35 +1446,176 @@ VALUE ArchiveReader::getArchiveProperty()
     return ret;
 }
 
-VALUE ArchiveReader::getEntryInfo(VALUE index)
+VALUE ArchiveReader::getFolderCacheStats()
 {
     checkStateToBeginOperation(STATE_OPENED);
-    prepareAction();
-    EventLoopThreadExecuter te(this);
 
-    fillEntryInfo();
+    CMyComPtr<IInArchiveFolderCache> folder_cache;
+    if (m_in_archive->QueryInterface(IID_IInArchiveFolderCache, reinterpret_cast<void **>(&folder_cache)) != S_OK){
+        return Qnil;
+    }
 
-    checkState(STATE_OPENED, "getEntryInfo error");
+    // Only the counters of the cache are read, so the event loop is not needed.
+    UInt64 hits = 0, misses = 0, size = 0;
+    folder_cache->GetFolderCacheStat(&hits, &misses, &size);
 
-    UInt32 idx;
+    VALUE ret;
     runRubyFunction([&](){
-        idx = NUM2ULONG(index);
+        ret = rb_hash_new();
+        rb_hash_aset(ret, ID2SYM(INTERN("hits")), ULL2NUM(hits));
+        rb_hash_aset(ret, ID2SYM(INTERN("misses")), ULL2NUM(misses));
+        rb_hash_aset(ret, ID2SYM(INTERN("size")), ULL2NUM(size));
     });
-    return entryInfo(idx);
+    return ret;
 }
 
-VALUE ArchiveReader::entryInfo(UInt32 index)
+VALUE ArchiveReader::getCheckpointStats()
 {
-    if (index >= m_rb_entry_info_list.size()){
+    checkStateToBeginOperation(STATE_OPENED);
+
+    CMyComPtr<IInArchiveCheckpoints> checkpoints;
+    if (m_in_archive->QueryInterface(IID_IInArchiveCheckpoints, reinterpret_cast<void **>(&checkpoints)) != S_OK){
         return Qnil;
     }
 
-    return m_rb_entry_info_list[index];
+    UInt64 count = 0, size = 0;
+    checkpoints->GetCheckpointStat(&count, &size);
+
+    VALUE ret;
+    runRubyFunction([&](){
+        ret = rb_hash_new();
+        rb_hash_aset(ret, ID2SYM(INTERN("count")), ULL2NUM(count));
+        rb_hash_aset(ret, ID2SYM(INTERN("size")), ULL2NUM(size));
+    });
+    return ret;
 }
 
-VALUE ArchiveReader::getAllEntryInfo()
+// The header cache is shared by the process, so these do not need an opened archive.
+VALUE ArchiveReader::clearHeaderCache()
 {
-    checkStateToBeginOperation(STATE_OPENED);
+    CMyComPtr<IInArchiveDatabaseCache> database_cache;
+    if (!m_in_archive ||
+        m_in_archive->QueryInterface(IID_IInArchiveDatabaseCache, reinterpret_cast<void **>(&database_cache)) != S_OK){
+        return Qnil;
+    }
+    database_cache->ClearDatabaseCache();
+    return Qtrue;
+}
+
+VALUE ArchiveReader::getHeaderCacheStats()
+{
+    CMyComPtr<IInArchiveDatabaseCache> database_cache;
+    if (!m_in_archive ||
+        m_in_archive->QueryInterface(IID_IInArchiveDatabaseCache, reinterpret_cast<void **>(&database_cache)) != S_OK){
+        return Qnil;
+    }
+
+    UInt32 count = 0;
+    UInt64 items = 0;
+    database_cache->GetDatabaseCacheStat(&count, &items);
+
+    VALUE ret;
+    runRubyFunction([&](){
+        ret = rb_hash_new();
+        rb_hash_aset(ret, ID2SYM(INTERN("count")), ULONG2NUM(count));
+        rb_hash_aset(ret, ID2SYM(INTERN("items")), ULL2NUM(items));
+    });
+    return ret;
+}
+
+VALUE ArchiveReader::getExtractPlanStats()
+{
+    checkStateToBeginOperation(STATE_OPENED);
+
+    VALUE ret;
+    runRubyFunction([&](){
+        ret = rb_hash_new();
+        rb_hash_aset(ret, ID2SYM(INTERN("folder_decodes")), ULL2NUM(m_plan_folder_decodes));
+        rb_hash_aset(ret, ID2SYM(INTERN("saved_folder_decodes")), ULL2NUM(m_plan_saved_decodes));
+    });
+    return ret;
+}
+
+VALUE ArchiveReader::getVerifyStats()
+{
+    checkStateToBeginOperation(STATE_OPENED);
+
+    std::vector<FolderStat> stats(m_folder_stats);
+    std::sort(stats.begin(), stats.end(), [](const FolderStat &a, const FolderStat &b){
+        return a.folder_index < b.folder_index;
+    });
+
+    VALUE ret;
+    runRubyFunction([&](){
+        ret = rb_ary_new2((long)stats.size());
+        for (const FolderStat &stat : stats){
+            VALUE hash = rb_hash_new();
+            double time = stat.time / 1000000.0;
+            rb_hash_aset(hash, ID2SYM(INTERN("folder")), ULONG2NUM(stat.folder_index));
+            rb_hash_aset(hash, ID2SYM(INTERN("pack_size")), ULL2NUM(stat.pack_size));
+            rb_hash_aset(hash, ID2SYM(INTERN("unpack_size")), ULL2NUM(stat.unpack_size));
+            rb_hash_aset(hash, ID2SYM(INTERN("time")), rb_float_new(time));
+            // Bytes per second, or nil when the folder took no measurable time.
+            rb_hash_aset(hash, ID2SYM(INTERN("pack_speed")),
+                         (stat.time == 0 ? Qnil : rb_float_new(stat.pack_size / time)));
+            rb_hash_aset(hash, ID2SYM(INTERN("unpack_speed")),
+                         (stat.time == 0 ? Qnil : rb_float_new(stat.unpack_size / time)));
+            rb_ary_push(ret, hash);
+        }
+    });
+    return ret;
+}
+
+VALUE ArchiveReader::getEntryInfo(VALUE index, VALUE cache)
+{
+    checkStateToBeginOperation(STATE_OPENED);
+    if (!m_entry_table.filled()){
+        prepareAction();
+        EventLoopThreadExecuter te(this);
+
+        fillEntryInfo();
+
+        checkState(STATE_OPENED, "getEntryInfo error");
+    }
+
+    // The table is already filled, so EntryInfo can be created without the event loop.
+    VALUE ret;
+    runRubyFunction([&](){
+        UInt32 idx = NUM2ULONG(index);
+        ret = (RTEST(cache) ? cachedEntryInfo(idx) : entryInfo(idx));
+    });
+    return ret;
+}
+
+// Returns EntryInfo without keeping it, so that iterating or extracting
+// many entries does not hold all EntryInfo objects.
+VALUE ArchiveReader::entryInfo(UInt32 index)
+{
+    if (index >= m_entry_table.size()){
+        return Qnil;
+    }
+
+    if (!NIL_P(m_rb_entry_info_list[index])){
+        return m_rb_entry_info_list[index];
+    }
+    return m_entry_table.newEntryInfo(index);
+}
+
+VALUE ArchiveReader::cachedEntryInfo(UInt32 index)
+{
+    if (index >= m_entry_table.size()){
+        return Qnil;
+    }
+
+    if (NIL_P(m_rb_entry_info_list[index])){
+        m_rb_entry_info_list[index] = m_entry_table.newEntryInfo(index);
+    }
+    return m_rb_entry_info_list[index];
+}
+
+VALUE ArchiveReader::getAllEntryInfo()
+{
+    checkStateToBeginOperation(STATE_OPENED);
     prepareAction();
     EventLoopThreadExecuter te(this);
 
@@ -450,11 +1625,33 @@ VALUE ArchiveReader::getAllEntryInfo()
 
     VALUE ret;
     runRubyFunction([&](){
-        ret = rb_ary_new4(m_rb_entry_info_list.size(), &m_rb_entry_info_list[0]);
+        const UInt32 num = m_entry_table.size();
+        ret = rb_ary_new2(num);
+        for (UInt32 i=0; i<num; i++){
+            rb_ary_store(ret, (long)i, cachedEntryInfo(i));
+        }
     });
     return ret;
 }
 
+VALUE ArchiveReader::findEntry(VALUE path)
+{
+    StringValue(path);
+    checkStateToBeginOperation(STATE_OPENED);
+    if (!m_entry_table.filled()){
+        prepareAction();
+        EventLoopThreadExecuter te(this);
+
+        fillEntryInfo();
+
+        checkState(STATE_OPENED, "findEntry error");
+    }
+
+    UInt32 idx;
+    bool found = m_entry_table.find(RSTRING_PTR(path), RSTRING_LEN(path), &idx);
+    return (found ? ULONG2NUM(idx) : Qnil);
+}
+
 VALUE ArchiveReader::setFileAttribute(VALUE path, VALUE attrib)
 {
 #ifdef _WIN32
@@ -486,7 +1683,7 @@ VALUE ArchiveReader::extract(VALUE index, VALUE callback_proc)
     runNativeFunc([&](){
         ArchiveExtractCallback *extract_callback = createArchiveExtractCallback();
         CMyComPtr<IArchiveExtractCallback> callback(extract_callback);
-        ret = m_in_archive->Extract(&i, 1, 0, extract_callback);
+        ret = extractItems(&i, 1, 0, extract_callback);
     });
 
     m_rb_callback_proc = Qnil;
@@ -499,25 +1696,93 @@ VALUE ArchiveReader::extract(VALUE index, VALUE callback_proc)
     return Qnil;
 }
 
-VALUE ArchiveReader::extractFiles(VALUE index_list, VALUE callback_proc)
+// Raises ArgumentError for the indices out of range, so it is called in runRubyFunction.
+void ArchiveReader::convertIndexList(VALUE index_list, std::vector<UInt32> *list)
+{
+    const UInt32 num = m_entry_table.size();
+    list->resize(RARRAY_LEN(index_list));
+    for (long i=0; i<RARRAY_LEN(index_list); i++){
+        VALUE index = rb_to_int(RARRAY_AREF(index_list, i));
+        if (RTEST(rb_funcall(index, INTERN("negative?"), 0)) ||
+            RTEST(rb_funcall(index, INTERN(">="), 1, ULONG2NUM(num)))){
+            rb_raise(rb_eArgError, "Invalid index");
+        }
+        (*list)[i] = NUM2ULONG(index);
+    }
+}
+
+// Orders the requested entries by (solid block, index) without duplicates, so that
+// each block is decoded once. The entries without a block come first, and
+// the indices out of range come last for the archive to reject.
+void ArchiveReader::planExtract(const std::vector<UInt32> &list, std::vector<UInt32> *plan)
+{
+    const UInt32 num = m_entry_table.size();
+    const UInt32 kNoBlock = EntryInfoTable::kNoBlock;
+
+    // The archive decodes a block again whenever the list leaves it or goes back in it.
+    UInt64 requested_decodes = 0;
+    UInt32 last_block = kNoBlock, last_index = 0;
+    for (UInt32 index : list){
+        if (index >= num){
+            continue;
+        }
+        const UInt32 block = m_entry_table.block(index);
+        if (block != kNoBlock && (block != last_block || index < last_index)){
+            requested_decodes++;
+        }
+        last_block = block;
+        last_index = index;
+    }
+
+    auto key = [&](UInt32 index){
+        const UInt32 block = (index < num ? m_entry_table.block(index) : kNoBlock);
+        const int group = (index >= num ? 2 : block == kNoBlock ? 0 : 1);
+        return std::make_tuple(group, block, index);
+    };
+    *plan = list;
+    std::sort(plan->begin(), plan->end(), [&](UInt32 a, UInt32 b){ return key(a) < key(b); });
+    plan->erase(std::unique(plan->begin(), plan->end()), plan->end());
+
+    UInt64 planned_decodes = 0;
+    last_block = kNoBlock;
+    for (UInt32 index : *plan){
+        const UInt32 block = (index < num ? m_entry_table.block(index) : kNoBlock);
+        if (block != kNoBlock && block != last_block){
+            planned_decodes++;
+        }
+        last_block = block;
+    }
+
+    m_plan_folder_decodes += planned_decodes;
+    if (requested_decodes > planned_decodes){
+        m_plan_saved_decodes += requested_decodes - planned_decodes;
+    }
+}
+
+VALUE ArchiveReader::extractFiles(VALUE index_list, VALUE callback_proc, VALUE param)
 {
     checkStateToBeginOperation(STATE_OPENED);
+    const ExtractOption option = convertExtractOption(param);
     prepareAction();
     EventLoopThreadExecuter te(this);
 
     m_rb_callback_proc = callback_proc;
 
     fillEntryInfo();
+    setExtractOption(option);
 
-    std::vector<UInt32> list(RARRAY_LEN(index_list));
-    std::transform(RARRAY_CONST_PTR(index_list), RARRAY_CONST_PTR(index_list) + RARRAY_LEN(index_list),
-                   list.begin(), [](VALUE num){ return NUM2ULONG(num); });
+    std::vector<UInt32> list;
+    runRubyFunction([&](){
+        convertIndexList(index_list, &list);
+    });
+    std::vector<UInt32> plan;
+    planExtract(list, &plan);
 
     HRESULT ret;
     runNativeFunc([&](){
         ArchiveExtractCallback *extract_callback = createArchiveExtractCallback();
         CMyComPtr<IArchiveExtractCallback> callback(extract_callback);
-        ret = m_in_archive->Extract(&list[0], list.size(), 0, extract_callback);
+        ret = extractItems(plan.data(), plan.size(), 0, extract_callback);
     });
 
     m_rb_callback_proc = Qnil;
@@ -530,21 +1795,23 @@ VALUE ArchiveReader::extractFiles(VALUE index_list, VALUE callback_proc)
     return Qnil;
 }
 
-VALUE ArchiveReader::extractAll(VALUE callback_proc)
+VALUE ArchiveReader::extractAll(VALUE callback_proc, VALUE param)
 {
     checkStateToBeginOperation(STATE_OPENED);
+    const ExtractOption option = convertExtractOption(param);
     prepareAction();
     EventLoopThreadExecuter te(this);
 
     m_rb_callback_proc = callback_proc;
 
     fillEntryInfo();
+    setExtractOption(option);
 
     HRESULT ret;
     runNativeFunc([&](){
         ArchiveExtractCallback *extract_callback = createArchiveExtractCallback();
         CMyComPtr<IArchiveExtractCallback> callback(extract_callback);
-        ret = m_in_archive->Extract(0, (UInt32)(Int32)(-1), 0, extract_callback);
+        ret = extractItems(0, (UInt32)(Int32)(-1), 0, extract_callback);
     });
 
     m_rb_callback_proc = Qnil;
@@ -557,9 +1824,349 @@ VALUE ArchiveReader::extractAll(VALUE callback_proc)
     return Qnil;
 }
 
-VALUE ArchiveReader::testAll(VALUE detail)
+std::string *ArchiveReader::memoryExtractBuffer(UInt32 index, UInt64 *size)
+{
+    if (index >= m_entry_table.size() || !m_entry_table.hasData(index)){
+        return 0;
+    }
+
+    size_t slot = index;
+    if (!m_memory_index_list.empty()){
+        auto it = std::lower_bound(m_memory_index_list.begin(), m_memory_index_list.end(), index);
+        if (it == m_memory_index_list.end() || *it != index){
+            return 0;
+        }
+        slot = it - m_memory_index_list.begin();
+    }
+
+    *size = m_entry_table.dataSize(index);
+    return &m_memory_data[slot];
+}
+
+void ArchiveReader::setMemoryExtractResult(Int32 result)
+{
+    // Keep the first error.
+    if (m_memory_extract_result == NArchive::NExtract::NOperationResult::kOK){
+        m_memory_extract_result = result;
+    }
+}
+
+void ArchiveReader::clearMemoryExtract()
+{
+    m_memory_extract = false;
+    std::vector<UInt32>().swap(m_memory_index_list);
+    std::vector<std::string>().swap(m_memory_data);
+}
+
+VALUE ArchiveReader::extractData(VALUE index_list, VALUE param)
+{
+    checkStateToBeginOperation(STATE_OPENED);
+    const ExtractOption option = convertExtractOption(param);
+    prepareAction();
+    EventLoopThreadExecuter te(this);
+
+    m_rb_callback_proc = Qnil;
+
+    fillEntryInfo();
+    setExtractOption(option);
+
+    const UInt32 num = m_entry_table.size();
+    const bool all = NIL_P(index_list);
+    std::vector<UInt32> list;
+    if (!all){
+        runRubyFunction([&](){
+            convertIndexList(index_list, &list);
+        });
+    }
+
+    using namespace NArchive::NExtract::NOperationResult;
+
+    HRESULT ret;
+    std::vector<UInt32> plan;
+    try{
+        if (!all){
+            planExtract(list, &plan);
+            m_memory_index_list = plan;
+            std::sort(m_memory_index_list.begin(), m_memory_index_list.end());
+        }
+        m_memory_data.resize(all ? num : m_memory_index_list.size());
+        m_memory_extract_result = kOK;
+        m_memory_extract = true;
+
+        runNativeFunc([&](){
+            ArchiveExtractCallback *extract_callback = createArchiveExtractCallback();
+            CMyComPtr<IArchiveExtractCallback> callback(extract_callback);
+            if (all){
+                ret = extractItems(0, (UInt32)(Int32)(-1), 0, extract_callback);
+            }else{
+                ret = extractItems(plan.data(), plan.size(), 0, extract_callback);
+            }
+        });
+        m_memory_extract = false;
+
+        checkState(STATE_OPENED, "extractData error");
+    }catch(...){
+        clearMemoryExtract();
+        throw;
+    }
+
+    if (ret != S_OK){
+        clearMemoryExtract();
+        throw RubyCppUtil::RubyException("Invalid file format. extractData");
+    }
+    if (m_memory_extract_result != kOK){
+        clearMemoryExtract();
+        VALUE invalid_archive_exc = rb_const_get(gSevenZipModule, INTERN("InvalidArchive"));
+        const char *msg = "Corrupted archive or invalid password";
+        throw RubyCppUtil::RubyException(rb_exc_new(invalid_archive_exc, msg, strlen(msg)));
+    }
+
+    VALUE ary;
+    try{
+        runRubyFunction([&](){
+            if (all){
+                ary = rb_ary_new2(num);
+                for (UInt32 i=0; i<num; i++){
+                    VALUE str = Qnil;
+                    if (m_entry_table.hasData(i)){
+                        str = rb_str_new(m_memory_data[i].data(), m_memory_data[i].size());
+                        std::string().swap(m_memory_data[i]);
+                    }
+                    rb_ary_store(ary, (long)i, str);
+                }
+                return;
+            }
+
+            // Each buffer is converted once, and the same index requested twice gets a copy.
+            std::vector<VALUE> str_list(m_memory_index_list.size(), Qnil);
+            ary = rb_ary_new2(list.size());
+            for (size_t i=0; i<list.size(); i++){
+                const UInt32 index = list[i];
+                VALUE str = Qnil;
+                if (m_entry_table.hasData(index)){
+                    const size_t slot = std::lower_bound(m_memory_index_list.begin(), m_memory_index_list.end(), index)
+                        - m_memory_index_list.begin();
+                    if (NIL_P(str_list[slot])){
+                        str = rb_str_new(m_memory_data[slot].data(), m_memory_data[slot].size());
+                        std::string().swap(m_memory_data[slot]);
+                        str_list[slot] = str;
+                    }else{
+                        str = rb_str_dup(str_list[slot]);
+                    }
+                }
+                rb_ary_store(ary, (long)i, str);
+            }
+        });
+    }catch(...){
+        clearMemoryExtract();
+        throw;
+    }
+    clearMemoryExtract();
+
+    return ary;
+}
+
+// Opens an extraction context of the parent reader. It shares the parsed archive,
+// and reads packed data from its own stream, so that the parent and the contexts
+// can extract in parallel.
+VALUE ArchiveReader::openContext(VALUE parent, VALUE in_stream, VALUE param)
+{
+    checkStateToBeginOperation(STATE_INITIAL);
+    if (rb_obj_class(parent) != rb_obj_class(self())){
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, "parent should be the same reader class"));
+    }
+    // Every reader class derives only from ArchiveReader, so the data pointer is the ArchiveReader.
+    ArchiveReader *reader = reinterpret_cast<ArchiveReader*>(DATA_PTR(parent));
+    reader->checkStateToBeginOperation(STATE_OPENED);
+
+    CMyComPtr<IInArchiveExtractStream> extract_stream;
+    if (reader->m_in_archive->QueryInterface(IID_IInArchiveExtractStream,
+                                             reinterpret_cast<void **>(&extract_stream)) != S_OK){
+        const char *msg = "Extraction contexts are not supported for this format";
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eNotImpError, msg));
+    }
+
+    if (NIL_P(in_stream)){
+#ifdef USE_WIN32_FILE_API
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, "stream is required"));
+#else
+        if (!reader->m_mapped_in_stream){
+            const char *msg = "stream is required for the archive which is not opened by open_file";
+            throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, msg));
+        }
+        MappedFileInStream *stream = reader->m_mapped_in_stream->duplicate();
+        CMyComPtr<IInStream> ptr(stream);
+        if (!stream->isOpened()){
+            runRubyFunction([&](){
+                rb_syserr_fail(stream->error(), "Cannot open extraction context");
+            });
+        }
+        m_mapped_in_stream = stream;
+        m_in_stream = ptr;
+#endif
+    }else{
+        UInt32 read_ahead_size = InStream::kDefaultReadAheadSize;
+        VALUE size = rb_hash_aref(param, ID2SYM(INTERN("read_ahead_size")));
+        if (!NIL_P(size)){
+            read_ahead_size = (UInt32)ConvertValueToSize(size, "read_ahead_size", InStream::kMaxReadAheadSize);
+        }
+        m_rb_in_stream = in_stream;
+        m_in_stream = new InStream(m_rb_in_stream, this, read_ahead_size);
+    }
+
+    m_in_archive = reader->m_in_archive;
+    m_opened_archive = reader->m_opened_archive;
+    m_extract_stream = extract_stream;
+    m_password_specified = reader->m_password_specified;
+    m_password = reader->m_password;
+    m_default_path = reader->m_default_path;
+    if (reader->m_entry_table.filled()){
+        m_entry_table = reader->m_entry_table;
+        m_rb_entry_info_list.assign(m_entry_table.size(), Qnil);
+    }
+
+    m_state = STATE_OPENED;
+    return Qnil;
+}
+
+VALUE ArchiveReader::openEntry(VALUE index, VALUE param)
+{
+    checkStateToBeginOperation(STATE_OPENED);
+
+    size_t capacity = EntryPipe::kDefaultCapacity;
+    VALUE size = rb_hash_aref(param, ID2SYM(INTERN("buffer_size")));
+    if (!NIL_P(size)){
+        capacity = (size_t)ConvertValueToSize(size, "buffer_size", EntryPipe::kMaxCapacity);
+        capacity = std::max(capacity, (size_t)1);
+    }
+    const UInt32 i = NUM2ULONG(index);
+    const ExtractOption option = convertExtractOption(param);
+
+    prepareAction();
+    // The event loop keeps running for the input stream until the entry is closed.
+    startEventLoopThread(false);
+    try{
+        fillEntryInfo();
+        if (i >= m_entry_table.size()){
+            throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, "Invalid index"));
+        }
+        setExtractOption(option);
+        checkState(STATE_OPENED, "openEntry error");
+
+        m_entry_pipe.reset(new EntryPipe(capacity));
+        m_entry_thread = std::thread([this, i](){
+            UInt32 index = i;
+            ArchiveExtractCallback *extract_callback = createArchiveExtractCallback();
+            CMyComPtr<IArchiveExtractCallback> callback(extract_callback);
+            HRESULT ret = extractItems(&index, 1, 0, extract_callback);
+            callback.Release();
+            m_entry_pipe->closeWrite(ret);
+        });
+    }catch(const std::system_error &){
+        m_entry_pipe.reset();
+        terminateEventLoopThread();
+        throw RubyCppUtil::RubyException("Cannot create a thread");
+    }catch(...){
+        m_entry_pipe.reset();
+        terminateEventLoopThread();
+        throw;
+    }
+
+    m_state = STATE_STREAMING;
+    m_rb_streaming_self = self();
+    rb_gc_register_address(&m_rb_streaming_self);
+
+    return Qnil;
+}
+
+// Returns at most size bytes as soon as some data is decoded, and nil at the end.
+VALUE ArchiveReader::readEntry(VALUE size, VALUE buffer)
+{
+    checkStateToBeginOperation(STATE_STREAMING, "Entry is not opened");
+
+    const size_t len = NUM2SIZET(size);
+    if (!NIL_P(buffer)){
+        StringValue(buffer);
+        rb_str_modify(buffer);
+    }
+
+    size_t available = 0;
+    bool cancelled = false;
+    bool success = runNativeFuncProtect([&](){
+        available = m_entry_pipe->wait(&cancelled);
+    }, [&](){
+        m_entry_pipe->cancelWait(&cancelled);
+    });
+    if (!success){
+        throw RubyCppUtil::RubyException(std::string("Interrupted"));
+    }
+
+    if (available == 0){
+        finishEntry(false);
+        return Qnil;
+    }
+
+    // The decoded region is not touched by the decoder, so it is copied with GVL.
+    const size_t read_size = std::min(len, available);
+    if (NIL_P(buffer)){
+        buffer = rb_str_buf_new(read_size);
+    }else{
+        rb_str_resize(buffer, 0);
+        rb_str_modify_expand(buffer, read_size);
+    }
+    m_entry_pipe->read(RSTRING_PTR(buffer), read_size);
+    rb_str_set_len(buffer, read_size);
+    return buffer;
+}
+
+VALUE ArchiveReader::closeEntry()
+{
+    if (m_state == STATE_STREAMING){
+        finishEntry(true);
+    }
+    return Qnil;
+}
+
+// Waits for the decoder, and raises the error of the entry unless it is aborted.
+void ArchiveReader::finishEntry(bool abort)
+{
+    if (abort){
+        m_entry_pipe->closeRead();
+    }
+    runNativeFuncProtect([&](){
+        m_entry_thread.join();
+    }, [&](){
+        // Nothing to do. The decoder stops soon after closeRead.
+    });
+    terminateEventLoopThread();
+
+    const HRESULT ret = m_entry_pipe->result();
+    const Int32 result = m_entry_pipe->operationResult();
+    m_entry_pipe.reset();
+    rb_gc_unregister_address(&m_rb_streaming_self);
+    m_rb_streaming_self = Qnil;
+    if (m_state == STATE_STREAMING){
+        m_state = STATE_OPENED;
+    }
+
+    checkState(STATE_OPENED, "readEntry error");
+    if (abort){
+        return;
+    }
+    if (ret != S_OK){
+        throw RubyCppUtil::RubyException("Invalid file format. readEntry");
+    }
+    if (result != NArchive::NExtract::NOperationResult::kOK){
+        VALUE invalid_archive_exc = rb_const_get(gSevenZipModule, INTERN("InvalidArchive"));
+        const char *msg = "Corrupted archive or invalid password";
+        throw RubyCppUtil::RubyException(rb_exc_new(invalid_archive_exc, msg, strlen(msg)));
+    }
+}
+
+VALUE ArchiveReader::testAll(VALUE detail, VALUE param)
 {
     checkStateToBeginOperation(STATE_OPENED);
+    const ExtractOption option = convertExtractOption(param);
     prepareAction();
     EventLoopThreadExecuter te(this);
 
@@ -574,17 +2181,28 @@ VALUE ArchiveReader::testAll(VALUE detail)
     if (ret != S_OK || m_state == STATE_ERROR){
         throw RubyCppUtil::RubyException("Cannot get number of items");
     }
+    // Entries left untested by stop_on_error are reported as nil.
     m_test_result.resize(num);
-    std::fill(m_test_result.begin(), m_test_result.end(), NArchive::NExtract::NOperationResult::kOK);
+    std::fill(m_test_result.begin(), m_test_result.end(), (Int32)kNotTested);
+    m_folder_stats.clear();
+
+    runRubyFunction([&](){
+        m_test_stop_on_error = RTEST(rb_hash_aref(param, ID2SYM(INTERN("stop_on_error"))));
+    });
+    m_test_stopped = false;
+    setExtractOption(option);
 
+    m_testing = true;
     runNativeFunc([&](){
         ArchiveExtractCallback *extract_callback = createArchiveExtractCallback();
         CMyComPtr<IArchiveExtractCallback> callback(extract_callback);
-        ret = m_in_archive->Extract(0, (UInt32)(Int32)(-1), 1, extract_callback);
+        ret = extractItems(0, (UInt32)(Int32)(-1), 1, extract_callback);
     });
+    m_testing = false;
+    m_test_stop_on_error = false;
 
     checkState(STATE_OPENED, "testAll error");
-    if (ret != S_OK){
+    if (ret != S_OK && !(ret == E_ABORT && m_test_stopped)){
         throw RubyCppUtil::RubyException("Archive corrupted.");
     }
 
@@ -629,8 +2247,26 @@ VALUE ArchiveReader::testAll(VALUE detail)
     }
 }
 
+HRESULT ArchiveReader::extractItems(const UInt32 *indices, UInt32 num, Int32 test_mode,
+                                    IArchiveExtractCallback *callback)
+{
+    if (m_extract_stream){
+        return m_extract_stream->ExtractFromStream(m_in_stream, indices, num, test_mode,
+                                                   m_extract_option.threads, !m_extract_option.in_order,
+                                                   m_extract_option.binder_buffer_size, callback);
+    }
+    return m_in_archive->Extract(indices, num, test_mode, callback);
+}
+
 ArchiveExtractCallback *ArchiveReader::createArchiveExtractCallback()
 {
+#ifndef USE_WIN32_FILE_API
+    // Every extraction reads packed streams from the start to the end.
+    if (m_mapped_in_stream){
+        m_mapped_in_stream->adviseSequential(true);
+    }
+#endif
+
     ArchiveExtractCallback *extract_callback;
     if (m_password_specified){
         extract_callback = new ArchiveExtractCallback(this, m_password);
@@ -640,72 +2276,68 @@ ArchiveExtractCallback *ArchiveReader::createArchiveExtractCallback()
     return extract_callback;
 }
 
-void ArchiveReader::fillEntryInfo()
+// Called before prepareAction, so that invalid options raise before the operation starts.
+ArchiveReader::ExtractOption ArchiveReader::convertExtractOption(VALUE param)
+{
+    ExtractOption option;
+    VALUE value = rb_hash_aref(param, ID2SYM(INTERN("threads")));
+    if (!NIL_P(value)){
+        // Too many threads are reduced to the maximum.
+        value = rb_to_int(value);
+        if (RTEST(rb_funcall(value, INTERN("negative?"), 0))){
+            throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, "threads should not be negative"));
+        }
+        VALUE max = ULONG2NUM(kMaxExtractThreads);
+        option.threads = NUM2ULONG(RTEST(rb_funcall(value, INTERN(">"), 1, max)) ? max : value);
+    }
+    option.in_order = RTEST(rb_hash_lookup2(param, ID2SYM(INTERN("in_order")), Qtrue));
+    value = rb_hash_aref(param, ID2SYM(INTERN("binder_buffer_size")));
+    if (!NIL_P(value)){
+        // 0 is valid and hands the data over between the coders without a buffer.
+        option.binder_buffer_size = (UInt32)ConvertValueToSize(value, "binder_buffer_size", kMaxBinderBufferSize);
+    }
+    return option;
+}
+
+void ArchiveReader::setExtractOption(const ExtractOption &option)
 {
-    if (!m_rb_entry_info_list.empty()){
+    // Extraction contexts pass the options to ExtractFromStream instead of the shared handler.
+    if (m_extract_stream){
+        m_extract_option = option;
         return;
     }
 
-    struct PropIdVarTypePair
-    {
-        PROPID prop_id;
-        VARTYPE vt;
-    };
-    PropIdVarTypePair list[] = {
-        { kpidPath, VT_BSTR },
-        { kpidMethod, VT_BSTR },
-        { kpidIsDir, VT_BOOL },
-        { kpidEncrypted, VT_BOOL },
-        { kpidIsAnti, VT_BOOL },
-        { kpidSize, VT_UI8 },
-        { kpidPackSize, VT_UI8 },
-        { kpidCTime, VT_FILETIME },
-        { kpidATime, VT_FILETIME },
-        { kpidMTime, VT_FILETIME },
-        { kpidAttrib, VT_UI4 },
-        { kpidCRC, VT_UI4 }
-    };
+    CMyComPtr<ISetProperties> set;
+    if (m_in_archive->QueryInterface(IID_ISetProperties, reinterpret_cast<void **>(&set)) != S_OK){
+        return;
+    }
 
-    const unsigned int size = sizeof(list)/sizeof(list[0]);
+    NWindows::NCOM::CPropVariant prop[3];
+    const wchar_t *name[3] = { L"emt", L"eoo", L"ebs" };
+    prop[0] = option.threads;
+    prop[1] = !option.in_order;
+    prop[2] = option.binder_buffer_size;
 
-    UInt32 num;
-    HRESULT ret;
-    runNativeFunc([&](){
-        ret = m_in_archive->GetNumberOfItems(&num);
-    });
-    if (ret != S_OK || m_state == STATE_ERROR){
-        throw RubyCppUtil::RubyException("Cannot get number of items");
-    }
+    // Formats without parallel extraction ignore these properties.
+    set->SetProperties(name, prop, 3);
+}
 
-    std::vector< std::array< NWindows::NCOM::CPropVariant, size > > variant_list(num);
+void ArchiveReader::fillEntryInfo()
+{
+    if (m_entry_table.filled()){
+        return;
+    }
 
+    HRESULT ret;
     runNativeFunc([&](){
-        for (UInt32 idx=0; idx<num; idx++){
-            for (unsigned int i=0; i<size; i++){
-                HRESULT ret = m_in_archive->GetProperty(idx, list[i].prop_id, &variant_list[idx][i]);
-                if (ret != S_OK || variant_list[idx][i].vt != list[i].vt){
-                    variant_list[idx][i].Clear();
-                }
-            }
-        }
+        ret = m_entry_table.fill(m_in_archive, m_default_path);
     });
-    if (m_state == STATE_ERROR){
+    if (ret != S_OK || m_state == STATE_ERROR){
+        m_entry_table.clear();
         throw RubyCppUtil::RubyException("Cannot get property of items");
     }
 
-    m_rb_entry_info_list.resize(variant_list.size(), Qnil);
-    VALUE value_list[size + 1];
-    runRubyFunction([&](){
-        VALUE entry_info = rb_const_get(gSevenZipModule, INTERN("EntryInfo"));
-        ID new_id = INTERN("new");
-        for (UInt32 i=0; i<m_rb_entry_info_list.size(); i++){
-            value_list[0] = ULONG2NUM(i);
-            for (unsigned int j=0; j<size; j++){
-                value_list[j+1] = ConvertPropToValue(variant_list[i][j]);
-            }
-            m_rb_entry_info_list[i] = rb_funcall2(entry_info, new_id, size + 1, value_list);
-        }
-    });
+    m_rb_entry_info_list.assign(m_entry_table.size(), Qnil);
 }
 
 void ArchiveReader::mark()
@@ -753,10 +2385,10 @@ void ArchiveReader::setErrorState()
 ////////////////////////////////////////////////////////////////
 ArchiveWriter::ArchiveWriter(const GUID &format_guid)
      : m_rb_callback_proc(Qnil),
-       m_rb_in_stream(Qnil),
        m_processing_index((UInt32)(Int32)-1),
        m_rb_out_stream(Qnil),
        m_format_guid(format_guid),
+       m_rb_archive_stream(Qnil),
        m_password_specified(false),
        m_state(STATE_INITIAL)
 {
@@ -770,14 +2402,11 @@ ArchiveWriter::ArchiveWriter(const GUID &format_guid)
     m_out_archive.Attach(archive);
 }
 
-VALUE ArchiveWriter::open(VALUE out_stream, VALUE param)
+void ArchiveWriter::setOpenParam(VALUE out_stream, VALUE param)
 {
-    checkStateToBeginOperation(STATE_INITIAL);
-    prepareAction();
-
     m_rb_out_stream = out_stream;
     m_rb_callback_proc = Qnil;
-    m_rb_in_stream = Qnil;
+    clearProcessingStream();
     std::vector<VALUE>().swap(m_rb_update_list);
 
     VALUE password;
@@ -790,13 +2419,92 @@ VALUE ArchiveWriter::open(VALUE out_stream, VALUE param)
         m_password_specified = true;
         m_password = std::string(RSTRING_PTR(password), RSTRING_LEN(password));
     }
+}
+
+VALUE ArchiveWriter::open(VALUE out_stream, VALUE param)
+{
+    checkStateToBeginOperation(STATE_INITIAL);
+    prepareAction();
+
+    setOpenParam(out_stream, param);
+
+    checkState(STATE_INITIAL, "Open error");
+    m_state = STATE_OPENED;
+
+    return Qnil;
+}
+
+// Opens the archive of in_stream with the handler of this writer, so that
+// the items added with index_in_archive keep their data. The handler copies
+// the folders (solid blocks) whose items are all kept, and repacks the others.
+VALUE ArchiveWriter::update(VALUE in_stream, VALUE out_stream, VALUE param)
+{
+    checkStateToBeginOperation(STATE_INITIAL);
+    prepareAction();
+    EventLoopThreadExecuter te(this);
+
+    setOpenParam(out_stream, param);
+
+    if (m_out_archive->QueryInterface(IID_IInArchive, reinterpret_cast<void **>(&m_in_archive)) != S_OK){
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, "This format cannot be updated"));
+    }
+    m_rb_archive_stream = in_stream;
+    m_in_stream = new InStream(m_rb_archive_stream, this, InStream::kDefaultReadAheadSize);
+
+    HRESULT ret = E_FAIL;
+    runNativeFunc([&](){
+        ArchiveOpenCallback *callback;
+        if (m_password_specified){
+            callback = new ArchiveOpenCallback(this, m_password);
+        }else{
+            callback = new ArchiveOpenCallback(this);
+        }
+
+        CMyComPtr<IArchiveOpenCallback> callback_ptr(callback);
+
+        ret = m_in_archive->Open(m_in_stream, 0, callback);
+        if (ret == S_OK){
+            ret = m_entry_table.fill(m_in_archive, std::string());
+        }
+    });
 
     checkState(STATE_INITIAL, "Open error");
+    if (ret != S_OK){
+        closeArchive();
+        throw RubyCppUtil::RubyException("Invalid file format. open");
+    }
+
     m_state = STATE_OPENED;
 
     return Qnil;
 }
 
+VALUE ArchiveWriter::archiveEntries()
+{
+    checkStateToBeginOperation(STATE_OPENED, STATE_COMPRESSED);
+
+    VALUE ret;
+    runRubyFunction([&](){
+        const UInt32 num = m_entry_table.size();
+        ret = rb_ary_new2(num);
+        for (UInt32 i=0; i<num; i++){
+            rb_ary_store(ret, (long)i, m_entry_table.newEntryInfo(i));
+        }
+    });
+    return ret;
+}
+
+void ArchiveWriter::closeArchive()
+{
+    if (m_in_archive){
+        m_in_archive->Close();
+        m_in_archive.Release();
+    }
+    m_in_stream.Release();
+    m_entry_table.clear();
+    m_rb_archive_stream = Qnil;
+}
+
 VALUE ArchiveWriter::addItem(VALUE item)
 {
     checkStateToBeginOperation(STATE_OPENED);
@@ -816,6 +2524,7 @@ VALUE ArchiveWriter::compress(VALUE callback_proc)
     }
 
     checkStateToBeginOperation(STATE_OPENED);
+    checkOption();
     prepareAction();
     EventLoopThreadExecuter te(this);
 
@@ -838,11 +2547,21 @@ VALUE ArchiveWriter::compress(VALUE callback_proc)
             callback = new ArchiveUpdateCallback(this);
         }
 
-        CMyComPtr<IOutStream> out_stream(new OutStream(m_rb_out_stream, this));
+        CMyComPtr<OutStream> out_stream(new OutStream(m_rb_out_stream, this));
         CMyComPtr<IArchiveUpdateCallback> callback_ptr(callback);
         ret = m_out_archive->UpdateItems(out_stream, m_rb_update_list.size(), callback_ptr);
+        if (ret == S_OK){
+            ret = out_stream->flush();
+        }
     });
 
+    // The handler has released all streams.
+    if (opt_ret == S_OK && ret == S_OK && !isErrorState()){
+        runRubyFunction([&](){
+            reportFinishedStreams(true);
+        });
+    }
+    clearProcessingStream();
     m_rb_callback_proc = Qnil;
 
     if (opt_ret != S_OK){
@@ -869,6 +2588,7 @@ VALUE ArchiveWriter::close()
     prepareAction();
 
     std::vector<VALUE>().swap(m_rb_update_list);
+    closeArchive();
 
     checkState(STATE_OPENED, STATE_COMPRESSED, "close error");
     m_state = STATE_CLOSED;
@@ -884,30 +2604,88 @@ VALUE ArchiveWriter::getFileAttribute(VALUE path)
     SysFreeString(str);
     return ULONG2NUM(attr);
 #else
-    // TODO
-    return Qnil;
+    // The same attributes as p7zip: the mode is kept in the high 16 bits.
+    // The 7z encoder selects the exe filter by the executable bits of the mode.
+    std::string str(RSTRING_PTR(path), RSTRING_LEN(path));
+    struct stat st;
+    if (stat(str.c_str(), &st) != 0){
+        return Qnil;
+    }
+    UInt32 attr = (S_ISDIR(st.st_mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_ARCHIVE);
+    if (!(st.st_mode & S_IWUSR)){
+        attr |= FILE_ATTRIBUTE_READONLY;
+    }
+    attr |= FILE_ATTRIBUTE_UNIX_EXTENSION | ((UInt32)(st.st_mode & 0xFFFF) << 16);
+    return ULONG2NUM(attr);
 #endif
 }
 
 void ArchiveWriter::setProcessingStream(VALUE stream, UInt32 index)
 {
-    m_rb_in_stream = stream;
+    MutexLocker locker(&m_processing_mutex);
     m_processing_index = index;
+    if (!NIL_P(stream)){
+        ProcessingStream item = { index, stream, false, false };
+        m_processing_streams.push_back(item);
+    }
 }
 
-void ArchiveWriter::getProcessingStream(VALUE *stream, UInt32 *index)
+// The result of the item of the last setProcessingStream is reported.
+void ArchiveWriter::finishProcessingStream()
 {
-    if (stream){
-        *stream = m_rb_in_stream;
+    MutexLocker locker(&m_processing_mutex);
+    for (auto &item : m_processing_streams){
+        if (item.index == m_processing_index){
+            item.finished = true;
+        }
     }
-    if (index){
-        *index = m_processing_index;
+    m_processing_index = (UInt32)(Int32)(-1);
+}
+
+// Called from any thread when the handler releases the stream.
+void ArchiveWriter::releaseProcessingStream(UInt32 index)
+{
+    MutexLocker locker(&m_processing_mutex);
+    for (auto &item : m_processing_streams){
+        if (item.index == index){
+            item.released = true;
+        }
+    }
+}
+
+// Removes a stream which is finished and released, or any stream if all is true.
+bool ArchiveWriter::takeFinishedStream(bool all, UInt32 *index, VALUE *stream)
+{
+    MutexLocker locker(&m_processing_mutex);
+    for (auto it = m_processing_streams.begin(); it != m_processing_streams.end(); ++it){
+        if (all || (it->finished && it->released)){
+            *index = it->index;
+            *stream = it->stream;
+            m_processing_streams.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Passes the finished streams to the result callback in the Ruby thread.
+void ArchiveWriter::reportFinishedStreams(bool all)
+{
+    UInt32 index;
+    VALUE stream;
+    while (takeFinishedStream(all, &index, &stream)){
+        VALUE arg_hash = rb_hash_new();
+        rb_hash_aset(arg_hash, ID2SYM(INTERN("info")), itemInfo(index));
+        rb_hash_aset(arg_hash, ID2SYM(INTERN("stream")), stream);
+        rb_funcall(m_rb_callback_proc, INTERN("call"), 2, ID2SYM(INTERN("result")), arg_hash);
     }
 }
 
 void ArchiveWriter::clearProcessingStream()
 {
-    setProcessingStream(Qnil, (UInt32)(Int32)(-1));
+    MutexLocker locker(&m_processing_mutex);
+    m_processing_streams.clear();
+    m_processing_index = (UInt32)(Int32)(-1);
 }
 
 bool ArchiveWriter::updateItemInfo(UInt32 index, bool *new_data, bool *new_properties, UInt32 *index_in_archive)
@@ -932,8 +2710,14 @@ bool ArchiveWriter::updateItemInfo(UInt32 index, bool *new_data, bool *new_prope
 void ArchiveWriter::mark()
 {
     rb_gc_mark(m_rb_callback_proc);
-    rb_gc_mark(m_rb_in_stream);
+    {
+        MutexLocker locker(&m_processing_mutex);
+        for (const auto &item : m_processing_streams){
+            rb_gc_mark(item.stream);
+        }
+    }
     rb_gc_mark(m_rb_out_stream);
+    rb_gc_mark(m_rb_archive_stream);
     std::for_each(m_rb_update_list.begin(), m_rb_update_list.end(), [](VALUE i){ rb_gc_mark(i); });
 
     ArchiveBase::mark();
@@ -1014,7 +2798,17 @@ SevenZipWriter::SevenZipWriter()
        m_solid(true),
        m_header_compression(true),
        m_header_encryption(false),
-       m_multi_threading(true)
+       m_multi_threading(true),
+       m_store_incompressible(false),
+       m_threads(0),
+       m_block_threads(0),
+       m_dictionary_size(0),
+       m_word_size(0),
+       m_solid_block_size(0),
+       m_solid_files(0),
+       m_block_size(0),
+       m_solid_block_threads(0),
+       m_solid_block_memory(0)
 {
 }
 
@@ -1111,6 +2905,17 @@ VALUE SevenZipWriter::headerEncryption()
     return (m_header_encryption ? Qtrue : Qfalse);
 }
 
+VALUE SevenZipWriter::setStoreIncompressible(VALUE store_incompressible)
+{
+    m_store_incompressible = RTEST(store_incompressible);
+    return store_incompressible;
+}
+
+VALUE SevenZipWriter::storeIncompressible()
+{
+    return (m_store_incompressible ? Qtrue : Qfalse);
+}
+
 VALUE SevenZipWriter::setMultiThreading(VALUE multi_threading)
 {
     m_multi_threading = RTEST(multi_threading);
@@ -1122,432 +2927,1725 @@ VALUE SevenZipWriter::multiThreading()
     return (m_multi_threading ? Qtrue : Qfalse);
 }
 
-HRESULT SevenZipWriter::setOption(ISetProperties *set)
+VALUE SevenZipWriter::setThreads(VALUE threads)
 {
-    NWindows::NCOM::CPropVariant prop[6];
-    const wchar_t *name[6] = { L"0", L"x", L"s", L"hc", L"he", L"mt" };
-    prop[0] = m_method.c_str();
-    prop[1] = m_level;
-    prop[2] = m_solid;
-    prop[3] = m_header_compression;
-    prop[4] = m_header_encryption;
-    prop[5] = m_multi_threading;
+    m_threads = (UInt32)ConvertValueToSize(threads, "threads", kMaxWriterThreads);
+    return threads;
+}
 
-    return set->SetProperties(name, prop, sizeof(name)/sizeof(name[0]));
+VALUE SevenZipWriter::threads()
+{
+    return ConvertSizeToValue(m_threads);
 }
 
-////////////////////////////////////////////////////////////////
-ArchiveOpenCallback::ArchiveOpenCallback(ArchiveReader *archive)
-     : m_archive(archive), m_password_specified(false)
+VALUE SevenZipWriter::setBlockThreads(VALUE block_threads)
 {
+    // NUM_MT_CODER_THREADS_MAX in Lzma2Enc.c
+    m_block_threads = (UInt32)ConvertValueToSize(block_threads, "block_threads", 32);
+    return block_threads;
 }
 
-ArchiveOpenCallback::ArchiveOpenCallback(ArchiveReader *archive, const std::string &password)
-     : m_archive(archive), m_password_specified(true), m_password(password)
+VALUE SevenZipWriter::blockThreads()
 {
+    return ConvertSizeToValue(m_block_threads);
 }
 
-STDMETHODIMP ArchiveOpenCallback::SetTotal(const UInt64 *files, const UInt64 *bytes)
+VALUE SevenZipWriter::setDictionarySize(VALUE dictionary_size)
 {
-    // This function is called periodically, so use this function as a check function of interrupt.
-    if (m_archive->isErrorState()){
-        return E_ABORT;
-    }
-    return S_OK;
+    m_dictionary_size = (UInt32)ConvertValueToSize(dictionary_size, "dictionary_size", 0xFFFFFFFF);
+    return dictionary_size;
 }
 
-STDMETHODIMP ArchiveOpenCallback::SetCompleted(const UInt64 *files, const UInt64 *bytes)
+VALUE SevenZipWriter::dictionarySize()
 {
-    // This function is called periodically, so use this function as a check function of interrupt.
-    if (m_archive->isErrorState()){
-        return E_ABORT;
-    }
-    return S_OK;
+    return ConvertSizeToValue(m_dictionary_size);
 }
 
-STDMETHODIMP ArchiveOpenCallback::CryptoGetTextPassword(BSTR *password)
+VALUE SevenZipWriter::setWordSize(VALUE word_size)
 {
-    if (!m_password_specified){
-        return E_ABORT;
+    m_word_size = (UInt32)ConvertValueToSize(word_size, "word_size", 273);
+    return word_size;
+}
+
+VALUE SevenZipWriter::wordSize()
+{
+    return ConvertSizeToValue(m_word_size);
+}
+
+VALUE SevenZipWriter::setMatchFinder(VALUE match_finder)
+{
+    if (NIL_P(match_finder)){
+        m_match_finder.clear();
+        return match_finder;
     }
 
-    if (password){
-        *password = ConvertStringToBstr(m_password);
+    VALUE str = rb_check_string_type(match_finder);
+    if (NIL_P(str)){
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, "match_finder should be String"));
     }
-    return S_OK;
+    str = rb_funcall(str, INTERN("upcase"), 0);
+    std::string mf(RSTRING_PTR(str), RSTRING_LEN(str));
+    const char *supported[] = {
+        "BT2", "BT3", "BT4", "HC4"
+    };
+    if (std::find(supported, supported + sizeof(supported)/sizeof(supported[0]), mf)
+          == supported + sizeof(supported)/sizeof(supported[0])){
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, "match_finder should be BT2, BT3, BT4 or HC4"));
+    }
+    m_match_finder = mf;
+    return match_finder;
 }
 
+VALUE SevenZipWriter::matchFinder()
+{
+    return (m_match_finder.empty() ? Qnil : rb_str_new(m_match_finder.c_str(), m_match_finder.size()));
+}
 
-////////////////////////////////////////////////////////////////
-ArchiveExtractCallback::ArchiveExtractCallback(ArchiveReader *archive)
-     : m_archive(archive), m_password_specified(false)
+VALUE SevenZipWriter::setSolidBlockSize(VALUE solid_block_size)
 {
+    m_solid_block_size = ConvertValueToSize(solid_block_size, "solid_block_size", 1ULL << 40);
+    return solid_block_size;
 }
 
-ArchiveExtractCallback::ArchiveExtractCallback(ArchiveReader *archive, const std::string &password)
-     : m_archive(archive), m_password_specified(true), m_password(password)
+VALUE SevenZipWriter::solidBlockSize()
 {
+    return ConvertSizeToValue(m_solid_block_size);
 }
 
-STDMETHODIMP ArchiveExtractCallback::SetTotal(UInt64 size)
+VALUE SevenZipWriter::setSolidFiles(VALUE solid_files)
 {
-    // This function is called periodically, so use this function as a check function of interrupt.
-    if (m_archive->isErrorState()){
-        return E_ABORT;
-    }
-    return S_OK;
+    m_solid_files = (UInt32)ConvertValueToSize(solid_files, "solid_files", 0xFFFFFFFF);
+    return solid_files;
 }
 
-STDMETHODIMP ArchiveExtractCallback::SetCompleted(const UInt64 *completeValue)
+VALUE SevenZipWriter::solidFiles()
 {
-    // This function is called periodically, so use this function as a check function of interrupt.
-    if (m_archive->isErrorState()){
-        return E_ABORT;
-    }
-    return S_OK;
+    return ConvertSizeToValue(m_solid_files);
 }
 
-STDMETHODIMP ArchiveExtractCallback::GetStream(UInt32 index, ISequentialOutStream **outStream,
-                                               Int32 askExtractMode)
+VALUE SevenZipWriter::setSolidBlockThreads(VALUE solid_block_threads)
 {
-    switch(askExtractMode){
-      case NArchive::NExtract::NAskMode::kExtract:
-        break;
-      case NArchive::NExtract::NAskMode::kTest:
-        m_archive->setProcessingStream(Qnil, index, askExtractMode);
-        return S_OK;
-      default:
-        return S_OK;
-    }
+    m_solid_block_threads = (UInt32)ConvertValueToSize(solid_block_threads, "solid_block_threads", kMaxWriterThreads);
+    return solid_block_threads;
+}
 
-    VALUE rb_stream;
-    VALUE proc = m_archive->callbackProc();
-    bool ret = m_archive->runRubyAction([&](){
-        rb_stream = rb_funcall(proc, INTERN("call"), 2,
-                               ID2SYM(INTERN("stream")), m_archive->entryInfo(index));
-        m_archive->setProcessingStream(rb_stream, index, askExtractMode);
-    });
-    if (!ret){
-        m_archive->clearProcessingStream();
-        return E_FAIL;
-    }
+VALUE SevenZipWriter::solidBlockThreads()
+{
+    return ConvertSizeToValue(m_solid_block_threads);
+}
 
-    OutStream *stream = new OutStream(rb_stream, m_archive);
-    CMyComPtr<OutStream> ptr(stream);
-    *outStream = ptr.Detach();
+VALUE SevenZipWriter::setSolidBlockMemory(VALUE solid_block_memory)
+{
+    m_solid_block_memory = ConvertValueToSize(solid_block_memory, "solid_block_memory", 1ULL << 40);
+    return solid_block_memory;
+}
 
-    return S_OK;
+VALUE SevenZipWriter::solidBlockMemory()
+{
+    return ConvertSizeToValue(m_solid_block_memory);
 }
 
-STDMETHODIMP ArchiveExtractCallback::PrepareOperation(Int32 askExtractMode)
+VALUE SevenZipWriter::setBlockSize(VALUE block_size)
 {
-    return S_OK;
+    m_block_size = (UInt32)ConvertValueToSize(block_size, "block_size", 0xFFFFFFFF);
+    return block_size;
 }
 
-STDMETHODIMP ArchiveExtractCallback::SetOperationResult(Int32 resultOperationResult)
+VALUE SevenZipWriter::blockSize()
 {
-    UInt32 index;
-    VALUE stream;
-    Int32 askExtractMode;
-    m_archive->getProcessingStream(&stream, &index, &askExtractMode);
+    return ConvertSizeToValue(m_block_size);
+}
 
-    switch(askExtractMode){
-      case NArchive::NExtract::NAskMode::kExtract:
-        break;
-      case NArchive::NExtract::NAskMode::kTest:
-        m_archive->clearProcessingStream();
-        m_archive->setOperationResult(index, resultOperationResult);
-        return S_OK;
-      default:
-        return S_OK;
-    }
+void SevenZipWriter::checkOption()
+{
+    const bool lzma = (m_method == "LZMA" || m_method == "LZMA2");
+    const char *error = 0;
 
-    if (!NIL_P(stream)){
-        VALUE proc = m_archive->callbackProc();
-        bool ret = m_archive->runRubyAction([&](){
-            using namespace NArchive::NExtract::NOperationResult;
+    if (m_dictionary_size != 0){
+        if (lzma){
+            if (m_dictionary_size < (1 << 12) || m_dictionary_size > (1 << 30)){
+                error = "dictionary_size of LZMA should be from 4k to 1g";
+            }
+        }else if (m_method == "BZIP2"){
+            if (m_dictionary_size < 100000 || m_dictionary_size > 900000){
+                error = "dictionary_size of BZIP2 should be from 100000 to 900000";
+            }
+        }else if (m_method == "PPMD"){
+            if (m_dictionary_size < (1 << 11) || m_dictionary_size > 0xFFFFFFFF - 12 * 3){
+                error = "dictionary_size of PPMd should be from 2k to 4g";
+            }
+        }else{
+            error = "dictionary_size cannot be used with this method";
+        }
+    }
 
-            VALUE arg_hash = rb_hash_new();
-            rb_hash_aset(arg_hash, ID2SYM(INTERN("info")), m_archive->entryInfo(index));
-            rb_hash_aset(arg_hash, ID2SYM(INTERN("stream")), stream);
-            rb_hash_aset(arg_hash, ID2SYM(INTERN("success")), (resultOperationResult == kOK ? Qtrue : Qfalse));
-            rb_funcall(proc, INTERN("call"), 2, ID2SYM(INTERN("result")), arg_hash);
-        });
-        if (!ret){
-            m_archive->clearProcessingStream();
-            return E_FAIL;
+    if (m_word_size != 0){
+        if (lzma){
+            if (m_word_size < 5){
+                error = "word_size of LZMA should be from 5 to 273";
+            }
+        }else if (m_method == "DEFLATE"){
+            if (m_word_size < 3 || m_word_size > 258){
+                error = "word_size of DEFLATE should be from 3 to 258";
+            }
+        }else if (m_method == "PPMD"){
+            if (m_word_size < 2 || m_word_size > 32){
+                error = "word_size of PPMd should be from 2 to 32";
+            }
+        }else{
+            error = "word_size cannot be used with this method";
         }
     }
-    m_archive->clearProcessingStream();
 
-    return S_OK;
-}
+    if (!m_match_finder.empty() && !lzma){
+        error = "match_finder can be used only with LZMA and LZMA2";
+    }
+    if ((m_block_size != 0 || m_block_threads != 0) && m_method != "LZMA2"){
+        error = "block_size and block_threads can be used only with LZMA2";
+    }
+    if ((m_solid_block_size != 0 || m_solid_files != 0) && !m_solid){
+        error = "solid_block_size and solid_files need solid mode";
+    }
+
+    if (error){
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, error));
+    }
+}
+
+void SevenZipWriter::getCoderSetting(CoderSetting *setting)
+{
+    const UInt32 level = m_level;
+
+    setting->threads = (m_threads != 0 ? m_threads : (m_multi_threading ? GetProcessorCount() : 1));
+    setting->dictionary_size = m_dictionary_size;
+    setting->word_size = m_word_size;
+    setting->match_finder = m_match_finder;
+    setting->lzma_threads = 1;
+    setting->block_threads = 1;
+    setting->block_size = 0;
+    setting->compress_memory = 0;
+    setting->decompress_memory = 0;
+
+    // The defaults of the level are the same as HandlerOut.cpp.
+    if (m_method == "LZMA" || m_method == "LZMA2"){
+        if (setting->dictionary_size == 0){
+            setting->dictionary_size = (level >= 9 ? (1 << 26) : level >= 7 ? (1 << 25) :
+                                        level >= 5 ? (1 << 24) : level >= 3 ? (1 << 20) : (1 << 16));
+        }
+        if (setting->word_size == 0){
+            setting->word_size = (level >= 7 ? 64 : 32);
+        }
+        if (setting->match_finder.empty()){
+            setting->match_finder = (level >= 5 ? "BT4" : "HC4");
+        }
+
+        const UInt64 dict = setting->dictionary_size;
+        const bool bt = (setting->match_finder[0] == 'B');
+        const bool lzma_mt = (bt && level >= 5);  // Same as LzmaEncProps_Normalize.
+
+        // Same as Lzma2EncProps_Normalize.
+        UInt32 threads = setting->threads;
+        if (m_method == "LZMA"){
+            setting->lzma_threads = ((lzma_mt && threads > 1) ? 2 : 1);
+        }else if (m_block_threads != 0){
+            setting->block_threads = m_block_threads;
+            setting->lzma_threads = ((lzma_mt && threads / m_block_threads > 1) ? 2 : 1);
+        }else{
+            setting->lzma_threads = ((lzma_mt && threads > 1) ? 2 : 1);
+            setting->block_threads = std::min<UInt32>(std::max<UInt32>(threads / setting->lzma_threads, 1), 32);
+        }
+
+        if (m_method == "LZMA2"){
+            setting->block_size = m_block_size;
+            if (setting->block_size == 0){
+                setting->block_size = std::max<UInt64>(std::min<UInt64>(std::max<UInt64>(dict << 2, 1 << 20), 1 << 28), dict);
+            }
+        }
+
+        // Estimation of the match finder and the buffers, as 7-Zip shows.
+        UInt64 hash_size = (1 << 16);
+        if (setting->match_finder != "BT2"){
+            UInt32 hs = (UInt32)dict - 1;
+            hs |= (hs >> 1);
+            hs |= (hs >> 2);
+            hs |= (hs >> 4);
+            hs |= (hs >> 8);
+            hs >>= 1;
+            hs |= 0xFFFF;
+            if (hs > (1 << 24)){
+                hs >>= 1;
+            }
+            hash_size = (UInt64)hs + 1;
+        }
+        UInt64 size = hash_size * 4 + dict * (bt ? 8 : 4) + (2 << 20);
+        if (setting->lzma_threads > 1){
+            size += (2 << 20) + (4 << 20);
+        }
+        if (setting->block_threads > 1){
+            size += setting->block_size * 2;
+        }else{
+            size += dict * 3 / 2;
+        }
+        setting->compress_memory = size * setting->block_threads;
+        setting->decompress_memory = dict + (2 << 20);
+    }else if (m_method == "PPMD"){
+        if (setting->dictionary_size == 0){
+            setting->dictionary_size = (level >= 9 ? (192 << 20) : level >= 7 ? (1 << 26) :
+                                        level >= 5 ? (1 << 24) : (1 << 22));
+        }
+        if (setting->word_size == 0){
+            setting->word_size = (level >= 9 ? 32 : level >= 7 ? 16 : level >= 5 ? 6 : 4);
+        }
+        setting->threads = 1;
+        setting->compress_memory = setting->decompress_memory = (UInt64)setting->dictionary_size + (2 << 20);
+    }else if (m_method == "BZIP2"){
+        if (setting->dictionary_size == 0){
+            setting->dictionary_size = (level >= 5 ? 900000 : level >= 3 ? 500000 : 100000);
+        }
+        setting->compress_memory = (UInt64)(10 << 20) * setting->threads;
+        setting->decompress_memory = (7 << 20);
+    }else if (m_method == "DEFLATE"){
+        if (setting->word_size == 0){
+            setting->word_size = (level >= 9 ? 128 : level >= 7 ? 64 : 32);
+        }
+        setting->threads = 1;
+        setting->compress_memory = (level >= 7 ? (4 << 20) : (3 << 20));
+        setting->decompress_memory = (2 << 20);
+    }else{
+        setting->threads = 1;
+    }
+
+    // Each solid block compressed in parallel has its own coder, and the blocks
+    // in progress keep their input and output in the memory budget.
+    if (m_solid_block_threads > 1){
+        setting->compress_memory = setting->compress_memory * m_solid_block_threads +
+            (m_solid_block_memory != 0 ? m_solid_block_memory : kDefaultSolidBlockMemory);
+    }
+}
+
+VALUE SevenZipWriter::memoryUsage()
+{
+    checkOption();
+
+    CoderSetting setting;
+    getCoderSetting(&setting);
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(INTERN("method")), method());
+    rb_hash_aset(hash, ID2SYM(INTERN("level")), ULONG2NUM(m_level));
+    rb_hash_aset(hash, ID2SYM(INTERN("threads")), ULONG2NUM(setting.threads));
+    rb_hash_aset(hash, ID2SYM(INTERN("dictionary_size")), ConvertSizeToValue(setting.dictionary_size));
+    rb_hash_aset(hash, ID2SYM(INTERN("word_size")), ConvertSizeToValue(setting.word_size));
+    if (!setting.match_finder.empty()){
+        rb_hash_aset(hash, ID2SYM(INTERN("match_finder")),
+                     rb_str_new(setting.match_finder.c_str(), setting.match_finder.size()));
+        rb_hash_aset(hash, ID2SYM(INTERN("lzma_threads")), ULONG2NUM(setting.lzma_threads));
+    }
+    if (m_method == "LZMA2"){
+        rb_hash_aset(hash, ID2SYM(INTERN("block_threads")), ULONG2NUM(setting.block_threads));
+        rb_hash_aset(hash, ID2SYM(INTERN("block_size")), ULL2NUM(setting.block_size));
+    }
+    rb_hash_aset(hash, ID2SYM(INTERN("solid_block_threads")), ULONG2NUM(std::max<UInt32>(m_solid_block_threads, 1)));
+    rb_hash_aset(hash, ID2SYM(INTERN("compress")), ULL2NUM(setting.compress_memory));
+    rb_hash_aset(hash, ID2SYM(INTERN("decompress")), ULL2NUM(setting.decompress_memory));
+    return hash;
+}
+
+static std::string ConvertSizeToPropString(UInt64 size, char suffix = 'b')
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%llu%c", (unsigned long long)size, suffix);
+    return std::string(buf);
+}
+
+HRESULT SevenZipWriter::setOption(ISetProperties *set)
+{
+    NWindows::NCOM::CPropVariant prop[16];
+    const wchar_t *name[16];
+    Int32 num = 0;
+
+    name[num] = L"0";
+    prop[num++] = m_method.c_str();
+    name[num] = L"x";
+    prop[num++] = m_level;
+
+    name[num] = L"s";
+    if (m_solid && (m_solid_block_size != 0 || m_solid_files != 0)){
+        std::string solid;
+        if (m_solid_files != 0){
+            solid += ConvertSizeToPropString(m_solid_files, 'f');
+        }
+        if (m_solid_block_size != 0){
+            solid += ConvertSizeToPropString(m_solid_block_size);
+        }
+        prop[num++] = solid.c_str();
+    }else{
+        prop[num++] = m_solid;
+    }
+
+    name[num] = L"hc";
+    prop[num++] = m_header_compression;
+    name[num] = L"he";
+    prop[num++] = m_header_encryption;
+
+    name[num] = L"mt";
+    if (m_threads != 0){
+        prop[num++] = m_threads;
+    }else{
+        prop[num++] = m_multi_threading;
+    }
+
+    // Coder properties of the main method.
+    if (m_dictionary_size != 0){
+        name[num] = (m_method == "PPMD" ? L"0mem" : L"0d");
+        prop[num++] = ConvertSizeToPropString(m_dictionary_size).c_str();
+    }
+    if (m_word_size != 0){
+        name[num] = (m_method == "PPMD" ? L"0o" : L"0fb");
+        prop[num++] = m_word_size;
+    }
+    if (!m_match_finder.empty()){
+        name[num] = L"0mf";
+        prop[num++] = m_match_finder.c_str();
+    }
+    if (m_block_size != 0){
+        name[num] = L"0c";
+        prop[num++] = ConvertSizeToPropString(m_block_size).c_str();
+    }
+    if (m_block_threads != 0){
+        name[num] = L"0mtb";
+        prop[num++] = m_block_threads;
+    }
+    if (m_solid_block_threads != 0){
+        name[num] = L"fmt";
+        prop[num++] = m_solid_block_threads;
+    }
+    if (m_solid_block_memory != 0){
+        name[num] = L"fmm";
+        prop[num++] = m_solid_block_memory;
+    }
+    if (m_store_incompressible){
+        name[num] = L"fsi";
+        prop[num++] = m_store_incompressible;
+    }
+
+    return set->SetProperties(name, prop, num);
+}
+
+////////////////////////////////////////////////////////////////
+ZipReader::ZipReader()
+     : ArchiveReader(CLSID_CFormatZip)
+{
+}
+
+TarReader::TarReader()
+     : ArchiveReader(CLSID_CFormatTar)
+{
+}
+
+GZipReader::GZipReader()
+     : ArchiveReader(CLSID_CFormatGZip)
+{
+}
+
+BZip2Reader::BZip2Reader()
+     : ArchiveReader(CLSID_CFormatBZip2)
+{
+}
+
+XzReader::XzReader()
+     : ArchiveReader(CLSID_CFormatXz)
+{
+}
+
+////////////////////////////////////////////////////////////////
+static const char *const gZipMethods[] = { "DEFLATE", "DEFLATE64", "BZIP2", "LZMA", "PPMD", "COPY" };
+static const char *const gTarMethods[] = { "COPY" };
+static const char *const gGZipMethods[] = { "DEFLATE" };
+static const char *const gBZip2Methods[] = { "BZIP2" };
+static const char *const gXzMethods[] = { "LZMA2" };
+
+#define FORMAT_WRITER_METHODS(list) list, sizeof(list)/sizeof(list[0])
+
+//                                                              level  threads encryption
+const FormatWriter::Spec ZipWriter::kSpec   = { FORMAT_WRITER_METHODS(gZipMethods),   true,  true,  true  };
+const FormatWriter::Spec TarWriter::kSpec   = { FORMAT_WRITER_METHODS(gTarMethods),   false, false, false };
+const FormatWriter::Spec GZipWriter::kSpec  = { FORMAT_WRITER_METHODS(gGZipMethods),  true,  false, false };
+const FormatWriter::Spec BZip2Writer::kSpec = { FORMAT_WRITER_METHODS(gBZip2Methods), true,  true,  false };
+const FormatWriter::Spec XzWriter::kSpec    = { FORMAT_WRITER_METHODS(gXzMethods),    true,  true,  false };
+
+#undef FORMAT_WRITER_METHODS
+
+FormatWriter::FormatWriter(const GUID &format_guid, const Spec &spec)
+     : ArchiveWriter(format_guid),
+       m_spec(spec),
+       m_method(spec.methods[0]),
+       m_level(5),
+       m_threads(0)
+{
+}
+
+VALUE FormatWriter::setMethod(VALUE method)
+{
+    method = rb_check_string_type(method);
+    if (NIL_P(method)){
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, "method should be String"));
+    }
+
+    method = rb_funcall(method, INTERN("upcase"), 0);
+    std::string str(RSTRING_PTR(method), RSTRING_LEN(method));
+    const char *const *end = m_spec.methods + m_spec.method_num;
+    if (std::find(m_spec.methods, end, str) == end){
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, "Invalid method specified"));
+    }
+
+    m_method = str;
+    return method;
+}
+
+VALUE FormatWriter::method()
+{
+    if (m_method != "PPMD"){
+        return rb_str_new(m_method.c_str(), m_method.size());
+    }else{
+        return rb_str_new2("PPMd");
+    }
+}
+
+VALUE FormatWriter::setLevel(VALUE level)
+{
+    level = rb_check_to_integer(level, "to_int");
+    if (NIL_P(level)){
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, "level should be Integer"));
+    }
+    UInt32 l = NUM2ULONG(level);
+    if (l > 9){
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, "level should be from 0 to 9"));
+    }
+    m_level = l;
+    return level;
+}
+
+VALUE FormatWriter::level()
+{
+    return ULONG2NUM(m_level);
+}
+
+VALUE FormatWriter::setThreads(VALUE threads)
+{
+    m_threads = (UInt32)ConvertValueToSize(threads, "threads", kMaxWriterThreads);
+    return threads;
+}
+
+VALUE FormatWriter::threads()
+{
+    return ULONG2NUM(m_threads);
+}
+
+VALUE FormatWriter::setEncryptionMethod(VALUE encryption_method)
+{
+    encryption_method = rb_check_string_type(encryption_method);
+    if (NIL_P(encryption_method)){
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, "encryption_method should be String"));
+    }
+
+    encryption_method = rb_funcall(encryption_method, INTERN("upcase"), 0);
+    std::string str(RSTRING_PTR(encryption_method), RSTRING_LEN(encryption_method));
+    const char *supported[] = {
+        "ZIPCRYPTO", "AES128", "AES192", "AES256"
+    };
+    if (std::find(supported, supported + sizeof(supported)/sizeof(supported[0]), str)
+          == supported + sizeof(supported)/sizeof(supported[0])){
+        throw RubyCppUtil::RubyException(rb_exc_new2(rb_eArgError, "Invalid encryption method specified"));
+    }
+
+    m_encryption_method = str;
+    return encryption_method;
+}
+
+VALUE FormatWriter::encryptionMethod()
+{
+    if (m_encryption_method.empty()){
+        return rb_str_new2("ZIPCRYPTO");
+    }
+    return rb_str_new(m_encryption_method.c_str(), m_encryption_method.size());
+}
+
+HRESULT FormatWriter::setOption(ISetProperties *set)
+{
+    NWindows::NCOM::CPropVariant prop[4];
+    const wchar_t *name[4];
+    Int32 num = 0;
+
+    if (m_spec.method_num > 1){
+        name[num] = L"m";
+        prop[num++] = m_method.c_str();
+    }
+    if (m_spec.level){
+        name[num] = L"x";
+        prop[num++] = m_level;
+    }
+    if (m_spec.threads && m_threads != 0){
+        name[num] = L"mt";
+        prop[num++] = m_threads;
+    }
+    if (m_spec.encryption && !m_encryption_method.empty()){
+        name[num] = L"em";
+        prop[num++] = m_encryption_method.c_str();
+    }
+
+    if (num == 0){
+        return S_OK;
+    }
+    if (!set){
+        return E_NOTIMPL;
+    }
+    return set->SetProperties(name, prop, num);
+}
+
+ZipWriter::ZipWriter()
+     : FormatWriter(CLSID_CFormatZip, kSpec)
+{
+}
+
+TarWriter::TarWriter()
+     : FormatWriter(CLSID_CFormatTar, kSpec)
+{
+}
+
+GZipWriter::GZipWriter()
+     : FormatWriter(CLSID_CFormatGZip, kSpec)
+{
+}
+
+BZip2Writer::BZip2Writer()
+     : FormatWriter(CLSID_CFormatBZip2, kSpec)
+{
+}
+
+XzWriter::XzWriter()
+     : FormatWriter(CLSID_CFormatXz, kSpec)
+{
+}
+
+////////////////////////////////////////////////////////////////
+ArchiveOpenCallback::ArchiveOpenCallback(ArchiveBase *archive)
+     : m_archive(archive), m_password_specified(false)
+{
+}
+
+ArchiveOpenCallback::ArchiveOpenCallback(ArchiveBase *archive, const std::string &password)
+     : m_archive(archive), m_password_specified(true), m_password(password)
+{
+}
+
+STDMETHODIMP ArchiveOpenCallback::SetTotal(const UInt64 *files, const UInt64 *bytes)
+{
+    // This function is called periodically, so use this function as a check function of interrupt.
+    if (m_archive->isErrorState()){
+        return E_ABORT;
+    }
+    return S_OK;
+}
+
+STDMETHODIMP ArchiveOpenCallback::SetCompleted(const UInt64 *files, const UInt64 *bytes)
+{
+    // This function is called periodically, so use this function as a check function of interrupt.
+    if (m_archive->isErrorState()){
+        return E_ABORT;
+    }
+    return S_OK;
+}
+
+STDMETHODIMP ArchiveOpenCallback::CryptoGetTextPassword(BSTR *password)
+{
+    if (!m_password_specified){
+        return E_ABORT;
+    }
+
+    if (password){
+        *password = ConvertStringToBstr(m_password);
+    }
+    return S_OK;
+}
+
+
+////////////////////////////////////////////////////////////////
+ArchiveExtractCallback::ArchiveExtractCallback(ArchiveReader *archive)
+     : m_archive(archive), m_password_specified(false)
+{
+}
+
+ArchiveExtractCallback::ArchiveExtractCallback(ArchiveReader *archive, const std::string &password)
+     : m_archive(archive), m_password_specified(true), m_password(password)
+{
+}
+
+ArchiveExtractCallback::~ArchiveExtractCallback()
+{
+}
+
+STDMETHODIMP ArchiveExtractCallback::SetTotal(UInt64 size)
+{
+    // This function is called periodically, so use this function as a check function of interrupt.
+    if (m_archive->isErrorState()){
+        return E_ABORT;
+    }
+    return S_OK;
+}
+
+STDMETHODIMP ArchiveExtractCallback::SetCompleted(const UInt64 *completeValue)
+{
+    // This function is called periodically, so use this function as a check function of interrupt.
+    if (m_archive->isErrorState()){
+        return E_ABORT;
+    }
+    return S_OK;
+}
+
+STDMETHODIMP ArchiveExtractCallback::GetStream(UInt32 index, ISequentialOutStream **outStream,
+                                               Int32 askExtractMode)
+{
+    switch(askExtractMode){
+      case NArchive::NExtract::NAskMode::kExtract:
+        break;
+      case NArchive::NExtract::NAskMode::kTest:
+        m_archive->setProcessingStream(Qnil, index, askExtractMode);
+        return S_OK;
+      default:
+        return S_OK;
+    }
+
+    if (EntryPipe *pipe = m_archive->entryPipe()){
+        m_archive->setProcessingStream(Qnil, index, askExtractMode);
+        CMyComPtr<ISequentialOutStream> ptr(new PipeOutStream(pipe));
+        *outStream = ptr.Detach();
+        return S_OK;
+    }
+
+    if (m_archive->isMemoryExtract()){
+        m_archive->setProcessingStream(Qnil, index, askExtractMode);
+
+        UInt64 size = 0;
+        std::string *buffer = m_archive->memoryExtractBuffer(index, &size);
+        if (!buffer){
+            return S_OK;
+        }
+        CMyComPtr<ISequentialOutStream> ptr(new MemoryOutStream(buffer, size));
+        *outStream = ptr.Detach();
+        return S_OK;
+    }
+
+    VALUE rb_stream;
+    std::string filepath;
+    VALUE proc = m_archive->callbackProc();
+    bool ret = m_archive->runRubyAction([&](){
+        rb_stream = rb_funcall(proc, INTERN("call"), 2,
+                               ID2SYM(INTERN("stream")), m_archive->entryInfo(index));
+
+        // rb_stream can be [ true, filepath ], [ false, io ], io or nil.
+        if (RB_TYPE_P(rb_stream, T_ARRAY)){
+            if (RTEST(rb_ary_entry(rb_stream, 0))){
+                VALUE path = rb_ary_entry(rb_stream, 1);
+                filepath = std::string(RSTRING_PTR(path), RSTRING_LEN(path));
+                rb_stream = Qnil;
+            }else{
+                rb_stream = rb_ary_entry(rb_stream, 1);
+            }
+        }
+
+        m_archive->setProcessingStream(rb_stream, index, askExtractMode);
+    });
+    if (!ret){
+        m_archive->clearProcessingStream();
+        return E_FAIL;
+    }
+
+    if (!filepath.empty()){
+        FileOutStream *stream = new FileOutStream(filepath, m_archive);
+        CMyComPtr<FileOutStream> ptr(stream);
+        if (!stream->isOpened()){
+            m_archive->clearProcessingStream();
+            return E_FAIL;
+        }
+        m_file_out_stream = ptr;
+        *outStream = ptr.Detach();
+        return S_OK;
+    }
+
+    OutStream *stream = new OutStream(rb_stream, m_archive);
+    CMyComPtr<OutStream> ptr(stream);
+    m_out_stream = ptr;
+    *outStream = ptr.Detach();
+
+    return S_OK;
+}
+
+STDMETHODIMP ArchiveExtractCallback::PrepareOperation(Int32 askExtractMode)
+{
+    return S_OK;
+}
+
+STDMETHODIMP ArchiveExtractCallback::SetOperationResult(Int32 resultOperationResult)
+{
+    UInt32 index;
+    VALUE stream;
+    Int32 askExtractMode;
+    m_archive->getProcessingStream(&stream, &index, &askExtractMode);
+
+    switch(askExtractMode){
+      case NArchive::NExtract::NAskMode::kExtract:
+        break;
+      case NArchive::NExtract::NAskMode::kTest:
+        m_archive->clearProcessingStream();
+        return m_archive->setOperationResult(index, resultOperationResult) ? S_OK : E_ABORT;
+      default:
+        return S_OK;
+    }
+
+    if (EntryPipe *pipe = m_archive->entryPipe()){
+        m_archive->clearProcessingStream();
+        pipe->setOperationResult(resultOperationResult);
+        return S_OK;
+    }
+
+    if (m_archive->isMemoryExtract()){
+        m_archive->clearProcessingStream();
+        m_archive->setMemoryExtractResult(resultOperationResult);
+        return S_OK;
+    }
+
+    if (m_out_stream){
+        HRESULT ret = m_out_stream->flush();
+        m_out_stream.Release();
+        if (ret != S_OK){
+            m_archive->clearProcessingStream();
+            return E_FAIL;
+        }
+    }
+
+    bool file_out_stream = (m_file_out_stream != 0);
+    if (file_out_stream){
+        m_file_out_stream->close();
+        m_file_out_stream.Release();
+    }
+
+    if (!NIL_P(stream) || file_out_stream){
+        VALUE proc = m_archive->callbackProc();
+        bool ret = m_archive->runRubyAction([&](){
+            using namespace NArchive::NExtract::NOperationResult;
+
+            VALUE arg_hash = rb_hash_new();
+            rb_hash_aset(arg_hash, ID2SYM(INTERN("info")), m_archive->entryInfo(index));
+            rb_hash_aset(arg_hash, ID2SYM(INTERN("stream")), stream);
+            rb_hash_aset(arg_hash, ID2SYM(INTERN("success")), (resultOperationResult == kOK ? Qtrue : Qfalse));
+            rb_funcall(proc, INTERN("call"), 2, ID2SYM(INTERN("result")), arg_hash);
+        });
+        if (!ret){
+            m_archive->clearProcessingStream();
+            return E_FAIL;
+        }
+    }
+    m_archive->clearProcessingStream();
+
+    return S_OK;
+}
+
+STDMETHODIMP ArchiveExtractCallback::SetFolderStat(UInt32 folderIndex, UInt64 packSize,
+                                                   UInt64 unpackSize, UInt64 time)
+{
+    m_archive->setFolderStat(folderIndex, packSize, unpackSize, time);
+    return S_OK;
+}
 
 STDMETHODIMP ArchiveExtractCallback::CryptoGetTextPassword(BSTR *password)
 {
-    if (!m_password_specified){
-        return E_ABORT;
+    if (!m_password_specified){
+        return E_ABORT;
+    }
+
+    if (password){
+        *password = ConvertStringToBstr(m_password);
+    }
+    return S_OK;
+}
+
+
+////////////////////////////////////////////////////////////////
+ArchiveUpdateCallback::ArchiveUpdateCallback(ArchiveWriter *archive)
+     : m_archive(archive), m_password_specified(false)
+{
+}
+
+ArchiveUpdateCallback::ArchiveUpdateCallback(ArchiveWriter *archive, const std::string &password)
+     : m_archive(archive), m_password_specified(true), m_password(password)
+{
+}
+
+STDMETHODIMP ArchiveUpdateCallback::SetTotal(UInt64 size)
+{
+    // This function is called periodically, so use this function as a check function of interrupt.
+    if (m_archive->isErrorState()){
+        return E_ABORT;
+    }
+    return S_OK;
+}
+
+STDMETHODIMP ArchiveUpdateCallback::SetCompleted(const UInt64 *completeValue)
+{
+    // This function is called periodically, so use this function as a check function of interrupt.
+    if (m_archive->isErrorState()){
+        return E_ABORT;
+    }
+    return S_OK;
+}
+
+STDMETHODIMP ArchiveUpdateCallback::EnumProperties(IEnumSTATPROPSTG **enumerator)
+{
+    return E_NOTIMPL;
+}
+
+STDMETHODIMP ArchiveUpdateCallback::GetUpdateItemInfo(UInt32 index, Int32 *newData,
+                                                      Int32 *newProperties, UInt32 *indexInArchive)
+{
+    bool new_data = false;
+    bool new_properties = false;
+    UInt32 index_in_archive = (UInt32)(Int32)(-1);
+
+    bool ret = m_archive->updateItemInfo(index, &new_data, &new_properties, &index_in_archive);
+    if (!ret){
+        return E_FAIL;
+    }
+
+    if (newData){
+        *newData = static_cast<Int32>(new_data);
+    }
+    if (newProperties){
+        *newProperties = static_cast<Int32>(new_properties);
+    }
+    if (indexInArchive){
+        *indexInArchive = index_in_archive;
+    }
+
+    return S_OK;
+}
+
+STDMETHODIMP ArchiveUpdateCallback::GetProperty(UInt32 index, PROPID propID, PROPVARIANT *value)
+{
+    VALUE info = m_archive->itemInfo(index);
+    auto setOptionalProp = [&](VALUE prop, VARTYPE type){
+        if (!NIL_P(prop)){
+            ConvertValueToProp(prop, type, value);
+        }
+    };
+
+    bool ret = m_archive->runRubyAction([&](){
+        switch(propID){
+          case kpidIsAnti:
+            ConvertValueToProp(rb_funcall(info, INTERN("anti?"), 0), VT_BOOL, value);
+            break;
+          case kpidPath:
+            ConvertValueToProp(rb_funcall(info, INTERN("path"), 0), VT_BSTR, value);
+            break;
+          case kpidIsDir:
+            ConvertValueToProp(rb_funcall(info, INTERN("directory?"), 0), VT_BOOL, value);
+            break;
+          case kpidMethod:
+            {
+                VALUE method = rb_funcall(info, INTERN("compress_method"), 0);
+                if (RTEST(method)){
+                    ConvertValueToProp(method, VT_BSTR, value);
+                }
+            }
+            break;
+          case kpidSize:
+            ConvertValueToProp(rb_funcall(info, INTERN("size"), 0), VT_UI8, value);
+            break;
+          // The entries of the archive being updated may have no attribute or time.
+          case kpidAttrib:
+            setOptionalProp(rb_funcall(info, INTERN("attrib"), 0), VT_UI4);
+            break;
+          case kpidCTime:
+            setOptionalProp(rb_funcall(info, INTERN("ctime"), 0), VT_FILETIME);
+            break;
+          case kpidATime:
+            setOptionalProp(rb_funcall(info, INTERN("atime"), 0), VT_FILETIME);
+            break;
+          case kpidMTime:
+            setOptionalProp(rb_funcall(info, INTERN("mtime"), 0), VT_FILETIME);
+            break;
+          case kpidPosixAttrib:
+            ConvertValueToProp(rb_funcall(info, INTERN("posix_attrib"), 0), VT_UI4, value);
+            break;
+          case kpidUser:
+            {
+                VALUE user = rb_funcall(info, INTERN("user"), 0);
+                if (RTEST(user)){
+                    ConvertValueToProp(user, VT_BSTR, value);
+                }
+            }
+            break;
+          case kpidGroup:
+            {
+                VALUE group = rb_funcall(info, INTERN("group"), 0);
+                if (RTEST(group)){
+                    ConvertValueToProp(group, VT_BSTR, value);
+                }
+            }
+            break;
+          default:
+            rb_warning("Unknown propID");
+            break;
+        }
+    });
+    if (!ret){
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+STDMETHODIMP ArchiveUpdateCallback::GetStream(UInt32 index, ISequentialInStream **inStream)
+{
+    VALUE rb_stream;
+    std::string filepath;
+    VALUE proc = m_archive->callbackProc();
+    bool ret = m_archive->runRubyAction([&](){
+        VALUE info = m_archive->itemInfo(index);
+        VALUE ret_array = rb_funcall(proc, INTERN("call"), 2, ID2SYM(INTERN("stream")), info);
+        if (NIL_P(ret_array)){
+            rb_stream = Qnil;
+            return;
+        }
+
+        // ret_array[0]: true:  filepath
+        //               false: io
+        if (RTEST(rb_ary_entry(ret_array, 0))){
+            rb_stream = Qnil;
+            VALUE path = rb_ary_entry(ret_array, 1);
+            filepath = std::string(RSTRING_PTR(path), RSTRING_LEN(path));
+        }else{
+            rb_stream = rb_ary_entry(ret_array, 1);
+        }
+
+        m_archive->setProcessingStream(rb_stream, index);
+    });
+    if (!ret){
+        m_archive->clearProcessingStream();
+        return E_FAIL;
+    }
+
+    if (NIL_P(rb_stream) && !(filepath.empty())){
+        FileInStream *stream = new FileInStream(filepath, m_archive);
+        CMyComPtr<FileInStream> ptr(stream);
+        *inStream = ptr.Detach();
+    }else{
+        UpdateInStream *stream = new UpdateInStream(rb_stream, m_archive, index);
+        CMyComPtr<UpdateInStream> ptr(stream);
+        *inStream = ptr.Detach();
+    }
+
+    return S_OK;
+}
+
+STDMETHODIMP ArchiveUpdateCallback::SetOperationResult(Int32 operationResult)
+{
+    m_archive->finishProcessingStream();
+
+    bool ret = m_archive->runRubyAction([&](){
+        m_archive->reportFinishedStreams(false);
+    });
+    if (!ret){
+        m_archive->clearProcessingStream();
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+STDMETHODIMP ArchiveUpdateCallback::CryptoGetTextPassword2(Int32 *passwordIsDefined, BSTR *password)
+{
+    if (m_password_specified){
+        *passwordIsDefined = 1;
+        *password = ConvertStringToBstr(m_password);
+    }else{
+        *passwordIsDefined = 0;
+    }
+    return S_OK;
+}
+
+STDMETHODIMP ArchiveUpdateCallback::GetSample(UInt32 index, UInt64 offset, void *data, UInt32 size, UInt32 *processedSize)
+{
+    *processedSize = 0;
+    VALUE info = m_archive->itemInfo(index);
+
+    bool ret = m_archive->runRubyAction([&](){
+        VALUE sample = rb_funcall(info, INTERN("sample"), 2, ULL2NUM(offset), ULONG2NUM(size));
+        if (NIL_P(sample)){
+            return;
+        }
+        StringValue(sample);
+        UInt32 len = std::min<UInt32>(size, RSTRING_LEN(sample));
+        std::memcpy(data, RSTRING_PTR(sample), len);
+        *processedSize = len;
+    });
+    if (!ret){
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+
+////////////////////////////////////////////////////////////////
+const UInt32 InStream::kDefaultReadAheadSize;
+const UInt32 InStream::kMaxReadAheadSize;
+const UInt32 InStream::kReadAheadAlignment;
+
+InStream::InStream(VALUE stream, ArchiveBase *archive, UInt32 read_ahead_size)
+     : m_stream(stream), m_archive(archive),
+       m_read_ahead_size(std::min(read_ahead_size, kMaxReadAheadSize)),
+       m_buffer_pos(0), m_buffer_len(0),
+       m_pos_valid(false), m_pos(0), m_stream_pos(0),
+       m_size_valid(false), m_size(0)
+{
+    if (m_read_ahead_size != 0){
+        // Round up to a multiple of the alignment so that windows stay aligned.
+        m_read_ahead_size = (m_read_ahead_size + kReadAheadAlignment - 1) & ~(kReadAheadAlignment - 1);
+    }
+}
+
+// Until Seek is called, positions are relative to where the stream was,
+// so that sequential streams need only stream.read.
+bool InStream::initPosition()
+{
+    if (m_pos_valid){
+        return true;
+    }
+    if (m_stream_pos == (UInt64)-1){
+        return false;
+    }
+
+    UInt64 base = 0;
+    bool ret = m_archive->runRubyAction([&](){
+        VALUE pos = rb_funcall(m_stream, INTERN("tell"), 0);
+        base = NUM2ULL(pos) - m_stream_pos;
+    });
+    if (!ret){
+        return false;
+    }
+
+    m_pos += base;
+    m_stream_pos += base;
+    m_buffer_pos += base;
+    m_pos_valid = true;
+    return true;
+}
+
+// One Ruby call. Seek only if the stream is not at pos.
+bool InStream::readStream(UInt64 pos, Byte *data, UInt32 size, UInt32 *read_size)
+{
+    *read_size = 0;
+    bool ret = m_archive->runRubyAction([&](){
+        if (m_stream_pos != pos){
+            rb_funcall(m_stream, INTERN("seek"), 2, ULL2NUM(pos), rb_const_get(rb_cIO, INTERN("SEEK_SET")));
+            m_stream_pos = pos;
+        }
+
+        VALUE str = rb_funcall(m_stream, INTERN("read"), 1, ULONG2NUM(size));
+        if (!NIL_P(str)){
+            StringValue(str);
+            UInt32 len = (UInt32)std::min<long>(RSTRING_LEN(str), size);
+            memcpy(data, RSTRING_PTR(str), len);
+            *read_size = len;
+            m_stream_pos += len;
+        }
+    });
+    if (!ret){
+        // The position of the stream is unknown now.
+        m_stream_pos = (UInt64)-1;
+    }
+    return ret;
+}
+
+STDMETHODIMP InStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
+{
+    if (!initPosition()){
+        return E_FAIL;
+    }
+
+    Int64 base;
+    switch(seekOrigin){
+      case 0:
+        base = 0;
+        break;
+      case 1:
+        base = (Int64)m_pos;
+        break;
+      case 2:
+        if (!m_size_valid){
+            bool ret = m_archive->runRubyAction([&](){
+                rb_funcall(m_stream, INTERN("seek"), 2, INT2FIX(0), rb_const_get(rb_cIO, INTERN("SEEK_END")));
+                m_size = m_stream_pos = NUM2ULL(rb_funcall(m_stream, INTERN("tell"), 0));
+            });
+            if (!ret){
+                m_stream_pos = (UInt64)-1;
+                return E_FAIL;
+            }
+            m_size_valid = true;
+        }
+        base = (Int64)m_size;
+        break;
+      default:
+        return E_FAIL;
+    }
+    if (base + offset < 0){
+        return E_FAIL;
+    }
+
+    m_pos = (UInt64)(base + offset);
+    if (newPosition){
+        *newPosition = m_pos;
+    }
+
+    return S_OK;
+}
+
+STDMETHODIMP InStream::Read(void *data, UInt32 size, UInt32 *processedSize)
+{
+    if (processedSize){
+        *processedSize = 0;
+    }
+    if (size == 0){
+        return S_OK;
+    }
+    if (!data){
+        return E_FAIL;
+    }
+
+    Byte *dest = static_cast<Byte*>(data);
+    UInt32 done = 0;
+    while (done < size){
+        if (m_pos >= m_buffer_pos && m_pos < m_buffer_pos + m_buffer_len){
+            UInt32 offset = (UInt32)(m_pos - m_buffer_pos);
+            UInt32 len = std::min(m_buffer_len - offset, size - done);
+            memcpy(dest + done, &m_buffer[offset], len);
+            m_pos += len;
+            done += len;
+            continue;
+        }
+
+        UInt32 rest = size - done;
+        if (rest >= m_read_ahead_size){
+            // Large reads bypass the window.
+            UInt32 len;
+            if (!readStream(m_pos, dest + done, rest, &len)){
+                return E_FAIL;
+            }
+            m_pos += len;
+            done += len;
+            break;
+        }
+
+        UInt64 window_pos = m_pos & ~(UInt64)(kReadAheadAlignment - 1);
+        if (m_buffer.size() < m_read_ahead_size){
+            m_buffer.resize(m_read_ahead_size);
+        }
+        m_buffer_len = 0;
+        if (!readStream(window_pos, &m_buffer[0], m_read_ahead_size, &m_buffer_len)){
+            return E_FAIL;
+        }
+        m_buffer_pos = window_pos;
+        if (m_pos >= m_buffer_pos + m_buffer_len){
+            break;  // End of the stream.
+        }
+    }
+
+    if (processedSize){
+        *processedSize = done;
+    }
+
+    return S_OK;
+}
+
+////////////////////////////////////////////////////////////////
+UpdateInStream::~UpdateInStream()
+{
+    m_writer->releaseProcessingStream(m_index);
+}
+
+////////////////////////////////////////////////////////////////
+FileInStream::FileInStream(const std::string  &filename, ArchiveBase *archive)
+     : m_archive(archive)
+#ifdef USE_WIN32_FILE_API
+     , m_file_handle(INVALID_HANDLE_VALUE)
+#else
+     , m_file(filename.c_str(), std::ios::binary)
+#endif
+{
+#ifdef USE_WIN32_FILE_API
+    BSTR name = ConvertStringToBstr(filename);
+    m_file_handle = CreateFileW(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, NULL);
+    SysFreeString(name);
+#else
+    // Nothing to do
+#endif
+}
+
+FileInStream::~FileInStream()
+{
+#ifdef USE_WIN32_FILE_API
+    if (m_file_handle == INVALID_HANDLE_VALUE){
+        return;
+    }
+
+    CloseHandle(m_file_handle);
+    m_file_handle = INVALID_HANDLE_VALUE;
+#else
+    // Nothing to do
+#endif
+}
+
+STDMETHODIMP FileInStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
+{
+#ifdef USE_WIN32_FILE_API
+    if (m_file_handle == INVALID_HANDLE_VALUE){
+        return E_FAIL;
+    }
+
+    DWORD method;
+    switch(seekOrigin){
+      case 0:
+        method = FILE_BEGIN;
+        break;
+      case 1:
+        method = FILE_CURRENT;
+        break;
+      case 2:
+        method = FILE_END;
+        break;
+      default:
+        return E_FAIL;
+    }
+
+    DWORD low, high;
+    low = (DWORD)(offset & 0xFFFFFFFFUL);
+    high = (DWORD)((offset >> 32) & 0xFFFFFFFFUL);
+    DWORD new_low = SetFilePointer(m_file_handle, (LONG)low, (PLONG)&high, method);
+
+    if (newPosition){
+        *newPosition = (((UInt64)high) << 32) + ((UInt64)new_low);
+    }
+    return S_OK;
+#else
+    if (!m_file.is_open()){
+        return E_FAIL;
+    }
+
+    std::ios::seekdir method;
+    switch(seekOrigin){
+      case 0:
+        method = std::ios::beg;
+        break;
+      case 1:
+        method = std::ios::cur;
+        break;
+      case 2:
+        method = std::ios::end;
+        break;
+      default:
+        return E_FAIL;
+    }
+
+    std::streamoff sto = offset;
+    m_file.seekg(sto, method);
+    if (newPosition){
+        *newPosition = m_file.tellg();
+    }
+    return S_OK;
+#endif
+}
+
+STDMETHODIMP FileInStream::Read(void *data, UInt32 size, UInt32 *processedSize)
+{
+#ifdef USE_WIN32_FILE_API
+    if (m_file_handle == INVALID_HANDLE_VALUE){
+        return E_FAIL;
     }
 
-    if (password){
-        *password = ConvertStringToBstr(m_password);
+    DWORD processed_size;
+    BOOL ret = ReadFile(m_file_handle, data, size, &processed_size, NULL);
+    if (!ret){
+        return E_FAIL;
+    }
+
+    if (processedSize){
+        *processedSize = processed_size;
+    }
+
+    return S_OK;
+#else
+    if (!m_file.is_open()){
+        return E_FAIL;
+    }
+
+    m_file.read(reinterpret_cast<char*>(data), size);
+    if (processedSize){
+        *processedSize = m_file.gcount();
     }
     return S_OK;
+#endif
 }
 
+bool FileInStream::isOpened() const
+{
+#ifdef USE_WIN32_FILE_API
+    return m_file_handle != INVALID_HANDLE_VALUE;
+#else
+    return m_file.is_open();
+#endif
+}
 
+#ifndef USE_WIN32_FILE_API
 ////////////////////////////////////////////////////////////////
-ArchiveUpdateCallback::ArchiveUpdateCallback(ArchiveWriter *archive)
-     : m_archive(archive), m_password_specified(false)
+MappedFileInStream::MappedFileInStream()
+     : m_fd(-1), m_errno(0), m_use_map(false), m_map(0), m_size(0), m_pos(0)
 {
 }
 
-ArchiveUpdateCallback::ArchiveUpdateCallback(ArchiveWriter *archive, const std::string &password)
-     : m_archive(archive), m_password_specified(true), m_password(password)
+MappedFileInStream::MappedFileInStream(const std::string &filename, bool use_map)
+     : m_fd(-1), m_errno(0), m_use_map(false), m_map(0), m_size(0), m_pos(0)
 {
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0){
+        m_errno = errno;
+        return;
+    }
+    init(fd, use_map);
 }
 
-STDMETHODIMP ArchiveUpdateCallback::SetTotal(UInt64 size)
+MappedFileInStream *MappedFileInStream::duplicate() const
 {
-    // This function is called periodically, so use this function as a check function of interrupt.
-    if (m_archive->isErrorState()){
-        return E_ABORT;
+    MappedFileInStream *stream = new MappedFileInStream();
+    const int fd = (m_fd >= 0 ? ::dup(m_fd) : -1);
+    if (fd < 0){
+        stream->m_errno = (m_fd >= 0 ? errno : EBADF);
+        return stream;
     }
-    return S_OK;
+    stream->init(fd, m_use_map);
+    return stream;
 }
 
-STDMETHODIMP ArchiveUpdateCallback::SetCompleted(const UInt64 *completeValue)
+void MappedFileInStream::init(int fd, bool use_map)
 {
-    // This function is called periodically, so use this function as a check function of interrupt.
-    if (m_archive->isErrorState()){
-        return E_ABORT;
+    m_fd = fd;
+    m_use_map = use_map;
+
+    struct stat st;
+    if (::fstat(m_fd, &st) != 0){
+        m_errno = errno;
+        ::close(m_fd);
+        m_fd = -1;
+        return;
+    }
+    m_size = (UInt64)st.st_size;
+
+    // Empty files cannot be mapped, and huge files may not fit in the address space.
+    // pread is used in those cases.
+    if (m_use_map && m_size != 0 && m_size <= (UInt64)(size_t)-1){
+        void *p = ::mmap(NULL, (size_t)m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (p != MAP_FAILED){
+            m_map = reinterpret_cast<Byte*>(p);
+        }
     }
-    return S_OK;
 }
 
-STDMETHODIMP ArchiveUpdateCallback::EnumProperties(IEnumSTATPROPSTG **enumerator)
+MappedFileInStream::~MappedFileInStream()
 {
-    return E_NOTIMPL;
+    if (m_map){
+        ::munmap(m_map, (size_t)m_size);
+        m_map = 0;
+    }
+    if (m_fd >= 0){
+        ::close(m_fd);
+        m_fd = -1;
+    }
 }
 
-STDMETHODIMP ArchiveUpdateCallback::GetUpdateItemInfo(UInt32 index, Int32 *newData,
-                                                      Int32 *newProperties, UInt32 *indexInArchive)
+void MappedFileInStream::adviseSequential(bool sequential)
 {
-    bool new_data = false;
-    bool new_properties = false;
-    UInt32 index_in_archive = (UInt32)(Int32)(-1);
+    if (m_map){
+        ::madvise(m_map, (size_t)m_size, (sequential ? MADV_SEQUENTIAL : MADV_RANDOM));
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    else if (m_fd >= 0){
+        ::posix_fadvise(m_fd, 0, 0, (sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_RANDOM));
+    }
+#endif
+}
 
-    bool ret = m_archive->updateItemInfo(index, &new_data, &new_properties, &index_in_archive);
-    if (!ret){
+STDMETHODIMP MappedFileInStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
+{
+    if (m_fd < 0){
         return E_FAIL;
     }
 
-    if (newData){
-        *newData = static_cast<Int32>(new_data);
+    Int64 base;
+    switch(seekOrigin){
+      case 0:
+        base = 0;
+        break;
+      case 1:
+        base = (Int64)m_pos;
+        break;
+      case 2:
+        base = (Int64)m_size;
+        break;
+      default:
+        return E_FAIL;
     }
-    if (newProperties){
-        *newProperties = static_cast<Int32>(new_properties);
+    if (base + offset < 0){
+        return E_FAIL;
     }
-    if (indexInArchive){
-        *indexInArchive = index_in_archive;
+
+    m_pos = (UInt64)(base + offset);
+    if (newPosition){
+        *newPosition = m_pos;
+    }
+    return S_OK;
+}
+
+STDMETHODIMP MappedFileInStream::Read(void *data, UInt32 size, UInt32 *processedSize)
+{
+    if (processedSize){
+        *processedSize = 0;
+    }
+    if (m_fd < 0){
+        return E_FAIL;
+    }
+    if (m_pos >= m_size){
+        return S_OK;
+    }
+
+    UInt32 read_size = (UInt32)std::min((UInt64)size, m_size - m_pos);
+    if (m_map){
+        // Touching the pages beyond the end of a truncated file raises SIGBUS.
+        struct stat st;
+        if (::fstat(m_fd, &st) != 0 || (UInt64)st.st_size < m_pos + read_size){
+            return E_FAIL;
+        }
+        std::memcpy(data, m_map + m_pos, read_size);
+    }else{
+        ssize_t ret;
+        do{
+            ret = ::pread(m_fd, data, read_size, (off_t)m_pos);
+        }while(ret < 0 && errno == EINTR);
+        if (ret < 0){
+            return E_FAIL;
+        }
+        read_size = (UInt32)ret;
     }
 
+    m_pos += read_size;
+    if (processedSize){
+        *processedSize = read_size;
+    }
     return S_OK;
 }
+#endif
 
-STDMETHODIMP ArchiveUpdateCallback::GetProperty(UInt32 index, PROPID propID, PROPVARIANT *value)
+////////////////////////////////////////////////////////////////
+const UInt32 OutStream::kWriteBufferSize;
+
+OutStream::OutStream(VALUE stream, ArchiveBase *archive)
+     : m_stream(stream), m_archive(archive),
+       m_buffer_pos(0),
+       m_pos_valid(false), m_pos(0), m_stream_pos(0)
 {
-    VALUE info = m_archive->itemInfo(index);
+}
+
+// Until Seek is called, positions are relative to where the stream was,
+// so that sequential streams need only stream.write.
+bool OutStream::initPosition()
+{
+    if (m_pos_valid){
+        return true;
+    }
+    if (m_stream_pos == (UInt64)-1){
+        return false;
+    }
 
+    UInt64 base = 0;
     bool ret = m_archive->runRubyAction([&](){
-        switch(propID){
-          case kpidIsAnti:
-            ConvertValueToProp(rb_funcall(info, INTERN("anti?"), 0), VT_BOOL, value);
-            break;
-          case kpidPath:
-            ConvertValueToProp(rb_funcall(info, INTERN("path"), 0), VT_BSTR, value);
-            break;
-          case kpidIsDir:
-            ConvertValueToProp(rb_funcall(info, INTERN("directory?"), 0), VT_BOOL, value);
-            break;
-          case kpidSize:
-            ConvertValueToProp(rb_funcall(info, INTERN("size"), 0), VT_UI8, value);
-            break;
-          case kpidAttrib:
-            ConvertValueToProp(rb_funcall(info, INTERN("attrib"), 0), VT_UI4, value);
-            break;
-          case kpidCTime:
-            ConvertValueToProp(rb_funcall(info, INTERN("ctime"), 0), VT_FILETIME, value);
-            break;
-          case kpidATime:
-            ConvertValueToProp(rb_funcall(info, INTERN("atime"), 0), VT_FILETIME, value);
-            break;
-          case kpidMTime:
-            ConvertValueToProp(rb_funcall(info, INTERN("mtime"), 0), VT_FILETIME, value);
-            break;
-          case kpidPosixAttrib:
-            ConvertValueToProp(rb_funcall(info, INTERN("posix_attrib"), 0), VT_UI4, value);
-            break;
-          case kpidUser:
-            {
-                VALUE user = rb_funcall(info, INTERN("user"), 0);
-                if (RTEST(user)){
-                    ConvertValueToProp(user, VT_BSTR, value);
-                }
-            }
-            break;
-          case kpidGroup:
-            {
-                VALUE group = rb_funcall(info, INTERN("group"), 0);
-                if (RTEST(group)){
-                    ConvertValueToProp(group, VT_BSTR, value);
-                }
-            }
-            break;
-          default:
-            rb_warning("Unknown propID");
-            break;
-        }
+        VALUE pos = rb_funcall(m_stream, INTERN("tell"), 0);
+        base = NUM2ULL(pos) - m_stream_pos;
     });
     if (!ret){
-        return E_FAIL;
+        return false;
     }
 
-    return S_OK;
+    m_pos += base;
+    m_stream_pos += base;
+    m_buffer_pos += base;
+    m_pos_valid = true;
+    return true;
 }
 
-STDMETHODIMP ArchiveUpdateCallback::GetStream(UInt32 index, ISequentialInStream **inStream)
+// One Ruby call for one chunk. Seek only if the stream is not at pos.
+bool OutStream::writeStream(UInt64 pos, const char *data, UInt32 size)
 {
-    VALUE rb_stream;
-    std::string filepath;
-    VALUE proc = m_archive->callbackProc();
     bool ret = m_archive->runRubyAction([&](){
-        VALUE info = m_archive->itemInfo(index);
-        VALUE ret_array = rb_funcall(proc, INTERN("call"), 2, ID2SYM(INTERN("stream")), info);
-        if (NIL_P(ret_array)){
-            rb_stream = Qnil;
-            return;
+        if (m_stream_pos != pos){
+            rb_funcall(m_stream, INTERN("seek"), 2, ULL2NUM(pos), rb_const_get(rb_cIO, INTERN("SEEK_SET")));
+            m_stream_pos = pos;
         }
 
-        // ret_array[0]: true:  filepath
-        //               false: io
-        if (RTEST(rb_ary_entry(ret_array, 0))){
-            rb_stream = Qnil;
-            VALUE path = rb_ary_entry(ret_array, 1);
-            filepath = std::string(RSTRING_PTR(path), RSTRING_LEN(path));
-        }else{
-            rb_stream = rb_ary_entry(ret_array, 1);
+        UInt32 done = 0;
+        while (done < size){
+            VALUE str = rb_str_new(data + done, size - done);
+            VALUE len = rb_funcall(m_stream, INTERN("write"), 1, str);
+            UInt32 written = (NIL_P(len) ? 0 : (UInt32)std::min<unsigned long>(NUM2ULONG(len), size - done));
+            if (written == 0){
+                rb_raise(rb_eIOError, "stream.write wrote nothing");
+            }
+            done += written;
+            m_stream_pos += written;
         }
-
-        m_archive->setProcessingStream(rb_stream, index);
     });
     if (!ret){
-        m_archive->clearProcessingStream();
-        return E_FAIL;
+        // The position of the stream is unknown now.
+        m_stream_pos = (UInt64)-1;
     }
+    return ret;
+}
 
-    if (NIL_P(rb_stream) && !(filepath.empty())){
-        FileInStream *stream = new FileInStream(filepath, m_archive);
-        CMyComPtr<FileInStream> ptr(stream);
-        *inStream = ptr.Detach();
-    }else{
-        InStream *stream = new InStream(rb_stream, m_archive);
-        CMyComPtr<InStream> ptr(stream);
-        *inStream = ptr.Detach();
+HRESULT OutStream::flush()
+{
+    if (m_buffer.empty()){
+        return S_OK;
+    }
+
+    bool ret = writeStream(m_buffer_pos, m_buffer.data(), (UInt32)m_buffer.size());
+    m_buffer.clear();
+    if (!ret){
+        return E_FAIL;
     }
 
     return S_OK;
 }
 
-STDMETHODIMP ArchiveUpdateCallback::SetOperationResult(Int32 operationResult)
+STDMETHODIMP OutStream::Write(const void *data, UInt32 size, UInt32 *processedSize)
 {
-    UInt32 index;
-    VALUE stream;
-    m_archive->getProcessingStream(&stream, &index);
+    if (processedSize){
+        *processedSize = 0;
+    }
+    if (size == 0){
+        return S_OK;
+    }
 
-    if (!NIL_P(stream)){
-        VALUE proc = m_archive->callbackProc();
-        bool ret = m_archive->runRubyAction([&](){
-            VALUE arg_hash = rb_hash_new();
-            rb_hash_aset(arg_hash, ID2SYM(INTERN("info")), m_archive->itemInfo(index));
-            rb_hash_aset(arg_hash, ID2SYM(INTERN("stream")), stream);
-            rb_funcall(proc, INTERN("call"), 2, ID2SYM(INTERN("result")), arg_hash);
-        });
-        if (!ret){
-            m_archive->clearProcessingStream();
+    const char *src = reinterpret_cast<const char*>(data);
+    UInt64 buffer_end = m_buffer_pos + m_buffer.size();
+    if (!m_buffer.empty() && (m_pos < m_buffer_pos || m_pos > buffer_end)){
+        if (flush() != S_OK){
+            // When killEventLoopThread is called in cancelAction
+            // return S_OK even if error occurs.
+            //
+            // Detail:
+            //  It seems that BZip2Encoder has a bug.
+            //  If Write method returns E_FAIL, some Events are not set in that file
+            //  because OutBuffer throws an exception in Encoder->WriteBytes.
             return E_FAIL;
         }
     }
-    m_archive->clearProcessingStream();
 
-    return S_OK;
-}
+    if (m_buffer.empty()){
+        m_buffer_pos = m_pos;
+        if (size >= kWriteBufferSize){
+            // Large writes bypass the buffer.
+            if (!writeStream(m_pos, src, size)){
+                return E_FAIL;
+            }
+            m_pos += size;
+            if (processedSize){
+                *processedSize = size;
+            }
+            return S_OK;
+        }
+    }
 
-STDMETHODIMP ArchiveUpdateCallback::CryptoGetTextPassword2(Int32 *passwordIsDefined, BSTR *password)
-{
-    if (m_password_specified){
-        *passwordIsDefined = 1;
-        *password = ConvertStringToBstr(m_password);
-    }else{
-        *passwordIsDefined = 0;
+    // Overwrite the pending bytes from m_pos, and append the rest.
+    size_t offset = (size_t)(m_pos - m_buffer_pos);
+    size_t overlap = std::min<size_t>(m_buffer.size() - offset, size);
+    m_buffer.replace(offset, overlap, src, overlap);
+    m_buffer.append(src + overlap, size - overlap);
+    m_pos += size;
+    if (processedSize){
+        *processedSize = size;
     }
-    return S_OK;
-}
 
+    if (m_buffer.size() >= kWriteBufferSize && flush() != S_OK){
+        return E_FAIL;
+    }
 
-////////////////////////////////////////////////////////////////
-InStream::InStream(VALUE stream, ArchiveBase *archive)
-     : m_stream(stream), m_archive(archive)
-{
+    return S_OK;
 }
 
-STDMETHODIMP InStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
+STDMETHODIMP OutStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
 {
-    bool ret = m_archive->runRubyAction([&](){
-        VALUE whence;
-        switch(seekOrigin){
-          case 0:
-            whence = rb_const_get(rb_cIO, INTERN("SEEK_SET"));
-            break;
-          case 1:
-            whence = rb_const_get(rb_cIO, INTERN("SEEK_CUR"));
-            break;
-          case 2:
-            whence = rb_const_get(rb_cIO, INTERN("SEEK_END"));
-            break;
-          default:
-            return;
-        }
+    if (!initPosition()){
+        return E_FAIL;
+    }
 
-        rb_funcall(m_stream, INTERN("seek"), 2, LL2NUM(offset), whence);
-        if (newPosition){
-            VALUE pos = rb_funcall(m_stream, INTERN("tell"), 0);
-            *newPosition = NUM2ULONG(pos);
+    Int64 base;
+    switch(seekOrigin){
+      case 0:
+        base = 0;
+        break;
+      case 1:
+        base = (Int64)m_pos;
+        break;
+      case 2:
+        {
+            if (flush() != S_OK){
+                return E_FAIL;
+            }
+            bool ret = m_archive->runRubyAction([&](){
+                rb_funcall(m_stream, INTERN("seek"), 2, INT2FIX(0), rb_const_get(rb_cIO, INTERN("SEEK_END")));
+                m_stream_pos = NUM2ULL(rb_funcall(m_stream, INTERN("tell"), 0));
+            });
+            if (!ret){
+                m_stream_pos = (UInt64)-1;
+                return E_FAIL;
+            }
+            base = (Int64)m_stream_pos;
         }
-    });
-    if (!ret){
+        break;
+      default:
         return E_FAIL;
     }
+    if (base + offset < 0){
+        return E_FAIL;
+    }
+
+    m_pos = (UInt64)(base + offset);
+    if (newPosition){
+        *newPosition = m_pos;
+    }
 
     return S_OK;
 }
 
-STDMETHODIMP InStream::Read(void *data, UInt32 size, UInt32 *processedSize)
+STDMETHODIMP OutStream::SetSize(UInt64 size)
 {
-    bool ret = m_archive->runRubyAction([&](){
-        VALUE str = rb_funcall(m_stream, INTERN("read"), 1, ULONG2NUM(size));
-        if (!NIL_P(str) && data){
-            memcpy(data, RSTRING_PTR(str), RSTRING_LEN(str));
-        }
+    if (flush() != S_OK){
+        return E_FAIL;
+    }
 
-        if (processedSize){
-            *processedSize = (NIL_P(str) ? 0 : RSTRING_LEN(str));
-        }
+    bool ret = m_archive->runRubyAction([&](){
+        rb_funcall(m_stream, INTERN("truncate"), 1, ULL2NUM(size));
     });
     if (!ret){
-        if (processedSize){
-            *processedSize = 0;
-        }
         return E_FAIL;
     }
 
@@ -1555,25 +4653,45 @@ STDMETHODIMP InStream::Read(void *data, UInt32 size, UInt32 *processedSize)
 }
 
 ////////////////////////////////////////////////////////////////
-FileInStream::FileInStream(const std::string  &filename, ArchiveBase *archive)
+FileOutStream::FileOutStream(const std::string &filename, ArchiveBase *archive)
      : m_archive(archive)
 #ifdef USE_WIN32_FILE_API
      , m_file_handle(INVALID_HANDLE_VALUE)
 #else
-     , m_file(filename.c_str(), std::ios::binary)
+     , m_fd(-1)
 #endif
 {
 #ifdef USE_WIN32_FILE_API
     BSTR name = ConvertStringToBstr(filename);
-    m_file_handle = CreateFileW(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+    m_file_handle = CreateFileW(name, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
                                 FILE_ATTRIBUTE_NORMAL, NULL);
     SysFreeString(name);
 #else
-    // Nothing to do
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_CLOEXEC
+    flags |= O_CLOEXEC;
+#endif
+    do{
+        m_fd = ::open(filename.c_str(), flags, 0666);
+    }while(m_fd < 0 && errno == EINTR);
 #endif
 }
 
-FileInStream::~FileInStream()
+FileOutStream::~FileOutStream()
+{
+    close();
+}
+
+bool FileOutStream::isOpened() const
+{
+#ifdef USE_WIN32_FILE_API
+    return m_file_handle != INVALID_HANDLE_VALUE;
+#else
+    return m_fd >= 0;
+#endif
+}
+
+void FileOutStream::close()
 {
 #ifdef USE_WIN32_FILE_API
     if (m_file_handle == INVALID_HANDLE_VALUE){
@@ -1583,11 +4701,62 @@ FileInStream::~FileInStream()
     CloseHandle(m_file_handle);
     m_file_handle = INVALID_HANDLE_VALUE;
 #else
-    // Nothing to do
+    if (m_fd < 0){
+        return;
+    }
+
+    ::close(m_fd);
+    m_fd = -1;
 #endif
 }
 
-STDMETHODIMP FileInStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
+STDMETHODIMP FileOutStream::Write(const void *data, UInt32 size, UInt32 *processedSize)
+{
+    if (processedSize){
+        *processedSize = 0;
+    }
+
+#ifdef USE_WIN32_FILE_API
+    if (m_file_handle == INVALID_HANDLE_VALUE){
+        return E_FAIL;
+    }
+
+    DWORD processed_size;
+    BOOL ret = WriteFile(m_file_handle, data, size, &processed_size, NULL);
+    if (!ret){
+        return E_FAIL;
+    }
+
+    if (processedSize){
+        *processedSize = processed_size;
+    }
+
+    return S_OK;
+#else
+    if (m_fd < 0){
+        return E_FAIL;
+    }
+
+    const char *p = reinterpret_cast<const char*>(data);
+    while(size > 0){
+        ssize_t ret = ::write(m_fd, p, size);
+        if (ret < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return E_FAIL;
+        }
+        p += ret;
+        size -= (UInt32)ret;
+        if (processedSize){
+            *processedSize += (UInt32)ret;
+        }
+    }
+    return S_OK;
+#endif
+}
+
+STDMETHODIMP FileOutStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
 {
 #ifdef USE_WIN32_FILE_API
     if (m_file_handle == INVALID_HANDLE_VALUE){
@@ -1609,158 +4778,330 @@ STDMETHODIMP FileInStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosi
         return E_FAIL;
     }
 
-    DWORD low, high;
-    low = (DWORD)(offset & 0xFFFFFFFFUL);
-    high = (DWORD)((offset >> 32) & 0xFFFFFFFFUL);
-    DWORD new_low = SetFilePointer(m_file_handle, (LONG)low, (PLONG)&high, method);
+    LARGE_INTEGER distance, new_pos;
+    distance.QuadPart = offset;
+    if (!SetFilePointerEx(m_file_handle, distance, &new_pos, method)){
+        return E_FAIL;
+    }
 
     if (newPosition){
-        *newPosition = (((UInt64)high) << 32) + ((UInt64)new_low);
+        *newPosition = (UInt64)new_pos.QuadPart;
     }
     return S_OK;
 #else
-    if (!m_file.is_open()){
+    if (m_fd < 0){
         return E_FAIL;
     }
 
-    std::ios::seekdir method;
+    int whence;
     switch(seekOrigin){
       case 0:
-        method = std::ios::beg;
+        whence = SEEK_SET;
         break;
       case 1:
-        method = std::ios::cur;
+        whence = SEEK_CUR;
         break;
       case 2:
-        method = std::ios::end;
+        whence = SEEK_END;
         break;
       default:
         return E_FAIL;
     }
 
-    std::streamoff sto = offset;
-    m_file.seekg(sto, method);
+    off_t pos = ::lseek(m_fd, (off_t)offset, whence);
+    if (pos == (off_t)-1){
+        return E_FAIL;
+    }
+
     if (newPosition){
-        *newPosition = m_file.tellg();
+        *newPosition = (UInt64)pos;
     }
     return S_OK;
 #endif
 }
 
-STDMETHODIMP FileInStream::Read(void *data, UInt32 size, UInt32 *processedSize)
+STDMETHODIMP FileOutStream::SetSize(UInt64 size)
 {
 #ifdef USE_WIN32_FILE_API
     if (m_file_handle == INVALID_HANDLE_VALUE){
         return E_FAIL;
     }
 
-    DWORD processed_size;
-    BOOL ret = ReadFile(m_file_handle, data, size, &processed_size, NULL);
-    if (!ret){
+    LARGE_INTEGER zero, current, new_size;
+    zero.QuadPart = 0;
+    new_size.QuadPart = (LONGLONG)size;
+    if (!SetFilePointerEx(m_file_handle, zero, &current, FILE_CURRENT) ||
+        !SetFilePointerEx(m_file_handle, new_size, NULL, FILE_BEGIN) ||
+        !SetEndOfFile(m_file_handle) ||
+        !SetFilePointerEx(m_file_handle, current, NULL, FILE_BEGIN)){
         return E_FAIL;
     }
-
-    if (processedSize){
-        *processedSize = processed_size;
-    }
-
     return S_OK;
 #else
-    if (!m_file.is_open()){
+    if (m_fd < 0){
         return E_FAIL;
     }
 
-    m_file.read(reinterpret_cast<char*>(data), size);
-    if (processedSize){
-        *processedSize = m_file.gcount();
+    if (::ftruncate(m_fd, (off_t)size) != 0){
+        return E_FAIL;
     }
     return S_OK;
 #endif
 }
 
 ////////////////////////////////////////////////////////////////
-OutStream::OutStream(VALUE stream, ArchiveBase *archive)
-     : m_stream(stream), m_archive(archive)
+MemoryOutStream::MemoryOutStream(std::string *buffer, UInt64 expected_size)
+     : m_buffer(buffer)
 {
+    // kpidSize is only a hint. If it is wrong, the buffer just grows in Write.
+    try{
+        if (expected_size <= m_buffer->max_size()){
+            m_buffer->reserve((size_t)expected_size);
+        }
+    }catch(const std::bad_alloc &){
+    }
 }
 
-STDMETHODIMP OutStream::Write(const void *data, UInt32 size, UInt32 *processedSize)
+STDMETHODIMP MemoryOutStream::Write(const void *data, UInt32 size, UInt32 *processedSize)
 {
-    bool ret = m_archive->runRubyAction([&](){
-        VALUE str = rb_str_new(reinterpret_cast<const char*>(data), size);
-        VALUE len = rb_funcall(m_stream, INTERN("write"), 1, str);
-        if (processedSize){
-            if (NIL_P(len)){
-                *processedSize = 0;
-            }else{
-                *processedSize = NUM2ULONG(len);
-            }
-        }
-    });
-    if (!ret){
-        if (processedSize){
-            *processedSize = 0;
-        }
-        // When killEventLoopThread is called in cancelAction
-        // return S_OK even if error occurs.
-        //
-        // Detail:
-        //  It seems that BZip2Encoder has a bug.
-        //  If Write method returns E_FAIL, some Events are not set in that file
-        //  because OutBuffer throws an exception in Encoder->WriteBytes.
-        return E_FAIL;
+    if (processedSize){
+        *processedSize = 0;
+    }
+
+    try{
+        m_buffer->append(reinterpret_cast<const char*>(data), size);
+    }catch(const std::bad_alloc &){
+        return E_OUTOFMEMORY;
     }
 
+    if (processedSize){
+        *processedSize = size;
+    }
     return S_OK;
 }
 
-STDMETHODIMP OutStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
+////////////////////////////////////////////////////////////////
+const size_t EntryPipe::kDefaultCapacity;
+const size_t EntryPipe::kMaxCapacity;
+
+EntryPipe::EntryPipe(size_t capacity)
+     : m_buffer(capacity), m_read_pos(0), m_size(0),
+       m_read_closed(false), m_write_closed(false),
+       m_result(S_OK), m_operation_result(NArchive::NExtract::NOperationResult::kOK)
 {
-    bool ret = m_archive->runRubyAction([&](){
-        VALUE whence;
-        switch(seekOrigin){
-          case 0:
-            whence = rb_const_get(rb_cIO, INTERN("SEEK_SET"));
-            break;
-          case 1:
-            whence = rb_const_get(rb_cIO, INTERN("SEEK_CUR"));
-            break;
-          case 2:
-            whence = rb_const_get(rb_cIO, INTERN("SEEK_END"));
-            break;
-          default:
-            return;
+}
+
+HRESULT EntryPipe::write(const void *data, UInt32 size, UInt32 *processedSize)
+{
+    if (processedSize){
+        *processedSize = 0;
+    }
+
+    const char *src = reinterpret_cast<const char*>(data);
+    const size_t capacity = m_buffer.size();
+    UInt32 written = 0;
+    while(written < size){
+        size_t pos, cur;
+        {
+            MutexLocker locker(&m_mutex);
+            while(m_size == capacity && !m_read_closed){
+                m_cond_var.wait(&m_mutex);
+            }
+            if (m_read_closed){
+                return E_ABORT;
+            }
+            pos = m_read_pos + m_size;
+            if (pos >= capacity){
+                pos -= capacity;
+            }
+            cur = std::min(capacity - m_size, capacity - pos);
+            cur = std::min(cur, (size_t)(size - written));
         }
 
-        rb_funcall(m_stream, INTERN("seek"), 2, LL2NUM(offset), whence);
-        if (newPosition){
-            VALUE pos = rb_funcall(m_stream, INTERN("tell"), 0);
-            *newPosition = NUM2ULONG(pos);
+        memcpy(&m_buffer[pos], src + written, cur);
+        written += (UInt32)cur;
+
+        MutexLocker locker(&m_mutex);
+        if (m_size == 0){
+            m_cond_var.broadcast();
         }
-    });
-    if (!ret){
-        return E_FAIL;
+        m_size += cur;
     }
 
+    if (processedSize){
+        *processedSize = size;
+    }
     return S_OK;
 }
 
-STDMETHODIMP OutStream::SetSize(UInt64 size)
+void EntryPipe::closeWrite(HRESULT result)
 {
-    bool ret = m_archive->runRubyAction([&](){
-        rb_funcall(m_stream, INTERN("truncate"), 1, ULL2NUM(size));
-    });
-    if (!ret){
-        return E_FAIL;
+    MutexLocker locker(&m_mutex);
+    m_result = result;
+    m_write_closed = true;
+    m_cond_var.broadcast();
+}
+
+size_t EntryPipe::wait(bool *cancelled)
+{
+    MutexLocker locker(&m_mutex);
+    while(m_size == 0 && !m_write_closed && !*cancelled){
+        m_cond_var.wait(&m_mutex);
     }
+    return m_size;
+}
 
-    return S_OK;
+void EntryPipe::cancelWait(bool *cancelled)
+{
+    MutexLocker locker(&m_mutex);
+    *cancelled = true;
+    m_cond_var.broadcast();
+}
+
+size_t EntryPipe::read(char *data, size_t size)
+{
+    const size_t capacity = m_buffer.size();
+    size_t pos;
+    {
+        MutexLocker locker(&m_mutex);
+        size = std::min(size, m_size);
+        pos = m_read_pos;
+    }
+
+    const size_t part = std::min(size, capacity - pos);
+    memcpy(data, &m_buffer[pos], part);
+    memcpy(data + part, &m_buffer[0], size - part);
+
+    MutexLocker locker(&m_mutex);
+    if (m_size == capacity){
+        m_cond_var.broadcast();
+    }
+    m_read_pos += size;
+    if (m_read_pos >= capacity){
+        m_read_pos -= capacity;
+    }
+    m_size -= size;
+    return size;
+}
+
+void EntryPipe::closeRead()
+{
+    MutexLocker locker(&m_mutex);
+    m_read_closed = true;
+    m_cond_var.broadcast();
+}
+
+
+}
+
+
+// The format classes are Ruby subclasses of SevenZipReader and SevenZipWriter,
+// so the native methods are defined again with their own C++ type.
+template<typename T>
+static void defineReaderMethods(VALUE cls)
+{
+    using namespace SevenZip;
+    using namespace RubyCppUtil;
+
+// arg_count is needed by MSVC 2010...
+// MSVC 2010 seems not to be able to guess argument count of the function passed as a template parameter.
+#define READER_FUNC(func, arg_count) wrappedFunction##arg_count<T, ArchiveReader, &ArchiveReader::func>
+
+    rb_define_method_ext(cls, "open_impl", READER_FUNC(open, 2));
+    rb_define_method_ext(cls, "open_file_impl", READER_FUNC(openFile, 2));
+    rb_define_method_ext(cls, "close_impl", READER_FUNC(close, 0));
+    rb_define_method_ext(cls, "entry_num", READER_FUNC(entryNum, 0));
+    rb_define_method_ext(cls, "extract_impl", READER_FUNC(extract, 2));
+    rb_define_method_ext(cls, "extract_files_impl", READER_FUNC(extractFiles, 3));
+    rb_define_method_ext(cls, "extract_all_impl", READER_FUNC(extractAll, 2));
+    rb_define_method_ext(cls, "extract_data_impl", READER_FUNC(extractData, 2));
+    rb_define_method_ext(cls, "test_all_impl", READER_FUNC(testAll, 2));
+    rb_define_method_ext(cls, "archive_property", READER_FUNC(getArchiveProperty, 0));
+    rb_define_method_ext(cls, "folder_cache_stats", READER_FUNC(getFolderCacheStats, 0));
+    rb_define_method_ext(cls, "checkpoint_stats", READER_FUNC(getCheckpointStats, 0));
+    rb_define_method_ext(cls, "clear_header_cache_impl", READER_FUNC(clearHeaderCache, 0));
+    rb_define_method_ext(cls, "header_cache_stats_impl", READER_FUNC(getHeaderCacheStats, 0));
+    rb_define_method_ext(cls, "extract_plan_stats", READER_FUNC(getExtractPlanStats, 0));
+    rb_define_method_ext(cls, "verify_stats", READER_FUNC(getVerifyStats, 0));
+    rb_define_method_ext(cls, "entry_impl", READER_FUNC(getEntryInfo, 2));
+    rb_define_method_ext(cls, "entries_impl", READER_FUNC(getAllEntryInfo, 0));
+    rb_define_method_ext(cls, "find_entry_impl", READER_FUNC(findEntry, 1));
+    rb_define_method_ext(cls, "set_file_attribute", READER_FUNC(setFileAttribute, 2));
+    rb_define_method_ext(cls, "open_entry_impl", READER_FUNC(openEntry, 2));
+    rb_define_method_ext(cls, "read_entry_impl", READER_FUNC(readEntry, 2));
+    rb_define_method_ext(cls, "close_entry_impl", READER_FUNC(closeEntry, 0));
+    rb_define_method_ext(cls, "open_context_impl", READER_FUNC(openContext, 3));
+
+#undef READER_FUNC
 }
 
+template<typename T>
+static void defineWriterMethods(VALUE cls)
+{
+    using namespace SevenZip;
+    using namespace RubyCppUtil;
+
+#define WRITER_FUNC(func, arg_count) wrappedFunction##arg_count<T, ArchiveWriter, &ArchiveWriter::func>
 
+    rb_define_method_ext(cls, "open_impl", WRITER_FUNC(open, 2));
+    rb_define_method_ext(cls, "update_impl", WRITER_FUNC(update, 3));
+    rb_define_method_ext(cls, "archive_entries_impl", WRITER_FUNC(archiveEntries, 0));
+    rb_define_method_ext(cls, "add_item_impl", WRITER_FUNC(addItem, 1));
+    rb_define_method_ext(cls, "compress_impl", WRITER_FUNC(compress, 1));
+    rb_define_method_ext(cls, "close_impl", WRITER_FUNC(close, 0));
+    rb_define_method_ext(cls, "get_file_attribute", WRITER_FUNC(getFileAttribute, 1));
 
+#undef WRITER_FUNC
 }
 
+template<typename T>
+static void defineFormatWriter(VALUE mod, const char *name, VALUE super)
+{
+    using namespace SevenZip;
+    using namespace RubyCppUtil;
+
+    VALUE cls = rb_define_wrapped_cpp_class_under<T>(mod, name, super);
+    defineWriterMethods<T>(cls);
+
+    // Options of SevenZipWriter are not inherited.
+    const char *seven_zip_options[] = {
+        "method=", "method", "level=", "level", "solid=", "solid", "solid?",
+        "header_compression=", "header_compression", "header_compression?",
+        "header_encryption=", "header_encryption", "header_encryption?",
+        "multi_threading=", "multi_thread=", "multi_threading", "multi_threading?",
+        "multi_thread", "multi_thread?", "threads=", "threads", "block_threads=", "block_threads",
+        "dictionary_size=", "dictionary_size", "word_size=", "word_size", "match_finder=", "match_finder",
+        "solid_block_size=", "solid_block_size", "solid_files=", "solid_files",
+        "block_size=", "block_size", "solid_block_threads=", "solid_block_threads",
+        "solid_block_memory=", "solid_block_memory", "store_incompressible=", "store_incompressible",
+        "memory_usage"
+    };
+    for (size_t i = 0; i < sizeof(seven_zip_options)/sizeof(seven_zip_options[0]); i++){
+        rb_undef_method(cls, seven_zip_options[i]);
+    }
+
+#define FORMAT_WRITER_FUNC(func, arg_count) wrappedFunction##arg_count<T, FormatWriter, &FormatWriter::func>
+
+    const FormatWriter::Spec &spec = T::kSpec;
+    rb_define_method_ext(cls, "method", FORMAT_WRITER_FUNC(method, 0));
+    if (spec.method_num > 1){
+        rb_define_method_ext(cls, "method=", FORMAT_WRITER_FUNC(setMethod, 1));
+    }
+    if (spec.level){
+        rb_define_method_ext(cls, "level=", FORMAT_WRITER_FUNC(setLevel, 1));
+        rb_define_method_ext(cls, "level", FORMAT_WRITER_FUNC(level, 0));
+    }
+    if (spec.threads){
+        rb_define_method_ext(cls, "threads=", FORMAT_WRITER_FUNC(setThreads, 1));
+        rb_define_method_ext(cls, "threads", FORMAT_WRITER_FUNC(threads, 0));
+    }
+    if (spec.encryption){
+        rb_define_method_ext(cls, "encryption_method=", FORMAT_WRITER_FUNC(setEncryptionMethod, 1));
+        rb_define_method_ext(cls, "encryption_method", FORMAT_WRITER_FUNC(encryptionMethod, 0));
+    }
+
+#undef FORMAT_WRITER_FUNC
+}
 
 extern "C" void Init_seven_zip_archive(void)
 {
@@ -1816,38 +5157,24 @@ extern "C" void Init_seven_zip_archive(void)
 
 
     VALUE cls;
+    VALUE reader_cls, writer_cls;
 
-// arg_count is needed by MSVC 2010...
-// MSVC 2010 seems not to be able to guess argument count of the function passed as a template parameter.
-#define READER_FUNC(func, arg_count) wrappedFunction##arg_count<SevenZipReader, ArchiveReader, &ArchiveReader::func>
-
-    cls = rb_define_wrapped_cpp_class_under<SevenZipReader>(mod, "SevenZipReader", rb_cObject);
-    rb_define_method_ext(cls, "open_impl", READER_FUNC(open, 2));
-    rb_define_method_ext(cls, "close_impl", READER_FUNC(close, 0));
-    rb_define_method_ext(cls, "entry_num", READER_FUNC(entryNum, 0));
-    rb_define_method_ext(cls, "extract_impl", READER_FUNC(extract, 2));
-    rb_define_method_ext(cls, "extract_files_impl", READER_FUNC(extractFiles, 2));
-    rb_define_method_ext(cls, "extract_all_impl", READER_FUNC(extractAll, 1));
-    rb_define_method_ext(cls, "test_all_impl", READER_FUNC(testAll, 1));
-    rb_define_method_ext(cls, "archive_property", READER_FUNC(getArchiveProperty, 0));
-    rb_define_method_ext(cls, "entry", READER_FUNC(getEntryInfo, 1));
-    rb_define_method_ext(cls, "entries", READER_FUNC(getAllEntryInfo, 0));
-    rb_define_method_ext(cls, "set_file_attribute", READER_FUNC(setFileAttribute, 2));
+    reader_cls = rb_define_wrapped_cpp_class_under<SevenZipReader>(mod, "SevenZipReader", rb_cObject);
+    defineReaderMethods<SevenZipReader>(reader_cls);
 
-#undef READER_FUNC
+    defineReaderMethods<ZipReader>(rb_define_wrapped_cpp_class_under<ZipReader>(mod, "ZipReader", reader_cls));
+    defineReaderMethods<TarReader>(rb_define_wrapped_cpp_class_under<TarReader>(mod, "TarReader", reader_cls));
+    defineReaderMethods<GZipReader>(rb_define_wrapped_cpp_class_under<GZipReader>(mod, "GZipReader", reader_cls));
+    defineReaderMethods<BZip2Reader>(rb_define_wrapped_cpp_class_under<BZip2Reader>(mod, "BZip2Reader", reader_cls));
+    defineReaderMethods<XzReader>(rb_define_wrapped_cpp_class_under<XzReader>(mod, "XzReader", reader_cls));
 
 
 // arg_count is needed by MSVC 2010...
 // MSVC 2010 seems not to be able to guess argument count of the function passed as a template parameter.
-#define WRITER_FUNC(func, arg_count) wrappedFunction##arg_count<SevenZipWriter, ArchiveWriter, &ArchiveWriter::func>
 #define WRITER_FUNC2(func, arg_count) wrappedFunction##arg_count<SevenZipWriter, &SevenZipWriter::func>
 
-    cls = rb_define_wrapped_cpp_class_under<SevenZipWriter>(mod, "SevenZipWriter", rb_cObject);
-    rb_define_method_ext(cls, "open_impl", WRITER_FUNC(open, 2));
-    rb_define_method_ext(cls, "add_item", WRITER_FUNC(addItem, 1));
-    rb_define_method_ext(cls, "compress_impl", WRITER_FUNC(compress, 1));
-    rb_define_method_ext(cls, "close_impl", WRITER_FUNC(close, 0));
-    rb_define_method_ext(cls, "get_file_attribute", WRITER_FUNC(getFileAttribute, 1));
+    cls = writer_cls = rb_define_wrapped_cpp_class_under<SevenZipWriter>(mod, "SevenZipWriter", rb_cObject);
+    defineWriterMethods<SevenZipWriter>(cls);
 
     rb_define_method_ext(cls, "method=", WRITER_FUNC2(setMethod, 1));
     rb_define_method_ext(cls, "method", WRITER_FUNC2(method, 0));
@@ -1868,9 +5195,37 @@ extern "C" void Init_seven_zip_archive(void)
     rb_define_method_ext(cls, "multi_threading?", WRITER_FUNC2(multiThreading, 0));
     rb_define_method_ext(cls, "multi_thread", WRITER_FUNC2(multiThreading, 0));
     rb_define_method_ext(cls, "multi_thread?", WRITER_FUNC2(multiThreading, 0));
+    rb_define_method_ext(cls, "threads=", WRITER_FUNC2(setThreads, 1));
+    rb_define_method_ext(cls, "threads", WRITER_FUNC2(threads, 0));
+    rb_define_method_ext(cls, "block_threads=", WRITER_FUNC2(setBlockThreads, 1));
+    rb_define_method_ext(cls, "block_threads", WRITER_FUNC2(blockThreads, 0));
+    rb_define_method_ext(cls, "dictionary_size=", WRITER_FUNC2(setDictionarySize, 1));
+    rb_define_method_ext(cls, "dictionary_size", WRITER_FUNC2(dictionarySize, 0));
+    rb_define_method_ext(cls, "word_size=", WRITER_FUNC2(setWordSize, 1));
+    rb_define_method_ext(cls, "word_size", WRITER_FUNC2(wordSize, 0));
+    rb_define_method_ext(cls, "match_finder=", WRITER_FUNC2(setMatchFinder, 1));
+    rb_define_method_ext(cls, "match_finder", WRITER_FUNC2(matchFinder, 0));
+    rb_define_method_ext(cls, "solid_block_size=", WRITER_FUNC2(setSolidBlockSize, 1));
+    rb_define_method_ext(cls, "solid_block_size", WRITER_FUNC2(solidBlockSize, 0));
+    rb_define_method_ext(cls, "solid_files=", WRITER_FUNC2(setSolidFiles, 1));
+    rb_define_method_ext(cls, "solid_files", WRITER_FUNC2(solidFiles, 0));
+    rb_define_method_ext(cls, "block_size=", WRITER_FUNC2(setBlockSize, 1));
+    rb_define_method_ext(cls, "block_size", WRITER_FUNC2(blockSize, 0));
+    rb_define_method_ext(cls, "solid_block_threads=", WRITER_FUNC2(setSolidBlockThreads, 1));
+    rb_define_method_ext(cls, "solid_block_threads", WRITER_FUNC2(solidBlockThreads, 0));
+    rb_define_method_ext(cls, "solid_block_memory=", WRITER_FUNC2(setSolidBlockMemory, 1));
+    rb_define_method_ext(cls, "solid_block_memory", WRITER_FUNC2(solidBlockMemory, 0));
+    rb_define_method_ext(cls, "store_incompressible=", WRITER_FUNC2(setStoreIncompressible, 1));
+    rb_define_method_ext(cls, "store_incompressible", WRITER_FUNC2(storeIncompressible, 0));
+    rb_define_method_ext(cls, "memory_usage", WRITER_FUNC2(memoryUsage, 0));
 
 #undef WRITER_FUNC2
-#undef WRITER_FUNC
+
+    defineFormatWriter<ZipWriter>(mod, "ZipWriter", writer_cls);
+    defineFormatWriter<TarWriter>(mod, "TarWriter", writer_cls);
+    defineFormatWriter<GZipWriter>(mod, "GZipWriter", writer_cls);
+    defineFormatWriter<BZip2Writer>(mod, "BZip2Writer", writer_cls);
+    defineFormatWriter<XzWriter>(mod, "XzWriter", writer_cls);
 
 }
 
@@ -6,9 +6,14 @@
 #include <cstdlib>
 #include <cstring>
 #include <list>
+#include <vector>
+#include <string>
 #include <map>
 #include <utility>
 #include <functional>
+#include <atomic>
+#include <memory>
+#include <thread>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -28,6 +33,12 @@
 #ifdef HAVE_RUBY_THREAD_H
 #include <ruby/thread.h>
 #endif
+// When a Fiber scheduler is set, the calling fiber runs the event loop itself.
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT) && !defined(_WIN32)
+#include <ruby/io.h>
+#include <ruby/fiber/scheduler.h>
+#define USE_FIBER_EVENT_LOOP
+#endif
 
 #include <CPP/Common/MyCom.h>
 #include <CPP/Windows/PropVariant.h>
@@ -58,6 +69,11 @@ namespace SevenZip
 {
 
 class ArchiveExtractCallback;
+class OutStream;
+class FileOutStream;
+class MemoryOutStream;
+class EntryPipe;
+class MappedFileInStream;
 
 ////////////////////////////////////////////////////////////////
 class ArchiveBase
@@ -65,7 +81,27 @@ class ArchiveBase
   public:
     typedef std::function<void ()> RubyAction;
 
-    typedef std::pair<RubyAction*, bool> RubyActionTuple;
+    // An action queued by a native thread. It lives on the stack of that thread
+    // until the event loop sets its state to ACTION_STATE_DONE.
+    struct RubyActionNode
+    {
+        RubyAction *action;
+        RubyActionNode *next;
+        std::atomic<int> state;
+        bool success;
+
+        RubyActionNode(RubyAction *a = nullptr)
+             : action(a), next(nullptr), state(0), success(false)
+        {
+        }
+    };
+
+    enum RubyActionState
+    {
+        ACTION_STATE_PENDING,
+        ACTION_STATE_PARKED,  // The queuing thread sleeps on m_action_done_cond_var.
+        ACTION_STATE_DONE
+    };
 
     struct RubyActionResult
     {
@@ -124,40 +160,65 @@ class ArchiveBase
     ~ArchiveBase();
     void setSelf(VALUE self);
     VALUE self();
-    void rubyEventLoop();
+    bool rubyEventLoop();
     static VALUE staticRubyEventLoop(void *p);
     template<typename T> bool runRubyAction(T t);
     static VALUE runProtectedRubyAction(VALUE p);
+    virtual bool isErrorState() = 0;
 
   protected:
     void mark();
     void prepareAction();
+    // The fiber mode is not allowed for the operations which return to Ruby
+    // before they finish, because nobody runs the actions after that.
+    void startEventLoopThread(bool allow_fiber_mode = true);
+    void terminateEventLoopThread();
+    // Fails the queued and the following actions without running them.
+    void killEventLoopThread();
 
     template<typename T>
       void runNativeFunc(T func);
+#ifdef USE_FIBER_EVENT_LOOP
+    void runNativeFuncInFiber(const std::function<void ()> &func);
+#endif
     template<typename T, typename U>
       bool runNativeFuncProtect(T func, U cancel);
 
   private:
-    void startEventLoopThread();
-    void terminateEventLoopThread();
-    void killEventLoopThread();
     void finishRubyAction();
     bool runRubyActionImpl(RubyAction *action);
+    RubyActionNode *takeRubyActions();
+    RubyActionNode *waitRubyActions(bool *cancelled);
+    bool runRubyActionList(RubyActionNode *list, bool running);
+    void wakeEventLoop();
+    RubyActionNode *closeActionQueue();
+    void completeRubyAction(RubyActionNode *node, bool success);
     void cancelAction();
     virtual void setErrorState() = 0;
 
 
   private:
     static RubyAction ACTION_END;
+    static RubyActionNode ACTION_QUEUE_CLOSED;
 
   private:
-    RubyActionTuple * volatile m_action_tuple;
+    // Lock-free stack of queued actions (newest first).
+    // &ACTION_QUEUE_CLOSED means that the event loop is not running.
+    std::atomic<RubyActionNode*> m_action_queue;
+    std::atomic<bool> m_event_loop_parked;
+    std::atomic<UInt32> m_event_loop_spin;
+    std::atomic<UInt32> m_action_spin;
     Mutex m_action_mutex;
     ConditionVariable m_action_cond_var;
-    volatile bool m_event_loop_running;
+    ConditionVariable m_action_done_cond_var;
     VALUE m_self;
 
+    // Fiber mode: the native function runs on its own thread, and the calling fiber
+    // waits for actions on a pipe through the Fiber scheduler.
+    bool m_fiber_mode;
+    VALUE m_rb_wakeup_pipe;
+    int m_wakeup_fd;
+
   protected:
     RubyActionResult m_action_result;
 };
@@ -168,6 +229,12 @@ void ArchiveBase::runNativeFunc(T func)
     typedef std::function<void ()> func_type;
 
     func_type functor = func;
+#ifdef USE_FIBER_EVENT_LOOP
+    if (m_fiber_mode){
+        runNativeFuncInFiber(functor);
+        return;
+    }
+#endif
     func_type cancel = [&](){ cancelAction(); };
 
     func_type protected_func = [&](){
@@ -200,6 +267,118 @@ bool ArchiveBase::runNativeFuncProtect(T func, U cancel)
     return (state == 0);
 }
 
+// Closes the archive when the reader and all of its extraction contexts release it.
+class OpenedArchive
+{
+  public:
+    OpenedArchive(IInArchive *archive)
+         : m_archive(archive)
+    {
+    }
+    ~OpenedArchive()
+    {
+        m_archive->Close();
+    }
+
+  private:
+    CMyComPtr<IInArchive> m_archive;
+};
+
+// Entry metadata of the opened archive, kept natively in columns.
+// EntryInfo objects are created from this table only when they are accessed.
+class EntryInfoTable
+{
+  public:
+    enum Column
+    {
+        COL_PATH,
+        COL_METHOD,
+        COL_DIR,
+        COL_ENCRYPTED,
+        COL_ANTI,
+        COL_SIZE,
+        COL_PACK_SIZE,
+        COL_CTIME,
+        COL_ATIME,
+        COL_MTIME,
+        COL_ATTRIB,
+        COL_CRC,
+        COL_NUM
+    };
+
+    static const UInt32 kNoBlock = (UInt32)(Int32)-1;
+
+    EntryInfoTable()
+         : m_filled(false)
+    {
+    }
+
+    bool filled() const
+    {
+        return m_filled;
+    }
+    UInt32 size() const
+    {
+        return (UInt32)m_flags.size();
+    }
+    void clear();
+    HRESULT fill(IInArchive *archive, const std::string &default_path);
+    VALUE newEntryInfo(UInt32 index) const;
+    bool hasData(UInt32 index) const
+    {
+        return !(flag(index, COL_DIR) || flag(index, COL_ANTI));
+    }
+    UInt64 dataSize(UInt32 index) const
+    {
+        return m_size[index];
+    }
+    // Solid block (folder) of the entry, or kNoBlock.
+    UInt32 block(UInt32 index) const
+    {
+        return m_block[index];
+    }
+    bool find(const char *path, size_t length, UInt32 *index);
+
+  private:
+    bool defined(UInt32 index, Column col) const
+    {
+        return (m_flags[index] & (1 << col)) != 0;
+    }
+    bool flag(UInt32 index, Column col) const
+    {
+        return (m_flags[index] & (1 << (col + COL_NUM))) != 0;
+    }
+    void buildIndex();
+    static size_t hashPath(const char *path, size_t length);
+
+  private:
+    bool m_filled;
+
+    // Paths are stored in one UTF-8 arena, path i is
+    // [m_path_offset[i], m_path_offset[i+1]).
+    std::string m_path_arena;
+    std::vector<size_t> m_path_offset;
+
+    std::vector<std::string> m_method_names;
+    std::vector<UInt32> m_method_index;
+
+    // Low COL_NUM bits: the property is defined.
+    // Next COL_NUM bits: value of the boolean properties.
+    std::vector<UInt32> m_flags;
+    std::vector<UInt64> m_size;
+    std::vector<UInt64> m_pack_size;
+    std::vector<UInt64> m_ctime;
+    std::vector<UInt64> m_atime;
+    std::vector<UInt64> m_mtime;
+    std::vector<UInt32> m_attrib;
+    std::vector<UInt32> m_crc;
+    std::vector<UInt32> m_block;
+
+    // Open addressing hash index of paths, built by the first find().
+    // Each slot holds (entry index + 1), 0 means empty.
+    std::vector<UInt32> m_path_index;
+};
+
 class ArchiveReader : public ArchiveBase
 {
   private:
@@ -207,6 +386,7 @@ class ArchiveReader : public ArchiveBase
     {
         STATE_INITIAL,
         STATE_OPENED,
+        STATE_STREAMING,  // An entry is opened by open_entry.
         STATE_CLOSED,
         STATE_ERROR
     };
@@ -214,10 +394,13 @@ class ArchiveReader : public ArchiveBase
 
   public:
     ArchiveReader(const GUID &format_guid);
+    ~ArchiveReader();
     void setProcessingStream(VALUE stream, UInt32 index, Int32 askExtractMode);
     void getProcessingStream(VALUE *stream, UInt32 *index, Int32 *askExtractMode);
     void clearProcessingStream();
-    void setOperationResult(UInt32 index, Int32 result);
+    // Returns false to stop testing.
+    bool setOperationResult(UInt32 index, Int32 result);
+    void setFolderStat(UInt32 folder_index, UInt64 pack_size, UInt64 unpack_size, UInt64 time);
     VALUE callbackProc()
     {
         return m_rb_callback_proc;
@@ -229,19 +412,42 @@ class ArchiveReader : public ArchiveBase
     {
         return m_state == STATE_ERROR;
     }
+    bool isMemoryExtract() const
+    {
+        return m_memory_extract;
+    }
+    std::string *memoryExtractBuffer(UInt32 index, UInt64 *size);
+    void setMemoryExtractResult(Int32 result);
+    EntryPipe *entryPipe()
+    {
+        return m_entry_pipe.get();
+    }
 
     // Called from Ruby script.
     VALUE open(VALUE in_stream, VALUE param);
+    VALUE openFile(VALUE filename, VALUE param);
     VALUE close();
     VALUE entryNum();
     VALUE getArchiveProperty();
-    VALUE getEntryInfo(VALUE index);
+    VALUE getFolderCacheStats();
+    VALUE getCheckpointStats();
+    VALUE clearHeaderCache();
+    VALUE getHeaderCacheStats();
+    VALUE getExtractPlanStats();
+    VALUE getVerifyStats();
+    VALUE getEntryInfo(VALUE index, VALUE cache);
     VALUE getAllEntryInfo();
+    VALUE findEntry(VALUE path);
     VALUE extract(VALUE index, VALUE callback_proc);
-    VALUE extractFiles(VALUE index_list, VALUE callback_proc);
-    VALUE extractAll(VALUE callback_proc);
-    VALUE testAll(VALUE callback_proc);
+    VALUE extractFiles(VALUE index_list, VALUE callback_proc, VALUE param);
+    VALUE extractAll(VALUE callback_proc, VALUE param);
+    VALUE extractData(VALUE index_list, VALUE param);
+    VALUE testAll(VALUE detail, VALUE param);
     VALUE setFileAttribute(VALUE path, VALUE attrib);
+    VALUE openEntry(VALUE index, VALUE param);
+    VALUE readEntry(VALUE size, VALUE buffer);
+    VALUE closeEntry();
+    VALUE openContext(VALUE parent, VALUE in_stream, VALUE param);
 
     VALUE entryInfo(UInt32 index);
 
@@ -249,26 +455,112 @@ class ArchiveReader : public ArchiveBase
     virtual void setErrorState();
 
   private:
+    // Upper limit of the threads option. Larger values are reduced to it.
+    static const UInt32 kMaxExtractThreads = 256;
+    // Default and upper limit of binder_buffer_size, the same as the 7z handler.
+    // Each bound stream of a folder allocates it.
+    static const UInt32 kDefaultBinderBufferSize = (1 << 22);
+    static const UInt32 kMaxBinderBufferSize = (1 << 28);
+    // Upper limit of folder_cache_size.
+    static const UInt64 kMaxFolderCacheSize = (1ULL << 40);
+    // Range of checkpoint_interval. Each checkpoint keeps a copy of the dictionary.
+    static const UInt64 kMinCheckpointInterval = (1ULL << 16);
+    static const UInt64 kMaxCheckpointInterval = (1ULL << 40);
+    // Memory to keep the checkpoints. The least recently used ones are dropped beyond it.
+    static const UInt64 kDefaultCheckpointMemory = (1ULL << 28);
+    static const UInt64 kMaxCheckpointMemory = (1ULL << 40);
+    // Result of the entries not tested by test_all_impl.
+    static const Int32 kNotTested = -1;
+
+    void openStream(IInStream *stream, VALUE param, UInt64 folder_cache_size,
+                    UInt64 checkpoint_interval, UInt64 checkpoint_memory);
+    void convertIndexList(VALUE index_list, std::vector<UInt32> *list);
+    void planExtract(const std::vector<UInt32> &list, std::vector<UInt32> *plan);
     ArchiveExtractCallback *createArchiveExtractCallback();
     void fillEntryInfo();
+    VALUE cachedEntryInfo(UInt32 index);
+    struct ExtractOption
+    {
+        ExtractOption()
+             : threads(1), in_order(true), binder_buffer_size(kDefaultBinderBufferSize)
+        {
+        }
+
+        UInt32 threads;
+        bool in_order;
+        UInt32 binder_buffer_size;
+    };
+
+    ExtractOption convertExtractOption(VALUE param);
+    void setExtractOption(const ExtractOption &option);
+    void clearMemoryExtract();
+    void finishEntry(bool abort);
+    HRESULT extractItems(const UInt32 *indices, UInt32 num, Int32 test_mode, IArchiveExtractCallback *callback);
 
   private:
     VALUE m_rb_callback_proc;
     VALUE m_rb_out_stream;
     UInt32 m_processing_index;
     VALUE m_rb_in_stream;
+    EntryInfoTable m_entry_table;
+    // EntryInfo objects returned by entry/entries. Qnil until requested.
     std::vector<VALUE> m_rb_entry_info_list;
 
     Int32 m_ask_extract_mode;
     std::vector<Int32> m_test_result;
+    bool m_testing;
+    bool m_test_stop_on_error;
+    bool m_test_stopped;
+
+    // Time spent on decoding each folder by the last test, in microseconds.
+    struct FolderStat
+    {
+        UInt32 folder_index;
+        UInt64 pack_size;
+        UInt64 unpack_size;
+        UInt64 time;
+    };
+    std::vector<FolderStat> m_folder_stats;
+
+    // extract_data decodes entries into these buffers without calling Ruby.
+    // m_memory_index_list is sorted, and empty when all entries are extracted.
+    bool m_memory_extract;
+    Int32 m_memory_extract_result;
+    std::vector<UInt32> m_memory_index_list;
+    std::vector<std::string> m_memory_data;
+
+    // Solid blocks decoded by the planned extractions, and the decodes saved
+    // by planning compared to the requested order.
+    UInt64 m_plan_folder_decodes;
+    UInt64 m_plan_saved_decodes;
+
+    // open_entry decodes the entry on m_entry_thread into m_entry_pipe.
+    // The reader is kept alive by m_rb_streaming_self until the entry is closed,
+    // because the thread refers to it.
+    std::unique_ptr<EntryPipe> m_entry_pipe;
+    std::thread m_entry_thread;
+    VALUE m_rb_streaming_self;
 
     const GUID &m_format_guid;
 
     CMyComPtr<IInArchive> m_in_archive;
     CMyComPtr<IInStream> m_in_stream;
+#ifndef USE_WIN32_FILE_API
+    // Same object as m_in_stream when opened by open_file.
+    MappedFileInStream *m_mapped_in_stream;
+#endif
+    std::shared_ptr<OpenedArchive> m_opened_archive;
+    // Set for extraction contexts, which share m_in_archive with the parent reader
+    // and read packed data from their own m_in_stream.
+    CMyComPtr<IInArchiveExtractStream> m_extract_stream;
+    // Options of the current extraction of the context. They are passed with each call,
+    // because the handler is shared with the parent reader and the other contexts.
+    ExtractOption m_extract_option;
 
     bool m_password_specified;
     std::string m_password;
+    // Path of the entries which have no name, as in gzip, bzip2 and xz.
+    std::string m_default_path;
 
     ArchiveReaderState m_state;
 };
@@ -294,7 +586,9 @@ class ArchiveWriter : public ArchiveBase
         return m_rb_callback_proc;
     }
     void setProcessingStream(VALUE stream, UInt32 index);
-    void getProcessingStream(VALUE *stream, UInt32 *index);
+    void finishProcessingStream();
+    void releaseProcessingStream(UInt32 index);
+    void reportFinishedStreams(bool all);
     void clearProcessingStream();
     bool updateItemInfo(UInt32 index, bool *new_data, bool *new_properties, UInt32 *index_in_archive);
     VALUE itemInfo(UInt32 index)
@@ -315,6 +609,8 @@ class ArchiveWriter : public ArchiveBase
 
     // Called from Ruby script.
     VALUE open(VALUE out_stream, VALUE param);
+    VALUE update(VALUE in_stream, VALUE out_stream, VALUE param);
+    VALUE archiveEntries();
     VALUE addItem(VALUE item);
     VALUE compress(VALUE callback_proc);
     VALUE close();
@@ -322,11 +618,34 @@ class ArchiveWriter : public ArchiveBase
 
   protected:
     virtual HRESULT setOption(ISetProperties *set) = 0;
+    // Called before compression to raise an error for invalid options.
+    virtual void checkOption()
+    {
+    }
     virtual void setErrorState();
 
+  private:
+    void setOpenParam(VALUE out_stream, VALUE param);
+    void closeArchive();
+    bool takeFinishedStream(bool all, UInt32 *index, VALUE *stream);
+
+  private:
+    // Ruby stream of an item to compress.
+    // Some handlers, such as Zip with multiple threads, report the result of
+    // an item before reading its stream. The stream is passed to the result
+    // callback, which closes it, after the handler also releases it.
+    struct ProcessingStream
+    {
+        UInt32 index;
+        VALUE stream;
+        bool finished;
+        bool released;
+    };
+
   private:
     VALUE m_rb_callback_proc;
-    VALUE m_rb_in_stream;
+    std::vector<ProcessingStream> m_processing_streams;
+    Mutex m_processing_mutex;
     UInt32 m_processing_index;
     VALUE m_rb_out_stream;
     std::vector<VALUE> m_rb_update_list;
@@ -334,7 +653,12 @@ class ArchiveWriter : public ArchiveBase
     const GUID &m_format_guid;
 
     CMyComPtr<IOutArchive> m_out_archive;
+
+    // The archive being updated. The handler copies its unchanged folders.
+    VALUE m_rb_archive_stream;
     CMyComPtr<IInStream> m_in_stream;
+    CMyComPtr<IInArchive> m_in_archive;
+    EntryInfoTable m_entry_table;
 
     bool m_password_specified;
     std::string m_password;
@@ -368,6 +692,51 @@ class SevenZipWriter : public ArchiveWriter
     VALUE headerEncryption();
     VALUE setMultiThreading(VALUE multi_threading);
     VALUE multiThreading();
+    VALUE setThreads(VALUE threads);
+    VALUE threads();
+    VALUE setBlockThreads(VALUE block_threads);
+    VALUE blockThreads();
+    VALUE setDictionarySize(VALUE dictionary_size);
+    VALUE dictionarySize();
+    VALUE setWordSize(VALUE word_size);
+    VALUE wordSize();
+    VALUE setMatchFinder(VALUE match_finder);
+    VALUE matchFinder();
+    VALUE setSolidBlockSize(VALUE solid_block_size);
+    VALUE solidBlockSize();
+    VALUE setSolidFiles(VALUE solid_files);
+    VALUE solidFiles();
+    VALUE setSolidBlockThreads(VALUE solid_block_threads);
+    VALUE solidBlockThreads();
+    VALUE setSolidBlockMemory(VALUE solid_block_memory);
+    VALUE solidBlockMemory();
+    VALUE setStoreIncompressible(VALUE store_incompressible);
+    VALUE storeIncompressible();
+    VALUE setBlockSize(VALUE block_size);
+    VALUE blockSize();
+    VALUE memoryUsage();
+
+  protected:
+    virtual void checkOption();
+
+  private:
+    // Same as kFolderThreadsMemoryDefault in 7zHandler.h.
+    static const UInt64 kDefaultSolidBlockMemory = (1ULL << 28);
+
+    // Coder settings after the defaults of the level are applied.
+    struct CoderSetting
+    {
+        UInt32 dictionary_size;
+        UInt32 word_size;
+        std::string match_finder;
+        UInt32 threads;
+        UInt32 lzma_threads;
+        UInt32 block_threads;
+        UInt64 block_size;
+        UInt64 compress_memory;
+        UInt64 decompress_memory;
+    };
+    void getCoderSetting(CoderSetting *setting);
 
   private:
     std::string m_method;
@@ -376,6 +745,124 @@ class SevenZipWriter : public ArchiveWriter
     bool m_header_compression;
     bool m_header_encryption;
     bool m_multi_threading;
+    bool m_store_incompressible;
+
+    // 0 or empty means the default of the method and the level.
+    UInt32 m_threads;
+    UInt32 m_block_threads;
+    UInt32 m_dictionary_size;
+    UInt32 m_word_size;
+    std::string m_match_finder;
+    UInt64 m_solid_block_size;
+    UInt32 m_solid_files;
+    UInt32 m_block_size;
+    UInt32 m_solid_block_threads;
+    UInt64 m_solid_block_memory;
+};
+
+////////////////////////////////////////////////////////////////
+// Readers of the other formats in 7z.so.
+class ZipReader : public ArchiveReader
+{
+  public:
+    ZipReader();
+};
+
+class TarReader : public ArchiveReader
+{
+  public:
+    TarReader();
+};
+
+class GZipReader : public ArchiveReader
+{
+  public:
+    GZipReader();
+};
+
+class BZip2Reader : public ArchiveReader
+{
+  public:
+    BZip2Reader();
+};
+
+class XzReader : public ArchiveReader
+{
+  public:
+    XzReader();
+};
+
+////////////////////////////////////////////////////////////////
+// Writer of the other formats in 7z.so.
+// Spec lists the options which the format handler accepts.
+class FormatWriter : public ArchiveWriter
+{
+  public:
+    struct Spec
+    {
+        // The first method is the default one.
+        // Method can be changed only if there are two or more methods.
+        const char *const *methods;
+        size_t method_num;
+        bool level;
+        bool threads;
+        bool encryption;
+    };
+
+  public:
+    FormatWriter(const GUID &format_guid, const Spec &spec);
+    virtual HRESULT setOption(ISetProperties *set);
+
+    VALUE setMethod(VALUE method);
+    VALUE method();
+    VALUE setLevel(VALUE level);
+    VALUE level();
+    VALUE setThreads(VALUE threads);
+    VALUE threads();
+    VALUE setEncryptionMethod(VALUE encryption_method);
+    VALUE encryptionMethod();
+
+  private:
+    const Spec &m_spec;
+    std::string m_method;
+    UInt32 m_level;
+    UInt32 m_threads;  // 0 means the number of processors.
+    std::string m_encryption_method;
+};
+
+class ZipWriter : public FormatWriter
+{
+  public:
+    static const Spec kSpec;
+    ZipWriter();
+};
+
+class TarWriter : public FormatWriter
+{
+  public:
+    static const Spec kSpec;
+    TarWriter();
+};
+
+class GZipWriter : public FormatWriter
+{
+  public:
+    static const Spec kSpec;
+    GZipWriter();
+};
+
+class BZip2Writer : public FormatWriter
+{
+  public:
+    static const Spec kSpec;
+    BZip2Writer();
+};
+
+class XzWriter : public FormatWriter
+{
+  public:
+    static const Spec kSpec;
+    XzWriter();
 };
 
 ////////////////////////////////////////////////////////////////
@@ -383,8 +870,8 @@ class ArchiveOpenCallback : public IArchiveOpenCallback, public ICryptoGetTextPa
                             public CMyUnknownImp
 {
   public:
-    ArchiveOpenCallback(ArchiveReader *archive);
-    ArchiveOpenCallback(ArchiveReader *archive, const std::string &password);
+    ArchiveOpenCallback(ArchiveBase *archive);
+    ArchiveOpenCallback(ArchiveBase *archive, const std::string &password);
     virtual ~ArchiveOpenCallback() {}
 
     MY_UNKNOWN_IMP2(IArchiveOpenCallback, ICryptoGetTextPassword)
@@ -397,21 +884,21 @@ class ArchiveOpenCallback : public IArchiveOpenCallback, public ICryptoGetTextPa
     STDMETHOD(CryptoGetTextPassword)(BSTR *password);
 
   protected:
-    ArchiveReader *m_archive;
+    ArchiveBase *m_archive;
 
     bool m_password_specified;
     std::string m_password;
 };
 
 class ArchiveExtractCallback : public IArchiveExtractCallback, public ICryptoGetTextPassword,
-                               public CMyUnknownImp
+                               public IArchiveFolderStatCallback, public CMyUnknownImp
 {
   public:
     ArchiveExtractCallback(ArchiveReader *archive);
     ArchiveExtractCallback(ArchiveReader *archive, const std::string &password);
-    virtual ~ArchiveExtractCallback() {}
+    virtual ~ArchiveExtractCallback();
 
-    MY_UNKNOWN_IMP2(IArchiveExtractCallback, ICryptoGetTextPassword)
+    MY_UNKNOWN_IMP3(IArchiveExtractCallback, ICryptoGetTextPassword, IArchiveFolderStatCallback)
 
     // IProgress
     STDMETHOD(SetTotal)(UInt64 size);
@@ -425,22 +912,27 @@ class ArchiveExtractCallback : public IArchiveExtractCallback, public ICryptoGet
     // ICryptoGetTextPassword
     STDMETHOD(CryptoGetTextPassword)(BSTR *password);
 
+    // IArchiveFolderStatCallback
+    STDMETHOD(SetFolderStat)(UInt32 folderIndex, UInt64 packSize, UInt64 unpackSize, UInt64 time);
+
   private:
     ArchiveReader *m_archive;
+    CMyComPtr<OutStream> m_out_stream;
+    CMyComPtr<FileOutStream> m_file_out_stream;
 
     bool m_password_specified;
     const std::string m_password;
 };
 
 class ArchiveUpdateCallback : public IArchiveUpdateCallback, public ICryptoGetTextPassword2,
-                              public CMyUnknownImp
+                              public IArchiveUpdateCallbackSample, public CMyUnknownImp
 {
   public:
     ArchiveUpdateCallback(ArchiveWriter *archive);
     ArchiveUpdateCallback(ArchiveWriter *archive, const std::string &password);
     virtual ~ArchiveUpdateCallback() {}
 
-    MY_UNKNOWN_IMP2(IArchiveUpdateCallback, ICryptoGetTextPassword2)
+    MY_UNKNOWN_IMP3(IArchiveUpdateCallback, ICryptoGetTextPassword2, IArchiveUpdateCallbackSample)
 
     // IProgress
     STDMETHOD(SetTotal)(UInt64 size);
@@ -457,6 +949,9 @@ class ArchiveUpdateCallback : public IArchiveUpdateCallback, public ICryptoGetTe
     // ICryptoGetTextPassword2
     STDMETHOD(CryptoGetTextPassword2)(Int32 *passwordIsDefined, BSTR *password);
 
+    // IArchiveUpdateCallbackSample
+    STDMETHOD(GetSample)(UInt32 index, UInt64 offset, void *data, UInt32 size, UInt32 *processedSize);
+
   private:
     ArchiveWriter *m_archive;
 
@@ -465,10 +960,13 @@ class ArchiveUpdateCallback : public IArchiveUpdateCallback, public ICryptoGetTe
 };
 
 
+// Reads a Ruby IO-like stream through a read-ahead window.
+// Each stream.read fetches a whole window, so that small reads and seeks
+// inside the window need no Ruby call. The position is tracked natively.
 class InStream : public IInStream, public CMyUnknownImp
 {
   public:
-    InStream(VALUE stream, ArchiveBase *archive);
+    InStream(VALUE stream, ArchiveBase *archive, UInt32 read_ahead_size = kDefaultReadAheadSize);
     virtual ~InStream() {}
 
     MY_UNKNOWN_IMP1(IInStream)
@@ -476,9 +974,43 @@ class InStream : public IInStream, public CMyUnknownImp
     STDMETHOD(Seek)(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition);
     STDMETHOD(Read)(void *data, UInt32 size, UInt32 *processedSize);
 
+    static const UInt32 kDefaultReadAheadSize = (1 << 20);
+    static const UInt32 kMaxReadAheadSize = (64 << 20);
+    static const UInt32 kReadAheadAlignment = (1 << 12);
+
+  private:
+    bool initPosition();
+    bool readStream(UInt64 pos, Byte *data, UInt32 size, UInt32 *read_size);
+
   private:
     VALUE m_stream;
     ArchiveBase *m_archive;
+
+    std::vector<Byte> m_buffer;
+    UInt32 m_read_ahead_size;
+    UInt64 m_buffer_pos;
+    UInt32 m_buffer_len;
+
+    bool m_pos_valid;
+    UInt64 m_pos;
+    UInt64 m_stream_pos;
+    bool m_size_valid;
+    UInt64 m_size;
+};
+
+// InStream of an item to compress, which tells the writer when it is released.
+class UpdateInStream : public InStream
+{
+  public:
+    UpdateInStream(VALUE stream, ArchiveWriter *archive, UInt32 index)
+         : InStream(stream, archive), m_writer(archive), m_index(index)
+    {
+    }
+    virtual ~UpdateInStream();
+
+  private:
+    ArchiveWriter *m_writer;
+    UInt32 m_index;
 };
 
 class FileInStream : public IInStream, public CMyUnknownImp
@@ -492,6 +1024,8 @@ class FileInStream : public IInStream, public CMyUnknownImp
     STDMETHOD(Seek)(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition);
     STDMETHOD(Read)(void *data, UInt32 size, UInt32 *processedSize);
 
+    bool isOpened() const;
+
   private:
     ArchiveBase *m_archive;
 #ifdef USE_WIN32_FILE_API
@@ -501,7 +1035,54 @@ class FileInStream : public IInStream, public CMyUnknownImp
 #endif
 };
 
+#ifndef USE_WIN32_FILE_API
+// Reads an archive file without Ruby.
+// pread is used by default. If use_map is true, the whole file is mapped if possible,
+// and each read is checked against the current file size, so that a truncated file
+// fails the read instead of raising SIGBUS.
+class MappedFileInStream : public IInStream, public CMyUnknownImp
+{
+  public:
+    MappedFileInStream(const std::string &filename, bool use_map);
+    virtual ~MappedFileInStream();
+    // Another stream of the same file, which has its own position.
+    MappedFileInStream *duplicate() const;
+
+    MY_UNKNOWN_IMP1(IInStream)
+
+    STDMETHOD(Seek)(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition);
+    STDMETHOD(Read)(void *data, UInt32 size, UInt32 *processedSize);
+
+    bool isOpened() const
+    {
+        return m_fd >= 0;
+    }
+    int error() const
+    {
+        return m_errno;
+    }
+    // Header parsing jumps around the file, and extraction reads packed streams in order.
+    void adviseSequential(bool sequential);
+
+  private:
+    MappedFileInStream();
+    void init(int fd, bool use_map);
+
+  private:
+    int m_fd;
+    int m_errno;
+    bool m_use_map;
+    Byte *m_map;
+    UInt64 m_size;
+    UInt64 m_pos;
+};
+#endif
+
 
+// Writes to a Ruby IO-like stream through a write-back buffer.
+// Writes and seeks inside the pending region stay native, and the region is
+// written by one stream.write when it becomes large, when the position leaves
+// it, or when flush is called. The owner must call flush at the end.
 class OutStream : public IOutStream, public CMyUnknownImp
 {
   public:
@@ -515,17 +1096,31 @@ class OutStream : public IOutStream, public CMyUnknownImp
     STDMETHOD(Seek)(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition);
     STDMETHOD(SetSize)(UInt64 size);
 
+    HRESULT flush();
+
+    static const UInt32 kWriteBufferSize = (1 << 20);
+
+  private:
+    bool initPosition();
+    bool writeStream(UInt64 pos, const char *data, UInt32 size);
+
   private:
     VALUE m_stream;
     ArchiveBase *m_archive;
+
+    std::string m_buffer;
+    UInt64 m_buffer_pos;
+
+    bool m_pos_valid;
+    UInt64 m_pos;
+    UInt64 m_stream_pos;
 };
 
-// Not implemented yet.
 class FileOutStream : public IOutStream, public CMyUnknownImp
 {
   public:
     FileOutStream(const std::string &filename, ArchiveBase *archive);
-    virtual ~FileOutStream() {}
+    virtual ~FileOutStream();
 
     MY_UNKNOWN_IMP1(IOutStream)
 
@@ -534,9 +1129,100 @@ class FileOutStream : public IOutStream, public CMyUnknownImp
     STDMETHOD(Seek)(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition);
     STDMETHOD(SetSize)(UInt64 size);
 
+    bool isOpened() const;
+    void close();
+
   private:
-    const std::string m_filename;
     ArchiveBase *m_archive;
+#ifdef USE_WIN32_FILE_API
+    HANDLE m_file_handle;
+#else
+    int m_fd;
+#endif
+};
+
+// Appends the decoded data to the buffer owned by ArchiveReader.
+// It is used without GVL.
+class MemoryOutStream : public ISequentialOutStream, public CMyUnknownImp
+{
+  public:
+    MemoryOutStream(std::string *buffer, UInt64 expected_size);
+    virtual ~MemoryOutStream() {}
+
+    MY_UNKNOWN_IMP
+
+    STDMETHOD(Write)(const void *data, UInt32 size, UInt32 *processedSize);
+
+  private:
+    std::string *m_buffer;
+};
+
+// Bounded ring buffer between the thread decoding an entry and Ruby reading it.
+// The decoder waits while the buffer is full, which limits the memory usage.
+// Each side copies its data outside the lock, because the other side never
+// touches the region owned by it.
+class EntryPipe
+{
+  public:
+    EntryPipe(size_t capacity);
+
+    // Called by the decoder.
+    HRESULT write(const void *data, UInt32 size, UInt32 *processedSize);
+    void closeWrite(HRESULT result);
+    void setOperationResult(Int32 result)
+    {
+        m_operation_result = result;
+    }
+
+    // Called by Ruby. wait returns the readable size, and 0 at the end.
+    size_t wait(bool *cancelled);
+    void cancelWait(bool *cancelled);
+    size_t read(char *data, size_t size);
+    void closeRead();
+
+    // Valid after the decoder has finished.
+    HRESULT result() const
+    {
+        return m_result;
+    }
+    Int32 operationResult() const
+    {
+        return m_operation_result;
+    }
+
+    static const size_t kDefaultCapacity = (1 << 20);
+    static const size_t kMaxCapacity = (1 << 30);
+
+  private:
+    Mutex m_mutex;
+    ConditionVariable m_cond_var;
+    std::vector<char> m_buffer;
+    size_t m_read_pos;
+    size_t m_size;
+    bool m_read_closed;
+    bool m_write_closed;
+    HRESULT m_result;
+    Int32 m_operation_result;
+};
+
+class PipeOutStream : public ISequentialOutStream, public CMyUnknownImp
+{
+  public:
+    PipeOutStream(EntryPipe *pipe)
+         : m_pipe(pipe)
+    {
+    }
+    virtual ~PipeOutStream() {}
+
+    MY_UNKNOWN_IMP
+
+    STDMETHOD(Write)(const void *data, UInt32 size, UInt32 *processedSize)
+    {
+        return m_pipe->write(data, size, processedSize);
+    }
+
+  private:
+    EntryPipe *m_pipe;
 };
 
 
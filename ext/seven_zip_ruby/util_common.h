@@ -21,12 +21,19 @@ class RubyException
 {
   public:
     RubyException(VALUE exc)
-         : m_exc(exc)
+         : m_exc(exc), m_state(0)
     {
     }
 
     RubyException(const std::string &str)
-         : m_exc(rb_exc_new(rb_eStandardError, str.c_str(), str.size()))
+         : m_exc(rb_exc_new(rb_eStandardError, str.c_str(), str.size())), m_state(0)
+    {
+    }
+
+    // A non-local exit other than raise, such as throw. The wrapped functions
+    // resume it with rb_jump_tag.
+    RubyException(VALUE exc, int state)
+         : m_exc(exc), m_state(state)
     {
     }
 
@@ -35,8 +42,14 @@ class RubyException
         return m_exc;
     }
 
+    int state()
+    {
+        return m_state;
+    }
+
   private:
     VALUE m_exc;
+    int m_state;
 };
 
 
@@ -64,14 +77,18 @@ VALUE wrappedFunction0(VALUE self)
     Data_Get_Struct(self, T, p);
 
     VALUE exc = Qnil;
+    int state = 0;
     try{
         return (p->*func)();
     }catch(RubyException &e){
         exc = e.exception();
+        state = e.state();
     }catch(...){
     }
 
-    if (NIL_P(exc)){
+    if (state){
+        rb_jump_tag(state);
+    }else if (NIL_P(exc)){
         rb_raise(rb_eStandardError, "Unknown exception");
     }else{
         rb_exc_raise(exc);
@@ -88,14 +105,18 @@ VALUE wrappedFunction0(VALUE self)
     U *u = p;
 
     VALUE exc = Qnil;
+    int state = 0;
     try{
         return (u->*func)();
     }catch(RubyException &e){
         exc = e.exception();
+        state = e.state();
     }catch(...){
     }
 
-    if (NIL_P(exc)){
+    if (state){
+        rb_jump_tag(state);
+    }else if (NIL_P(exc)){
         rb_raise(rb_eStandardError, "Unknown exception");
     }else{
         rb_exc_raise(exc);
@@ -111,14 +132,18 @@ VALUE wrappedFunction1(VALUE self, VALUE a1)
     Data_Get_Struct(self, T, p);
 
     VALUE exc = Qnil;
+    int state = 0;
     try{
         return (p->*func)(a1);
     }catch(RubyException &e){
         exc = e.exception();
+        state = e.state();
     }catch(...){
     }
 
-    if (NIL_P(exc)){
+    if (state){
+        rb_jump_tag(state);
+    }else if (NIL_P(exc)){
         rb_raise(rb_eStandardError, "Unknown exception");
     }else{
         rb_exc_raise(exc);
@@ -135,14 +160,18 @@ VALUE wrappedFunction1(VALUE self, VALUE a1)
     U *u = p;
 
     VALUE exc = Qnil;
+    int state = 0;
     try{
         return (u->*func)(a1);
     }catch(RubyException &e){
         exc = e.exception();
+        state = e.state();
     }catch(...){
     }
 
-    if (NIL_P(exc)){
+    if (state){
+        rb_jump_tag(state);
+    }else if (NIL_P(exc)){
         rb_raise(rb_eStandardError, "Unknown exception");
     }else{
         rb_exc_raise(exc);
@@ -158,14 +187,18 @@ VALUE wrappedFunction2(VALUE self, VALUE a1, VALUE a2)
     Data_Get_Struct(self, T, p);
 
     VALUE exc = Qnil;
+    int state = 0;
     try{
         return (p->*func)(a1, a2);
     }catch(RubyException &e){
         exc = e.exception();
+        state = e.state();
     }catch(...){
     }
 
-    if (NIL_P(exc)){
+    if (state){
+        rb_jump_tag(state);
+    }else if (NIL_P(exc)){
         rb_raise(rb_eStandardError, "Unknown exception");
     }else{
         rb_exc_raise(exc);
@@ -182,14 +215,18 @@ VALUE wrappedFunction2(VALUE self, VALUE a1, VALUE a2)
     U *u = p;
 
     VALUE exc = Qnil;
+    int state = 0;
     try{
         return (u->*func)(a1, a2);
     }catch(RubyException &e){
         exc = e.exception();
+        state = e.state();
     }catch(...){
     }
 
-    if (NIL_P(exc)){
+    if (state){
+        rb_jump_tag(state);
+    }else if (NIL_P(exc)){
         rb_raise(rb_eStandardError, "Unknown exception");
     }else{
         rb_exc_raise(exc);
@@ -205,14 +242,18 @@ VALUE wrappedFunction3(VALUE self, VALUE a1, VALUE a2, VALUE a3)
     Data_Get_Struct(self, T, p);
 
     VALUE exc = Qnil;
+    int state = 0;
     try{
         return (p->*func)(a1, a2, a3);
     }catch(RubyException &e){
         exc = e.exception();
+        state = e.state();
     }catch(...){
     }
 
-    if (NIL_P(exc)){
+    if (state){
+        rb_jump_tag(state);
+    }else if (NIL_P(exc)){
         rb_raise(rb_eStandardError, "Unknown exception");
     }else{
         rb_exc_raise(exc);
@@ -229,14 +270,18 @@ VALUE wrappedFunction3(VALUE self, VALUE a1, VALUE a2, VALUE a3)
     U *u = p;
 
     VALUE exc = Qnil;
+    int state = 0;
     try{
         return (u->*func)(a1, a2, a3);
     }catch(RubyException &e){
         exc = e.exception();
+        state = e.state();
     }catch(...){
     }
 
-    if (NIL_P(exc)){
+    if (state){
+        rb_jump_tag(state);
+    }else if (NIL_P(exc)){
         rb_raise(rb_eStandardError, "Unknown exception");
     }else{
         rb_exc_raise(exc);
@@ -252,14 +297,18 @@ VALUE wrappedFunction4(VALUE self, VALUE a1, VALUE a2, VALUE a3, VALUE a4)
     Data_Get_Struct(self, T, p);
 
     VALUE exc = Qnil;
+    int state = 0;
     try{
         return (p->*func)(a1, a2, a3, a4);
     }catch(RubyException &e){
         exc = e.exception();
+        state = e.state();
     }catch(...){
     }
 
-    if (NIL_P(exc)){
+    if (state){
+        rb_jump_tag(state);
+    }else if (NIL_P(exc)){
         rb_raise(rb_eStandardError, "Unknown exception");
     }else{
         rb_exc_raise(exc);
@@ -276,14 +325,18 @@ VALUE wrappedFunction4(VALUE self, VALUE a1, VALUE a2, VALUE a3, VALUE a4)
     U *u = p;
 
     VALUE exc = Qnil;
+    int state = 0;
     try{
         return (u->*func)(a1, a2, a3, a4);
     }catch(RubyException &e){
         exc = e.exception();
+        state = e.state();
     }catch(...){
     }
 
-    if (NIL_P(exc)){
+    if (state){
+        rb_jump_tag(state);
+    }else if (NIL_P(exc)){
         rb_raise(rb_eStandardError, "Unknown exception");
     }else{
         rb_exc_raise(exc);
@@ -299,14 +352,18 @@ VALUE wrappedFunction5(VALUE self, VALUE a1, VALUE a2, VALUE a3, VALUE a4, VALUE
     Data_Get_Struct(self, T, p);
 
     VALUE exc = Qnil;
+    int state = 0;
     try{
         return (p->*func)(a1, a2, a3, a4, a5);
     }catch(RubyException &e){
         exc = e.exception();
+        state = e.state();
     }catch(...){
     }
 
-    if (NIL_P(exc)){
+    if (state){
+        rb_jump_tag(state);
+    }else if (NIL_P(exc)){
         rb_raise(rb_eStandardError, "Unknown exception");
     }else{
         rb_exc_raise(exc);
@@ -323,14 +380,18 @@ VALUE wrappedFunction5(VALUE self, VALUE a1, VALUE a2, VALUE a3, VALUE a4, VALUE
     U *u = p;
 
     VALUE exc = Qnil;
+    int state = 0;
     try{
         return (u->*func)(a1, a2, a3, a4, a5);
     }catch(RubyException &e){
         exc = e.exception();
+        state = e.state();
     }catch(...){
     }
 
-    if (NIL_P(exc)){
+    if (state){
+        rb_jump_tag(state);
+    }else if (NIL_P(exc)){
         rb_raise(rb_eStandardError, "Unknown exception");
     }else{
         rb_exc_raise(exc);
@@ -1,6 +1,10 @@
 
 #include "utils.h"
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 #define INTERN(const_str) rb_intern2(const_str, sizeof(const_str) - 1)
 
 ////////////////////////////////////////////////////////////////
@@ -460,6 +464,22 @@ VALUE ConvertBstrToString(const BSTR &bstr)
     return str;
 }
 
+void AppendBstrToUtf8(const BSTR &bstr, std::string *str)
+{
+    const int char_count = SysStringLen(bstr);
+    const size_t pos = str->size();
+#ifdef _WIN32
+    const int len = WideCharToMultiByte(CP_UTF8, 0, bstr, char_count, NULL, 0, NULL, NULL);
+    str->resize(pos + len);
+    WideCharToMultiByte(CP_UTF8, 0, bstr, char_count, &(*str)[pos], len, NULL, NULL);
+#else
+    size_t len;
+    Utf16_To_Utf8(NULL, &len, bstr, char_count);
+    str->resize(pos + len);
+    Utf16_To_Utf8(&(*str)[pos], &len, bstr, char_count);
+#endif
+}
+
 BSTR ConvertStringToBstr(const std::string &str)
 {
 #ifdef _WIN32
@@ -573,3 +593,14 @@ void ConvertValueToProp(VALUE value, VARTYPE type, PROPVARIANT *prop)
     }
 }
 
+UInt32 GetProcessorCount()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long num = sysconf(_SC_NPROCESSORS_ONLN);
+    return (num < 1 ? 1 : (UInt32)num);
+#endif
+}
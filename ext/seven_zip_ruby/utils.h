@@ -16,10 +16,12 @@
 #include <CPP/Windows/PropVariant.h>
 
 VALUE ConvertBstrToString(const BSTR &bstr);
+void AppendBstrToUtf8(const BSTR &bstr, std::string *str);
 BSTR ConvertStringToBstr(const std::string &str);
 BSTR ConvertStringToBstr(const char *str, int length);
 VALUE ConvertFiletimeToTime(const FILETIME &filetime);
 VALUE ConvertPropToValue(const PROPVARIANT &prop);
 void ConvertValueToProp(VALUE value, VARTYPE type, PROPVARIANT *prop);
+UInt32 GetProcessorCount();
 
 #endif
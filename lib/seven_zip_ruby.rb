@@ -30,5 +30,7 @@ require("seven_zip_ruby/seven_zip_writer")
 require("seven_zip_ruby/archive_info")
 require("seven_zip_ruby/update_info")
 require("seven_zip_ruby/entry_info")
+require("seven_zip_ruby/entry_reader")
 require("seven_zip_ruby/exception")
+require("seven_zip_ruby/archive_format")
 
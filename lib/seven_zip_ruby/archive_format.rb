@@ -0,0 +1,212 @@
+module SevenZipRuby
+
+  # ZipReader, TarReader, GZipReader, BZip2Reader and XzReader read the other
+  # formats supported by 7z.so. They have the same methods as SevenZipReader.
+  #
+  # ZipWriter, TarWriter, GZipWriter, BZip2Writer and XzWriter create them.
+  # They have the same methods as SevenZipWriter, except the options.
+  #
+  # ZipWriter :: +method+ ("DEFLATE", "DEFLATE64", "BZIP2", "LZMA", "PPMd" or "COPY"),
+  #              +level+ (0-9), +threads+ and +encryption_method+ ("ZIPCRYPTO", "AES128", "AES192" or "AES256").
+  # TarWriter :: No option.
+  # GZipWriter :: +level+ (0-9).
+  # BZip2Writer :: +level+ (0-9) and +threads+.
+  # XzWriter :: +level+ (0-9) and +threads+.
+  #
+  # +threads+ is the number of threads. 0 means the number of processors.
+  # GZipWriter, BZip2Writer and XzWriter can store only one file.
+  module ArchiveFormat
+    # Format name => [ reader class, writer class, extensions ]
+    FORMAT_LIST = {
+      seven_zip: [ SevenZipReader, SevenZipWriter, [ ".7z" ] ],
+      zip: [ ZipReader, ZipWriter, [ ".zip" ] ],
+      tar: [ TarReader, TarWriter, [ ".tar" ] ],
+      gzip: [ GZipReader, GZipWriter, [ ".gz", ".tgz" ] ],
+      bzip2: [ BZip2Reader, BZip2Writer, [ ".bz2", ".tbz", ".tbz2" ] ],
+      xz: [ XzReader, XzWriter, [ ".xz", ".txz" ] ]
+    }
+
+    FORMAT_ALIAS = { "7z" => :seven_zip, "gz" => :gzip, "bz2" => :bzip2 }  # :nodoc:
+
+    # Bytes read to detect the format. This is the size of a tar header.
+    SIGNATURE_SIZE = 512  # :nodoc:
+
+    class << self
+      # Normalize a format name, such as <tt>:zip</tt>, <tt>"7z"</tt> or <tt>"GZip"</tt>.
+      def format_name(format)
+        name = format.to_s.downcase
+        name = FORMAT_ALIAS[name] || name.to_sym
+        raise ArgumentError.new("unknown format: #{format}") unless (FORMAT_LIST.key?(name))
+        return name
+      end
+
+      # Detect the format from the head of an archive. Return nil if unknown.
+      def detect(head)
+        head = head.b
+        return :seven_zip if (head.start_with?("7z\xBC\xAF\x27\x1C".b))
+        return :xz if (head.start_with?("\xFD7zXZ\x00".b))
+        return :gzip if (head.start_with?("\x1F\x8B\x08".b))
+        return :bzip2 if (head.start_with?("BZh"))
+        return :zip if (head.start_with?("PK\x03\x04", "PK\x05\x06", "PK\x07\x08"))
+        return :tar if (tar_header?(head))
+        return nil
+      end
+
+      # Old tar headers, which 7z.so also writes, have no signature.
+      # So the checksum of the header is checked.
+      def tar_header?(head)  # :nodoc:
+        return false if (head.bytesize < SIGNATURE_SIZE || head.getbyte(0) == 0)
+        return true if (head.byteslice(257, 5) == "ustar")
+
+        checksum = head.byteslice(148, 8).delete("\0 ")
+        return false unless (checksum.match?(/\A[0-7]+\z/))
+        sum = head.byteslice(0, SIGNATURE_SIZE).sum(32) - head.byteslice(148, 8).sum(32) + 0x20 * 8
+        return sum == checksum.to_i(8)
+      end
+      private :tar_header?
+
+      # Detect the format from the extension of a filename. Return nil if unknown.
+      def detect_by_name(filename)
+        ext = File.extname(filename.to_s).downcase
+        name, _ = FORMAT_LIST.find{ |_, (_, _, ext_list)| ext_list.include?(ext) }
+        return name
+      end
+
+      def reader_class(format)
+        return FORMAT_LIST[format_name(format)][0]
+      end
+
+      def writer_class(format)
+        return FORMAT_LIST[format_name(format)][1]
+      end
+    end
+  end
+
+  # ArchiveReader opens an archive with the reader class of its format.
+  #
+  # ==== Examples
+  #   # The format is detected from the signature.
+  #   SevenZipRuby::ArchiveReader.open_file("filename.zip") do |reader|
+  #     reader.extract(:all, "path_to_dir")
+  #   end
+  #
+  #   # Specify the format.
+  #   File.open("filename.tar", "rb") do |file|
+  #     SevenZipRuby::ArchiveReader.open(file, format: :tar) do |reader|
+  #       entries = reader.entries
+  #     end
+  #   end
+  module ArchiveReader
+    class << self
+      # Open an archive to read.
+      #
+      # ==== Args
+      # +stream+ :: Input stream to read the archive. <tt>stream.seek</tt> and <tt>stream.read</tt> are needed.
+      # +param+ :: Optional hash parameter. <tt>:format</tt> key specifies the format, which is detected from the signature by default.
+      #            The other keys are passed to the reader.
+      def open(stream, param = {}, &block)  # :yield: reader
+        param = param.clone
+        format = param.delete(:format)
+        unless (format)
+          pos = stream.pos
+          stream.set_encoding(Encoding::ASCII_8BIT)
+          format = detect_format(stream.read(ArchiveFormat::SIGNATURE_SIZE))
+          stream.seek(pos)
+        end
+        return ArchiveFormat.reader_class(format).open(stream, param, &block)
+      end
+
+      # Open an archive file to read.
+      #
+      # ==== Args
+      # +filename+ :: Filename of the archive.
+      # +param+ :: Optional hash parameter. <tt>:format</tt> key specifies the format, which is detected from the signature by default.
+      #            The other keys are passed to the reader.
+      def open_file(filename, param = {}, &block)  # :yield: reader
+        param = param.clone
+        format = param.delete(:format)
+        format ||= detect_format(File.open(filename, "rb"){ |file| file.read(ArchiveFormat::SIGNATURE_SIZE) })
+        return ArchiveFormat.reader_class(format).open_file(filename, param, &block)
+      end
+
+      def detect_format(head)  # :nodoc:
+        format = ArchiveFormat.detect(head.to_s)
+        raise InvalidArchive.new("Unknown archive format") unless (format)
+        return format
+      end
+      private :detect_format
+    end
+  end
+
+  # ArchiveWriter creates an archive with the writer class of the format.
+  #
+  # ==== Examples
+  #   SevenZipRuby::ArchiveWriter.open_file("filename.zip", threads: 4) do |writer|
+  #     writer.add_directory("dir")
+  #   end
+  #
+  #   File.open("filename.xz", "wb") do |file|
+  #     SevenZipRuby::ArchiveWriter.open(file, format: :xz, level: 9) do |writer|
+  #       writer.add_data("data", "file.txt")
+  #     end
+  #   end
+  module ArchiveWriter
+    class << self
+      # Open an archive to create.
+      #
+      # ==== Args
+      # +stream+ :: Output stream to write the archive. <tt>stream.write</tt> is needed.
+      # +param+ :: Optional hash parameter. <tt>:format</tt> key specifies the format. It is required.
+      #            The option keys of the writer, such as <tt>:method</tt>, <tt>:level</tt> and <tt>:threads</tt>, are set to the writer.
+      #            The other keys are passed to the writer.
+      def open(stream, param = {}, &block)  # :yield: writer
+        param = param.clone
+        format = param.delete(:format)
+        raise ArgumentError.new(":format is required") unless (format)
+        return open_writer(format, param, block){ |cls, open_param| cls.open(stream, open_param) }
+      end
+
+      # Open an archive file to create.
+      #
+      # ==== Args
+      # +filename+ :: Filename of the archive.
+      # +param+ :: Optional hash parameter. <tt>:format</tt> key specifies the format, which is detected from the extension by default.
+      #            The option keys of the writer, such as <tt>:method</tt>, <tt>:level</tt> and <tt>:threads</tt>, are set to the writer.
+      #            The other keys are passed to the writer.
+      def open_file(filename, param = {}, &block)  # :yield: writer
+        param = param.clone
+        format = param.delete(:format) || ArchiveFormat.detect_by_name(filename)
+        raise ArgumentError.new("Unknown archive format: #{filename}") unless (format)
+        return open_writer(format, param, block){ |cls, open_param| cls.open_file(filename, open_param) }
+      end
+
+      def open_writer(format, param, block)  # :nodoc:
+        cls = ArchiveFormat.writer_class(format)
+        option = {}
+        param.keys.each do |key|
+          option[key] = param.delete(key) if (cls.method_defined?("#{key}="))
+        end
+
+        writer = yield(cls, param)
+        begin
+          option.each do |key, value|
+            writer.__send__("#{key}=", value)
+          end
+        rescue
+          writer.close_file
+          raise
+        end
+        return writer unless (block)
+
+        begin
+          block.call(writer)
+          writer.compress
+          writer.close
+        ensure
+          writer.close_file
+        end
+      end
+      private :open_writer
+    end
+  end
+end
@@ -0,0 +1,103 @@
+module SevenZipRuby
+  # EntryReader reads the contents of an entry on demand.
+  # It is returned by SevenZipReader#open_entry.
+  #
+  # The entry is decoded on a native thread into a bounded buffer, and the decoder
+  # waits while the buffer is full. So a large entry can be passed to another
+  # stream, such as an HTTP response, without keeping the whole data in memory.
+  #
+  # The other operations of the reader raise InvalidOperation until it is closed.
+  #
+  # ==== Examples
+  #   SevenZipRuby::SevenZipReader.open_file("filename.7z") do |szr|
+  #     szr.open_entry(szr.find_entry("large_file.bin")) do |entry|
+  #       while (chunk = entry.read(64 * 1024))
+  #         socket.write(chunk)
+  #       end
+  #     end
+  #   end
+  class EntryReader
+    # Size of chunks yielded by each_chunk.
+    DEFAULT_CHUNK_SIZE = 64 * 1024
+
+    def initialize(archive, entry_info)  # :nodoc:
+      @archive = archive
+      @entry_info = entry_info
+      @finished = false
+      @closed = false
+    end
+
+    # EntryInfo of the entry.
+    attr_reader :entry_info
+
+    # Read at most +maxlen+ bytes. It returns as soon as some data is decoded.
+    # EOFError is raised at the end of the entry.
+    # The data is written to +outbuf+ if it is given.
+    def readpartial(maxlen, outbuf = nil)
+      data = read_chunk(maxlen, outbuf)
+      raise EOFError.new("end of entry reached") unless (data)
+      return data
+    end
+
+    # Read +length+ bytes, or until the end of the entry if +length+ is nil.
+    # nil is returned at the end of the entry when +length+ is positive, as IO#read does.
+    def read(length = nil, outbuf = nil)
+      if (length)
+        raise ArgumentError.new("negative length #{length} given") if (length < 0)
+        return (outbuf ? outbuf.replace("") : "".b) if (length == 0)
+      end
+
+      data = read_chunk(length || DEFAULT_CHUNK_SIZE, outbuf)
+      unless (data)
+        outbuf.replace("") if (outbuf)
+        return (length ? nil : (outbuf || "".b))
+      end
+
+      buffer = "".b
+      while (!length || data.bytesize < length)
+        chunk = read_chunk(length ? length - data.bytesize : DEFAULT_CHUNK_SIZE, buffer)
+        break unless (chunk)
+        data << chunk
+      end
+      return data
+    end
+
+    # Iterate over the chunks of the entry. Each chunk is at most +chunk_size+ bytes.
+    def each_chunk(chunk_size = DEFAULT_CHUNK_SIZE)  # :yield: chunk
+      return to_enum(:each_chunk, chunk_size) unless (block_given?)
+
+      while (chunk = read_chunk(chunk_size))
+        yield chunk
+      end
+      return self
+    end
+    alias each each_chunk
+
+    # Stop decoding the entry.
+    def close
+      return nil if (@closed)
+      @closed = true
+      @archive.close_entry_impl unless (@finished)
+      return nil
+    end
+
+    def closed?
+      return @closed
+    end
+
+    def eof?
+      return @finished
+    end
+    alias eof eof?
+
+    def read_chunk(size, outbuf = nil)  # :nodoc:
+      raise IOError.new("closed stream") if (@closed)
+      return nil if (@finished)
+
+      data = @archive.read_entry_impl(size, outbuf)
+      @finished = true unless (data)
+      return data
+    end
+    private :read_chunk
+  end
+end
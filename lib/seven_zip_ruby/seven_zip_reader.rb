@@ -21,6 +21,22 @@ module SevenZipRuby
   #     end
   #   end
   #
+  # === Read entries of a solid archive at random
+  #   # Decoded solid blocks up to 256MB are kept in memory.
+  #   SevenZipRuby::Reader.open_file("filename.7z", folder_cache_size: "256m") do |szr|
+  #     data = szr.extract_data(szr.find_entry("dir/file.txt"))
+  #     data2 = szr.extract_data(szr.find_entry("dir/file2.txt"))  # Copied from the kept block.
+  #     szr.folder_cache_stats  # => { hits: 1, misses: 1, size: ... }
+  #   end
+  #
+  #   # The decoder states are kept at each 64MB of solid blocks, and entries are decoded
+  #   # from the nearest one. Each of them takes up to the dictionary size of the block,
+  #   # and they are kept up to checkpoint_memory, 256MB by default.
+  #   SevenZipRuby::Reader.open_file("filename.7z", checkpoint_interval: "64m") do |szr|
+  #     data = szr.extract_data(szr.find_entry("dir/file.txt"))
+  #     szr.checkpoint_stats  # => { count: 3, size: ... }
+  #   end
+  #
   # === Extract 7zip archive.
   #   # Extract archive
   #   File.open("filename.7z", "rb") do |file|
@@ -63,12 +79,47 @@ module SevenZipRuby
   #     # => true/false
   #   end
   class SevenZipReader
+    @use_native_output_file_stream = true
+    @use_native_input_file_stream = true
+
     class << self
+      attr_accessor :use_native_output_file_stream
+
+      # If true, open_file reads the archive file natively with pread, or mmap if the <tt>:mmap</tt> option is given,
+      # without calling File#seek and File#read.
+      attr_accessor :use_native_input_file_stream
+
+      # Drop the parsed headers of 7zip archives kept by the process.
+      # Up to 16 headers are kept, so that the archives opened again are not parsed again.
+      # Use <tt>header_cache: false</tt> of open to read an archive without it.
+      def clear_header_cache
+        self.new.clear_header_cache_impl
+        return nil
+      end
+
+      # Return the number of the parsed headers kept by the process, and the number of their files and folders.
+      #
+      # ==== Examples
+      #   SevenZipRuby::SevenZipReader.header_cache_stats  # => { count: 2, items: 1234 }
+      def header_cache_stats
+        return self.new.header_cache_stats_impl
+      end
+
       # Open 7zip archive to read.
       #
       # ==== Args
       # +stream+ :: Input stream to read 7zip archive. <tt>stream.seek</tt> and <tt>stream.read</tt> are needed.
       # +param+ :: Optional hash parameter. <tt>:password</tt> key represents password of this archive.
+      #            <tt>:read_ahead_size</tt> key is the size read from +stream+ at once, such as <tt>"4m"</tt>. The default is 1MB.
+      #            0 reads only the requested size.
+      #            <tt>:folder_cache_size</tt> key is the memory size to keep the decoded solid blocks, such as <tt>"256m"</tt>.
+      #            Entries of a kept block are extracted again without decoding. The default is 0, which disables it.
+      #            <tt>:checkpoint_interval</tt> key is the interval to keep the decoder states in LZMA solid blocks, such as <tt>"64m"</tt>.
+      #            Entries are decoded from the nearest state before them. The default is 0, which disables it.
+      #            <tt>:checkpoint_memory</tt> key is the memory size to keep the decoder states, such as <tt>"1g"</tt>.
+      #            The least recently used states are dropped beyond it. The default is 256MB.
+      #            <tt>:header_cache</tt> key is false not to take the parsed header from the cache shared by the process,
+      #            nor to add it. The default is true.
       #
       # ==== Examples
       #   # Open archive
@@ -172,9 +223,10 @@ module SevenZipRuby
       #     SevenZipRuby::SevenZipReader.extract(file, :all, "path_to_dir")
       #   end
       def extract(stream, index, dir = ".", param = {})
+        param = param.clone
         password = { password: param.delete(:password) }
         self.open(stream, password) do |szr|
-          szr.extract(index, dir)
+          szr.extract(index, dir, param)
         end
       end
 
@@ -184,15 +236,21 @@ module SevenZipRuby
       # +stream+ :: Input stream to read 7zip archive. <tt>stream.seek</tt> and <tt>stream.read</tt> are needed.
       # +dir+ :: Directory to extract the archive to.
       # +param+ :: Optional hash parameter. <tt>:password</tt> key represents password of this archive.
+      #            <tt>:threads</tt> and <tt>:in_order</tt> keys are passed to SevenZipReader#extract_all.
       #
       # ==== Examples
       #   File.open("filename.7z", "rb") do |file|
       #     SevenZipRuby::SevenZipReader.extract_all(file, "path_to_dir")
       #   end
+      #
+      #   File.open("filename.7z", "rb") do |file|
+      #     SevenZipRuby::SevenZipReader.extract_all(file, "path_to_dir", threads: 4)
+      #   end
       def extract_all(stream, dir = ".", param = {})
+        param = param.clone
         password = { password: param.delete(:password) }
         self.open(stream, password) do |szr|
-          szr.extract_all(dir)
+          szr.extract_all(dir, param)
         end
       end
 
@@ -201,6 +259,7 @@ module SevenZipRuby
       # ==== Args
       # +stream+ :: Input stream to read 7zip archive. <tt>stream.seek</tt> and <tt>stream.read</tt> are needed.
       # +opt+ :: Optional hash parameter. <tt>:password</tt> key represents password of this archive.
+      #          <tt>:threads</tt> and <tt>:stop_on_error</tt> keys are passed to SevenZipReader#verify.
       #
       # ==== Examples
       #   File.open("filename.7z", "rb") do |file|
@@ -211,7 +270,7 @@ module SevenZipRuby
         ret = false
         begin
           self.open(stream, opt) do |szr|
-            ret = szr.verify
+            ret = szr.verify(opt)
           end
         rescue
           ret = false
@@ -227,6 +286,14 @@ module SevenZipRuby
     # ==== Args
     # +stream+ :: Input stream to read 7zip archive. <tt>stream.seek</tt> and <tt>stream.read</tt> are needed.
     # +param+ :: Optional hash parameter. <tt>:password</tt> key represents password of this archive.
+    #            <tt>:read_ahead_size</tt> key is the size read from +stream+ at once, such as <tt>"4m"</tt>. The default is 1MB.
+    #            0 reads only the requested size.
+    #            <tt>:folder_cache_size</tt> key is the memory size to keep the decoded solid blocks, such as <tt>"256m"</tt>.
+    #            Entries of a kept block are extracted again without decoding. The default is 0, which disables it.
+    #            <tt>:checkpoint_interval</tt> key is the interval to keep the decoder states in LZMA solid blocks, such as <tt>"64m"</tt>.
+    #            Entries are decoded from the nearest state before them. The default is 0, which disables it.
+    #            <tt>:checkpoint_memory</tt> key is the memory size to keep the decoder states, such as <tt>"1g"</tt>.
+    #            The least recently used states are dropped beyond it. The default is 256MB.
     #
     # ==== Examples
     #   File.open("filename.7z", "rb") do |file|
@@ -238,7 +305,9 @@ module SevenZipRuby
     def open(stream, param = {})
       param = param.clone
       param[:password] = param[:password].to_s if (param[:password])
+      param[:default_path] ||= default_entry_path(stream.respond_to?(:path) ? stream.path : nil)
       stream.set_encoding(Encoding::ASCII_8BIT)
+      @guard = Mutex.new
       open_impl(stream, param)
       return self
     end
@@ -248,6 +317,9 @@ module SevenZipRuby
     # ==== Args
     # +filename+ :: Filename of 7zip archive.
     # +param+ :: Optional hash parameter. <tt>:password</tt> key represents password of this archive.
+    #            <tt>:folder_cache_size</tt>, <tt>:checkpoint_interval</tt> and <tt>:checkpoint_memory</tt> keys are the same as open.
+    #            If <tt>:mmap</tt> key is true, the archive file is mapped into memory instead of being read by pread.
+    #            A read beyond the end of the file truncated while it is opened fails with an error.
     #
     # ==== Examples
     #   szr = SevenZipRuby::SevenZipReader.new
@@ -255,8 +327,60 @@ module SevenZipRuby
     #   # ...
     #   szr.close
     def open_file(filename, param = {})
-      @stream = File.open(filename, "rb")
-      self.open(@stream, param)
+      if (SevenZipReader.use_native_input_file_stream)
+        param = param.clone
+        param[:password] = param[:password].to_s if (param[:password])
+        param[:default_path] ||= default_entry_path(File.path(filename))
+        @guard = Mutex.new
+        open_file_impl(File.path(filename), param)
+      else
+        @stream = File.open(filename, "rb")
+        self.open(@stream, param)
+      end
+      return self
+    end
+
+    # Open an extraction context of this archive.
+    # The context shares the parsed archive with this reader and reads the packed data
+    # through its own stream, so that the contexts can extract entries in different threads
+    # at the same time. The context can be used after this reader is closed.
+    # Only 7z archives are supported.
+    #
+    # ==== Args
+    # +stream+ :: Input stream of the same archive. It can be omitted for the archive opened by open_file,
+    #             whose file is opened again for the context.
+    # +param+ :: Optional hash parameter. <tt>:read_ahead_size</tt> key is the same as open.
+    #            The password and the extraction options, such as <tt>:threads</tt>, of this reader are used.
+    #
+    # ==== Examples
+    #   SevenZipRuby::SevenZipReader.open_file("filename.7z") do |szr|
+    #     threads = szr.entries.select(&:file?).each_slice(100).map do |list|
+    #       Thread.new do
+    #         szr.open_context do |ctx|
+    #           list.map{ |entry| ctx.extract_data(entry) }
+    #         end
+    #       end
+    #     end
+    #     data_list = threads.flat_map(&:value)
+    #   end
+    def open_context(stream = nil, param = {})  # :yield: context
+      ctx = self.class.new
+      ctx.open_as_context(self, stream, param)
+      return ctx unless (block_given?)
+
+      begin
+        ret = yield(ctx)
+        ctx.close
+        return ret
+      ensure
+        ctx.close_file
+      end
+    end
+
+    def open_as_context(parent, stream, param)  # :nodoc:
+      stream.set_encoding(Encoding::ASCII_8BIT) if (stream)
+      @guard = Mutex.new
+      open_context_impl(parent, stream, param)
       return self
     end
 
@@ -275,19 +399,28 @@ module SevenZipRuby
     # Verify 7zip archive.
     #
     # ==== Args
-    # none
+    # +param+ :: Optional hash parameter.
+    #            <tt>:threads</tt> key represents the number of threads to decode folders with.
+    #            Testing stops at the first broken entry if <tt>:stop_on_error</tt> key is true.
+    #
+    # The time spent on each folder is reported by SevenZipReader#verify_stats.
     #
     # ==== Examples
     #   File.open("filename.7z", "rb") do |file|
     #     SevenZipRuby::SevenZipReader.open(file) do |szr|
     #       ret = szr.verify
     #       # => true/false
+    #
+    #       ret = szr.verify(threads: 4, stop_on_error: true)
+    #       szr.verify_stats
+    #       # => [ { folder: 0, pack_size: ..., unpack_size: ..., time: 0.25,
+    #       #        pack_speed: ..., unpack_speed: ... }, ... ]
     #     end
     #   end
-    def test
+    def test(param = {})
       begin
         synchronize do
-          return test_all_impl(nil)
+          return test_all_impl(nil, param)
         end
       rescue
         return false
@@ -298,7 +431,8 @@ module SevenZipRuby
     # Verify 7zip archive and return the result of each entry.
     #
     # ==== Args
-    # none
+    # +param+ :: Optional hash parameter. Same as SevenZipReader#verify.
+    #            The entries not tested because of <tt>:stop_on_error</tt> are nil.
     #
     # ==== Examples
     #   File.open("filename.7z", "rb") do |file|
@@ -307,21 +441,99 @@ module SevenZipRuby
     #       # => [ true, :DataError, :DataError, ... ]
     #     end
     #   end
-    def verify_detail
+    def verify_detail(param = {})
       begin
         synchronize do
-          return test_all_impl(true)
+          return test_all_impl(true, param)
         end
       rescue
         return nil
       end
     end
 
+    # Get the information of the entry.
+    #
+    # ==== Args
+    # +index+ :: Index of the entry.
+    #
+    # ==== Examples
+    #   File.open("filename.7z", "rb") do |file|
+    #     SevenZipRuby::SevenZipReader.open(file) do |szr|
+    #       info = szr.entry(2)
+    #       # => #<EntryInfo: 2, file, dir/file.txt>
+    #     end
+    #   end
+    def entry(index)
+      return entry_impl(index, true)
+    end
+
+    # Get the information of all entries.
+    #
+    # ==== Args
+    # +param+ :: Optional hash parameter.
+    #            <tt>:lazy</tt> key returns Enumerator::Lazy which creates each EntryInfo on access.
+    #
+    # ==== Examples
+    #   File.open("filename.7z", "rb") do |file|
+    #     SevenZipRuby::SevenZipReader.open(file) do |szr|
+    #       list = szr.entries
+    #       # => [ #<EntryInfo: 0, dir, dir>, #<EntryInfo: 1, file, dir/file.txt>, ... ]
+    #
+    #       large_files = szr.entries(lazy: true).select{ |i| i.size > 1024 * 1024 }.first(10)
+    #     end
+    #   end
+    def entries(param = {})
+      return each_entry.lazy if (param[:lazy])
+      return entries_impl
+    end
+
+    # Iterate over the entries without keeping EntryInfo objects.
+    # It is suitable for archives with many entries.
+    #
+    # ==== Examples
+    #   File.open("filename.7z", "rb") do |file|
+    #     SevenZipRuby::SevenZipReader.open(file) do |szr|
+    #       total = 0
+    #       szr.each_entry do |entry|
+    #         total += entry.size if (entry.file?)
+    #       end
+    #     end
+    #   end
+    def each_entry  # :yield: entry_info
+      return to_enum(:each_entry){ entry_num } unless (block_given?)
+
+      num = entry_num
+      num.times do |i|
+        yield entry_impl(i, false)
+      end
+      return self
+    end
+
+    # Find the entry by its path.
+    # Return nil if there is no such entry.
+    #
+    # ==== Args
+    # +path+ :: Path of the entry in the archive.
+    #
+    # ==== Examples
+    #   File.open("filename.7z", "rb") do |file|
+    #     SevenZipRuby::SevenZipReader.open(file) do |szr|
+    #       info = szr.find_entry("dir/file.txt")
+    #       data = szr.extract_data(info) if (info)
+    #     end
+    #   end
+    def find_entry(path)
+      path = Pathname(path.to_s).cleanpath.to_s.b
+      index = find_entry_impl(path)
+      return index && entry(index)
+    end
+
     # Extract some entries of 7zip archive to local directory.
     #
     # ==== Args
     # +index+ :: Index of the entry to extract. Integer or Array of Integer can be specified.
     # +dir+ :: Directory to extract the archive to.
+    # +param+ :: Optional hash parameter. See SevenZipReader#extract_all.
     #
     # ==== Examples
     #   File.open("filename.7z", "rb") do |file|
@@ -335,16 +547,16 @@ module SevenZipRuby
     #       szr.extract(:all, "path_to_dir")
     #     end
     #   end
-    def extract(index, dir = ".")
+    def extract(index, dir = ".", param = {})
       path = File.expand_path(dir)
       case(index)
       when Symbol
         raise SevenZipError.new("Argument error") unless (index == :all)
-        return extract_all(path)
+        return extract_all(path, param)
       when Enumerable
-        index_list = index.map(&:to_i).sort.uniq
+        index_list = index.map(&:to_i)
         synchronize do
-          extract_files_impl(index_list, file_proc(path))
+          extract_files_impl(index_list, file_proc(path), param)
         end
       when nil
         raise ArgumentError.new("Invalid parameter index")
@@ -359,6 +571,11 @@ module SevenZipRuby
     #
     # ==== Args
     # +dir+ :: Directory to extract the archive to.
+    # +param+ :: Optional hash parameter.
+    #            <tt>:threads</tt> key represents the number of threads to decode independent folders with.
+    #            Entries are written in index order unless <tt>:in_order</tt> key is false.
+    #            <tt>:binder_buffer_size</tt> key specifies the buffer size in bytes between coders
+    #            of a folder, such as BCJ2 and LZMA, up to 256MB. 0 means unbuffered handoff.
     #
     # ==== Examples
     #   File.open("filename.7z", "rb") do |file|
@@ -366,9 +583,15 @@ module SevenZipRuby
     #       szr.extract_all("path_to_dir")
     #     end
     #   end
-    def extract_all(dir = ".")
+    #
+    #   File.open("filename.7z", "rb") do |file|
+    #     SevenZipRuby::SevenZipReader.open(file) do |szr|
+    #       szr.extract_all("path_to_dir", threads: 4, in_order: false)
+    #     end
+    #   end
+    def extract_all(dir = ".", param = {})
       synchronize do
-        extract_all_impl(file_proc(File.expand_path(dir)))
+        extract_all_impl(file_proc(File.expand_path(dir)), param)
       end
     end
 
@@ -387,13 +610,20 @@ module SevenZipRuby
     #     end
     #   end
     def extract_if(dir = ".", &block)  # :yield: entry_info
-      extract(entries.select(&block).map(&:index), dir)
+      extract(each_entry.select(&block).map(&:index), dir)
     end
 
     # Extract some entries of 7zip archive and return the extracted data.
+    # The data is decoded directly into memory without calling Ruby for each entry.
+    #
+    # The entries of a list are decoded in the order of their solid blocks, so each block
+    # is decoded once whatever the order of the list is. The data is returned in the order
+    # of the list, or yielded with the index of the entry as soon as it is decoded
+    # when a block is given. SevenZipReader#extract_plan_stats reports the decodes saved.
     #
     # ==== Args
     # +index+ :: Index of the entry to extract. :all, Integer or Array of Integer can be specified.
+    # +param+ :: Optional hash parameter. See SevenZipReader#extract_all.
     #
     # ==== Examples
     #   File.open("filename.7z", "rb") do |file|
@@ -413,29 +643,32 @@ module SevenZipRuby
     #       # => "file contents..."
     #     end
     #   end
-    def extract_data(index)
+    #
+    #   File.open("filename.7z", "rb") do |file|
+    #     SevenZipRuby::SevenZipReader.open(file) do |szr|
+    #       szr.extract_data([ 9, 2, 5 ]) do |index, data|
+    #         # Each entry is yielded once in the archive order.
+    #       end
+    #     end
+    #   end
+    def extract_data(index, param = {}, &block)  # :yield: index, data
       case(index)
       when :all
-        idx_prj = Object.new
-        def idx_prj.[](index)
-          return index
-        end
-
-        ret = []
         synchronize do
-          extract_all_impl(data_proc(ret, idx_prj))
+          return extract_data_impl(nil, param)
         end
-        return ret
 
       when Enumerable
         index_list = index.map(&:to_i)
-        idx_prj = Hash[*(index_list.each_with_index.map{ |idx, i| [ idx, i ] }.flatten)]
+        data_list = synchronize do
+          extract_data_impl(index_list, param)
+        end
+        return data_list unless (block)
 
-        ret = []
-        synchronize do
-          extract_files_impl(index_list, data_proc(ret, idx_prj))
+        index_list.zip(data_list).uniq(&:first).sort_by(&:first).each do |i, data|
+          yield(i, data) if (data)
         end
-        return ret
+        return nil
 
       when nil
         raise ArgumentError.new("Invalid parameter index")
@@ -443,22 +676,71 @@ module SevenZipRuby
       else
         index = index.to_i
         item = entry(index)
+        raise ArgumentError.new("Invalid index") unless (item)
         return nil unless (item.has_data?)
 
-        idx_prj = Object.new
-        def idx_prj.[](index)
-          return 0
-        end
-
-        ret = []
         synchronize do
-          extract_impl(index, data_proc(ret, idx_prj))
+          return extract_data_impl([ index ], param)[0]
         end
-        return ret[0]
 
       end
     end
 
+    # Open an entry to read its contents on demand.
+    # EntryReader is returned, or yielded and closed at the end of the block.
+    # The other operations of the reader cannot be called until the entry is closed.
+    #
+    # ==== Args
+    # +index+ :: Index of the entry or EntryInfo.
+    # +param+ :: Optional hash parameter. <tt>:buffer_size</tt> key is the size of the buffer
+    #            between the decoder and Ruby, such as <tt>"4m"</tt>. The default is 1MB.
+    #            <tt>:threads</tt> key is the number of decoding threads.
+    #
+    # ==== Examples
+    #   File.open("filename.7z", "rb") do |file|
+    #     SevenZipRuby::SevenZipReader.open(file) do |szr|
+    #       szr.open_entry(0) do |entry|
+    #         IO.copy_stream(entry, "output.bin")
+    #       end
+    #     end
+    #   end
+    def open_entry(index, param = {})  # :yield: entry_reader
+      item = entry(index.to_i)
+      raise ArgumentError.new("Invalid index") unless (item)
+      open_entry_impl(item.index, param)
+      reader = EntryReader.new(self, item)
+      return reader unless (block_given?)
+
+      begin
+        return yield(reader)
+      ensure
+        reader.close
+      end
+    end
+
+    # Iterate over the contents of an entry in chunks.
+    # The entry is decoded on demand, so the whole data is not kept in memory.
+    #
+    # ==== Args
+    # +index+ :: Index of the entry or EntryInfo.
+    # +chunk_size+ :: Maximum size of each chunk.
+    # +param+ :: Optional hash parameter, which is the same as open_entry.
+    #
+    # ==== Examples
+    #   SevenZipRuby::SevenZipReader.open_file("filename.7z") do |szr|
+    #     szr.each_chunk(szr.find_entry("dir/file.txt")) do |chunk|
+    #       response.write(chunk)
+    #     end
+    #   end
+    def each_chunk(index, chunk_size = EntryReader::DEFAULT_CHUNK_SIZE, param = {}, &block)  # :yield: chunk
+      return to_enum(:each_chunk, index, chunk_size, param) unless (block)
+
+      open_entry(index, param) do |reader|
+        reader.each_chunk(chunk_size, &block)
+      end
+      return self
+    end
+
 
     def file_proc(base_dir)  # :nodoc:
       base_dir = base_dir.to_s
@@ -472,7 +754,11 @@ module SevenZipRuby
           elsif (arg.file?)
             path = arg_path.expand_path(base_dir)
             path.parent.mkpath
-            ret = File.open(path, "wb")
+            if (SevenZipReader.use_native_output_file_stream)
+              ret = [ true, path.to_s ]
+            else
+              ret = [ false, File.open(path, "wb") ]
+            end
           else
             path = arg_path.expand_path(base_dir)
             path.mkpath
@@ -482,7 +768,7 @@ module SevenZipRuby
           next ret
 
         when :result
-          arg[:stream].close
+          arg[:stream].close if (arg[:stream])
           raise InvalidArchive.new("Corrupted archive or invalid password") unless (arg[:success])
 
           unless (arg[:info].anti?)
@@ -495,33 +781,28 @@ module SevenZipRuby
     end
     private :file_proc
 
-    def data_proc(output, idx_prj)  # :nodoc:
-      return Proc.new do |type, arg|
-        case(type)
-        when :stream
-          ret = (arg.has_data? ? StringIO.new("".b) : nil)
-          unless (arg.has_data?)
-            output[idx_prj[arg.index]] = nil
-          end
-          next ret
-
-        when :result
-          arg[:stream].close
-          raise InvalidArchive.new("Corrupted archive or invalid password") unless (arg[:success])
+    # Extensions of compressed tar files, whose only entry is a tar file.
+    TAR_EXTENSION_LIST = [ ".tgz", ".tbz", ".tbz2", ".txz" ]  # :nodoc:
 
-          if (arg[:info].has_data?)
-            output[idx_prj[arg[:info].index]] = arg[:stream].string
-          end
+    # Path of the entry which has no name in the archive, such as the
+    # contents of gzip, bzip2 and xz files. "file.txt.gz" has "file.txt".
+    def default_entry_path(filename)  # :nodoc:
+      ext = (filename ? File.extname(filename.to_s) : "")
+      return "[Content]" if (ext.empty?)
 
-        end
-      end
+      path = File.basename(filename.to_s, ext)
+      path += ".tar" if (TAR_EXTENSION_LIST.include?(ext.downcase))
+      return path.encode(Encoding::UTF_8)
+    rescue EncodingError
+      return "[Content]"
     end
-    private :data_proc
+    private :default_entry_path
 
-    COMPRESS_GUARD = Mutex.new  # :nodoc:
+    # Each reader has its own guard, so that the readers and the contexts
+    # of one archive can extract entries at the same time.
     def synchronize  # :nodoc:
-      if (COMPRESS_GUARD)
-        COMPRESS_GUARD.synchronize do
+      if (@guard)
+        @guard.synchronize do
           yield
         end
       else
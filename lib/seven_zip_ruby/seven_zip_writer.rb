@@ -1,5 +1,6 @@
 require("stringio")
 require("thread")
+require("tempfile")
 
 module SevenZipRuby
 
@@ -12,6 +13,27 @@ module SevenZipRuby
   # +header_compression+ :: Header compression. <tt>true</tt> or <tt>false</tt>. Default value is <tt>true</tt>.
   # +header_encryption+ :: Header encryption. <tt>true</tt> or <tt>false</tt>. Default value is <tt>false</tt>.
   # +multi_threading+ :: Multi threading. <tt>true</tt> or <tt>false</tt>. Default value is <tt>true</tt>.
+  # +store_incompressible+ :: Check the samples of each file, and store the files compressed already
+  #                           (JPEG, video, ...) in separate solid blocks without compression.
+  #                           <tt>true</tt> or <tt>false</tt>. Default value is <tt>false</tt>.
+  #
+  # The following properties are <tt>nil</tt> by default, which means the default value of the method and the level.
+  # Sizes are Integer, or String with a suffix such as "64m".
+  # +threads+ :: Number of threads. It overrides +multi_threading+.
+  # +block_threads+ :: Number of LZMA2 blocks compressed in parallel. Up to 32.
+  # +block_size+ :: Size of LZMA2 blocks.
+  # +dictionary_size+ :: Dictionary size of LZMA and LZMA2, block size of BZIP2, or memory size of PPMd.
+  # +word_size+ :: Fast bytes of LZMA, LZMA2 and DEFLATE, or model order of PPMd.
+  # +match_finder+ :: Match finder of LZMA and LZMA2. "BT2", "BT3", "BT4" or "HC4".
+  # +solid_block_size+ :: Maximum size of a solid block.
+  # +solid_files+ :: Maximum number of files in a solid block.
+  # +solid_block_threads+ :: Number of solid blocks, or files without +solid+, compressed in parallel. Up to 256.
+  #                          Set +solid_block_size+ or +solid_files+ to make more than one solid block.
+  # +solid_block_memory+ :: Memory to keep the data of the blocks compressed in parallel. The rest is kept in
+  #                         temporary files. Default value is "256m".
+  #
+  # +memory_usage+ returns the settings after the defaults are applied, and the estimated memory
+  # to compress and decompress with them.
   #
   # == Examples
   # === Compress files
@@ -38,6 +60,14 @@ module SevenZipRuby
   #   end
   #   # p stream.string
   #
+  # === Update an archive
+  #   # Only the solid blocks of the deleted or renamed entries are recompressed.
+  #   SevenZipRuby::SevenZipWriter.update_file("filename.7z") do |szw|
+  #     szw.add_file("test.txt")  # Replaces the entry "test.txt" if the archive has it.
+  #     szw.delete("old_dir")
+  #     szw.rename("a.txt", "b.txt")
+  #   end
+  #
   # === Set various properties
   #   File.open("filename.7z", "wb") do |file|
   #     SevenZipRuby::SevenZipWriter.open(file, password: "Password") do |szw|
@@ -52,6 +82,14 @@ module SevenZipRuby
   #     end
   #   end
   #
+  #   # Set coder properties at once.
+  #   SevenZipRuby::SevenZipWriter.open_file("filename.7z") do |szw|
+  #     szw.set_options(method: "LZMA2", threads: 16, block_threads: 8, dictionary_size: "64m", solid_block_size: "1g")
+  #     p szw.memory_usage
+  #     # => {:method=>"LZMA2", :level=>5, :threads=>16, ..., :compress=>..., :decompress=>...}
+  #     szw.add_directory("test_dir")
+  #   end
+  #
   # === Create a sfx, a self extracting archive for Windows executable binary.
   #   File.open("filename.exe", "wb") do |file|
   #     SevenZipRuby::SevenZipWriter.open(file, sfx: true) do |szw|
@@ -164,6 +202,69 @@ module SevenZipRuby
         end
       end
 
+      # Open 7zip archive to update.
+      # The entries of the archive are kept unless they are deleted, renamed or replaced.
+      # The solid blocks whose entries are all kept are copied without recompression.
+      #
+      # ==== Args
+      # +in_stream+ :: Input stream of the archive to be updated. <tt>read</tt> and <tt>seek</tt> are needed.
+      # +out_stream+ :: Output stream to write the updated archive. It must be different from <tt>in_stream</tt>.
+      # +param+ :: Optional hash parameter. <tt>:password</tt> key specifies password of the archive.
+      #
+      # ==== Examples
+      #   File.open("old.7z", "rb") do |input|
+      #     File.open("new.7z", "wb") do |output|
+      #       SevenZipRuby::SevenZipWriter.update(input, output) do |szw|
+      #         szw.add_data("1234567890", "data.bin")
+      #         szw.delete("old.txt")
+      #         szw.rename("a.txt", "b.txt")
+      #       end
+      #     end
+      #   end
+      def update(in_stream, out_stream, param = {}, &block)  # :yield: szw
+        szw = self.new
+        szw.update(in_stream, out_stream, param)
+        if (block)
+          begin
+            block.call(szw)
+            szw.compress
+            szw.close
+          ensure
+            szw.close_file
+          end
+        else
+          szw
+        end
+      end
+
+      # Update 7zip archive file.
+      # The updated archive is written to a temporary file, which replaces the archive file
+      # when it is compressed successfully.
+      #
+      # ==== Args
+      # +filename+ :: 7zip archive filename.
+      # +param+ :: Optional hash parameter. <tt>:password</tt> key specifies password of the archive.
+      #
+      # ==== Examples
+      #   SevenZipRuby::SevenZipWriter.update_file("filename.7z") do |szw|
+      #     szw.add_file("test.txt")
+      #   end
+      def update_file(filename, param = {}, &block)  # :yield: szw
+        szw = self.new
+        szw.update_file(filename, param)
+        if (block)
+          begin
+            block.call(szw)
+            szw.compress
+            szw.close
+          ensure
+            szw.close_file
+          end
+        else
+          szw
+        end
+      end
+
       # Create 7zip archive which includes the specified directory recursively.
       #
       # ==== Args
@@ -267,18 +368,179 @@ module SevenZipRuby
       return self
     end
 
+    # Open 7zip archive to update.
+    #
+    # ==== Args
+    # +in_stream+ :: Input stream of the archive to be updated. <tt>read</tt> and <tt>seek</tt> are needed.
+    # +out_stream+ :: Output stream to write the updated archive. It must be different from <tt>in_stream</tt>.
+    # +param+ :: Optional hash parameter. <tt>:password</tt> key specifies password of the archive.
+    #
+    # ==== Examples
+    #   File.open("old.7z", "rb") do |input|
+    #     File.open("new.7z", "wb") do |output|
+    #       szw = SevenZipRuby::SevenZipWriter.new
+    #       szw.update(input, output)
+    #       szw.delete("old.txt")
+    #       szw.compress
+    #       szw.close
+    #     end
+    #   end
+    def update(in_stream, out_stream, param = {})
+      param = param.clone
+      check_option(param, [ :password ])
+      param[:password] = param[:password].to_s if (param[:password])
+      in_stream.set_encoding(Encoding::ASCII_8BIT)
+      out_stream.set_encoding(Encoding::ASCII_8BIT)
+
+      update_impl(in_stream, out_stream, param)
+      @archive_entries = archive_entries_impl.freeze
+      # Keyed by index_in_archive, because an archive can have entries of the same path.
+      @update_entries = {}
+      @archive_entries.each do |entry|
+        @update_entries[entry.index] = UpdateInfo.entry(entry)
+      end
+      return self
+    end
+
+    # Update 7zip archive file.
+    #
+    # <tt>close</tt> method must be called later. The archive file is replaced when it is compressed successfully.
+    #
+    # ==== Args
+    # +filename+ :: 7zip archive filename.
+    # +param+ :: Optional hash parameter. <tt>:password</tt> key specifies password of the archive.
+    #
+    # ==== Examples
+    #   szw = SevenZipRuby::SevenZipWriter.new
+    #   szw.update_file("filename.7z")
+    #   szw.add_file("test.txt")
+    #   szw.compress
+    #   szw.close
+    def update_file(filename, param = {})
+      filename = filename.to_s
+      @archive_stream = File.open(filename, "rb")
+      begin
+        @stream = create_temp_file(filename, @archive_stream.stat)
+        @update_file = [ @stream.path, filename ]
+        @compressed = false
+        self.update(@archive_stream, @stream, param)
+      rescue
+        close_file
+        raise
+      end
+      return self
+    end
+
+    # Entries of the archive being updated, as <tt>Array</tt> of <tt>EntryInfo</tt>.
+    # It is <tt>nil</tt> unless the archive is opened by <tt>update</tt> or <tt>update_file</tt>.
+    attr_reader :archive_entries
+
+    # Delete the entry of the archive being updated. The entries under a directory are deleted with it.
+    #
+    # ==== Args
+    # +path+ :: Path of the entry, or <tt>EntryInfo</tt>.
+    def delete(path)
+      path, keys = find_update_entries(path)
+      keys.each do |key|
+        @update_entries.delete(key)
+      end
+      return self
+    end
+
+    # Rename the entry of the archive being updated. The entries under a directory are moved with it.
+    # The data is kept without recompression.
+    #
+    # ==== Args
+    # +path+ :: Path of the entry, or <tt>EntryInfo</tt>.
+    # +new_path+ :: New path of the entry. <tt>new_path</tt> must be a <b>relative path</b>.
+    def rename(path, new_path)
+      new_path = Pathname(new_path).cleanpath
+      raise ArgumentError.new("new_path should be relative. #{new_path}") if (new_path.absolute?)
+      new_path = new_path.to_s.encode(PATH_ENCODING)
+
+      path, keys = find_update_entries(path)
+      keys.each do |key|
+        name = new_path + @update_entries[key].path[path.size..-1]
+        @update_entries[key] = UpdateInfo.entry(@archive_entries[key], name)
+      end
+      return self
+    end
+
+    def find_update_entries(path)  # :nodoc:
+      raise ArgumentError.new("archive is not opened to update") unless (@update_entries)
+      path = path.path if (path.is_a?(EntryInfo))
+      path = Pathname(path).cleanpath.to_s.encode(PATH_ENCODING)
+      keys = @update_entries.select{ |key, info| info.path == path || info.path.start_with?(path + "/") }.keys
+      raise ArgumentError.new("entry not found: #{path}") if (keys.empty?)
+      return [ path, keys ]
+    end
+    private :find_update_entries
+
+    # Entries added with the same path replace the entries of the archive being updated.
+    def add_item(item)  # :nodoc:
+      @update_entries.delete_if{ |key, info| info.path == item.path } if (@update_entries)
+      add_item_impl(item)
+    end
+
     def close
       close_impl
       close_file
     end
 
     def close_file  # :nodoc:
-      if (@stream)
+      if (@archive_stream)
+        @archive_stream.close rescue nil
+        @archive_stream = nil
+      end
+      if (@update_file)
+        close_update_file
+      elsif (@stream)
         @stream.close rescue nil
         @stream = nil
       end
     end
 
+    # The temporary file replaces the archive file only if it is compressed and written to the disk.
+    def close_update_file  # :nodoc:
+      temp_filename, filename = @update_file
+      stream = @stream
+      @update_file = @stream = nil
+      unless (@compressed)
+        stream.close rescue nil
+        File.delete(temp_filename) rescue nil
+        return
+      end
+
+      begin
+        stream.flush
+        stream.fsync
+        stream.close
+        File.rename(temp_filename, filename)
+      rescue Exception
+        stream.close rescue nil
+        File.delete(temp_filename) rescue nil
+        raise
+      end
+    end
+    private :close_update_file
+
+    # Creates a new file next to the archive file, with its mode and owner.
+    def create_temp_file(filename, stat)  # :nodoc:
+      dir, base = File.split(filename)
+      # Tempfile.create opens a file of a random name exclusively with mode 0600.
+      file = Tempfile.create([ ".#{base}.", ".tmp" ], dir, binmode: true)
+      begin
+        file.chown(stat.uid, stat.gid) rescue nil
+        file.chmod(stat.mode & 07777)
+      rescue
+        file.close
+        File.delete(file.path) rescue nil
+        raise
+      end
+      return file
+    end
+    private :create_temp_file
+
     # Compress and output data to archive file.
     # You don't have to call this method when you use block-style SevenZipWriter.open.
     #
@@ -302,8 +564,13 @@ module SevenZipRuby
     #  end
     def compress
       synchronize do
+        if (@update_entries)
+          @update_entries.each_value{ |info| add_item_impl(info) }
+          @update_entries = {}
+        end
         compress_impl(compress_proc)
       end
+      @compressed = true
       return self
     end
 
@@ -312,6 +579,9 @@ module SevenZipRuby
     # ==== Args
     # +filename+ :: File to be added to the 7zip archive. <tt>file</tt> must be a <b>relative path</b> if <tt>:as</tt> option is not specified.
     # +opt+ :: Optional hash parameter. <tt>:as</tt> key represents filename used in this archive.
+    #          <tt>:method</tt> key is <tt>:copy</tt> to store the file without compression, or
+    #          <tt>:compress</tt> to compress it even if +store_incompressible+ finds it incompressible.
+    #          It is used only by 7z archives.
     #
     # ==== Examples
     #   File.open("filename.7z", "wb") do |file|
@@ -327,7 +597,7 @@ module SevenZipRuby
     #   end
     def add_file(filename, opt={})
       path = Pathname(filename)
-      check_option(opt, [ :as ])
+      check_option(opt, [ :as, :method ])
 
       if (opt[:as])
         filename = Pathname(opt[:as]).cleanpath
@@ -337,7 +607,8 @@ module SevenZipRuby
         raise ArgumentError.new("filename should be relative. #{filename}") if (path.absolute?)
         filename = path.cleanpath
       end
-      add_item(UpdateInfo.file(filename.to_s.encode(PATH_ENCODING), path, self))
+      add_item(UpdateInfo.file(filename.to_s.encode(PATH_ENCODING), path, self,
+                               compress_method: entry_method(opt[:method])))
       return self
     end
 
@@ -347,6 +618,7 @@ module SevenZipRuby
     # +data+ :: Data to be added to the 7zip archive.
     # +filename+ :: File name of the entry to be added to the 7zip archive. <tt>filename</tt> must be a <b>relative path</b>.
     # +opt+ :: Optional hash parameter. <tt>:ctime</tt>, <tt>:atime</tt> and <tt>:mtime</tt> keys can be specified as timestamp.
+    #          <tt>:method</tt> key is the same as +add_file+.
     #
     # ==== Examples
     #   File.open("filename.7z", "wb") do |file|
@@ -361,10 +633,10 @@ module SevenZipRuby
     def add_data(data, filename, opt={})
       path = Pathname(filename)
       raise ArgumentError.new("filename should be relative") if (path.absolute?)
-      check_option(opt, [ :ctime, :atime, :mtime ])
+      check_option(opt, [ :ctime, :atime, :mtime, :method ])
 
       name = path.cleanpath.to_s.encode(PATH_ENCODING)
-      add_item(UpdateInfo.buffer(name, data, opt))
+      add_item(UpdateInfo.buffer(name, data, opt.merge(compress_method: entry_method(opt[:method]))))
       return self
     end
 
@@ -443,12 +715,44 @@ module SevenZipRuby
     end
 
 
+    # Set properties at once.
+    #
+    # ==== Args
+    # +opt+ :: Hash of properties, such as <tt>{ method: "LZMA2", threads: 8 }</tt>.
+    #
+    # ==== Examples
+    #   SevenZipRuby::SevenZipWriter.open_file("filename.7z") do |szw|
+    #     szw.set_options(method: "LZMA2", level: 9, threads: 8)
+    #     szw.add_file("test.txt")
+    #   end
+    def set_options(opt)
+      check_option(opt, opt.keys.select{ |key| respond_to?("#{key}=") })
+      opt.each do |key, value|
+        __send__("#{key}=", value)
+      end
+      return self
+    end
+
     def check_option(opt, keys)  # :nodoc:
       invalid_keys = opt.keys - keys
       raise ArgumentError.new("invalid option: " + invalid_keys.join(", ")) unless (invalid_keys.empty?)
     end
     private :check_option
 
+    def entry_method(method)  # :nodoc:
+      case(method && method.to_s.downcase)
+      when nil
+        return nil
+      when "copy"
+        return "Copy"
+      when "compress"
+        return self.method
+      else
+        raise ArgumentError.new("invalid option: :method should be :copy or :compress")
+      end
+    end
+    private :entry_method
+
     def compress_proc  # :nodoc:
       return Proc.new do |type, info|
         case(type)
@@ -9,8 +9,13 @@ module SevenZipRuby
         new(:dir, opt.merge({ name: name }))
       end
 
-      def file(name, filepath, szw)
-        new(:file, { name: name, filepath: filepath, szw: szw })
+      def file(name, filepath, szw, opt={})
+        new(:file, opt.merge({ name: name, filepath: filepath, szw: szw }))
+      end
+
+      # Entry of the archive being updated. It is renamed to +name+ unless +name+ is nil.
+      def entry(entry, name = nil)
+        new(:entry, { entry: entry, name: name })
       end
     end
 
@@ -25,7 +30,9 @@ module SevenZipRuby
         name = param.delete(:name)
         initialize_dir(name, param)
       when :file
-        initialize_file(param[:name], param[:filepath], param[:szw])
+        initialize_file(param[:name], param[:filepath], param[:szw], param)
+      when :entry
+        initialize_entry(param[:entry], param[:name])
       end
     end
 
@@ -46,6 +53,7 @@ module SevenZipRuby
       @atime = (opt[:atime] || time)
       @mtime = (opt[:mtime] || time)
       @user = @group = nil
+      @compress_method = opt[:compress_method]
     end
 
     def initialize_dir(name, opt)
@@ -65,9 +73,10 @@ module SevenZipRuby
       @atime = (opt[:atime] || time)
       @mtime = (opt[:mtime] || time)
       @user = @group = nil
+      @compress_method = nil
     end
 
-    def initialize_file(name, filepath, szw)
+    def initialize_file(name, filepath, szw, opt)
       @index_in_archive = nil
       @new_data = true
       @new_properties = true
@@ -84,10 +93,42 @@ module SevenZipRuby
       @atime = filepath.atime
       @mtime = filepath.mtime
       @user = @group = nil
+      @compress_method = opt[:compress_method]
+    end
+
+    def initialize_entry(entry, name)
+      @index_in_archive = entry.index
+      @new_data = false
+      @new_properties = !name.nil?
+      @anti = entry.anti?
+
+      @path = (name || entry.path)
+      @dir = entry.directory?
+      @data = nil
+      @size = entry.size
+      @attrib = entry.attrib
+      @posix_attrib = 0x00
+      @ctime = entry.ctime
+      @atime = entry.atime
+      @mtime = entry.mtime
+      @user = @group = nil
+      @compress_method = nil
     end
 
 
     attr_reader :index_in_archive, :path, :data, :size, :attrib, :ctime, :atime, :mtime, :posix_attrib, :user, :group
+    # Method name given by the <tt>:method</tt> option, or nil.
+    attr_reader :compress_method
+
+    # Returns +size+ bytes of the data from +offset+, to check whether it is compressible.
+    def sample(offset, size)
+      if (buffer?)
+        return @data.byteslice(offset, size)
+      elsif (@type == :file)
+        return File.binread(@data, size, offset)
+      end
+      return nil
+    end
 
     def buffer?
       return (@type == :buffer)
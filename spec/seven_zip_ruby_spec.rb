@@ -1,4 +1,6 @@
 require("seven_zip_ruby")
+require("tmpdir")
+require("rubygems/package")
 require_relative("seven_zip_ruby_spec_helper")
 
 describe SevenZipRuby do
@@ -14,12 +16,16 @@ describe SevenZipRuby do
 
   before(:each) do
     @use_native_input_file_stream = SevenZipRuby::SevenZipWriter.use_native_input_file_stream
+    @use_native_output_file_stream = SevenZipRuby::SevenZipReader.use_native_output_file_stream
+    @use_native_reader_input_file_stream = SevenZipRuby::SevenZipReader.use_native_input_file_stream
     SevenZipRubySpecHelper.prepare_each
   end
 
   after(:each) do
     SevenZipRubySpecHelper.cleanup_each
     SevenZipRuby::SevenZipWriter.use_native_input_file_stream = @use_native_input_file_stream
+    SevenZipRuby::SevenZipReader.use_native_output_file_stream = @use_native_output_file_stream
+    SevenZipRuby::SevenZipReader.use_native_input_file_stream = @use_native_reader_input_file_stream
   end
 
 
@@ -45,6 +51,38 @@ describe SevenZipRuby do
       end
     end
 
+    example "iterate and find entries without creating all entry information" do
+      SevenZipRuby::SevenZipReader.open_file(SevenZipRubySpecHelper::SEVEN_ZIP_FILE) do |szr|
+        paths = []
+        szr.each_entry{ |entry| paths.push(entry.path) }
+        expect(paths).to eq szr.entries.map(&:path)
+        expect(szr.entries(lazy: true).map(&:path).to_a).to eq paths
+        expect(szr.each_entry.size).to eq paths.size
+
+        SevenZipRubySpecHelper::SAMPLE_DATA.each do |sample|
+          entry = szr.find_entry(sample[:name])
+          expect(entry.path).to eq Pathname(sample[:name]).cleanpath.to_s
+          expect(entry.directory?).to be sample[:directory]
+          expect(entry).to be szr.entry(entry.index)
+        end
+        expect(szr.find_entry("no_such_entry")).to be nil
+        expect{ szr.find_entry_impl(1) }.to raise_error(TypeError)
+      end
+
+      # Paths which are not clean in the archive are found by EntryInfo#path.
+      tar = StringIO.new("".b)
+      Gem::Package::TarWriter.new(tar) do |writer|
+        [ "./d/a.txt", "d//b.txt", "x/../c.txt" ].each do |name|
+          writer.add_file_simple(name, 0644, name.size){ |io| io.write(name) }
+        end
+      end
+      SevenZipRuby::ArchiveReader.open(StringIO.new(tar.string)) do |reader|
+        expect(reader.entries.map(&:path)).to eq [ "d/a.txt", "d/b.txt", "c.txt" ]
+        expect(reader.entries.map{ |entry| reader.find_entry(entry.path).index }).to eq [ 0, 1, 2 ]
+        expect(reader.find_entry("./x/../d/b.txt").index).to eq 1
+      end
+    end
+
     example "get archive information" do
       File.open(SevenZipRubySpecHelper::SEVEN_ZIP_FILE, "rb") do |file|
         SevenZipRuby::SevenZipReader.open(file) do |szr|
@@ -79,6 +117,219 @@ describe SevenZipRuby do
       end
     end
 
+    example "extract data of all and repeated entries into memory" do
+      SevenZipRuby::SevenZipReader.open_file(SevenZipRubySpecHelper::SEVEN_ZIP_FILE) do |szr|
+        entries = szr.entries
+        all_data = szr.extract_data(:all)
+        expect(all_data.size).to eq entries.size
+
+        entries.each do |entry|
+          expect(all_data[entry.index].nil?).to eq !entry.has_data?
+        end
+
+        files = entries.select(&:file?).reverse
+        data_list = szr.extract_data(files + files.take(1), threads: 2)
+        expect(data_list).to eq files.map{ |i| all_data[i.index] } + [ all_data[files[0].index] ]
+        expect(data_list.last).not_to be data_list.first
+      end
+    end
+
+    example "read entry contents on demand" do
+      data = Random.new(0).bytes(3 * 1024 * 1024)
+      output = StringIO.new("")
+      SevenZipRuby::SevenZipWriter.open(output) do |szw|
+        szw.add_data(data, "hoge.bin")
+        szw.add_data("hoge", "hoge.txt")
+      end
+      output.rewind
+
+      SevenZipRuby::SevenZipReader.open(output) do |szr|
+        chunks = szr.each_chunk(0, 100_000).to_a
+        expect(chunks.all?{ |i| i.bytesize <= 100_000 }).to eq true
+        expect(chunks.join).to eq data
+
+        entry = szr.open_entry(0, buffer_size: "64k")
+        head = entry.read(10)
+        expect{ szr.extract_data(1) }.to raise_error(SevenZipRuby::InvalidOperation)
+        expect(head + entry.read).to eq data
+        expect(entry.read(10)).to eq nil
+        entry.close
+
+        # Closing an entry in the middle stops decoding.
+        szr.open_entry(0){ |i| i.read(100) }
+        expect(szr.open_entry(1){ |i| i.read }).to eq "hoge"
+      end
+    end
+
+    example "extract in parallel with contexts" do
+      file = File.expand_path("context.7z", SevenZipRubySpecHelper::TEMP_DIR)
+      data_list = SevenZipRubySpecHelper.random_data_list(8, 200_000)
+      File.binwrite(file, SevenZipRubySpecHelper.create_archive(data_list, solid: false))
+
+      begin
+        szr = SevenZipRuby::SevenZipReader.open_file(file)
+        threads = 4.times.map do |i|
+          Thread.new do
+            szr.open_context do |ctx|
+              # Each context extracts with its own options.
+              ctx.extract_data([ i, i + 4 ], threads: i + 1, in_order: i.even?, binder_buffer_size: i * 4096)
+            end
+          end
+        end
+        result = threads.map(&:value)
+        expect(result.map(&:first) + result.map(&:last)).to eq data_list
+
+        # The context is usable after the reader is closed.
+        ctx = szr.open_context
+        szr.close
+        expect(ctx.extract_data(7)).to eq data_list[7]
+        expect{ ctx.extract_data(7, binder_buffer_size: -1) }.to raise_error(ArgumentError)
+        ctx.close
+
+        File.open(file, "rb") do |stream|
+          SevenZipRuby::SevenZipReader.open(stream) do |reader|
+            expect{ reader.open_context }.to raise_error(ArgumentError)
+            File.open(file, "rb") do |ctx_stream|
+              expect(reader.open_context(ctx_stream){ |i| i.extract_data(3) }).to eq data_list[3]
+            end
+          end
+        end
+      ensure
+        File.unlink(file)
+      end
+    end
+
+    example "reuse the parsed header of the same archive" do
+      create = lambda do |names, header_encryption = false|
+        output = StringIO.new("")
+        SevenZipRuby::SevenZipWriter.open(output, password: "pass") do |szw|
+          szw.header_encryption = header_encryption
+          names.each{ |name| szw.add_data(name * 10, name) }
+        end
+        next output.string
+      end
+
+      SevenZipRuby::SevenZipReader.clear_header_cache
+      expect(SevenZipRuby::SevenZipReader.header_cache_stats).to eq({ count: 0, items: 0 })
+
+      data = create.call(%w[a.txt b.txt])
+      # The header is not cached with header_cache: false.
+      SevenZipRuby::SevenZipReader.open(StringIO.new(data), password: "pass", header_cache: false) do |szr|
+        expect(szr.entries.map(&:path)).to eq %w[a.txt b.txt]
+      end
+      expect(SevenZipRuby::SevenZipReader.header_cache_stats[:count]).to eq 0
+
+      3.times do
+        SevenZipRuby::SevenZipReader.open(StringIO.new(data), password: "pass") do |szr|
+          expect(szr.entries.map(&:path)).to eq %w[a.txt b.txt]
+          expect(szr.extract_data(1)).to eq "b.txt" * 10
+        end
+      end
+      expect(SevenZipRuby::SevenZipReader.header_cache_stats[:count]).to eq 1
+
+      # An archive which has the same size but the different header is read again.
+      data2 = create.call(%w[c.txt d.txt])
+      SevenZipRuby::SevenZipReader.open(StringIO.new(data2), password: "pass") do |szr|
+        expect(szr.entries.map(&:path)).to eq %w[c.txt d.txt]
+      end
+
+      # The encrypted header is not cached.
+      data3 = create.call(%w[e.txt], true)
+      SevenZipRuby::SevenZipReader.open(StringIO.new(data3), password: "pass") do |szr|
+        expect(szr.entries.map(&:path)).to eq %w[e.txt]
+      end
+      expect{ SevenZipRuby::SevenZipReader.open(StringIO.new(data3)) }.to raise_error(StandardError)
+
+      expect(SevenZipRuby::SevenZipReader.header_cache_stats[:count]).to eq 2
+      SevenZipRuby::SevenZipReader.clear_header_cache
+      expect(SevenZipRuby::SevenZipReader.header_cache_stats).to eq({ count: 0, items: 0 })
+      SevenZipRuby::SevenZipReader.open(StringIO.new(data), password: "pass") do |szr|
+        expect(szr.entries.map(&:path)).to eq %w[a.txt b.txt]
+      end
+    end
+
+    example "keep decoded solid blocks in memory" do
+      data_list = SevenZipRubySpecHelper.random_data_list
+      archive = SevenZipRubySpecHelper.create_archive(data_list)
+
+      SevenZipRuby::SevenZipReader.open(StringIO.new(archive), folder_cache_size: "1m") do |szr|
+        expect(szr.extract_data(3)).to eq data_list[3]
+        expect(szr.folder_cache_stats).to eq({ hits: 0, misses: 1, size: 400_000 })
+        expect(szr.extract_data(1)).to eq data_list[1]
+        expect(szr.extract_data([ 0, 2 ])).to eq [ data_list[0], data_list[2] ]
+        expect(szr.folder_cache_stats).to eq({ hits: 2, misses: 1, size: 400_000 })
+      end
+
+      # The block larger than the cache is not kept.
+      SevenZipRuby::SevenZipReader.open(StringIO.new(archive), folder_cache_size: 1000) do |szr|
+        expect(szr.extract_data(0)).to eq data_list[0]
+        expect(szr.folder_cache_stats).to eq({ hits: 0, misses: 0, size: 0 })
+      end
+
+      expect{ SevenZipRuby::SevenZipReader.open(StringIO.new(archive), folder_cache_size: -1) }.to raise_error(ArgumentError)
+    end
+
+    example "plan extraction of unordered index list" do
+      data_list = SevenZipRubySpecHelper.random_data_list
+      archive = SevenZipRubySpecHelper.create_archive(data_list, solid: false)
+
+      SevenZipRuby::SevenZipReader.open(StringIO.new(archive)) do |szr|
+        expect(szr.extract_data([ 3, 0, 3, 1, 0 ])).to eq data_list.values_at(3, 0, 3, 1, 0)
+        expect(szr.extract_plan_stats).to eq({ folder_decodes: 3, saved_folder_decodes: 2 })
+
+        yielded = []
+        szr.extract_data([ 2, 1, 2 ]){ |index, data| yielded.push([ index, data ]) }
+        expect(yielded).to eq [ [ 1, data_list[1] ], [ 2, data_list[2] ] ]
+        expect(szr.extract_plan_stats).to eq({ folder_decodes: 5, saved_folder_decodes: 3 })
+      end
+    end
+
+    example "verify folders in multi threads" do
+      data_list = SevenZipRubySpecHelper.random_data_list
+      archive = SevenZipRubySpecHelper.create_archive(data_list, solid: false)
+
+      SevenZipRuby::SevenZipReader.open(StringIO.new(archive)) do |szr|
+        expect(szr.verify(threads: 2)).to eq true
+        stats = szr.verify_stats
+        expect(stats.map{ |i| i[:folder] }).to eq [ 0, 1, 2, 3 ]
+        expect(stats.map{ |i| i[:unpack_size] }).to eq [ 100_000 ] * 4
+      end
+
+      archive[82] = (archive[82].ord ^ 0xFF).chr  # Packed data of the first entry.
+      SevenZipRuby::SevenZipReader.open(StringIO.new(archive)) do |szr|
+        expect(szr.verify_detail(threads: 2)).to eq [ :DataError, true, true, true ]
+        expect(szr.verify_detail(stop_on_error: true)).to eq [ :DataError, nil, nil, nil ]
+        expect(szr.verify(threads: 2, stop_on_error: true)).to eq false
+      end
+    end
+
+    example "decode entries of a solid block from checkpoints" do
+      # Repeated data has matches across the checkpoints, which are resumed from them.
+      data_list = SevenZipRubySpecHelper.random_data_list(4, 1000).map{ |data| data * 100 }
+      archive = SevenZipRubySpecHelper.create_archive(data_list)
+
+      SevenZipRuby::SevenZipReader.open(StringIO.new(archive), checkpoint_interval: "64k") do |szr|
+        expect(szr.extract_data(3)).to eq data_list[3]
+        expect(szr.checkpoint_stats[:count]).to eq 6
+        expect(szr.extract_data(1)).to eq data_list[1]
+        expect(szr.extract_data([ 0, 2 ])).to eq [ data_list[0], data_list[2] ]
+        expect(szr.extract_data(:all)).to eq data_list
+        expect(szr.checkpoint_stats[:count]).to eq 6
+      end
+
+      # The least recently used checkpoints are dropped beyond checkpoint_memory.
+      SevenZipRuby::SevenZipReader.open(StringIO.new(archive), checkpoint_interval: "64k", checkpoint_memory: "200k") do |szr|
+        expect(szr.extract_data(:all)).to eq data_list
+        stats = szr.checkpoint_stats
+        expect(stats[:count] < 6).to eq true
+        expect(stats[:size] <= 200 * 1024).to eq true
+        expect(szr.extract_data(3)).to eq data_list[3]
+      end
+
+      expect{ SevenZipRuby::SevenZipReader.open(StringIO.new(archive), checkpoint_interval: 100) }.to raise_error(ArgumentError)
+      expect{ SevenZipRuby::SevenZipReader.open(StringIO.new(archive), checkpoint_memory: -1) }.to raise_error(ArgumentError)
+    end
+
     example "singleton method: extract" do
       File.open(SevenZipRubySpecHelper::SEVEN_ZIP_FILE, "rb") do |file|
         SevenZipRuby::SevenZipReader.extract(file, :all, SevenZipRubySpecHelper::EXTRACT_DIR)
@@ -97,23 +348,159 @@ describe SevenZipRuby do
       end
     end
 
-    example "extract archive" do
-      File.open(SevenZipRubySpecHelper::SEVEN_ZIP_FILE, "rb") do |file|
-        SevenZipRuby::SevenZipReader.open(file) do |szr|
-          szr.extract_all(SevenZipRubySpecHelper::EXTRACT_DIR)
+    [ true, false ].each do |use_native_output_file_stream|
+      example "extract archive: use_native_output_file_stream=#{use_native_output_file_stream}" do
+        SevenZipRuby::SevenZipReader.use_native_output_file_stream = use_native_output_file_stream
+
+        File.open(SevenZipRubySpecHelper::SEVEN_ZIP_FILE, "rb") do |file|
+          SevenZipRuby::SevenZipReader.open(file) do |szr|
+            szr.extract_all(SevenZipRubySpecHelper::EXTRACT_DIR)
+          end
+        end
+
+        Dir.chdir(SevenZipRubySpecHelper::EXTRACT_DIR) do
+          SevenZipRubySpecHelper::SAMPLE_DATA.each do |info|
+            path = Pathname(info[:name])
+            expected_path = Pathname(SevenZipRubySpecHelper::SAMPLE_FILE_DIR) + info[:name]
+            # Do not check mtime because seven_zip.7z is not compressed dynamically.
+            # expect(path.mtime.to_i).to eq expected_path.mtime.to_i
+            expect(path.file?).to eq expected_path.file?
+            (expect(File.open(path, "rb", &:read)).to eq info[:data]) if (path.file?)
+          end
+        end
+      end
+    end
+
+    [ true, false ].each do |use_native_input_file_stream|
+      example "open_file: use_native_input_file_stream=#{use_native_input_file_stream}" do
+        SevenZipRuby::SevenZipReader.use_native_input_file_stream = use_native_input_file_stream
+
+        SevenZipRuby::SevenZipReader.open_file(Pathname(SevenZipRubySpecHelper::SEVEN_ZIP_FILE)) do |szr|
+          expect(szr.verify).to eq true
+          SevenZipRubySpecHelper::SAMPLE_DATA.each do |sample|
+            entry = szr.find_entry(sample[:name])
+            expect(szr.extract_data(entry)).to eq sample[:data]
+          end
+        end
+
+        SevenZipRuby::SevenZipReader.open_file(SevenZipRubySpecHelper::SEVEN_ZIP_PASSWORD_FILE, password: SevenZipRubySpecHelper::SEVEN_ZIP_PASSWORD) do |szr|
+          expect(szr.verify).to eq true
+        end
+
+        expect{ SevenZipRuby::SevenZipReader.open_file(SevenZipRubySpecHelper::SEVEN_ZIP_FILE + ".none") }.to raise_error(Errno::ENOENT)
+        expect{ SevenZipRuby::SevenZipReader.open_file(__FILE__) }.to raise_error(StandardError)
+      end
+    end
+
+    [ true, false ].each do |mmap|
+      example "open_file: read truncated file with mmap=#{mmap}" do
+        data = SevenZipRubySpecHelper::SAMPLE_LARGE_RANDOM_DATA
+        Dir.mktmpdir do |dir|
+          path = File.join(dir, "test.7z")
+          File.open(path, "wb") do |file|
+            SevenZipRuby::SevenZipWriter.open(file) do |szw|
+              szw.method = "COPY"
+              szw.add_data(data, "data.bin")
+            end
+          end
+
+          SevenZipRuby::SevenZipReader.open_file(path, mmap: mmap) do |szr|
+            File.truncate(path, 4096)
+            expect{ szr.extract_data(0) }.to raise_error(StandardError)
+          end
+        end
+      end
+    end
+
+    example "extract non-solid archive with threads" do
+      data_list = (0 ... 20).map{ |i| SevenZipRubySpecHelper::SAMPLE_LARGE_RANDOM_DATA.slice(i * 1000 .. -1) }
+      output = StringIO.new("")
+      SevenZipRuby::SevenZipWriter.open(output) do |szw|
+        szw.solid = false
+        data_list.each_with_index{ |data, i| szw.add_data(data, "hoge#{i}.txt") }
+      end
+
+      [ true, false ].each do |in_order|
+        SevenZipRubySpecHelper.cleanup_each
+        SevenZipRuby::SevenZipReader.open(StringIO.new(output.string)) do |szr|
+          szr.extract_all(SevenZipRubySpecHelper::EXTRACT_DIR, threads: 4, in_order: in_order)
+        end
+
+        Dir.chdir(SevenZipRubySpecHelper::EXTRACT_DIR) do
+          data_list.each_with_index do |data, i|
+            expect(File.open("hoge#{i}.txt", "rb", &:read)).to eq data
+          end
         end
       end
 
+      SevenZipRuby::SevenZipReader.open(StringIO.new(output.string)) do |szr|
+        expect{ szr.extract_data(:all, threads: -1) }.to raise_error(ArgumentError)
+        # Too many threads are reduced to the maximum.
+        expect(szr.extract_data(:all, threads: 100_000)).to eq szr.entries.map{ |entry| data_list[entry.path[/\d+/].to_i] }
+      end
+    end
+
+    example "extract BCJ2 folder with stream binder buffer sizes" do
+      data = SevenZipRubySpecHelper::SAMPLE_LARGE_RANDOM_DATA
+      output = StringIO.new("")
+      FileUtils.mkpath(SevenZipRubySpecHelper::EXTRACT_DIR)
       Dir.chdir(SevenZipRubySpecHelper::EXTRACT_DIR) do
-        SevenZipRubySpecHelper::SAMPLE_DATA.each do |info|
-          path = Pathname(info[:name])
-          expected_path = Pathname(SevenZipRubySpecHelper::SAMPLE_FILE_DIR) + info[:name]
-          # Do not check mtime because seven_zip.7z is not compressed dynamically.
-          # expect(path.mtime.to_i).to eq expected_path.mtime.to_i
-          expect(path.file?).to eq expected_path.file?
-          (expect(File.open(path, "rb", &:read)).to eq info[:data]) if (path.file?)
+        File.open("data.exe", "wb"){ |file| file.write(data) }
+        File.chmod(0755, "data.exe")
+        # The encoder selects BCJ2 filter for executable files.
+        SevenZipRuby::SevenZipWriter.open(output) do |szw|
+          szw.level = 9
+          szw.add_file("data.exe")
         end
       end
+
+      [ 0, 1, 4096, "1m", nil ].each do |size|
+        SevenZipRubySpecHelper.cleanup_each
+        SevenZipRuby::SevenZipReader.open(StringIO.new(output.string)) do |szr|
+          expect(szr.entries.first.method.start_with?("BCJ2 ")).to eq true
+          szr.extract_all(SevenZipRubySpecHelper::EXTRACT_DIR, (size ? { binder_buffer_size: size } : {}))
+        end
+        expect(File.open(File.join(SevenZipRubySpecHelper::EXTRACT_DIR, "data.exe"), "rb", &:read)).to eq data
+      end
+
+      SevenZipRuby::SevenZipReader.open(StringIO.new(output.string)) do |szr|
+        expect{ szr.extract_data(0, binder_buffer_size: -1) }.to raise_error(ArgumentError)
+        expect{ szr.extract_data(0, binder_buffer_size: 1 << 30) }.to raise_error(ArgumentError)
+        expect{ szr.extract_data(0, binder_buffer_size: "4x") }.to raise_error(ArgumentError)
+        expect(szr.test(binder_buffer_size: :size)).to eq false
+        expect(szr.extract_data(0, binder_buffer_size: "4m")).to eq data
+      end
+    end
+
+    example "read archive through read-ahead window" do
+      data_list = (0 ... 10).map{ |i| SevenZipRubySpecHelper::SAMPLE_LARGE_RANDOM_DATA.slice(i * 1000 .. -1) }
+      output = StringIO.new("")
+      SevenZipRuby::SevenZipWriter.open(output) do |szw|
+        szw.solid = false
+        data_list.each_with_index{ |data, i| szw.add_data(data, "hoge#{i}.txt") }
+      end
+
+      counting_io = Class.new(StringIO) do
+        attr_reader :read_count
+        def read(*args)
+          @read_count = (@read_count || 0) + 1
+          super
+        end
+      end
+
+      read_count = {}
+      [ 0, 1, "4m", nil ].each do |size|
+        stream = counting_io.new(output.string)
+        SevenZipRuby::SevenZipReader.open(stream, (size ? { read_ahead_size: size } : {})) do |szr|
+          expect(szr.extract_data(:all)).to eq data_list
+          expect(szr.verify).to eq true
+        end
+        read_count[size] = stream.read_count
+      end
+      expect(read_count[nil]).to be < read_count[0]
+      expect(read_count["4m"]).to be < read_count[1]
+
+      expect{ SevenZipRuby::SevenZipReader.open(StringIO.new(output.string), read_ahead_size: "1t") }.to raise_error(ArgumentError)
     end
 
     example "run in another thread" do
@@ -188,6 +575,124 @@ describe SevenZipRuby do
       th_list.each(&:join)
     end
 
+    example "reuse event loop threads" do
+      data = File.open(SevenZipRubySpecHelper::SEVEN_ZIP_FILE, "rb", &:read)
+      SevenZipRuby::SevenZipReader.open(StringIO.new(data)) do |szr|
+        szr.extract_data(0)
+        thread_num = Thread.list.size
+        100.times do |i|
+          szr.entry(i % szr.entries.size)
+          szr.archive_property
+          szr.extract_data(0)
+        end
+        # Surplus threads of the former examples may still be leaving the pool.
+        expect(Thread.list.size <= thread_num).to eq true
+      end
+    end
+
+    example "run in non-blocking fiber" do
+      skip("Fiber scheduler is not supported") unless (Fiber.respond_to?(:set_scheduler))
+
+      data = Random.new(0).bytes(3 * 1024 * 1024)
+      result = nil
+      error = nil
+      ticks = 0
+      Thread.new do
+        Fiber.set_scheduler(SevenZipRubySpecHelper::FiberScheduler.new)
+        Fiber.schedule do
+          output = StringIO.new("")
+          SevenZipRuby::SevenZipWriter.open(output) do |szw|
+            szw.add_data(data, "hoge.bin")
+          end
+          output.rewind
+          SevenZipRuby::SevenZipReader.open(output) do |szr|
+            result = szr.extract_data(0)
+          end
+
+          output.define_singleton_method(:read){ |*args| raise "read error" }
+          begin
+            SevenZipRuby::SevenZipReader.open(output, read_ahead_size: 0)
+          rescue => e
+            error = e
+          end
+        end
+        Fiber.schedule do
+          until (error)
+            ticks += 1
+            sleep(0.001)
+          end
+        end
+      end.join
+
+      expect(result == data).to eq true
+      expect(error.message).to eq "read error"
+      # The other fiber runs while the archive is processed.
+      expect(ticks).to be > 1
+    end
+
+    example "run many archives in non-blocking fibers" do
+      skip("Fiber scheduler is not supported") unless (Fiber.respond_to?(:set_scheduler))
+
+      data_list = Array.new(64){ |i| Random.new(i).bytes(64 * 1024) }
+      archives = data_list.map do |data|
+        output = StringIO.new("")
+        SevenZipRuby::SevenZipWriter.open(output){ |szw| szw.add_data(data, "hoge.bin") }
+        output.string
+      end
+
+      results = []
+      Thread.new do
+        Fiber.set_scheduler(SevenZipRubySpecHelper::FiberScheduler.new)
+        archives.each_with_index do |archive, i|
+          Fiber.schedule do
+            SevenZipRuby::SevenZipReader.open(StringIO.new(archive)) do |szr|
+              results[i] = szr.extract_data(0)
+            end
+          end
+        end
+      end.join
+
+      expect(results == data_list).to eq true
+    end
+
+    example "throw out of non-blocking fiber" do
+      skip("Fiber scheduler is not supported") unless (Fiber.respond_to?(:set_scheduler))
+
+      data = Random.new(0).bytes(3 * 1024 * 1024)
+      output = StringIO.new("")
+      SevenZipRuby::SevenZipWriter.open(output){ |szw| szw.add_data(data, "hoge.bin") }
+
+      result = nil
+      Thread.new do
+        scheduler = SevenZipRubySpecHelper::FiberScheduler.new
+        class << scheduler
+          attr_accessor :stop
+
+          # Throws while the fiber waits for the native function.
+          def io_wait(io, events, timeout)
+            if (stop)
+              self.stop = false
+              throw :stop, :thrown
+            end
+            super
+          end
+        end
+        Fiber.set_scheduler(scheduler)
+        Fiber.schedule do
+          szr = SevenZipRuby::SevenZipReader.open(StringIO.new(output.string))
+          scheduler.stop = true
+          result = catch(:stop) do
+            szr.extract_data(0)
+            :finished
+          end
+          # The archive is in the error state after the interrupted operation.
+          szr.close rescue nil
+        end
+      end.join
+
+      expect(result).to eq :thrown
+    end
+
 
     describe "error handling" do
 
@@ -198,7 +703,8 @@ describe SevenZipRuby do
               file.define_singleton_method(method) do |*args|
                 throw tag
               end
-              expect{ SevenZipRuby::SevenZipReader.open(file) }.to raise_error(ArgumentError)
+              # Without read-ahead, every access reaches the stream.
+              expect{ SevenZipRuby::SevenZipReader.open(file, read_ahead_size: 0) }.to raise_error(ArgumentError)
             end
           end
         end
@@ -208,6 +714,10 @@ describe SevenZipRuby do
         File.open(SevenZipRubySpecHelper::SEVEN_ZIP_FILE, "rb") do |file|
           SevenZipRuby::SevenZipReader.open(file) do |szr|
             expect{ szr.extract_data(nil) }.to raise_error(ArgumentError)
+            expect{ szr.extract_data(-1) }.to raise_error(ArgumentError)
+            expect{ szr.extract_data(100) }.to raise_error(ArgumentError)
+            expect{ szr.extract_data([0, 100]) }.to raise_error(ArgumentError)
+            expect{ szr.extract_data([-1]) }.to raise_error(ArgumentError)
           end
         end
       end
@@ -242,7 +752,8 @@ describe SevenZipRuby do
           file.define_singleton_method(method) do |*args|
             raise error
           end
-          expect{ SevenZipRuby::SevenZipReader.open(file) }.to raise_error(error)
+          # Without read-ahead, every access reaches the stream.
+          expect{ SevenZipRuby::SevenZipReader.open(file, read_ahead_size: 0) }.to raise_error(error)
           file.close
         end
       end
@@ -254,7 +765,8 @@ describe SevenZipRuby do
           file = File.open(SevenZipRubySpecHelper::SEVEN_ZIP_FILE, "rb")
 
           szr = nil
-          expect{ szr = SevenZipRuby::SevenZipReader.open(file) }.not_to raise_error
+          # Without read-ahead, every access reaches the stream.
+          expect{ szr = SevenZipRuby::SevenZipReader.open(file, read_ahead_size: 0) }.not_to raise_error
 
           file.define_singleton_method(method) do |*args|
             raise error
@@ -342,6 +854,31 @@ describe SevenZipRuby do
       expect(SevenZipRuby::SevenZipReader.verify(output)).to eq true
     end
 
+    example "write archive through write buffer" do
+      counting_io = Class.new(StringIO) do
+        attr_reader :write_count
+        def write(*args)
+          @write_count = (@write_count || 0) + 1
+          super
+        end
+      end
+
+      data_list = (0 ... 20).map{ |i| "This is hoge#{i}.txt content." * (i + 1) }
+      output = counting_io.new("".b)
+      output.write("prefix")
+      SevenZipRuby::SevenZipWriter.open(output) do |szw|
+        szw.solid = false
+        data_list.each_with_index{ |data, i| szw.add_data(data, "hoge%02d.txt" % i) }
+      end
+      # Not one write for each entry.
+      expect(output.write_count).to be < 10
+
+      expect(output.string.start_with?("prefix")).to eq true
+      SevenZipRuby::SevenZipReader.open(StringIO.new(output.string.byteslice(6 .. -1))) do |szr|
+        expect(szr.extract_data(:all)).to eq data_list
+      end
+    end
+
     example "open_file" do
       FileUtils.mkpath(SevenZipRubySpecHelper::EXTRACT_DIR)
       Dir.chdir(SevenZipRubySpecHelper::EXTRACT_DIR) do
@@ -374,6 +911,35 @@ describe SevenZipRuby do
       end
     end
 
+    example "keep attributes of local files" do
+      next if (RbConfig::CONFIG["target_os"].match(/mingw|mswin/))
+
+      output = StringIO.new("")
+      FileUtils.mkpath(SevenZipRubySpecHelper::EXTRACT_DIR)
+      Dir.chdir(SevenZipRubySpecHelper::EXTRACT_DIR) do
+        File.open("exec.sh", "wb"){ |file| file.write("#!/bin/sh\n") }
+        File.chmod(0755, "exec.sh")
+        File.open("readonly.txt", "wb"){ |file| file.write("readonly") }
+        File.chmod(0444, "readonly.txt")
+        SevenZipRuby::SevenZipWriter.open(output) do |szw|
+          szw.add_file("exec.sh")
+          szw.add_file("readonly.txt")
+        end
+        File.chmod(0644, "readonly.txt")
+      end
+
+      output.rewind
+      SevenZipRuby::SevenZipReader.open(output) do |szr|
+        attrib = szr.entries.map{ |entry| [ entry.path, entry.attrib ] }.to_h
+        # FILE_ATTRIBUTE_UNIX_EXTENSION with the mode in the high 16 bits.
+        expect(attrib["exec.sh"] & 0x8000).to eq 0x8000
+        expect((attrib["exec.sh"] >> 16) & 0170777).to eq 0100755
+        expect(attrib["exec.sh"] & 0x01).to eq 0
+        expect((attrib["readonly.txt"] >> 16) & 0170777).to eq 0100444
+        expect(attrib["readonly.txt"] & 0x01).to eq 0x01
+      end
+    end
+
     example "set password" do
       sample_data = "Sample Data"
       sample_password = "sample password"
@@ -407,6 +973,28 @@ describe SevenZipRuby do
       end
     end
 
+    example "set password with large data" do
+      sample_password = "sample password"
+      # Odd sizes exercise both the multi-block and the tail paths of AES.
+      data_list = [ 1, 15, 16, 17, 63, 65, 1000003 ].map{ |size| Random.new(size).bytes(size) }
+
+      output = StringIO.new("")
+      SevenZipRuby::SevenZipWriter.open(output, { password: sample_password }) do |szw|
+        szw.method = "COPY"
+        szw.header_encryption = true
+        data_list.each_with_index do |data, i|
+          szw.add_data(data, "data#{i}.bin")
+        end
+      end
+
+      output.rewind
+      SevenZipRuby::SevenZipReader.open(output, { password: sample_password }) do |szr|
+        data_list.each_with_index do |data, i|
+          expect(szr.extract_data(i)).to eq data
+        end
+      end
+    end
+
     example "create a sfx archive" do
       time = Time.now
 
@@ -616,17 +1204,188 @@ describe SevenZipRuby do
     end
 
 
+    example "set coder options and get memory usage" do
+      data = SevenZipRubySpecHelper::SAMPLE_LARGE_RANDOM_DATA
+      [
+        [ { method: "LZMA2", threads: 4, block_threads: 2, block_size: "1m", dictionary_size: "1m" }, 1 << 20 ],
+        [ { method: "LZMA", dictionary_size: 1 << 20, word_size: 64, match_finder: "HC4" }, 1 << 20 ],
+        [ { method: "PPMd", dictionary_size: "16m", word_size: 8, solid_files: 1 }, 16 << 20 ],
+        [ { method: "BZIP2", dictionary_size: 100000, threads: 2, solid_block_size: "64k" }, 100000 ]
+      ].each do |option, dictionary_size|
+        output = StringIO.new("")
+        usage = nil
+        SevenZipRuby::SevenZipWriter.open(output) do |szw|
+          szw.set_options(option)
+          usage = szw.memory_usage
+          szw.add_data(data, "hoge.txt")
+          szw.add_data(data.reverse, "hoge2.txt")
+        end
+
+        expect(usage[:dictionary_size]).to eq dictionary_size
+        expect(usage[:compress] > 0 && usage[:decompress] > 0).to eq true
+        SevenZipRuby::SevenZipReader.open(StringIO.new(output.string)) do |szr|
+          expect(szr.extract_data(:all)).to eq [ data, data.reverse ]
+        end
+      end
+
+      szw = SevenZipRuby::SevenZipWriter.new
+      szw.set_options(method: "LZMA2", threads: 8, block_threads: 4)
+      usage = szw.memory_usage
+      expect([ usage[:threads], usage[:block_threads], usage[:lzma_threads] ]).to eq [ 8, 4, 2 ]
+      szw.block_threads = 1
+      expect(usage[:compress] > szw.memory_usage[:compress]).to eq true
+
+      expect{ szw.dictionary_size = "64x" }.to raise_error(ArgumentError)
+      expect{ szw.block_threads = 64 }.to raise_error(ArgumentError)
+      expect{ szw.threads = -1 }.to raise_error(ArgumentError)
+      expect{ szw.threads = 257 }.to raise_error(ArgumentError)
+      expect{ SevenZipRuby::BZip2Writer.new.threads = -1 }.to raise_error(ArgumentError)
+      expect{ szw.match_finder = "XX4" }.to raise_error(ArgumentError)
+      expect{ szw.set_options(unknown: 1) }.to raise_error(ArgumentError)
+      szw.method = "DEFLATE"
+      expect{ szw.memory_usage }.to raise_error(ArgumentError)
+    end
+
+    example "compress solid blocks in parallel" do
+      small_data = (0...8).map{ |i| [ "file#{i}.bin", Random.new(i).bytes(64 * 1024) + ("data#{i}" * 16 * 1024) ] }
+      large_data = (0...6).map{ |i| [ "file#{i}.bin", Random.new(i).bytes(512 * 1024) + ("data#{i}" * 128 * 1024) ] }
+      # Each block keeps at most one 1MB chunk in memory and spills the rest into "7zs*.tmp" files.
+      temp_pattern = [ Dir.tmpdir, "/tmp" ].uniq.map{ |dir| File.join(dir, "7zs*.tmp") }
+      [ [ small_data, "128k", nil ], [ large_data, "2m", 1 ] ].each do |data, block_size, memory|
+        temp_files = []
+        finished = false
+        watcher = Thread.new do
+          until (finished)
+            temp_files |= Dir.glob(temp_pattern)
+            Thread.pass
+          end
+        end
+
+        output = StringIO.new("")
+        usage = nil
+        begin
+          SevenZipRuby::SevenZipWriter.open(output) do |szw|
+            szw.set_options(solid_block_size: block_size, solid_block_threads: 3)
+            szw.solid_block_memory = memory if memory
+            usage = szw.memory_usage
+            data.each{ |name, d| szw.add_data(d, name) }
+          end
+        ensure
+          finished = true
+          watcher.join
+        end
+
+        expect(usage[:solid_block_threads]).to eq 3
+        expect(temp_files.empty?).to eq memory.nil?
+        expect(Dir.glob(temp_pattern) & temp_files).to eq []
+        SevenZipRuby::SevenZipReader.open(StringIO.new(output.string)) do |szr|
+          expect(szr.extract_data(:all)).to eq data.map(&:last)
+          expect(szr.verify_detail.all?).to eq true
+          expect(szr.verify_stats.size).to eq data.size
+        end
+      end
+
+      expect{ SevenZipRuby::SevenZipWriter.new.solid_block_threads = 257 }.to raise_error(ArgumentError)
+    end
+
+    example "store incompressible data without compression" do
+      random = Random.new(0).bytes(256 * 1024)
+      text = SevenZipRubySpecHelper::SAMPLE_LARGE_RANDOM_DATA
+      output = StringIO.new("")
+      SevenZipRuby::SevenZipWriter.open(output) do |szw|
+        szw.store_incompressible = true
+        szw.add_data(random, "random.bin")
+        szw.add_data(text, "text.bin")
+        szw.add_data(random.reverse, "random_forced.bin", method: :compress)
+        szw.add_data(text.reverse, "text_stored.bin", method: :copy)
+      end
+
+      SevenZipRuby::SevenZipReader.open(StringIO.new(output.string)) do |szr|
+        methods = szr.entries.map{ |entry| [ entry.path, entry.method == "Copy" ] }.sort
+        expect(methods).to eq [ [ "random.bin", true ], [ "random_forced.bin", false ],
+                                [ "text.bin", false ], [ "text_stored.bin", true ] ]
+        data = szr.entries.map{ |entry| [ entry.path, szr.extract_data(entry) ] }.sort
+        expect(data.map(&:last)).to eq [ random, random.reverse, text, text.reverse ]
+      end
+
+      expect{ SevenZipRuby::SevenZipWriter.new.add_data(text, "text.bin", method: :lzma) }.to raise_error(ArgumentError)
+    end
+
+    example "update archive" do
+      data = (0...4).map{ |i| [ "dir/file#{i}.txt", "data#{i}" * 1000 ] }
+      input = StringIO.new("")
+      SevenZipRuby::SevenZipWriter.open(input) do |szw|
+        szw.solid_files = 2
+        szw.mkdir("dir")
+        data.each{ |name, d| szw.add_data(d, name) }
+      end
+
+      output = StringIO.new("")
+      SevenZipRuby::SevenZipWriter.update(StringIO.new(input.string), output) do |szw|
+        expect(szw.archive_entries.size).to eq 5
+        szw.add_data("new", "new.txt")
+        szw.add_data("replaced", "dir/file3.txt")
+        szw.delete("dir/file0.txt")
+        szw.rename("dir/file2.txt", "renamed.txt")
+        expect{ szw.delete("unknown.txt") }.to raise_error(ArgumentError)
+      end
+
+      SevenZipRuby::SevenZipReader.open(StringIO.new(output.string)) do |szr|
+        result = szr.entries.select(&:file?).map{ |entry| [ entry.path, szr.extract_data(entry) ] }.sort
+        expect(result).to eq [ [ "dir/file1.txt", data[1][1] ], [ "dir/file3.txt", "replaced" ],
+                               [ "new.txt", "new" ], [ "renamed.txt", data[2][1] ] ]
+        expect(szr.test).to eq true
+      end
+
+      # The entries of the same path are kept.
+      dup_input = StringIO.new("")
+      SevenZipRuby::SevenZipWriter.open(dup_input) do |szw|
+        szw.add_data("a", "a.txt")
+        szw.add_data("dup1", "dup.txt")
+        szw.add_data("dup2", "dup.txt")
+      end
+      dup_output = StringIO.new("")
+      SevenZipRuby::SevenZipWriter.update(StringIO.new(dup_input.string), dup_output) do |szw|
+        szw.add_data("new", "new.txt")
+      end
+      SevenZipRuby::SevenZipReader.open(StringIO.new(dup_output.string)) do |szr|
+        expect(szr.entries.map(&:path)).to eq [ "a.txt", "dup.txt", "dup.txt", "new.txt" ]
+        expect(szr.extract_data(:all)).to eq [ "a", "dup1", "dup2", "new" ]
+      end
+
+      # The archive file is replaced only when it is compressed.
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "test.7z")
+        File.binwrite(path, output.string)
+        expect{ SevenZipRuby::SevenZipWriter.update_file(path){ |szw| szw.delete("new.txt"); raise "error" } }.to raise_error(RuntimeError)
+        expect(File.binread(path)).to eq output.string
+        File.chmod(0600, path)
+        SevenZipRuby::SevenZipWriter.update_file(path){ |szw| szw.delete("dir") }
+        expect(Dir.children(dir)).to eq [ "test.7z" ]
+        expect(File.stat(path).mode & 0777).to eq 0600
+        SevenZipRuby::SevenZipReader.open_file(path) do |szr|
+          expect(szr.entries.map(&:path).sort).to eq [ "new.txt", "renamed.txt" ]
+        end
+      end
+    end
+
     describe "error handling" do
 
       example "raise error in update" do
         error = StandardError.new
 
+        # Larger than the write buffer, so that the start header is written by seek.
+        data = Random.new(0).bytes(2 * 1024 * 1024)
         [ :write, :seek ].each do |method|
           output = StringIO.new("")
           output.define_singleton_method(method) do |*args|
             raise error
           end
-          expect{ SevenZipRuby::SevenZipWriter.open(output).compress }.to raise_error(error)
+          expect{ SevenZipRuby::SevenZipWriter.open(output).compress }.to raise_error(error) if (method == :write)
+          szw = SevenZipRuby::SevenZipWriter.open(output)
+          szw.method = "COPY"
+          szw.add_data(data, "data.bin")
+          expect{ szw.compress }.to raise_error(error)
         end
       end
 
@@ -699,5 +1458,56 @@ describe SevenZipRuby do
 
   end
 
+  describe SevenZipRuby::ArchiveWriter do
+
+    example "create and read other formats" do
+      data = SevenZipRubySpecHelper::SAMPLE_LARGE_RANDOM_DATA
+      [
+        [ :zip, { method: "LZMA", level: 9, threads: 2 }, [ "hoge.txt", "dir/hoge2.txt" ] ],
+        # Zip compresses DEFLATE entries in multiple threads, each of which reads its own stream.
+        [ :zip, { threads: 2 }, [ "hoge.txt", "hoge2.txt", "hoge3.txt", "hoge4.txt" ] ],
+        [ :tar, {}, [ "hoge.txt", "dir/hoge2.txt" ] ],
+        [ :gzip, { level: 9 }, [ "hoge.txt" ] ],
+        # bzip2 and xz have no filename.
+        [ :bzip2, { level: 9, threads: 2 }, [ "hoge.txt" ], [ "[Content]" ] ],
+        [ :xz, { level: 1, threads: 2 }, [ "hoge.txt" ], [ "[Content]" ] ]
+      ].each do |format, option, path_list, entry_path_list|
+        output = StringIO.new("")
+        SevenZipRuby::ArchiveWriter.open(output, option.merge(format: format)) do |writer|
+          expect(writer).to be_a SevenZipRuby::ArchiveFormat.writer_class(format)
+          path_list.each{ |path| writer.add_data(data, path) }
+        end
+
+        SevenZipRuby::ArchiveReader.open(StringIO.new(output.string)) do |reader|
+          expect(reader).to be_a SevenZipRuby::ArchiveFormat.reader_class(format)
+          expect(reader.entries.map(&:path)).to eq(entry_path_list || path_list)
+          expect(reader.extract_data(:all)).to eq [ data ] * path_list.size
+          expect(reader.test).to eq true
+        end
+      end
+    end
+
+    example "set per-format options" do
+      expect(SevenZipRuby::ZipWriter.new.method).to eq "DEFLATE"
+      expect(SevenZipRuby::XzWriter.new.respond_to?(:method=)).to eq false
+      expect(SevenZipRuby::TarWriter.new.respond_to?(:level=)).to eq false
+      expect(SevenZipRuby::ZipWriter.new.respond_to?(:solid=)).to eq false
+      expect{ SevenZipRuby::ZipWriter.new.method = "LZMA2" }.to raise_error(ArgumentError)
+      expect{ SevenZipRuby::GZipWriter.new.level = 10 }.to raise_error(ArgumentError)
+
+      output = StringIO.new("")
+      SevenZipRuby::ArchiveWriter.open(output, format: "zip", password: "pass", encryption_method: "AES256") do |writer|
+        writer.add_data("This is hoge.txt content.", "hoge.txt")
+      end
+      SevenZipRuby::ZipReader.open(StringIO.new(output.string), password: "pass") do |reader|
+        expect(reader.entries.map(&:encrypted?)).to eq [ true ]
+        expect(reader.extract_data(0)).to eq "This is hoge.txt content."
+      end
+
+      expect{ SevenZipRuby::ArchiveReader.open(StringIO.new("not an archive" * 100)) }.to raise_error(SevenZipRuby::InvalidArchive)
+    end
+
+  end
+
 end
 
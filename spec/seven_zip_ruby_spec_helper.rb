@@ -46,6 +46,20 @@ module SevenZipRubySpecHelper
       raise "System failed: #{str}" unless ($?.exitstatus == 0)
     end
 
+    def random_data_list(num = 4, size = 100_000)
+      return num.times.map{ |i| Random.new(i).bytes(size) }
+    end
+
+    # 7z archive of data_list, whose entries are "file0.bin", "file1.bin" and so on.
+    def create_archive(data_list, solid: true)
+      output = StringIO.new("")
+      SevenZipRuby::SevenZipWriter.open(output) do |szw|
+        szw.solid = solid
+        data_list.each_with_index{ |data, i| szw.add_data(data, "file#{i}.bin") }
+      end
+      return output.string
+    end
+
 
     def prepare_each
       cleanup_each
@@ -136,6 +150,88 @@ module SevenZipRubySpecHelper
       return @processor_count
     end
   end
+
+  # Minimal Fiber scheduler, which waits for IO with IO.select.
+  class FiberScheduler
+    def initialize
+      @readable = {}
+      @writable = {}
+      @waiting = {}
+      @blocked = 0
+      @lock = Thread::Mutex.new
+      @unblocked = []
+      @urgent = IO.pipe
+    end
+
+    def fiber(&block)
+      fiber = Fiber.new(blocking: false, &block)
+      fiber.resume
+      return fiber
+    end
+
+    def io_wait(io, events, timeout)
+      fiber = Fiber.current
+      @readable[io] = fiber if ((events & IO::READABLE) != 0)
+      @writable[io] = fiber if ((events & IO::WRITABLE) != 0)
+      @waiting[fiber] = Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout if (timeout)
+      Fiber.yield
+      return events
+    ensure
+      @readable.delete(io)
+      @writable.delete(io)
+      @waiting.delete(fiber)
+    end
+
+    def kernel_sleep(duration = nil)
+      @waiting[Fiber.current] = Process.clock_gettime(Process::CLOCK_MONOTONIC) + (duration || 0)
+      Fiber.yield
+      return true
+    ensure
+      @waiting.delete(Fiber.current)
+    end
+
+    def block(blocker, timeout = nil)
+      @blocked += 1
+      @waiting[Fiber.current] = Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout if (timeout)
+      Fiber.yield
+    ensure
+      @blocked -= 1
+      @waiting.delete(Fiber.current)
+    end
+
+    def unblock(blocker, fiber)
+      @lock.synchronize{ @unblocked << fiber }
+      @urgent[1].write_nonblock(".", exception: false)
+    end
+
+    def run
+      while (!@readable.empty? || !@writable.empty? || !@waiting.empty? || @blocked > 0)
+        now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        timeout = @waiting.values.min
+        timeout = (timeout && [ timeout - now, 0 ].max)
+
+        readable, writable, = IO.select(@readable.keys + [ @urgent[0] ], @writable.keys, [], timeout)
+        @urgent[0].read_nonblock(1024, exception: false) if (readable && readable.delete(@urgent[0]))
+
+        fibers = []
+        fibers.concat((readable || []).map{ |io| @readable[io] })
+        fibers.concat((writable || []).map{ |io| @writable[io] })
+        now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        fibers.concat(@waiting.select{ |_, time| time <= now }.keys)
+        fibers.concat(@lock.synchronize{ @unblocked.slice!(0..-1) })
+        fibers.uniq.each{ |fiber| fiber.resume if (fiber.alive?) }
+      end
+    end
+
+    def close
+      run
+      @urgent.each(&:close)
+    end
+
+    def closed?
+      return @urgent[0].closed?
+    end
+  end
 end
 
 